@@ -0,0 +1,522 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * The zstd and LZ4 compressed input: the frames of the file (each one
+ * compressed on its own) are decompressed on all the CPUs in parallel,
+ * either all into one buffer up front, or streamed by worker threads into
+ * a bounded pool of frames ahead of the one the engine runs on.
+ *
+ * Copyright (C) 2021, Linaro
+ */
+
+#define _POSIX_C_SOURCE 200809L	/* mmap() */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <lz4frame.h>
+#include <zstd.h>
+#include <zstd_errors.h>
+
+#include "debayer.h"
+
+#define ZSTD_MAGIC		0xfd2fb528
+#define LZ4_MAGIC		0x184d2204
+/* 0x184d2a50..0x184d2a5f, in both formats */
+#define SKIPPABLE_MAGIC		0x184d2a50
+#define SKIPPABLE_MASK		0xfffffff0
+
+/* the LZ4 frame descriptor flags */
+#define LZ4_FLG_DICT_ID		0x01
+#define LZ4_FLG_CONTENT_SUM	0x04
+#define LZ4_FLG_CONTENT_SIZE	0x08
+#define LZ4_FLG_BLOCK_SUM	0x10
+#define LZ4_BLOCK_RAW		0x80000000u
+
+/* the first guess of the size of a frame which doesn't store it */
+#define ARCHIVE_RATIO		4
+
+/* the decompressed frames a stream keeps, ahead of the one being read */
+#define ARCHIVE_POOL_MAX	16
+
+enum archive_format {
+	ARCHIVE_ZSTD,
+	ARCHIVE_LZ4,
+};
+
+struct archive_frame {
+	const uint8_t *src;
+	size_t src_size;
+	size_t size;		/* decompressed, 0 if not known yet */
+	uint8_t *dst;		/* in the output, or own buffer */
+	int own;		/* dst is the own buffer, of unknown size */
+	int failed;
+};
+
+struct archive {
+	enum archive_format format;
+	struct archive_frame *frames;
+	int count;
+	uint8_t *map;		/* of the file */
+	size_t map_size;
+};
+
+struct archive_stream {
+	struct archive a;
+	long frame_size;
+	uint8_t *pool;		/* slots frames of frame_size */
+	long *ready;		/* of each slot: n + 1 for the frame n
+				 * decompressed there, -(n + 1) if it failed */
+	int slots;
+	long next;		/* the next frame for a worker */
+	long end;		/* the frames to decompress, LONG_MAX to replay */
+	long read;		/* the next frame of archive_next() */
+	long released;		/* the frames the reader is done with */
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t threads[ARCHIVE_POOL_MAX];
+	int started;
+};
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+	return get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+/* the length of the skippable frame, 0 if it is not one */
+static size_t skippable_size(const uint8_t *p, size_t size)
+{
+	if (size < 8 || (get_le32(p) & SKIPPABLE_MASK) != SKIPPABLE_MAGIC ||
+	    get_le32(p + 4) > size - 8)
+		return 0;
+	return 8 + get_le32(p + 4);
+}
+
+/* the length of the zstd frame and its content size, 0 if not known */
+static size_t zstd_frame(const uint8_t *p, size_t size, size_t *content)
+{
+	size_t len = ZSTD_findFrameCompressedSize(p, size);
+	unsigned long long n = ZSTD_getFrameContentSize(p, size);
+
+	if (ZSTD_isError(len) || n == ZSTD_CONTENTSIZE_ERROR)
+		return 0;
+	*content = n == ZSTD_CONTENTSIZE_UNKNOWN ? 0 : n;
+	return len;
+}
+
+/*
+ * LZ4 has no call for the length of a frame, it is walked through the
+ * block headers here.
+ */
+static size_t lz4_frame(const uint8_t *p, size_t size, size_t *content)
+{
+	size_t pos = 7;		/* magic, FLG, BD and the header checksum */
+	int flg;
+
+	if (size < pos || get_le32(p) != LZ4_MAGIC)
+		return 0;
+	flg = p[4];
+	*content = 0;
+	if (flg & LZ4_FLG_CONTENT_SIZE) {
+		if (size < pos + 8)
+			return 0;
+		*content = get_le64(p + 6);
+		pos += 8;
+	}
+	if (flg & LZ4_FLG_DICT_ID)
+		pos += 4;
+	for (;;) {
+		uint32_t block;
+
+		if (pos > size || size - pos < 4)
+			return 0;
+		block = get_le32(p + pos) & ~LZ4_BLOCK_RAW;
+		pos += 4;
+		if (block == 0)
+			break;
+		if (block > size - pos)
+			return 0;
+		pos += block + (flg & LZ4_FLG_BLOCK_SUM ? 4 : 0);
+	}
+	pos += flg & LZ4_FLG_CONTENT_SUM ? 4 : 0;
+	return pos <= size ? pos : 0;
+}
+
+/* splits the file into the frames, the skippable ones are left out */
+static int archive_split(struct archive *a, const uint8_t *p, size_t size)
+{
+	int capacity = 0;
+
+	while (size > 0) {
+		struct archive_frame *f;
+		size_t len = skippable_size(p, size), content = 0;
+
+		if (len) {
+			p += len;
+			size -= len;
+			continue;
+		}
+		if (a->format == ARCHIVE_ZSTD)
+			len = zstd_frame(p, size, &content);
+		else
+			len = lz4_frame(p, size, &content);
+		if (len == 0)
+			return -1;
+
+		if (a->count == capacity) {
+			capacity = capacity ? 2 * capacity : 16;
+			f = realloc(a->frames, sizeof(*f) * capacity);
+			if (f == NULL)
+				return -1;
+			a->frames = f;
+		}
+		f = &a->frames[a->count++];
+		memset(f, 0, sizeof(*f));
+		f->src = p;
+		f->src_size = len;
+		f->size = content;
+		p += len;
+		size -= len;
+	}
+	return 0;
+}
+
+/*
+ * Returns the decompressed size, -1 if the frame can't be decompressed,
+ * -2 if it doesn't fit into capacity.
+ */
+static long lz4_decompress(const struct archive_frame *f, uint8_t *dst,
+			   size_t capacity)
+{
+	LZ4F_dctx *dctx;
+	const uint8_t *src = f->src;
+	size_t src_left = f->src_size, out = 0, hint = 1;
+
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx,
+							 LZ4F_VERSION)))
+		return -1;
+	while (hint != 0 && src_left > 0) {
+		size_t dst_size = capacity - out, src_size = src_left;
+
+		hint = LZ4F_decompress(dctx, dst + out, &dst_size, src,
+				       &src_size, NULL);
+		if (LZ4F_isError(hint) || (dst_size == 0 && src_size == 0))
+			break;
+		out += dst_size;
+		src += src_size;
+		src_left -= src_size;
+	}
+	LZ4F_freeDecompressionContext(dctx);
+	if (LZ4F_isError(hint))
+		return -1;
+	if (hint != 0)
+		return out == capacity ? -2 : -1;
+	return out;
+}
+
+static long frame_decompress(const struct archive *a,
+			     const struct archive_frame *f, uint8_t *dst,
+			     size_t capacity)
+{
+	size_t n;
+
+	if (a->format == ARCHIVE_LZ4)
+		return lz4_decompress(f, dst, capacity);
+	n = ZSTD_decompress(dst, capacity, f->src, f->src_size);
+	if (ZSTD_isError(n))
+		return ZSTD_getErrorCode(n) == ZSTD_error_dstSize_tooSmall ?
+		       -2 : -1;
+	return n;
+}
+
+/*
+ * The frames which don't store their size are decompressed into their own
+ * buffers, twice as large each time they don't fit.
+ */
+static void archive_measure(void *arg, int i)
+{
+	struct archive *a = arg;
+	struct archive_frame *f = &a->frames[i];
+	size_t capacity = ARCHIVE_RATIO * f->src_size;
+	long n = -2;
+
+	if (f->size)
+		return;
+	for (f->own = 1; n == -2; capacity *= 2) {
+		free(f->dst);
+		f->dst = malloc(capacity);
+		if (f->dst == NULL)
+			break;
+		n = frame_decompress(a, f, f->dst, capacity);
+	}
+	f->size = n < 0 ? 0 : n;
+	f->failed = n < 0;
+}
+
+static void archive_decompress(void *arg, int i)
+{
+	struct archive *a = arg;
+	struct archive_frame *f = &a->frames[i];
+
+	if (f->own)
+		return;
+	if (frame_decompress(a, f, f->dst, f->size) != (long)f->size)
+		f->failed = 1;
+}
+
+/*
+ * Maps the file and splits it into the frames: 1 if it is zstd or LZ4
+ * compressed, 0 if it isn't, -1 if it can't be read.
+ */
+static int archive_open_file(const char *fname, struct archive *a)
+{
+	struct stat st;
+	int fd;
+
+	memset(a, 0, sizeof(*a));
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st) < 0 || st.st_size < 4) {
+		close(fd);
+		return 0;
+	}
+	a->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (a->map == MAP_FAILED)
+		return 0;
+	a->map_size = st.st_size;
+
+	if (get_le32(a->map) == ZSTD_MAGIC) {
+		a->format = ARCHIVE_ZSTD;
+	} else if (get_le32(a->map) == LZ4_MAGIC) {
+		a->format = ARCHIVE_LZ4;
+	} else {
+		munmap(a->map, a->map_size);
+		return 0;
+	}
+	if (archive_split(a, a->map, a->map_size) < 0 || a->count == 0) {
+		free(a->frames);
+		munmap(a->map, a->map_size);
+		return -1;
+	}
+	return 1;
+}
+
+static void archive_close_file(struct archive *a)
+{
+	int i;
+
+	for (i = 0; i < a->count; i++)
+		if (a->frames[i].own)
+			free(a->frames[i].dst);
+	free(a->frames);
+	munmap(a->map, a->map_size);
+}
+
+/*
+ * Returns the size of the decompressed content of the file in *data, 0
+ * if the file is not zstd or LZ4 compressed, -1 if it can't be read.
+ */
+long archive_read(const char *fname, char **data)
+{
+	struct archive a;
+	uint8_t *out = NULL;
+	long size = 0;
+	int i;
+
+	i = archive_open_file(fname, &a);
+	if (i <= 0) {
+		*data = NULL;
+		return i;
+	}
+
+	/* the sizes of all the frames, then their places in the output */
+	parallel_for(a.count, archive_measure, &a);
+	for (i = 0; i < a.count; i++) {
+		if (a.frames[i].failed)
+			goto fail;
+		size += a.frames[i].size;
+	}
+	out = size ? malloc(size) : NULL;
+	if (out == NULL)
+		goto fail;
+	for (i = 0, size = 0; i < a.count; i++) {
+		struct archive_frame *f = &a.frames[i];
+
+		if (f->own)
+			memcpy(out + size, f->dst, f->size);
+		else
+			f->dst = out + size;
+		size += f->size;
+	}
+	parallel_for(a.count, archive_decompress, &a);
+	for (i = 0; i < a.count; i++)
+		if (a.frames[i].failed)
+			goto fail;
+	goto done;
+
+fail:
+	free(out);
+	out = NULL;
+	size = -1;
+done:
+	archive_close_file(&a);
+	*data = (char *)out;
+	return size;
+}
+
+/*
+ * The workers take the frames in order, round and round the file if it is
+ * replayed, as long as there is a slot of the pool the reader is done
+ * with. They leave after the last frame otherwise.
+ */
+static void *archive_worker(void *arg)
+{
+	struct archive_stream *s = arg;
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		long n, got;
+		uint8_t *dst;
+
+		while (!s->stop && s->next < s->end &&
+		       s->next >= s->released + s->slots)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if (s->stop || s->next >= s->end)
+			break;
+		n = s->next++;
+		dst = s->pool + (n % s->slots) * s->frame_size;
+		pthread_mutex_unlock(&s->lock);
+
+		got = frame_decompress(&s->a, &s->a.frames[n % s->a.count],
+				       dst, s->frame_size);
+
+		pthread_mutex_lock(&s->lock);
+		s->ready[n % s->slots] = got == s->frame_size ? n + 1 : -(n + 1);
+		pthread_cond_broadcast(&s->cond);
+	}
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+/*
+ * Opens the file for archive_next(), if it is zstd or LZ4 compressed with
+ * each frame of frame_size compressed on its own, storing its size, and
+ * returns the number of frames in *frames. They are decompressed once, or
+ * round and round the file if replay is set. NULL otherwise, for
+ * archive_read() to tell the other files and decompress the ones which
+ * can't be streamed.
+ */
+struct archive_stream *archive_open(const char *fname, long frame_size,
+				    int replay, long *frames)
+{
+	struct archive_stream *s;
+	int i, threads;
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL)
+		return NULL;
+	if (archive_open_file(fname, &s->a) <= 0) {
+		free(s);
+		return NULL;
+	}
+	for (i = 0; i < s->a.count; i++)
+		if (s->a.frames[i].size != (size_t)frame_size)
+			goto fail;
+
+	/* a CPU is left for the engine, a slot for the frame it reads */
+	threads = parallel_threads() - 1;
+	if (threads < 1)
+		threads = 1;
+	if (threads > ARCHIVE_POOL_MAX - 1)
+		threads = ARCHIVE_POOL_MAX - 1;
+	s->slots = threads + 1;
+	s->end = replay ? LONG_MAX : s->a.count;
+	s->frame_size = frame_size;
+	s->pool = malloc(s->slots * frame_size);
+	s->ready = calloc(s->slots, sizeof(*s->ready));
+	if (s->pool == NULL || s->ready == NULL)
+		goto fail;
+
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&s->threads[s->started], NULL,
+				   archive_worker, s))
+			break;
+		s->started++;
+	}
+	if (s->started == 0) {
+		pthread_cond_destroy(&s->cond);
+		pthread_mutex_destroy(&s->lock);
+		goto fail;
+	}
+	*frames = s->a.count;
+	return s;
+
+fail:
+	free(s->pool);
+	free(s->ready);
+	archive_close_file(&s->a);
+	free(s);
+	return NULL;
+}
+
+/*
+ * Returns the next frame, the first one after the last if it is replayed,
+ * valid until the next call. NULL if it can't be decompressed or after
+ * the last one.
+ */
+const uint8_t *archive_next(struct archive_stream *s)
+{
+	long n, slot, ready;
+
+	pthread_mutex_lock(&s->lock);
+	n = s->read++;
+	slot = n % s->slots;
+	/* the previous frame is done with */
+	s->released = n;
+	pthread_cond_broadcast(&s->cond);
+	if (n >= s->end) {
+		pthread_mutex_unlock(&s->lock);
+		return NULL;
+	}
+	while (s->ready[slot] != n + 1 && s->ready[slot] != -(n + 1))
+		pthread_cond_wait(&s->cond, &s->lock);
+	ready = s->ready[slot];
+	pthread_mutex_unlock(&s->lock);
+	return ready > 0 ? s->pool + slot * s->frame_size : NULL;
+}
+
+void archive_close(struct archive_stream *s)
+{
+	int i;
+
+	if (s == NULL)
+		return;
+	pthread_mutex_lock(&s->lock);
+	s->stop = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	for (i = 0; i < s->started; i++)
+		pthread_join(s->threads[i], NULL);
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+	free(s->pool);
+	free(s->ready);
+	archive_close_file(&s->a);
+	free(s);
+}
@@ -0,0 +1,152 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * The atlas of many small frames of different sizes and bayer orders: the
+ * frames are packed one after another into one input buffer, with the
+ * table of their formats and places, and the GL engine demosaics all of
+ * them in one dispatch (see ATLAS in debayer.comp), the outputs one after
+ * another in one output buffer.
+ *
+ * The rows of a frame are packed 4 bytes aligned, whatever the stride of
+ * its file, so that any width goes.
+ *
+ * Copyright (C) 2021, Linaro
+ */
+
+#define _POSIX_C_SOURCE 200809L	/* strdup() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debayer.h"
+
+/*
+ * Appends the frame (8-bit Bayer) to the atlas, its output is of opts.
+ * The name is NULL for the frame which is not written to a file.
+ */
+int atlas_add(struct atlas *a, const struct frame_fmt *fmt,
+	      const struct debayer_opts *opts, const uint8_t *data,
+	      const char *out_name)
+{
+	struct atlas_frame *f;
+	int stride = (fmt->width + 3) / 4 * 4;
+	long size = (long)stride * fmt->height;
+	int y;
+
+	if (a->count == a->capacity) {
+		int capacity = a->capacity ? 2 * a->capacity : 64;
+
+		f = realloc(a->frames, sizeof(*f) * capacity);
+		if (f == NULL)
+			return -1;
+		a->frames = f;
+		a->capacity = capacity;
+	}
+	if (a->in_size + size > a->in_capacity) {
+		long capacity = 2 * (a->in_size + size);
+		uint8_t *in = realloc(a->in, capacity);
+
+		if (in == NULL)
+			return -1;
+		a->in = in;
+		a->in_capacity = capacity;
+	}
+
+	f = &a->frames[a->count];
+	memset(f, 0, sizeof(*f));
+	f->fmt = *fmt;
+	f->fmt.stride = stride;
+	f->in_offset = a->in_size;
+	f->out_offset = a->out_size;
+	if (out_name && (f->out_name = strdup(out_name)) == NULL)
+		return -1;
+	for (y = 0; y < fmt->height; y++) {
+		uint8_t *row = a->in + f->in_offset + (long)y * stride;
+
+		memcpy(row, data + (long)y * fmt->stride, fmt->width);
+		memset(row + fmt->width, 0, stride - fmt->width);
+	}
+	a->in_size += size;
+	a->out_size += output_size(&f->fmt, opts);
+	a->count++;
+	return 0;
+}
+
+/* the table of the shader, a workgroup per tile of lsize_x x lsize_y */
+int atlas_table(struct atlas *a, int lsize_x, int lsize_y)
+{
+	int i;
+
+	free(a->table);
+	a->table = malloc(sizeof(*a->table) * a->count);
+	if (a->table == NULL)
+		return -1;
+	a->groups = 0;
+	for (i = 0; i < a->count; i++) {
+		const struct atlas_frame *f = &a->frames[i];
+		struct atlas_desc *d = &a->table[i];
+		int red_x, red_y;
+
+		bayer_first_red(f->fmt.order, &red_x, &red_y);
+		d->in_offset = f->in_offset / 4;
+		d->out_offset = f->out_offset / 4;
+		d->width = f->fmt.width;
+		d->height = f->fmt.height;
+		d->stride = f->fmt.stride;
+		d->red_x = red_x;
+		d->red_y = red_y;
+		d->first_group = a->groups;
+		a->groups += ((f->fmt.width + lsize_x - 1) / lsize_x) *
+			     ((f->fmt.height + lsize_y - 1) / lsize_y);
+	}
+	return 0;
+}
+
+/* the output of each frame from out, into its raw or image file */
+int atlas_write(const struct atlas *a, const struct debayer_opts *opts,
+		const uint8_t *out, int quality)
+{
+	int i;
+
+	for (i = 0; i < a->count; i++) {
+		const struct atlas_frame *f = &a->frames[i];
+		const uint8_t *data = out + f->out_offset;
+		long size = output_size(&f->fmt, opts);
+		enum image_format image = image_format(f->out_name);
+		int out_w, out_h;
+		size_t n;
+		FILE *fp;
+
+		if (image != IMAGE_RAW) {
+			orient_size(&f->fmt, opts->orient, &out_w, &out_h);
+			if (image_write(f->out_name, image, quality, data,
+					out_w, out_h, 0) < 0)
+				return -1;
+			continue;
+		}
+		fp = fopen(f->out_name, "wb");
+		if (fp == NULL) {
+			printf("Failed to open output file \"%s\"\n",
+			       f->out_name);
+			return -1;
+		}
+		n = fwrite(data, 1, size, fp);
+		if (fclose(fp) != 0 || n != (size_t)size) {
+			printf("Failed to write \"%s\"\n", f->out_name);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void atlas_free(struct atlas *a)
+{
+	int i;
+
+	for (i = 0; i < a->count; i++)
+		free(a->frames[i].out_name);
+	free(a->frames);
+	free(a->in);
+	free(a->table);
+	memset(a, 0, sizeof(*a));
+}
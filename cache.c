@@ -0,0 +1,392 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * The output cache of the batch runs: the output files of a run are kept
+ * in the cache directory under the hash of the input file, of the options
+ * which change the output and of the program itself (the binary and the
+ * shader), and the next run of the same key takes them from there instead
+ * of processing the input again.
+ *
+ * An entry is <key>.<n> for each output file (one, or the image of each
+ * frame) and <key>.info, written last: the number of the files and the
+ * time the run took. The files are reflinked where the file system can,
+ * copied otherwise; not hard linked, the next run writing to the output
+ * file would truncate the entry with it.
+ *
+ * Copyright (C) 2021, Linaro
+ */
+
+#define _GNU_SOURCE	/* copy_file_range(), flock() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debayer.h"
+
+#define XXH_PRIME1		0x9e3779b185ebca87ull
+#define XXH_PRIME2		0xc2b2ae3d27d4eb4full
+#define XXH_PRIME3		0x165667b19e3779f9ull
+#define XXH_PRIME4		0x85ebca77c2b2ae63ull
+#define XXH_PRIME5		0x27d4eb2f165667c5ull
+
+/* the files are hashed in chunks on all the CPUs, then the chunk hashes */
+#define CACHE_CHUNK		(1 << 20)
+
+#define CACHE_EXE		"/proc/self/exe"
+#define CACHE_STATS		"stats"
+
+struct hash_job {
+	const uint8_t *p;
+	size_t size;
+	uint64_t *chunks;
+};
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+	return x << r | x >> (64 - r);
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t in)
+{
+	acc += in * XXH_PRIME2;
+	return rotl64(acc, 31) * XXH_PRIME1;
+}
+
+static uint64_t xxh_merge(uint64_t h, uint64_t v)
+{
+	h ^= xxh_round(0, v);
+	return h * XXH_PRIME1 + XXH_PRIME4;
+}
+
+/* XXH64, of the words of the host byte order */
+static uint64_t xxh64(const void *data, size_t len, uint64_t seed)
+{
+	const uint8_t *p = data, *end = p + len;
+	uint64_t h, w;
+	uint32_t w32;
+
+	if (len >= 32) {
+		uint64_t v[4] = {
+			seed + XXH_PRIME1 + XXH_PRIME2, seed + XXH_PRIME2,
+			seed, seed - XXH_PRIME1,
+		};
+		int i;
+
+		for (; end - p >= 32; p += 32)
+			for (i = 0; i < 4; i++) {
+				memcpy(&w, p + 8 * i, 8);
+				v[i] = xxh_round(v[i], w);
+			}
+		h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) +
+		    rotl64(v[3], 18);
+		for (i = 0; i < 4; i++)
+			h = xxh_merge(h, v[i]);
+	} else {
+		h = seed + XXH_PRIME5;
+	}
+	h += len;
+
+	for (; end - p >= 8; p += 8) {
+		memcpy(&w, p, 8);
+		h ^= xxh_round(0, w);
+		h = rotl64(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+	}
+	if (end - p >= 4) {
+		memcpy(&w32, p, 4);
+		h ^= w32 * XXH_PRIME1;
+		h = rotl64(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * XXH_PRIME5;
+		h = rotl64(h, 11) * XXH_PRIME1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME2;
+	h ^= h >> 29;
+	h *= XXH_PRIME3;
+	return h ^ h >> 32;
+}
+
+static void hash_chunk(void *arg, int i)
+{
+	const struct hash_job *job = arg;
+	size_t pos = (size_t)i * CACHE_CHUNK;
+	size_t len = job->size - pos < CACHE_CHUNK ? job->size - pos :
+		     CACHE_CHUNK;
+
+	job->chunks[i] = xxh64(job->p + pos, len, i);
+}
+
+/* the content of the file, seeded by *h, -1 if it can't be read */
+static int hash_file(const char *fname, uint64_t *h)
+{
+	struct hash_job job;
+	struct stat st;
+	void *map = NULL;
+	int fd, count;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size > 0)
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	job.p = map;
+	job.size = st.st_size;
+	count = (job.size + CACHE_CHUNK - 1) / CACHE_CHUNK;
+	job.chunks = malloc(sizeof(*job.chunks) * (count ? count : 1));
+	if (job.chunks == NULL) {
+		if (map)
+			munmap(map, st.st_size);
+		return -1;
+	}
+	parallel_for(count, hash_chunk, &job);
+	*h = xxh64(job.chunks, sizeof(*job.chunks) * count, *h ^ job.size);
+
+	free(job.chunks);
+	if (map)
+		munmap(map, st.st_size);
+	return 0;
+}
+
+static double cache_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/*
+ * Adds the option to the key, but not the ones which don't change the
+ * output (nor -p, its stages come as their options); the files of -K by
+ * their content.
+ */
+void cache_option(struct cache *c, int opt, const char *arg)
+{
+	char name[4096], *comma;
+
+	if (strchr("cnFhp", opt))
+		return;
+	c->options = xxh64(&opt, sizeof(opt), c->options);
+	if (arg == NULL)
+		return;
+	c->options = xxh64(arg, strlen(arg), c->options);
+	if (opt != 'K')
+		return;
+
+	snprintf(name, sizeof(name), "%s", arg);
+	comma = strchr(name, ',');
+	if (comma) {
+		*comma = '\0';
+		hash_file(comma + 1, &c->options);
+	}
+	hash_file(name, &c->options);
+}
+
+/* the output file of the entry, the n-th frame of the image files */
+static void output_name(char *name, size_t size, const char *out_name,
+			enum image_format image, long n)
+{
+	if (image == IMAGE_RAW)
+		snprintf(name, size, "%s", out_name);
+	else
+		snprintf(name, size, out_name, n);
+}
+
+/*
+ * Copies the file src to dst: reflinked, or copied by the kernel, or
+ * read and written when the kernel can't copy between the two.
+ */
+static int copy_file(const char *src, const char *dst)
+{
+	char buf[65536];
+	struct stat st;
+	loff_t pos = 0;
+	int in, out, ret = -1;
+
+	in = open(src, O_RDONLY);
+	if (in < 0)
+		return -1;
+	out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0 || fstat(in, &st) < 0)
+		goto out;
+	if (ioctl(out, FICLONE, in) == 0) {
+		ret = 0;
+		goto out;
+	}
+
+	while (pos < st.st_size) {
+		loff_t out_pos = pos;
+		ssize_t n = copy_file_range(in, &pos, out, &out_pos,
+					    st.st_size - pos, 0);
+
+		if (n > 0)
+			continue;
+		if (n == 0)
+			goto out;
+		n = pread(in, buf, sizeof(buf), pos);
+		if (n <= 0 || pwrite(out, buf, n, pos) != n)
+			goto out;
+		pos += n;
+	}
+	ret = 0;
+out:
+	if (out >= 0 && close(out) < 0)
+		ret = -1;
+	close(in);
+	return ret;
+}
+
+/* the counts of all the runs on the directory, updated under the lock */
+static void cache_count(const struct cache *c, int hit, double saved)
+{
+	char name[4096];
+	long lookups = 0, hits = 0;
+	double total = 0;
+	FILE *fp;
+	int fd;
+
+	snprintf(name, sizeof(name), "%s/%s", c->dir, CACHE_STATS);
+	fd = open(name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return;
+	fp = fdopen(fd, "r+");
+	if (fp == NULL || flock(fd, LOCK_EX) < 0) {
+		if (fp)
+			fclose(fp);
+		else
+			close(fd);
+		return;
+	}
+	if (fscanf(fp, "%ld %ld %lf", &lookups, &hits, &total) != 3)
+		lookups = hits = total = 0;
+	lookups++;
+	hits += hit;
+	total += saved;
+	rewind(fp);
+	fprintf(fp, "%ld %ld %.1f\n", lookups, hits, total);
+	fflush(fp);
+	if (ftruncate(fd, ftell(fp)) < 0)
+		printf("%s: failed to truncate\n", name);
+	fclose(fp);
+
+	printf("cache: %ld of %ld runs hit (%.1f%%), %.1f s saved in all\n",
+	       hits, lookups, 100.0 * hits / lookups, total / 1000.0);
+}
+
+/*
+ * Hashes the input file and the program into the key of the entry, and
+ * returns the number of its output files, 0 if it is not in the cache, -1
+ * if the input can't be read.
+ */
+long cache_lookup(struct cache *c, const char *in_name,
+		  const char *shader_fname)
+{
+	uint64_t program = c->options, input = 0;
+	char name[4096];
+	long files;
+	FILE *fp;
+
+	c->start = cache_ms();
+	if (hash_file(CACHE_EXE, &program) < 0 ||
+	    hash_file(in_name, &input) < 0)
+		return -1;
+	/* the CPU engines don't read the shader */
+	hash_file(shader_fname, &program);
+	snprintf(c->key, sizeof(c->key), "%016llx%016llx",
+		 (unsigned long long)program, (unsigned long long)input);
+
+	if (mkdir(c->dir, 0755) < 0 && errno != EEXIST)
+		return 0;
+	snprintf(name, sizeof(name), "%s/%s.info", c->dir, c->key);
+	fp = fopen(name, "r");
+	if (fp == NULL)
+		return 0;
+	if (fscanf(fp, "%ld %lf", &files, &c->saved) != 2 || files <= 0)
+		files = 0;
+	fclose(fp);
+	return files;
+}
+
+/* the output files of the entry found by cache_lookup() */
+int cache_fetch(struct cache *c, const char *out_name,
+		enum image_format image, long files)
+{
+	char src[4096], dst[4096];
+	double saved;
+	long i;
+
+	for (i = 0; i < files; i++) {
+		snprintf(src, sizeof(src), "%s/%s.%ld", c->dir, c->key, i);
+		output_name(dst, sizeof(dst), out_name, image, i);
+		if (copy_file(src, dst) < 0) {
+			printf("cache: failed to copy %s to \"%s\"\n", src,
+			       dst);
+			return -1;
+		}
+	}
+	saved = c->saved - (cache_ms() - c->start);
+	printf("cache hit %s: %ld files, %.1f ms saved\n", c->key, files,
+	       saved);
+	cache_count(c, 1, saved);
+	return 0;
+}
+
+/*
+ * The output files of the run which has missed the cache go into the new
+ * entry; the run has succeeded even if they don't.
+ */
+void cache_store(struct cache *c, const char *out_name,
+		 enum image_format image, long files)
+{
+	char src[4096], dst[4096], tmp[4096 + 16];
+	double ms = cache_ms() - c->start;
+	FILE *fp;
+	long i;
+
+	for (i = 0; i < files; i++) {
+		output_name(src, sizeof(src), out_name, image, i);
+		snprintf(dst, sizeof(dst), "%s/%s.%ld", c->dir, c->key, i);
+		snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", dst, (long)getpid());
+		if (copy_file(src, tmp) < 0 || rename(tmp, dst) < 0) {
+			unlink(tmp);
+			goto fail;
+		}
+	}
+	snprintf(dst, sizeof(dst), "%s/%s.info", c->dir, c->key);
+	snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", dst, (long)getpid());
+	fp = fopen(tmp, "w");
+	if (fp == NULL)
+		goto fail;
+	fprintf(fp, "%ld %.1f\n", files, ms);
+	if (fclose(fp) != 0 || rename(tmp, dst) < 0) {
+		unlink(tmp);
+		goto fail;
+	}
+	printf("cache miss %s: %ld files stored\n", c->key, files);
+	cache_count(c, 0, 0);
+	return;
+
+fail:
+	printf("cache: failed to store \"%s\" in %s\n", out_name, c->dir);
+	cache_count(c, 0, 0);
+}
@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * An example of the coroutine API, also its test (make async-check):
+ * a coroutine submits several frames, cancels one and awaits the others
+ * out of order, checking each output against the cpu-ref engine. The
+ * coroutine is resumed on the main thread, by a queue standing for the
+ * executor of a service.
+ *
+ *   async_example [<engine>]
+ *
+ * Copyright (C) 2021, Linaro
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <random>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "debayer_async.h"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define FRAMES 6
+
+/* started at once, nothing waits for its end but the done flag */
+struct task {
+	struct promise_type {
+		task get_return_object() { return {}; }
+		std::suspend_never initial_suspend() { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+/* the executor of the main thread */
+static std::mutex ready_lock;
+static std::vector<std::coroutine_handle<>> ready;
+
+static int failed;
+static bool done;
+
+static task run(debayer::async_engine &eng, const frame_fmt &fmt,
+		const debayer_opts &opts,
+		const std::vector<std::vector<uint8_t>> &in,
+		const std::vector<std::vector<uint8_t>> &ref)
+{
+	std::vector<debayer::frame_op> ops;
+	std::stop_source stop;
+	/* the order of the awaits, the last frame is cancelled */
+	static const int order[] = { 3, 0, 4, 2, 1 };
+
+	for (int i = 0; i < FRAMES; i++)
+		ops.push_back(eng.submit(fmt, opts, in[i].data(),
+					 i == FRAMES - 1 ? stop.get_token() :
+					 std::stop_token()));
+	stop.request_stop();
+
+	for (int i : order) {
+		try {
+			debayer::frame_result out = co_await ops[i];
+
+			if (out.size() != (long)ref[i].size() ||
+			    memcmp(out.data(), ref[i].data(), out.size())) {
+				printf("frame %d: differs from cpu-ref\n", i);
+				failed++;
+			} else {
+				printf("frame %d: same as cpu-ref\n", i);
+			}
+		} catch (const std::exception &e) {
+			printf("frame %d: %s\n", i, e.what());
+			failed++;
+		}
+	}
+
+	try {
+		co_await ops[FRAMES - 1];
+		printf("frame %d: completed, not cancelled\n", FRAMES - 1);
+		failed++;
+	} catch (const std::system_error &e) {
+		if (e.code() != std::errc::operation_canceled)
+			failed++;
+		printf("frame %d: %s\n", FRAMES - 1, e.what());
+	}
+	done = true;
+}
+
+int main(int argc, char **argv)
+{
+	const cpu_engine *cpu_ref = cpu_engine_find("cpu-ref");
+	std::vector<std::vector<uint8_t>> in(FRAMES), ref(FRAMES);
+	debayer::async_options options;
+	std::mt19937 rnd(FRAMES);
+	frame_fmt fmt = {};
+	debayer_opts opts = {};
+
+	fmt.width = WIDTH;
+	fmt.height = HEIGHT;
+	fmt.stride = WIDTH;
+	fmt.order = BAYER_RGGB;
+	fmt.bits = 8;
+	fmt.cfa = CFA_BAYER;
+	opts.output = OUTPUT_RGBA;
+
+	/* a different frame each, so a mixed up output shows */
+	for (int i = 0; i < FRAMES; i++) {
+		in[i].resize(input_frame_size(&fmt));
+		for (auto &v : in[i])
+			v = rnd();
+		ref[i].resize(output_size(&fmt, &opts));
+		cpu_ref->process(&fmt, &opts, in[i].data(), ref[i].data());
+	}
+
+	if (argc > 1)
+		options.engine = argv[1];
+	options.max_in_flight = 2;
+	options.resume = [](std::coroutine_handle<> h) {
+		std::lock_guard<std::mutex> lk(ready_lock);
+
+		ready.push_back(h);
+	};
+
+	try {
+		debayer::async_engine eng(options);
+
+		run(eng, fmt, opts, in, ref);
+		while (!done) {
+			std::vector<std::coroutine_handle<>> hs;
+
+			{
+				std::lock_guard<std::mutex> lk(ready_lock);
+
+				hs.swap(ready);
+			}
+			for (auto h : hs)
+				h.resume();
+			if (hs.empty())
+				std::this_thread::yield();
+		}
+	} catch (const std::exception &e) {
+		printf("async_example: %s\n", e.what());
+		return 1;
+	}
+
+	printf("%s: %s\n", options.engine.c_str(), failed ? "FAILED" : "ok");
+	return failed ? 1 : 0;
+}
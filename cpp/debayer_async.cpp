@@ -0,0 +1,511 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * The asynchronous API of the engines, see debayer_async.h.
+ *
+ * The thread of the engine is the only one with the GL context. Each frame
+ * in flight has its output buffer from the pool, bound as bo_out for its
+ * dispatch, and its fence. The fences signal in the order of the
+ * dispatches, so the thread waits on the oldest one for a short time at
+ * once, taking the new frames of the queue in between. The buffer of a
+ * completed frame stays mapped until its frame_result is destroyed, and is
+ * unmapped by the thread before its next dispatch.
+ *
+ * Copyright (C) 2021, Linaro
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#include "debayer_async.h"
+
+extern "C" {
+#include "../gl.h"
+}
+
+namespace debayer {
+
+/* the time to wait on a fence before looking at the queue again */
+constexpr std::chrono::nanoseconds fence_poll = std::chrono::milliseconds(1);
+
+struct pool_buf {
+	pool_buf *next = nullptr;
+	long size = 0;
+	void *data = nullptr;		/* the CPU engines */
+	GLuint bo = 0;			/* the GL engine */
+	const void *map = nullptr;	/* of bo while a frame_result has it */
+};
+
+struct frame_job {
+	frame_fmt fmt;
+	debayer_opts opts;
+	const void *data;
+	std::weak_ptr<engine_state> engine;
+
+	std::atomic<bool> cancelled{false};
+	std::optional<std::stop_callback<std::function<void()>>> on_stop;
+
+	/* the awaiting side, under lock */
+	std::mutex lock;
+	bool done = false;
+	std::coroutine_handle<> waiter;
+	frame_result result;
+	std::exception_ptr error;
+
+	/* the engine side */
+	pool_buf *buf = nullptr;
+	GLsync fence = nullptr;
+};
+
+struct engine_state : std::enable_shared_from_this<engine_state> {
+	async_options options;
+	const struct cpu_engine *cpu = nullptr;	/* nullptr for gl */
+
+	std::mutex lock;	/* all of the below */
+	std::condition_variable wake;
+	std::deque<std::shared_ptr<frame_job>> queue;
+	bool stopping = false;
+	pool_buf *free = nullptr;	/* unmapped */
+	pool_buf *unmap = nullptr;	/* released by their frame_result */
+
+	/* the thread of the engine only */
+	converter conv = {};
+	bool gl_ready = false;
+	GLuint out_bo = 0;	/* bos[bo_out] of conv, see dispatch() */
+	std::deque<std::shared_ptr<frame_job>> in_flight;
+	std::thread thread;
+
+	~engine_state();
+	void run(std::promise<void> &started);
+	pool_buf *pool_get(long size);
+	void pool_put(pool_buf *buf);
+	void pool_unmap();
+	bool dispatch(frame_job &job);
+	void finish(frame_job &job);
+	void complete(frame_job &job, frame_result result,
+		      std::exception_ptr error);
+	void notify();
+};
+
+frame_result::frame_result(frame_result &&o) noexcept :
+	engine_(std::move(o.engine_)), buf_(o.buf_), data_(o.data_),
+	size_(o.size_)
+{
+	o.buf_ = nullptr;
+	o.data_ = nullptr;
+	o.size_ = 0;
+}
+
+frame_result &frame_result::operator=(frame_result &&o) noexcept
+{
+	if (this != &o) {
+		release();
+		engine_ = std::move(o.engine_);
+		buf_ = o.buf_;
+		data_ = o.data_;
+		size_ = o.size_;
+		o.buf_ = nullptr;
+		o.data_ = nullptr;
+		o.size_ = 0;
+	}
+	return *this;
+}
+
+frame_result::~frame_result()
+{
+	release();
+}
+
+void frame_result::release()
+{
+	if (buf_) {
+		std::lock_guard<std::mutex> lk(engine_->lock);
+
+		engine_->pool_put(buf_);
+	}
+	buf_ = nullptr;
+	engine_.reset();
+}
+
+bool frame_op::await_ready() const
+{
+	std::lock_guard<std::mutex> lk(job_->lock);
+
+	return job_->done;
+}
+
+/* false (no suspension) if the frame has completed meanwhile */
+bool frame_op::await_suspend(std::coroutine_handle<> h)
+{
+	std::lock_guard<std::mutex> lk(job_->lock);
+
+	if (job_->done)
+		return false;
+	job_->waiter = h;
+	return true;
+}
+
+frame_result frame_op::await_resume()
+{
+	std::lock_guard<std::mutex> lk(job_->lock);
+
+	if (job_->error)
+		std::rethrow_exception(job_->error);
+	return std::move(job_->result);
+}
+
+void frame_op::cancel()
+{
+	auto engine = job_->engine.lock();
+
+	job_->cancelled = true;
+	if (engine)
+		engine->notify();
+}
+
+static std::exception_ptr cancelled()
+{
+	return std::make_exception_ptr(std::system_error(
+		std::make_error_code(std::errc::operation_canceled)));
+}
+
+/* the caller has the lock */
+pool_buf *engine_state::pool_get(long size)
+{
+	for (pool_buf **p = &free; *p; p = &(*p)->next) {
+		if ((*p)->size == size) {
+			pool_buf *buf = *p;
+
+			*p = buf->next;
+			return buf;
+		}
+	}
+	return nullptr;
+}
+
+/* the caller has the lock */
+void engine_state::pool_put(pool_buf *buf)
+{
+	if (buf->map) {
+		buf->next = unmap;
+		unmap = buf;
+	} else {
+		buf->next = free;
+		free = buf;
+	}
+}
+
+/* the caller has the lock and the context */
+void engine_state::pool_unmap()
+{
+	pool_buf *buf, *next;
+
+	for (buf = unmap; buf; buf = next) {
+		next = buf->next;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, buf->bo);
+		glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+		buf->map = nullptr;
+		buf->next = free;
+		free = buf;
+	}
+	unmap = nullptr;
+}
+
+/* wakes the thread up, a lost wakeup only costs a poll */
+void engine_state::notify()
+{
+	wake.notify_one();
+}
+
+void engine_state::complete(frame_job &job, frame_result result,
+			    std::exception_ptr error)
+{
+	std::coroutine_handle<> h;
+
+	{
+		std::lock_guard<std::mutex> lk(job.lock);
+
+		if (job.done)
+			return;
+		job.result = std::move(result);
+		job.error = error;
+		job.done = true;
+		h = job.waiter;
+	}
+	if (!h)
+		return;
+	if (options.resume)
+		options.resume(h);
+	else
+		h.resume();
+}
+
+/*
+ * Uploads and dispatches the frame into a buffer of the pool, false if it
+ * has completed already (a CPU engine, or an error).
+ */
+bool engine_state::dispatch(frame_job &job)
+{
+	long size = output_size(&job.fmt, &job.opts);
+	pool_buf *buf;
+
+	{
+		std::lock_guard<std::mutex> lk(lock);
+
+		if (!cpu)
+			pool_unmap();
+		buf = pool_get(size);
+	}
+	if (buf == nullptr) {
+		buf = new pool_buf;
+		buf->size = size;
+		if (cpu)
+			buf->data = std::malloc(size);
+		else
+			glGenBuffers(1, &buf->bo);
+	}
+
+	if (cpu) {
+		if (buf->data == nullptr) {
+			delete buf;
+			complete(job, {}, std::make_exception_ptr(
+				std::bad_alloc()));
+			return false;
+		}
+		cpu->process(&job.fmt, &job.opts,
+			     (const uint8_t *)job.data, buf->data);
+		job.buf = buf;
+		finish(job);
+		return false;
+	}
+
+	conv.bos[bo_out] = buf->bo;
+	if (dispatch_shader(&conv, &job.fmt, &job.opts, job.data) != 0) {
+		conv.bos[bo_out] = out_bo;
+		{
+			std::lock_guard<std::mutex> lk(lock);
+
+			pool_put(buf);
+		}
+		complete(job, {}, std::make_exception_ptr(
+			std::runtime_error("the shader failed")));
+		return false;
+	}
+	conv.bos[bo_out] = out_bo;
+	job.fence = fence_shader();
+	glFlush();
+	job.buf = buf;
+	return true;
+}
+
+/* the output of the completed frame to its awaiting coroutine */
+void engine_state::finish(frame_job &job)
+{
+	pool_buf *buf = job.buf;
+	frame_result r;
+
+	job.buf = nullptr;
+	if (!cpu && !job.cancelled) {
+		conv.bos[bo_out] = buf->bo;
+		buf->map = map_output(&conv, buf->size);
+		conv.bos[bo_out] = out_bo;
+	}
+	if (job.cancelled || (!cpu && buf->map == nullptr)) {
+		{
+			std::lock_guard<std::mutex> lk(lock);
+
+			pool_put(buf);
+		}
+		complete(job, {}, job.cancelled ? cancelled() :
+			 std::make_exception_ptr(std::runtime_error(
+				"the output mapping failed")));
+		return;
+	}
+	/* the results can outlive the engine, see ~engine_state() */
+	r.engine_ = shared_from_this();
+	r.buf_ = buf;
+	r.data_ = cpu ? buf->data : buf->map;
+	r.size_ = buf->size;
+	complete(job, std::move(r), nullptr);
+}
+
+void engine_state::run(std::promise<void> &started)
+{
+	std::unique_lock<std::mutex> lk(lock, std::defer_lock);
+
+	if (!cpu) {
+		conv.shader_fname = options.shader.c_str();
+		if (init_egl(&conv, RENDER_NODE_FNAME) != 0) {
+			started.set_exception(std::make_exception_ptr(
+				std::runtime_error("the GL engine is not available")));
+			return;
+		}
+		glGenBuffers(bo_num, conv.bos);
+		out_bo = conv.bos[bo_out];
+		gl_ready = true;
+	}
+	started.set_value();
+
+	for (;;) {
+		std::shared_ptr<frame_job> job;
+
+		/* the cancelled frames in flight don't wait for their fence */
+		for (auto &j : in_flight)
+			if (j->cancelled)
+				complete(*j, {}, cancelled());
+
+		lk.lock();
+		if (stopping) {
+			for (auto &j : queue)
+				j->cancelled = true;
+			for (auto &j : in_flight)
+				j->cancelled = true;
+		}
+		while (!queue.empty() && queue.front()->cancelled) {
+			job = std::move(queue.front());
+			queue.pop_front();
+			lk.unlock();
+			complete(*job, {}, cancelled());
+			lk.lock();
+		}
+		job.reset();
+		if (!queue.empty() && in_flight.size() < options.max_in_flight) {
+			job = std::move(queue.front());
+			queue.pop_front();
+		} else if (in_flight.empty()) {
+			if (stopping && queue.empty())
+				break;
+			wake.wait(lk);
+			lk.unlock();
+			continue;
+		}
+		lk.unlock();
+
+		if (job) {
+			if (dispatch(*job))
+				in_flight.push_back(std::move(job));
+			continue;
+		}
+
+		/* the oldest frame in flight, the fences signal in order */
+		job = in_flight.front();
+		if (glClientWaitSync(job->fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+				     fence_poll.count()) == GL_TIMEOUT_EXPIRED)
+			continue;
+		in_flight.pop_front();
+		glDeleteSync(job->fence);
+		job->fence = nullptr;
+		finish(*job);
+	}
+
+	if (gl_ready)
+		eglMakeCurrent(conv.egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
+			       EGL_NO_CONTEXT);
+}
+
+/* the last frame_result is gone, on any thread: the context moves here */
+engine_state::~engine_state()
+{
+	pool_buf *buf, *next;
+
+	if (gl_ready && eglMakeCurrent(conv.egl_dpy, EGL_NO_SURFACE,
+				       EGL_NO_SURFACE, conv.core_ctx)) {
+		pool_unmap();
+		for (buf = free; buf; buf = buf->next)
+			glDeleteBuffers(1, &buf->bo);
+		glDeleteBuffers(bo_num, conv.bos);
+		if (conv.shader_program)
+			free_shader(&conv);
+		eglMakeCurrent(conv.egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
+			       EGL_NO_CONTEXT);
+		deinit_egl(&conv);
+	}
+	for (buf = free; buf; buf = next) {
+		next = buf->next;
+		std::free(buf->data);
+		delete buf;
+	}
+}
+
+async_engine::async_engine(async_options options) :
+	state_(std::make_shared<engine_state>())
+{
+	std::promise<void> started;
+	std::future<void> ready = started.get_future();
+	engine_state *s = state_.get();
+
+	s->options = std::move(options);
+	if (s->options.max_in_flight == 0)
+		s->options.max_in_flight = 1;
+	if (s->options.engine != "gl") {
+		s->cpu = cpu_engine_find(s->options.engine.c_str());
+		if (s->cpu == nullptr)
+			throw std::invalid_argument("unknown engine \"" +
+						    s->options.engine + "\"");
+	}
+	s->thread = std::thread([s, &started] { s->run(started); });
+	try {
+		ready.get();
+	} catch (...) {
+		s->thread.join();
+		throw;
+	}
+}
+
+/* the frames still queued or in flight are cancelled */
+async_engine::~async_engine()
+{
+	engine_state *s = state_.get();
+
+	{
+		std::lock_guard<std::mutex> lk(s->lock);
+
+		s->stopping = true;
+	}
+	s->notify();
+	s->thread.join();
+}
+
+frame_op async_engine::submit(const frame_fmt &fmt, const debayer_opts &opts,
+			      const void *data, std::stop_token stop)
+{
+	auto job = std::make_shared<frame_job>();
+	frame_job *j = job.get();
+
+	/* bo_out is a buffer of the pool, not kept from a frame to the next */
+	if (opts.temporal.enabled || opts.incremental)
+		throw std::invalid_argument(
+			"the temporal denoise and the incremental mode need the frames in order");
+	if (state_->cpu == nullptr && fmt.stride % 4)
+		throw std::invalid_argument(
+			"the stride must be multiple of 4 for gl");
+	job->fmt = fmt;
+	job->opts = opts;
+	job->data = data;
+	job->engine = state_;
+	job->on_stop.emplace(std::move(stop), [j] {
+		auto s = j->engine.lock();
+
+		j->cancelled = true;
+		if (s)
+			s->notify();
+	});
+
+	{
+		std::lock_guard<std::mutex> lk(state_->lock);
+
+		state_->queue.push_back(job);
+	}
+	state_->notify();
+	return frame_op(std::move(job));
+}
+
+} /* namespace debayer */
@@ -0,0 +1,116 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * The asynchronous API of the engines for the C++20 coroutines:
+ *
+ *   debayer::async_engine eng;
+ *   debayer::frame_result out = co_await eng.submit(fmt, opts, raw);
+ *
+ * submit() queues the frame at once and returns its awaitable, so that a
+ * coroutine can have many frames in flight and await them later. A thread
+ * of the engine owns the GL context: it uploads and dispatches the queued
+ * frames, up to max_in_flight of them, and polls their fences, resuming
+ * the awaiting coroutine of each frame which completes. The coroutine is
+ * resumed on that thread, or by the resume function of the options, e.g.
+ * one posting it to the executor of the service:
+ *
+ *   opts.resume = [&](std::coroutine_handle<> h) {
+ *           asio::post(ioc, [h] { h.resume(); });
+ *   };
+ *
+ * A coroutine resumed on the thread of the engine must not destroy it.
+ *
+ * A frame is cancelled by the stop token given to submit() or by cancel()
+ * of its awaitable: the awaiting coroutine is resumed with the
+ * operation_canceled system_error, before its dispatch if it is still in
+ * the queue. The input must stay valid until the frame completes or is
+ * cancelled.
+ *
+ * Copyright (C) 2021, Linaro
+ */
+
+#ifndef DEBAYER_ASYNC_H
+#define DEBAYER_ASYNC_H
+
+#include <coroutine>
+#include <functional>
+#include <memory>
+#include <stop_token>
+#include <string>
+
+extern "C" {
+#include "../debayer.h"
+}
+
+#ifndef DEBAYER_SHADER
+#define DEBAYER_SHADER "./debayer.comp"
+#endif
+
+namespace debayer {
+
+struct engine_state;	/* see debayer_async.cpp */
+struct frame_job;
+struct pool_buf;
+
+struct async_options {
+	std::string engine = "gl";	/* or cpu, cpu-ref */
+	std::string shader = DEBAYER_SHADER;
+	unsigned int max_in_flight = 4;	/* frames dispatched, not completed */
+	/* resumes the coroutines, on the thread of the engine if empty */
+	std::function<void(std::coroutine_handle<>)> resume;
+};
+
+/* the output of a frame, back to the pool of the engine when destroyed */
+class frame_result {
+public:
+	frame_result() = default;
+	frame_result(frame_result &&o) noexcept;
+	frame_result &operator=(frame_result &&o) noexcept;
+	frame_result(const frame_result &) = delete;
+	frame_result &operator=(const frame_result &) = delete;
+	~frame_result();
+
+	const void *data() const { return data_; }
+	long size() const { return size_; }
+
+private:
+	friend struct engine_state;
+	void release();
+
+	std::shared_ptr<engine_state> engine_;
+	pool_buf *buf_ = nullptr;
+	const void *data_ = nullptr;	/* the mapping of the GL buffer */
+	long size_ = 0;
+};
+
+/* the awaitable of a submitted frame */
+class frame_op {
+public:
+	explicit frame_op(std::shared_ptr<frame_job> job) :
+		job_(std::move(job)) {}
+
+	bool await_ready() const;
+	bool await_suspend(std::coroutine_handle<> h);
+	frame_result await_resume();
+	void cancel();
+
+private:
+	std::shared_ptr<frame_job> job_;
+};
+
+class async_engine {
+public:
+	explicit async_engine(async_options options = {});
+	~async_engine();
+	async_engine(const async_engine &) = delete;
+	async_engine &operator=(const async_engine &) = delete;
+
+	frame_op submit(const frame_fmt &fmt, const debayer_opts &opts,
+			const void *data, std::stop_token stop = {});
+
+private:
+	std::shared_ptr<engine_state> state_;
+};
+
+} /* namespace debayer */
+
+#endif /* DEBAYER_ASYNC_H */
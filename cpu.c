@@ -0,0 +1,1402 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * CPU implementations of the demosaic filter from debayer.comp.
+ *
+ * Based on the code from http://jgt.akpeters.com/papers/McGuire08/
+ * Copyright (c) 2008, Morgan McGuire. All rights reserved.
+ *
+ * Copyright (C) 2021, Linaro
+ *
+ * The engines must produce exactly the same output as the compute shader
+ * does: the same integer arithmetic is used, and the pixels outside of the
+ * frame are read as zeros.
+ */
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "debayer.h"
+
+static inline int clamp_pattern(int p16)
+{
+	if (p16 < 0)
+		return 0;
+	if (p16 > 255 * 16)
+		return 255;
+	return p16 / 16;
+}
+
+/*
+ * See debayer.comp for the meaning of the terms. C is the center pixel,
+ * the sums of the pixels in the 5x5 neighbourhood are:
+ *   A - vertical at distance 2,   B - vertical at distance 1,
+ *   E - horizontal at distance 2, F - horizontal at distance 1,
+ *   D - the four diagonal ones.
+ * alt_x and alt_y are the position in the bayer pattern relative to red.
+ */
+static inline uint32_t mcguire(int C, int A, int B, int D, int E, int F,
+			       int alt_x, int alt_y)
+{
+	int px = 8 * C - 2 * A - 2 * E + 4 * B + 4 * F;
+	int py = 12 * C + 4 * D - 3 * A - 3 * E;
+	int pz = 10 * C - 2 * D + A - 2 * E + 8 * F;
+	int pw = 10 * C - 2 * D - 2 * A + E + 8 * B;
+
+	if (alt_y == 0)
+		return alt_x == 0 ?
+			to_rgba(C, clamp_pattern(px), clamp_pattern(py)) :
+			to_rgba(clamp_pattern(pz), C, clamp_pattern(pw));
+	else
+		return alt_x == 0 ?
+			to_rgba(clamp_pattern(pw), C, clamp_pattern(pz)) :
+			to_rgba(clamp_pattern(py), clamp_pattern(px), C);
+}
+
+/* the state of a frame being processed */
+struct ctx {
+	const struct frame_fmt *fmt;
+	const struct debayer_opts *opts;
+	const uint8_t *in;
+	int fr_x, fr_y;		/* see bayer_first_red() */
+	uint32_t xtrans[XTRANS_TABLE];	/* CFA_XTRANS: see xtrans_init() */
+	int tn_weight[256];	/* of the previous frame by the motion, see
+				 * temporal_pixel() */
+};
+
+static void ctx_init(struct ctx *c, const struct frame_fmt *fmt,
+		     const struct debayer_opts *opts, const uint8_t *in)
+{
+	c->fmt = fmt;
+	c->opts = opts;
+	c->in = in;
+	bayer_first_red(fmt->order, &c->fr_x, &c->fr_y);
+	if (fmt->cfa == CFA_XTRANS)
+		xtrans_init(c->xtrans);
+
+	if (opts->temporal.enabled) {
+		const struct temporal_fmt *t = &opts->temporal;
+		int m;
+
+		for (m = 0; m < 256; m++)
+			c->tn_weight[m] = m < t->threshold ?
+				t->strength * (t->threshold - m) /
+				t->threshold : 0;
+	}
+}
+
+static inline int inside(const struct ctx *c, int x, int y)
+{
+	return x >= 0 && y >= 0 && x < c->fmt->width && y < c->fmt->height;
+}
+
+/* the raw pixel, zero outside of the frame */
+static inline int raw_pixel(const struct ctx *c, int x, int y)
+{
+	if (!inside(c, x, y))
+		return 0;
+	return c->in[(ptrdiff_t)y * c->fmt->stride + x];
+}
+
+/* denoise strength for the colour of the pixel */
+static inline int dn_strength(const struct ctx *c, int x, int y)
+{
+	int alt_x = (x + c->fr_x) & 1;
+	int alt_y = (y + c->fr_y) & 1;
+
+	if (alt_x != alt_y)
+		return c->opts->denoise.strength[1];
+	return c->opts->denoise.strength[alt_x ? 2 : 0];
+}
+
+/* see denoise() in debayer.comp */
+static int denoise_pixel(const struct ctx *c, int x, int y)
+{
+	int s = dn_strength(c, x, y);
+	int v = raw_pixel(c, x, y);
+	int sum, wsum;
+	int dx, dy;
+
+	if (s == 0 || !inside(c, x, y))
+		return v;
+
+	sum = v * s;
+	wsum = s;
+	for (dy = -2; dy <= 2; dy += 2) {
+		for (dx = -2; dx <= 2; dx += 2) {
+			int n, w;
+
+			if ((dx == 0 && dy == 0) || !inside(c, x + dx, y + dy))
+				continue;
+			n = raw_pixel(c, x + dx, y + dy);
+			w = s - abs(n - v);
+			if (w > 0) {
+				sum += w * n;
+				wsum += w;
+			}
+		}
+	}
+	return (sum + wsum / 2) / wsum;
+}
+
+/* the input of the demosaic filter */
+static inline int fetch(const struct ctx *c, int x, int y)
+{
+	if (c->opts->denoise.enabled)
+		return denoise_pixel(c, x, y);
+	return raw_pixel(c, x, y);
+}
+
+static uint32_t debayer_pixel(const struct ctx *c, int x, int y)
+{
+#define F(dx, dy) fetch(c, x + (dx), y + (dy))
+	return mcguire(F(0, 0),
+		       F(0, -2) + F(0, 2), F(0, -1) + F(0, 1),
+		       F(-1, -1) + F(-1, 1) + F(1, -1) + F(1, 1),
+		       F(-2, 0) + F(2, 0), F(-1, 0) + F(1, 0),
+		       (x + c->fr_x) & 1, (y + c->fr_y) & 1);
+#undef F
+}
+
+/* the interior pixels only, no bounds checks */
+static inline uint32_t debayer_pixel_direct(const uint8_t *p, ptrdiff_t s,
+					    int alt_x, int alt_y)
+{
+	return mcguire(p[0],
+		       p[-2 * s] + p[2 * s], p[-s] + p[s],
+		       p[-s - 1] + p[s - 1] + p[-s + 1] + p[s + 1],
+		       p[-2] + p[2], p[-1] + p[1],
+		       alt_x, alt_y);
+}
+
+static uint32_t debayer_pixel_fast(const struct ctx *c, int x, int y)
+{
+	const struct frame_fmt *fmt = c->fmt;
+
+	if (c->opts->denoise.enabled ||
+	    x < 2 || y < 2 || x >= fmt->width - 2 || y >= fmt->height - 2)
+		return debayer_pixel(c, x, y);
+	return debayer_pixel_direct(c->in + (ptrdiff_t)y * fmt->stride + x,
+				    fmt->stride, (x + c->fr_x) & 1,
+				    (y + c->fr_y) & 1);
+}
+
+/*
+ * X-Trans: the lines of the table for a position in the pattern, bound to
+ * the rows of the filter input: the pixels on both sides of the one at
+ * the column x of the rows are a[x] and b[x]
+ */
+struct xtrans_line {
+	const uint8_t *a, *b;
+	int wa, wb;		/* the weights of a and b */
+	int recip;		/* 65536 / (wa + wb), rounded up */
+	int scale;		/* of the difference, for the distance */
+};
+
+struct xtrans_pos {
+	int lines[3];		/* for R, G, B, 0 - the pixel itself */
+	struct xtrans_line line[3][4];
+	const uint8_t *pixel;	/* the row of the pixel itself */
+};
+
+/* rows[] are y-2..y+2 */
+static void xtrans_pos(const struct ctx *c, int x, int y,
+		       const uint8_t *const rows[5], struct xtrans_pos *p)
+{
+	int ch;
+
+	for (ch = 0; ch < 3; ch++) {
+		uint32_t lines = c->xtrans[((y % XTRANS_SIZE) * XTRANS_SIZE +
+					    x % XTRANS_SIZE) * 3 + ch];
+		int n;
+
+		for (n = 0; lines & XTRANS_LINE_ON;
+		     n++, lines >>= XTRANS_LINE_BITS) {
+			struct xtrans_line *l = &p->line[ch][n];
+			const int *dir = xtrans_dirs[(lines >> 2) & 3];
+			int da = ((lines >> 1) & 1) + 1;
+			int db = (lines & 1) + 1;
+
+			l->a = rows[2 - da * dir[1]] - da * dir[0];
+			l->b = rows[2 + db * dir[1]] + db * dir[0];
+			l->wa = db;
+			l->wb = da;
+			l->recip = (65536 + da + db - 1) / (da + db);
+			l->scale = 12 / (da + db);
+		}
+		p->lines[ch] = n;
+	}
+	p->pixel = rows[2];
+}
+
+/*
+ * See debayer() for CFA_XTRANS in debayer.comp: the line with the
+ * smallest difference wins, the first one of the equal ones. The
+ * division by the reciprocal is exact for the sums of 2..4 weights.
+ */
+static inline int xtrans_value(const struct xtrans_line *l, int n, int x)
+{
+	int best = 0, best_diff = INT_MAX;
+	int i;
+
+	for (i = 0; i < n; i++, l++) {
+		int a = l->a[x];
+		int b = l->b[x];
+		int diff = abs(a - b) * l->scale;
+
+		if (diff < best_diff) {
+			best_diff = diff;
+			best = ((a * l->wa + b * l->wb +
+				 (l->wa + l->wb) / 2) * l->recip) >> 16;
+		}
+	}
+	return best;
+}
+
+static inline uint32_t xtrans_rgb(const struct xtrans_pos *p, int x)
+{
+	int rgb[3];
+	int ch;
+
+	for (ch = 0; ch < 3; ch++)
+		rgb[ch] = p->lines[ch] ?
+			  xtrans_value(p->line[ch], p->lines[ch], x) :
+			  p->pixel[x];
+	return to_rgba(rgb[0], rgb[1], rgb[2]);
+}
+
+/* the 5x5 neighbourhood read with the bounds checks */
+static uint32_t xtrans_pixel(const struct ctx *c, int x, int y)
+{
+	uint8_t nb[5][5];
+	const uint8_t *rows[5];
+	struct xtrans_pos p;
+	int dx, dy;
+
+	for (dy = 0; dy < 5; dy++) {
+		for (dx = 0; dx < 5; dx++)
+			nb[dy][dx] = fetch(c, x + dx - 2, y + dy - 2);
+		rows[dy] = nb[dy];
+	}
+	xtrans_pos(c, x, y, rows, &p);
+	return xtrans_rgb(&p, 2);
+}
+
+static uint32_t xtrans_pixel_fast(const struct ctx *c, int x, int y)
+{
+	const struct frame_fmt *fmt = c->fmt;
+	const uint8_t *rows[5];
+	struct xtrans_pos p;
+	int i;
+
+	if (c->opts->denoise.enabled ||
+	    x < 2 || y < 2 || x >= fmt->width - 2 || y >= fmt->height - 2)
+		return xtrans_pixel(c, x, y);
+	for (i = 0; i < 5; i++)
+		rows[i] = c->in + (ptrdiff_t)(y + i - 2) * fmt->stride;
+	xtrans_pos(c, x, y, rows, &p);
+	return xtrans_rgb(&p, x);
+}
+
+/* CFA_MONO: no demosaicing */
+static uint32_t mono_pixel(const struct ctx *c, int x, int y)
+{
+	int v = fetch(c, x, y);
+
+	return to_rgba(v, v, v);
+}
+
+typedef uint32_t (*pixel_fn)(const struct ctx *c, int x, int y);
+
+static inline int red(uint32_t rgba)
+{
+	return rgba >> 24;
+}
+
+static inline int green(uint32_t rgba)
+{
+	return (rgba >> 16) & 0xff;
+}
+
+static inline int blue(uint32_t rgba)
+{
+	return (rgba >> 8) & 0xff;
+}
+
+static inline int clamp_int(int v, int lo, int hi)
+{
+	return v < lo ? lo : v > hi ? hi : v;
+}
+
+/* the middle 2 of the 4 values sorted */
+static inline void middle4(int a, int b, int c, int d, int *lo, int *hi)
+{
+	int l1 = a < b ? a : b, h1 = a < b ? b : a;
+	int l2 = c < d ? c : d, h2 = c < d ? d : c;
+	int l = l1 > l2 ? l1 : l2;
+	int h = h1 < h2 ? h1 : h2;
+
+	*lo = l < h ? l : h;
+	*hi = l < h ? h : l;
+}
+
+/*
+ * See postfilter() in debayer.comp, nb[] is the 3x3 neighbourhood of the
+ * demosaiced pixel nb[4], row by row.
+ */
+static inline uint32_t postfilter_core(const struct postfilter_fmt *pf,
+				       const uint32_t nb[9])
+{
+	int g = green(nb[4]);
+	int cr = red(nb[4]) - g;
+	int cb = blue(nb[4]) - g;
+	int blur = 0;
+	int detail, delta;
+	int lo, hi, i;
+
+	if (pf->chroma_median) {
+		/* the median of 5 is the value clamped to the middle 2 */
+		middle4(red(nb[1]) - green(nb[1]), red(nb[3]) - green(nb[3]),
+			red(nb[5]) - green(nb[5]), red(nb[7]) - green(nb[7]),
+			&lo, &hi);
+		cr = clamp_int(cr, lo, hi);
+		middle4(blue(nb[1]) - green(nb[1]), blue(nb[3]) - green(nb[3]),
+			blue(nb[5]) - green(nb[5]), blue(nb[7]) - green(nb[7]),
+			&lo, &hi);
+		cb = clamp_int(cb, lo, hi);
+	}
+
+	/* luma times 4, blurred luma times 64 */
+	for (i = 0; i < 9; i++) {
+		int w = i == 4 ? 4 : i % 2 ? 2 : 1;
+
+		blur += w * (red(nb[i]) + 2 * green(nb[i]) + blue(nb[i]));
+	}
+	detail = 16 * (red(nb[4]) + 2 * g + blue(nb[4])) - blur;
+	/* rounded, offset not to shift the negative values */
+	delta = ((pf->sharpen * detail + (8192 << 10) + 512) >> 10) - 8192;
+
+	return to_rgba(clamp_int(g + cr + delta, 0, 255),
+		       clamp_int(g + delta, 0, 255),
+		       clamp_int(g + cb + delta, 0, 255));
+}
+
+/* the neighbours outside of the frame are replaced by the pixel itself */
+static inline uint32_t postfilter_pixel(const struct ctx *c, int x, int y,
+					pixel_fn pixel)
+{
+	uint32_t nb[9];
+	int dx, dy;
+
+	nb[4] = pixel(c, x, y);
+	for (dy = -1; dy <= 1; dy++)
+		for (dx = -1; dx <= 1; dx++)
+			if (dx || dy)
+				nb[3 * (dy + 1) + dx + 1] =
+					inside(c, x + dx, y + dy) ?
+					pixel(c, x + dx, y + dy) : nb[4];
+	return postfilter_core(&c->opts->post, nb);
+}
+
+static uint32_t debayer_pixel_post(const struct ctx *c, int x, int y)
+{
+	return postfilter_pixel(c, x, y, debayer_pixel);
+}
+
+static uint32_t debayer_pixel_fast_post(const struct ctx *c, int x, int y)
+{
+	return postfilter_pixel(c, x, y, debayer_pixel_fast);
+}
+
+static uint32_t xtrans_pixel_post(const struct ctx *c, int x, int y)
+{
+	return postfilter_pixel(c, x, y, xtrans_pixel);
+}
+
+static uint32_t xtrans_pixel_fast_post(const struct ctx *c, int x, int y)
+{
+	return postfilter_pixel(c, x, y, xtrans_pixel_fast);
+}
+
+static uint32_t mono_pixel_post(const struct ctx *c, int x, int y)
+{
+	return postfilter_pixel(c, x, y, mono_pixel);
+}
+
+/* the pixel function for the CFA and the post-filter */
+static pixel_fn pixel_function(const struct frame_fmt *fmt,
+			       const struct debayer_opts *opts, int fast)
+{
+	static const pixel_fn fns[3][2][2] = {
+		{ { debayer_pixel, debayer_pixel_post },
+		  { debayer_pixel_fast, debayer_pixel_fast_post } },
+		{ { xtrans_pixel, xtrans_pixel_post },
+		  { xtrans_pixel_fast, xtrans_pixel_fast_post } },
+		{ { mono_pixel, mono_pixel_post },
+		  { mono_pixel, mono_pixel_post } },
+	};
+	int kind = fmt->cfa == CFA_XTRANS ? 1 : fmt->cfa == CFA_MONO ? 2 : 0;
+
+	return fns[kind][fast][opts->post.enabled];
+}
+
+/* see store_pixel() in debayer.comp */
+static inline uint32_t temporal_pixel(const struct ctx *c, long i,
+				      uint32_t rgba)
+{
+	const struct temporal_fmt *t = &c->opts->temporal;
+	uint32_t prev;
+	int motion = 0;
+	int a, ch;
+
+	if (!t->enabled || t->prev == NULL)
+		return rgba;
+
+	prev = t->prev[i];
+	for (ch = 8; ch <= 24; ch += 8) {
+		int d = abs((int)((rgba >> ch) & 0xff) -
+			    (int)((prev >> ch) & 0xff));
+
+		motion = d > motion ? d : motion;
+	}
+	a = c->tn_weight[motion];
+
+	return to_rgba(((int)(rgba >> 24) * (256 - a) +
+			(int)(prev >> 24) * a + 128) >> 8,
+		       ((int)((rgba >> 16) & 0xff) * (256 - a) +
+			(int)((prev >> 16) & 0xff) * a + 128) >> 8,
+		       ((int)((rgba >> 8) & 0xff) * (256 - a) +
+			(int)((prev >> 8) & 0xff) * a + 128) >> 8);
+}
+
+/* black outside of the frame */
+static inline uint32_t clip_pixel(const struct ctx *c, int x, int y,
+				  pixel_fn pixel)
+{
+	if (!inside(c, x, y))
+		return 0;
+	return pixel(c, x, y);
+}
+
+static inline int lerp_channel(uint32_t c00, uint32_t c10, uint32_t c01,
+			       uint32_t c11, int fx, int fy, int shift)
+{
+	int v = ((c00 >> shift) & 0xff) * (256 - fx) * (256 - fy) +
+		((c10 >> shift) & 0xff) * fx * (256 - fy) +
+		((c01 >> shift) & 0xff) * (256 - fx) * fy +
+		((c11 >> shift) & 0xff) * fx * fy;
+
+	return (v + (1 << 15)) >> 16;
+}
+
+/*
+ * The pixel (x,y) of the image after the lens distortion correction (if
+ * enabled): the bilinear interpolation of the 4 demosaiced pixels around
+ * the position given by the warp grid.
+ */
+static uint32_t sample_pixel(const struct ctx *c, int x, int y,
+			     pixel_fn pixel)
+{
+	uint32_t c00, c10, c01, c11;
+	int sx, sy, fx, fy;
+
+	if (!c->opts->remap.enabled)
+		return pixel(c, x, y);
+
+	remap_src(&c->opts->remap, x, y, &sx, &sy);
+	fx = sx & 0xff;
+	fy = sy & 0xff;
+	sx = (sx >> 8) - REMAP_BIAS;
+	sy = (sy >> 8) - REMAP_BIAS;
+
+	c00 = clip_pixel(c, sx, sy, pixel);
+	c10 = clip_pixel(c, sx + 1, sy, pixel);
+	c01 = clip_pixel(c, sx, sy + 1, pixel);
+	c11 = clip_pixel(c, sx + 1, sy + 1, pixel);
+
+	return to_rgba(lerp_channel(c00, c10, c01, c11, fx, fy, 24),
+		       lerp_channel(c00, c10, c01, c11, fx, fy, 16),
+		       lerp_channel(c00, c10, c01, c11, fx, fy, 8));
+}
+
+/*
+ * Lens distortion correction: every output pixel is gathered from the
+ * frame, there is no intermediate image.
+ */
+static void debayer_remap(const struct ctx *c, uint32_t *out, pixel_fn pixel)
+{
+	int out_w, out_h;
+	long i = 0;
+	int ox, oy;
+
+	orient_size(c->fmt, c->opts->orient, &out_w, &out_h);
+
+	for (oy = 0; oy < out_h; oy++) {
+		for (ox = 0; ox < out_w; ox++, i++) {
+			int x = ox, y = oy;
+
+			orient_src(c->fmt, c->opts->orient, &x, &y);
+			out[i] = temporal_pixel(c, i,
+						sample_pixel(c, x, y, pixel));
+		}
+	}
+}
+
+/* the gray output, see to_gray() */
+static void debayer_gray(const struct ctx *c, uint8_t *out, pixel_fn pixel)
+{
+	int out_w, out_h;
+	long i = 0;
+	int ox, oy;
+
+	orient_size(c->fmt, c->opts->orient, &out_w, &out_h);
+
+	for (oy = 0; oy < out_h; oy++) {
+		for (ox = 0; ox < out_w; ox++, i++) {
+			int x = ox, y = oy;
+			uint32_t rgba;
+
+			orient_src(c->fmt, c->opts->orient, &x, &y);
+			rgba = sample_pixel(c, x, y, pixel);
+			out[i] = to_gray(red(rgba), green(rgba), blue(rgba));
+		}
+	}
+}
+
+/* the YUV 4:2:0 output, see to_y() */
+static void debayer_yuv(const struct ctx *c, uint8_t *out, pixel_fn pixel)
+{
+	int nv12 = c->opts->output == OUTPUT_NV12;
+	int out_w, out_h;
+	uint8_t *uv;
+	int ox, oy, j;
+
+	orient_size(c->fmt, c->opts->orient, &out_w, &out_h);
+	uv = out + (long)out_w * out_h;
+
+	for (oy = 0; oy < out_h; oy += 2) {
+		for (ox = 0; ox < out_w; ox += 2) {
+			int r = 0, g = 0, b = 0;
+			long i = (long)oy / 2 * (out_w / 2) + ox / 2;
+
+			for (j = 0; j < 4; j++) {
+				int x = ox + (j & 1), y = oy + (j >> 1);
+				uint32_t rgba;
+
+				orient_src(c->fmt, c->opts->orient, &x, &y);
+				rgba = sample_pixel(c, x, y, pixel);
+				out[(long)(oy + (j >> 1)) * out_w + ox +
+				    (j & 1)] = to_y(red(rgba), green(rgba),
+						    blue(rgba));
+				r += red(rgba);
+				g += green(rgba);
+				b += blue(rgba);
+			}
+			r = (r + 2) >> 2;
+			g = (g + 2) >> 2;
+			b = (b + 2) >> 2;
+			if (nv12) {
+				uv[2 * i] = to_u(r, g, b);
+				uv[2 * i + 1] = to_v(r, g, b);
+			} else {
+				uv[i] = to_u(r, g, b);
+				uv[(long)out_w * out_h / 4 + i] = to_v(r, g, b);
+			}
+		}
+	}
+}
+
+/*
+ * CFA_MONO to the gray output is the copy of the input rows, or their
+ * pixels scattered by the orientation
+ */
+static void mono_gray(const struct ctx *c, uint8_t *out)
+{
+	const struct frame_fmt *fmt = c->fmt;
+	unsigned int orient = c->opts->orient;
+	int x, y;
+
+	for (y = 0; y < fmt->height; y++) {
+		const uint8_t *row = c->in + (ptrdiff_t)y * fmt->stride;
+
+		if (!(orient & (ORIENT_HFLIP | ORIENT_TRANSPOSE))) {
+			memcpy(out + orient_index(fmt, orient, 0, y), row,
+			       fmt->width);
+			continue;
+		}
+		for (x = 0; x < fmt->width; x++)
+			out[orient_index(fmt, orient, x, y)] = row[x];
+	}
+}
+
+static inline void store_elem(void *out, long i, int size, uint32_t e)
+{
+	switch (size) {
+	case 4:
+		((uint32_t *)out)[i] = e;
+		break;
+	case 2:
+		((uint16_t *)out)[i] = e;
+		break;
+	default:
+		((uint8_t *)out)[i] = e;
+		break;
+	}
+}
+
+/*
+ * Only the pixels sampled into the tensor are demosaiced, there is no
+ * intermediate RGBA frame.
+ */
+static void debayer_tensor(const struct ctx *c, void *out, pixel_fn pixel)
+{
+	const struct tensor_fmt *t = &c->opts->tensor;
+	long plane = (long)t->width * t->height;
+	int esize = tensor_elem_size(t);
+	int out_w, out_h;
+	int tx, ty, ch;
+
+	orient_size(c->fmt, c->opts->orient, &out_w, &out_h);
+
+	for (ty = 0; ty < t->height; ty++) {
+		for (tx = 0; tx < t->width; tx++) {
+			/* the tensor samples the oriented output image */
+			int x = tensor_src(tx, t->width, out_w);
+			int y = tensor_src(ty, t->height, out_h);
+			long i = (long)ty * t->width + tx;
+			uint32_t rgba;
+
+			orient_src(c->fmt, c->opts->orient, &x, &y);
+			rgba = sample_pixel(c, x, y, pixel);
+
+			for (ch = 0; ch < 3; ch++) {
+				int src = t->bgr ? 2 - ch : ch;
+				int v = (rgba >> (24 - 8 * src)) & 0xff;
+
+				if (t->layout == TENSOR_CHW)
+					store_elem(out, ch * plane + i, esize,
+						   t->lut[ch][v]);
+				else
+					store_elem(out, 3 * i + ch, esize,
+						   t->lut[ch][v]);
+			}
+		}
+	}
+}
+
+/* Straightforward per-pixel version, the reference for the other ones */
+static void debayer_ref(const struct frame_fmt *fmt,
+			const struct debayer_opts *opts,
+			const uint8_t *in, void *data_out)
+{
+	pixel_fn pixel = pixel_function(fmt, opts, 0);
+	uint32_t *out = data_out;
+	struct ctx c;
+	int x, y;
+
+	ctx_init(&c, fmt, opts, in);
+
+	if (opts->output == OUTPUT_TENSOR) {
+		debayer_tensor(&c, data_out, pixel);
+		return;
+	}
+	if (opts->output == OUTPUT_GRAY) {
+		debayer_gray(&c, data_out, pixel);
+		return;
+	}
+	if (output_yuv(opts->output)) {
+		debayer_yuv(&c, data_out, pixel);
+		return;
+	}
+	if (opts->remap.enabled) {
+		debayer_remap(&c, data_out, pixel);
+		return;
+	}
+
+	for (y = 0; y < fmt->height; y++) {
+		for (x = 0; x < fmt->width; x++) {
+			long i = orient_index(fmt, opts->orient, x, y);
+
+			out[i] = temporal_pixel(&c, i, pixel(&c, x, y));
+		}
+	}
+}
+
+/*
+ * The rows of the demosaic filter input for the row based version: either
+ * the input rows, or the ring of the 5 last preprocessed (denoised) ones;
+ * and the ring of the 3 last demosaiced rows for the post-filter. The
+ * input rows are the ring of the 5 last converted ones when the input
+ * conversion is fused into the loop (see cpu_fast()).
+ */
+struct rows {
+	const struct ctx *c;
+	uint8_t *zero;		/* for the rows outside of the frame */
+	const struct tone_map *map;	/* NULL if the input is 8-bit */
+	uint8_t *in_ring;
+	int in_next;		/* the next row to convert */
+	uint8_t *ring;		/* NULL if there is no preprocessing */
+	int next;		/* the next row to preprocess */
+	uint32_t *rgb_ring;	/* NULL if there is no post-filter */
+	int rgb_next;		/* the next row to demosaic */
+};
+
+/* same as denoise_pixel(), in[] are the rows y-2..y+2 (NULL outside) */
+static int denoise_at(const struct ctx *c, const uint8_t *const in[5],
+		      int s, int x)
+{
+	int v = in[2][x];
+	int sum = v * s, wsum = s;
+	int dx, dy;
+
+	if (s == 0)
+		return v;
+	for (dy = 0; dy <= 4; dy += 2) {
+		for (dx = -2; dx <= 2; dx += 2) {
+			int n, w;
+
+			if ((dx == 0 && dy == 2) || in[dy] == NULL ||
+			    x + dx < 0 || x + dx >= c->fmt->width)
+				continue;
+			n = in[dy][x + dx];
+			w = s - abs(n - v);
+			if (w > 0) {
+				sum += w * n;
+				wsum += w;
+			}
+		}
+	}
+	return (sum + wsum / 2) / wsum;
+}
+
+#ifdef __SSE2__
+static inline __m128i load8(const uint8_t *p)
+{
+	return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p),
+				 _mm_setzero_si128());
+}
+
+/*
+ * The middle of the row 8 pixels at once, from the even x to end, in 16-bit
+ * lanes: the weights and their products with the pixels (up to 255 * 255)
+ * fit, the sums are 32-bit. The division is the float one, truncated: the
+ * operands are exact below 2^24, and a remainder of at least 1 out of at
+ * most 9 * 255 can't be rounded up to the next integer. nb[] are the
+ * neighbours of the pixel x - 2 of p, in[] of denoise_at() from the top
+ * left. Returns the next x, for the scalar loop.
+ */
+static int denoise_row_sse2(const uint8_t *const nb[8], const int on[8],
+			    const uint8_t *p, const int s2[2], int x, int end,
+			    uint8_t *out)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i s = _mm_set_epi16(s2[1], s2[0], s2[1], s2[0],
+					s2[1], s2[0], s2[1], s2[0]);
+	__m128i mask[8];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		mask[i] = _mm_set1_epi16(on[i] ? -1 : 0);
+	for (; x + 8 <= end; x += 8) {
+		__m128i v = load8(p + x);
+		__m128i prod = _mm_mullo_epi16(v, s);
+		__m128i sum_lo = _mm_unpacklo_epi16(prod, zero);
+		__m128i sum_hi = _mm_unpackhi_epi16(prod, zero);
+		__m128i wsum = s, w_lo, w_hi, q, keep;
+		__m128 q_lo, q_hi;
+
+		for (i = 0; i < 8; i++) {
+			__m128i n = load8(nb[i] + x - 2);
+			__m128i d = _mm_sub_epi16(n, v);
+			__m128i w;
+
+			d = _mm_max_epi16(d, _mm_sub_epi16(zero, d));
+			w = _mm_max_epi16(_mm_sub_epi16(s, d), zero);
+			w = _mm_and_si128(w, mask[i]);
+			prod = _mm_mullo_epi16(w, n);
+			sum_lo = _mm_add_epi32(sum_lo,
+					       _mm_unpacklo_epi16(prod, zero));
+			sum_hi = _mm_add_epi32(sum_hi,
+					       _mm_unpackhi_epi16(prod, zero));
+			wsum = _mm_add_epi16(wsum, w);
+		}
+
+		/* (sum + wsum / 2) / wsum, v where the strength is 0 */
+		w_lo = _mm_unpacklo_epi16(wsum, zero);
+		w_hi = _mm_unpackhi_epi16(wsum, zero);
+		sum_lo = _mm_add_epi32(sum_lo, _mm_srli_epi32(w_lo, 1));
+		sum_hi = _mm_add_epi32(sum_hi, _mm_srli_epi32(w_hi, 1));
+		q_lo = _mm_div_ps(_mm_cvtepi32_ps(sum_lo), _mm_cvtepi32_ps(w_lo));
+		q_hi = _mm_div_ps(_mm_cvtepi32_ps(sum_hi), _mm_cvtepi32_ps(w_hi));
+		q = _mm_packs_epi32(_mm_cvttps_epi32(q_lo),
+				    _mm_cvttps_epi32(q_hi));
+		keep = _mm_cmpeq_epi16(wsum, zero);
+		q = _mm_or_si128(_mm_and_si128(keep, v),
+				 _mm_andnot_si128(keep, q));
+		_mm_storel_epi64((__m128i *)(out + x), _mm_packus_epi16(q, q));
+	}
+	return x;
+}
+#endif
+
+/*
+ * Same for the whole row. The pixels of the same colour alternate with
+ * the same strength for the row, and the neighbour rows outside of the
+ * frame are skipped through the zero weight, which keeps the inner loop
+ * free of branches. The middle of the row is done with SSE2 where there
+ * is, the rest by the scalar loop.
+ */
+static void denoise_row(const struct ctx *c, const uint8_t *const in[5],
+			int y, uint8_t *out)
+{
+	const struct frame_fmt *fmt = c->fmt;
+	const uint8_t *p = in[2];
+	const uint8_t *up = in[0] ? in[0] : p;
+	const uint8_t *down = in[4] ? in[4] : p;
+	int up_on = in[0] != NULL, down_on = in[4] != NULL;
+	int s2[2] = { dn_strength(c, 0, y), dn_strength(c, 1, y) };
+	int x;
+
+	for (x = 0; x < fmt->width && x < 2; x++)
+		out[x] = denoise_at(c, in, s2[x & 1], x);
+#ifdef __SSE2__
+	if (x == 2) {
+		const uint8_t *const nb[8] = {
+			up, up + 2, up + 4, p, p + 4, down, down + 2, down + 4,
+		};
+		const int on[8] = {
+			up_on, up_on, up_on, 1, 1, down_on, down_on, down_on,
+		};
+
+		x = denoise_row_sse2(nb, on, p, s2, x, fmt->width - 2, out);
+	}
+#endif
+	for (; x < fmt->width - 2; x++) {
+		const int n[8] = {
+			up[x - 2], up[x], up[x + 2], p[x - 2],
+			p[x + 2], down[x - 2], down[x], down[x + 2],
+		};
+		const int on[8] = {
+			up_on, up_on, up_on, 1, 1, down_on, down_on, down_on,
+		};
+		int s = s2[x & 1];
+		int v = p[x];
+		int sum = v * s, wsum = s;
+		int i;
+
+		for (i = 0; i < 8; i++) {
+			int w = s - abs(n[i] - v);
+
+			w = w > 0 ? w * on[i] : 0;
+			sum += w * n[i];
+			wsum += w;
+		}
+		out[x] = s ? (sum + wsum / 2) / wsum : v;
+	}
+	for (; x < fmt->width; x++)
+		out[x] = denoise_at(c, in, s2[x & 1], x);
+}
+
+static int rows_init(struct rows *r, const struct ctx *c,
+		     const struct tone_map *map)
+{
+	r->c = c;
+	r->map = map;
+	r->in_next = 0;
+	r->next = 0;
+	r->rgb_next = 0;
+	r->in_ring = NULL;
+	r->ring = NULL;
+	r->rgb_ring = NULL;
+	r->zero = calloc(1, c->fmt->width);
+	if (r->zero == NULL)
+		return -1;
+	if (map) {
+		r->in_ring = malloc(5 * c->fmt->width);
+		if (r->in_ring == NULL)
+			goto err_free;
+	}
+	if (c->opts->denoise.enabled) {
+		r->ring = malloc(5 * c->fmt->width);
+		if (r->ring == NULL)
+			goto err_free;
+	}
+	if (c->opts->post.enabled) {
+		r->rgb_ring = malloc(sizeof(*r->rgb_ring) * 3 * c->fmt->width);
+		if (r->rgb_ring == NULL)
+			goto err_free;
+	}
+	return 0;
+
+err_free:
+	free(r->zero);
+	free(r->in_ring);
+	free(r->ring);
+	return -1;
+}
+
+static void rows_free(struct rows *r)
+{
+	free(r->zero);
+	free(r->in_ring);
+	free(r->ring);
+	free(r->rgb_ring);
+}
+
+/*
+ * The input row y of the frame, converted if needed: y must not be more
+ * than 4 rows behind the last one
+ */
+static const uint8_t *rows_input(struct rows *r, int y)
+{
+	const struct frame_fmt *fmt = r->c->fmt;
+
+	if (r->map == NULL)
+		return r->c->in + (ptrdiff_t)y * fmt->stride;
+	for (; r->in_next <= y; r->in_next++)
+		tone_map_row(r->map, r->in_next,
+			     r->in_ring + (r->in_next % 5) * fmt->width);
+	return r->in_ring + (y % 5) * fmt->width;
+}
+
+/* rows y-2..y+2, y must increase from call to call */
+static void rows_get(struct rows *r, int y, const uint8_t *rows[5])
+{
+	const struct frame_fmt *fmt = r->c->fmt;
+	const uint8_t *in[5];
+	int i;
+
+	for (; r->ring && r->next < fmt->height && r->next <= y + 2;
+	     r->next++) {
+		for (i = 0; i < 5; i++) {
+			int yy = r->next + i - 2;
+
+			in[i] = yy < 0 || yy >= fmt->height ? NULL :
+				rows_input(r, yy);
+		}
+		denoise_row(r->c, in, r->next,
+			    r->ring + (r->next % 5) * fmt->width);
+	}
+	for (i = 0; i < 5; i++) {
+		int yy = y + i - 2;
+
+		if (yy < 0 || yy >= fmt->height)
+			rows[i] = r->zero;
+		else if (r->ring)
+			rows[i] = r->ring + (yy % 5) * fmt->width;
+		else
+			rows[i] = rows_input(r, yy);
+	}
+}
+
+/* the pixel of the filter input row, zero outside of the frame */
+#define COL(row, x) ((x) < 0 || (x) >= fmt->width ? 0 : (row)[x])
+
+/*
+ * Row based version: the bounds are only checked within 2 pixels from
+ * the left and right frame borders, the rows outside of the frame are
+ * the zero ones.
+ */
+static void debayer_row(const struct ctx *c, const uint8_t *const rows[5],
+			int y, uint32_t *out)
+{
+	const struct frame_fmt *fmt = c->fmt;
+	int alt_y = (y + c->fr_y) & 1;
+	int x;
+
+	for (x = 0; x < fmt->width; x++) {
+		if (x == 2 && fmt->width > 4) {
+			/* the interior */
+			for (; x < fmt->width - 2; x++)
+				out[x] = mcguire(rows[2][x],
+					 rows[0][x] + rows[4][x],
+					 rows[1][x] + rows[3][x],
+					 rows[1][x - 1] + rows[3][x - 1] +
+					 rows[1][x + 1] + rows[3][x + 1],
+					 rows[2][x - 2] + rows[2][x + 2],
+					 rows[2][x - 1] + rows[2][x + 1],
+					 (x + c->fr_x) & 1, alt_y);
+		}
+		if (x >= fmt->width)
+			break;
+		out[x] = mcguire(rows[2][x],
+				 rows[0][x] + rows[4][x],
+				 rows[1][x] + rows[3][x],
+				 COL(rows[1], x - 1) + COL(rows[3], x - 1) +
+				 COL(rows[1], x + 1) + COL(rows[3], x + 1),
+				 COL(rows[2], x - 2) + COL(rows[2], x + 2),
+				 COL(rows[2], x - 1) + COL(rows[2], x + 1),
+				 (x + c->fr_x) & 1, alt_y);
+	}
+}
+
+#ifdef __SSE2__
+/* the pixels x, x + 6, ..., x + 42 of a row: of the same position */
+static inline __m128i xtrans_load8(const uint8_t *p)
+{
+	return _mm_setr_epi16(p[0], p[6], p[12], p[18], p[24], p[30], p[36],
+			      p[42]);
+}
+
+/*
+ * xtrans_value() of 8 pixels in 16-bit lanes: the differences scaled (up
+ * to 255 * 6) and the weighted sums (up to 255 * 4 + 2) fit, and the
+ * reciprocal (at most 32768) is applied by the high half of the product.
+ */
+static inline __m128i xtrans_value_sse2(const struct xtrans_line *l, int n,
+					int x)
+{
+	__m128i best = _mm_setzero_si128();
+	__m128i best_diff = _mm_set1_epi16(0x7fff);
+	int i;
+
+	for (i = 0; i < n; i++, l++) {
+		__m128i a = xtrans_load8(l->a + x);
+		__m128i b = xtrans_load8(l->b + x);
+		__m128i diff = _mm_mullo_epi16(
+			_mm_sub_epi16(_mm_max_epi16(a, b), _mm_min_epi16(a, b)),
+			_mm_set1_epi16(l->scale));
+		__m128i sum = _mm_add_epi16(
+			_mm_add_epi16(_mm_mullo_epi16(a, _mm_set1_epi16(l->wa)),
+				      _mm_mullo_epi16(b, _mm_set1_epi16(l->wb))),
+			_mm_set1_epi16((l->wa + l->wb) / 2));
+		__m128i v = _mm_mulhi_epu16(sum, _mm_set1_epi16(l->recip));
+		__m128i lt = _mm_cmplt_epi16(diff, best_diff);
+
+		best_diff = _mm_min_epi16(diff, best_diff);
+		best = _mm_or_si128(_mm_and_si128(lt, v),
+				    _mm_andnot_si128(lt, best));
+	}
+	return best;
+}
+
+/* xtrans_rgb() of the pixels x, x + 6, ..., x + 42 into out[] */
+static void xtrans_rgb_sse2(const struct xtrans_pos *p, int x, uint32_t *out)
+{
+	uint32_t rgba[8];
+	__m128i rgb[3], lo, hi;
+	int ch, i;
+
+	for (ch = 0; ch < 3; ch++)
+		rgb[ch] = p->lines[ch] ?
+			  xtrans_value_sse2(p->line[ch], p->lines[ch], x) :
+			  xtrans_load8(p->pixel + x);
+	/* see to_rgba() */
+	lo = _mm_or_si128(_mm_slli_epi16(rgb[2], 8), _mm_set1_epi16(0xff));
+	hi = _mm_or_si128(_mm_slli_epi16(rgb[0], 8), rgb[1]);
+	_mm_storeu_si128((__m128i *)rgba, _mm_unpacklo_epi16(lo, hi));
+	_mm_storeu_si128((__m128i *)(rgba + 4), _mm_unpackhi_epi16(lo, hi));
+	for (i = 0; i < 8; i++)
+		out[x + i * XTRANS_SIZE] = rgba[i];
+}
+#endif
+
+/*
+ * Same for X-Trans: the lines are decoded for each of the 6 positions in
+ * the pattern along the row, and all the pixels of the position are
+ * demosaiced in a loop with the same lines, 8 at once with SSE2 where
+ * there is.
+ */
+static void xtrans_row(const struct ctx *c, const uint8_t *const rows[5],
+		       int y, uint32_t *out)
+{
+	const struct frame_fmt *fmt = c->fmt;
+	struct xtrans_pos p;
+	uint8_t nb[5][5];
+	const uint8_t *win[5];
+	int x, x0, i, dx;
+
+	for (x0 = 0; x0 < XTRANS_SIZE && x0 < fmt->width; x0++) {
+		xtrans_pos(c, x0, y, rows, &p);
+		x = x0 < 2 ? x0 + XTRANS_SIZE : x0;
+#ifdef __SSE2__
+		for (; x + 7 * XTRANS_SIZE < fmt->width - 2;
+		     x += 8 * XTRANS_SIZE)
+			xtrans_rgb_sse2(&p, x, out);
+#endif
+		for (; x < fmt->width - 2; x += XTRANS_SIZE)
+			out[x] = xtrans_rgb(&p, x);
+	}
+
+	/* the borders, zero outside of the frame */
+	for (i = 0; i < 5; i++)
+		win[i] = nb[i];
+	for (x = 0; x < fmt->width; x++) {
+		if (x == 2 && fmt->width > 4)
+			x = fmt->width - 2;
+		for (i = 0; i < 5; i++)
+			for (dx = 0; dx < 5; dx++)
+				nb[i][dx] = COL(rows[i], x + dx - 2);
+		xtrans_pos(c, x, y, win, &p);
+		out[x] = xtrans_rgb(&p, 2);
+	}
+}
+
+#undef COL
+
+/* and CFA_MONO, the pixels of the row are only replicated */
+static void mono_row(const struct ctx *c, const uint8_t *row, uint32_t *out)
+{
+	int x;
+
+	for (x = 0; x < c->fmt->width; x++)
+		out[x] = to_rgba(row[x], row[x], row[x]);
+}
+
+static void demosaic_row(const struct ctx *c, const uint8_t *const rows[5],
+			 int y, uint32_t *out)
+{
+	if (c->fmt->cfa == CFA_XTRANS)
+		xtrans_row(c, rows, y, out);
+	else if (c->fmt->cfa == CFA_MONO)
+		mono_row(c, rows[2], out);
+	else
+		debayer_row(c, rows, y, out);
+}
+
+/* rows[] are y-1..y+1, NULL outside of the frame */
+static void postfilter_row(const struct ctx *c, const uint32_t *const rows[3],
+			   uint32_t *out)
+{
+	int width = c->fmt->width;
+	uint32_t nb[9];
+	int x, dx, i;
+
+	for (x = 0; x < width; x++) {
+		if (x == 1 && rows[0] && rows[2]) {
+			/* the interior */
+			for (; x < width - 1; x++) {
+				for (i = 0; i < 3; i++)
+					for (dx = -1; dx <= 1; dx++)
+						nb[3 * i + dx + 1] =
+							rows[i][x + dx];
+				out[x] = postfilter_core(&c->opts->post, nb);
+			}
+			if (x >= width)
+				break;
+		}
+		for (i = 0; i < 3; i++)
+			for (dx = -1; dx <= 1; dx++)
+				nb[3 * i + dx + 1] = rows[i] && x + dx >= 0 &&
+					x + dx < width ? rows[i][x + dx] :
+					rows[1][x];
+		out[x] = postfilter_core(&c->opts->post, nb);
+	}
+}
+
+/* the output row y (before the orientation), y must increase */
+static void rows_debayer(struct rows *r, int y, uint32_t *out)
+{
+	const struct frame_fmt *fmt = r->c->fmt;
+	const uint32_t *rgb[3];
+	const uint8_t *rows[5];
+	int i;
+
+	if (r->rgb_ring == NULL) {
+		rows_get(r, y, rows);
+		demosaic_row(r->c, rows, y, out);
+		return;
+	}
+
+	for (; r->rgb_next < fmt->height && r->rgb_next <= y + 1;
+	     r->rgb_next++) {
+		rows_get(r, r->rgb_next, rows);
+		demosaic_row(r->c, rows, r->rgb_next,
+			     r->rgb_ring + (r->rgb_next % 3) * fmt->width);
+	}
+	for (i = 0; i < 3; i++) {
+		int yy = y + i - 1;
+
+		rgb[i] = yy < 0 || yy >= fmt->height ? NULL :
+			 r->rgb_ring + (yy % 3) * fmt->width;
+	}
+	postfilter_row(r->c, rgb, out);
+}
+
+/* rows per band for the transposed output: 16 pixels is a cache line */
+#define TRANSPOSE_BAND 16
+
+/*
+ * The RGBA output row by row, the input rows converted by map if it is not
+ * NULL (in is not read then). Returns -1 if out of memory.
+ */
+static int debayer_rows(const struct frame_fmt *fmt,
+			const struct debayer_opts *opts, const uint8_t *in,
+			const struct tone_map *map, uint32_t *out)
+{
+	unsigned int orient = opts->orient;
+	struct rows r;
+	struct ctx c;
+	uint32_t *band;
+	int band_h;
+	int x, y, i;
+
+	ctx_init(&c, fmt, opts, in);
+
+	/*
+	 * When transposed or mirrored, the rows are demosaiced into a band
+	 * buffer, and the band is copied out. When transposed, a column of
+	 * the band is a contiguous piece of an output row.
+	 */
+	band_h = orient & ORIENT_TRANSPOSE ? TRANSPOSE_BAND : 1;
+	band = malloc(sizeof(*band) * band_h * fmt->width);
+	if (band == NULL || rows_init(&r, &c, map) < 0) {
+		free(band);
+		return -1;
+	}
+
+	if (!(orient & (ORIENT_HFLIP | ORIENT_TRANSPOSE))) {
+		/* the rows of the output are the rows of the frame */
+		for (y = 0; y < fmt->height; y++) {
+			long row = orient_index(fmt, orient, 0, y);
+
+			rows_debayer(&r, y, out + row);
+			/* blended while the row is still in the cache */
+			if (opts->temporal.enabled && opts->temporal.prev)
+				for (x = 0; x < fmt->width; x++)
+					out[row + x] = temporal_pixel(&c,
+						row + x, out[row + x]);
+		}
+	} else {
+		for (y = 0; y < fmt->height; y += band_h) {
+			int n = fmt->height - y < band_h ?
+				fmt->height - y : band_h;
+
+			for (i = 0; i < n; i++)
+				rows_debayer(&r, y + i, band + i * fmt->width);
+			for (x = 0; x < fmt->width; x++) {
+				for (i = 0; i < n; i++) {
+					long o = orient_index(fmt, orient, x,
+							      y + i);
+
+					out[o] = temporal_pixel(&c, o,
+						band[i * fmt->width + x]);
+				}
+			}
+		}
+	}
+	rows_free(&r);
+	free(band);
+	return 0;
+}
+
+static void debayer_fast(const struct frame_fmt *fmt,
+			 const struct debayer_opts *opts,
+			 const uint8_t *in, void *data_out)
+{
+	pixel_fn pixel = pixel_function(fmt, opts, 1);
+	struct ctx c;
+
+	ctx_init(&c, fmt, opts, in);
+
+	if (opts->output == OUTPUT_TENSOR) {
+		debayer_tensor(&c, data_out, pixel);
+		return;
+	}
+	if (opts->output == OUTPUT_GRAY) {
+		if (fmt->cfa == CFA_MONO && !opts->remap.enabled &&
+		    !opts->post.enabled)
+			mono_gray(&c, data_out);
+		else
+			debayer_gray(&c, data_out, pixel);
+		return;
+	}
+	if (output_yuv(opts->output)) {
+		debayer_yuv(&c, data_out, pixel);
+		return;
+	}
+	if (opts->remap.enabled) {
+		debayer_remap(&c, data_out, pixel);
+		return;
+	}
+	if (debayer_rows(fmt, opts, in, NULL, data_out) < 0)
+		debayer_ref(fmt, opts, in, data_out);
+}
+
+/*
+ * The high bit depth, calibrated, HDR, 4x4 CFA and tone mapped input is
+ * converted to the 8-bit Bayer frame first, see tone_frame(). The IR
+ * plane follows the output.
+ */
+static void debayer_input(void (*process)(const struct frame_fmt *fmt,
+					  const struct debayer_opts *opts,
+					  const uint8_t *in, void *out),
+			  const struct frame_fmt *fmt,
+			  const struct debayer_opts *opts,
+			  const uint8_t *in, void *data_out)
+{
+	struct frame_fmt fmt8;
+	uint8_t *in8;
+
+	if (!input_converted(fmt, opts)) {
+		process(fmt, opts, in, data_out);
+		return;
+	}
+	in8 = tone_frame(fmt, opts, in, &fmt8);
+	if (in8 == NULL) {
+		memset(data_out, 0, output_size(fmt, opts));
+		return;
+	}
+	process(&fmt8, opts, in8, data_out);
+	free(in8);
+	if (fmt->cfa == CFA_RGBIR)
+		ir_plane(fmt, opts, in, (uint8_t *)data_out +
+			 output_size(&fmt8, opts));
+}
+
+static void cpu_ref(const struct frame_fmt *fmt,
+		    const struct debayer_opts *opts,
+		    const uint8_t *in, void *data_out)
+{
+	debayer_input(debayer_ref, fmt, opts, in, data_out);
+}
+
+/*
+ * The input conversion is fused into the row loop (see rows_input()),
+ * unless the output is gathered from the whole converted frame, as the
+ * shader does (see convert_pass()).
+ */
+static void cpu_fast(const struct frame_fmt *fmt,
+		     const struct debayer_opts *opts,
+		     const uint8_t *in, void *data_out)
+{
+	struct tone_map map;
+	int ret;
+
+	if (!input_converted(fmt, opts) || convert_pass(fmt, opts) ||
+	    tone_map_init(&map, fmt, opts, in) < 0) {
+		debayer_input(debayer_fast, fmt, opts, in, data_out);
+		return;
+	}
+	ret = debayer_rows(&map.fmt8, opts, NULL, &map, data_out);
+	tone_map_free(&map);
+	if (ret < 0) {
+		/* the histogram is of this frame already */
+		memset(data_out, 0, output_size(fmt, opts));
+		return;
+	}
+	if (fmt->cfa == CFA_RGBIR)
+		ir_plane(fmt, opts, in, (uint8_t *)data_out +
+			 output_size(&map.fmt8, opts));
+}
+
+const struct cpu_engine cpu_engines[] = {
+	{ "cpu-ref", cpu_ref },
+	{ "cpu", cpu_fast },
+	{ NULL, NULL }
+};
+
+const struct cpu_engine *cpu_engine_find(const char *name)
+{
+	const struct cpu_engine *e;
+
+	for (e = cpu_engines; e->name; e++)
+		if (!strcmp(e->name, name))
+			return e;
+	return NULL;
+}
@@ -0,0 +1,631 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * Definitions shared by the GPU (compute shader) and the CPU debayer
+ * engines.
+ *
+ * Copyright (C) 2021, Linaro
+ */
+
+#ifndef DEBAYER_H
+#define DEBAYER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum bayer_order {
+	BAYER_RGGB,
+	BAYER_GRBG,
+	BAYER_GBRG,
+	BAYER_BGGR,
+};
+
+/*
+ * The 4x4 colour filter arrays are converted to the Bayer frame of the
+ * order given while the input is loaded, and demosaiced as Bayer:
+ *   CFA_QUAD		Quad Bayer (each colour of the Bayer order given
+ *			covers 2x2 pixels), remosaiced at the full resolution
+ *   CFA_QUAD_BIN	Quad Bayer, the 2x2 pixels of a colour are averaged
+ *			into the Bayer frame of the half resolution
+ *   CFA_RGBIR		RGB-IR 4x4: the red pixels of the Bayer order are IR,
+ *			and the blue ones alternate between blue and red
+ *			like a checkerboard of the 2x2 cells. The IR pixels
+ *			go to a separate plane after the output, see
+ *			ir_plane_size().
+ * The pixels missing in the Bayer frame are the average of the nearest
+ * ones of the colour in the 4 directions, or the 4 diagonals.
+ */
+enum cfa_type {
+	CFA_BAYER,
+	CFA_QUAD,
+	CFA_QUAD_BIN,
+	CFA_RGBIR,
+	CFA_XTRANS,		/* demosaiced as is, see xtrans_init() */
+	CFA_MONO,		/* monochrome, not demosaiced: R = G = B */
+};
+
+/* the CFA is converted to Bayer on the input */
+static inline int cfa_remosaiced(enum cfa_type cfa)
+{
+	return cfa == CFA_QUAD || cfa == CFA_QUAD_BIN || cfa == CFA_RGBIR;
+}
+
+/*
+ * Fuji X-Trans: the 6x6 pattern of xtrans.c from the top left pixel of the
+ * frame. Each missing colour of a pixel is interpolated along one of the
+ * lines (horizontal, vertical or diagonal) through the nearest pixels of
+ * the colour on both sides: the one with the smallest difference of the
+ * two pixels for the distance between them.
+ *
+ * The table has a word for each position in the pattern and colour (R, G,
+ * B), 0 for the colour of the pixel itself, or up to 4 lines of
+ * XTRANS_LINE_BITS from the LSB: XTRANS_LINE_ON, the direction (2 bits,
+ * see xtrans_dirs[]), the distance - 1 to the pixel behind (1 bit) and
+ * ahead (1 bit).
+ */
+#define XTRANS_SIZE 6
+#define XTRANS_TABLE (XTRANS_SIZE * XTRANS_SIZE * 3)
+#define XTRANS_REACH 2
+#define XTRANS_LINE_BITS 5
+#define XTRANS_LINE_ON 16
+
+struct frame_fmt {
+	int width;		/* of the Bayer frame to demosaic */
+	int height;
+	int stride;		/* input line length in bytes */
+	enum bayer_order order;	/* not used for CFA_XTRANS and CFA_MONO */
+	int bits;		/* 8, or 9..16 in 16-bit little endian words */
+	enum cfa_type cfa;	/* of the sensor, a multiple of 4 pixels
+				 * for the remosaiced ones */
+};
+
+/* size of the sensor frame in pixels */
+static inline void sensor_size(const struct frame_fmt *fmt, int *width,
+			       int *height)
+{
+	int scale = fmt->cfa == CFA_QUAD_BIN ? 2 : 1;
+
+	*width = fmt->width * scale;
+	*height = fmt->height * scale;
+}
+
+/* size of an input frame (an exposure) in bytes */
+static inline long input_frame_size(const struct frame_fmt *fmt)
+{
+	int width, height;
+
+	sensor_size(fmt, &width, &height);
+	return (long)fmt->stride * height;
+}
+
+/* the IR plane of CFA_RGBIR: a byte per 2x2 cell of the sensor */
+static inline long ir_plane_size(const struct frame_fmt *fmt)
+{
+	if (fmt->cfa != CFA_RGBIR)
+		return 0;
+	return (long)(fmt->width / 2) * (fmt->height / 2);
+}
+
+/* Position of the red pixel within the 2x2 bayer pattern */
+static inline void bayer_first_red(enum bayer_order order, int *x, int *y)
+{
+	*x = (order == BAYER_GRBG || order == BAYER_BGGR);
+	*y = (order == BAYER_GBRG || order == BAYER_BGGR);
+}
+
+/*
+ * The output pixel format is the one of the compute shader: one 32-bit
+ * word per pixel, red in the MSB, alpha (always 0xFF) in the LSB.
+ */
+static inline uint32_t to_rgba(int red, int green, int blue)
+{
+	return ((uint32_t)red << 24) | ((uint32_t)green << 16) |
+		((uint32_t)blue << 8) | 0xFFu;
+}
+
+enum output_format {
+	OUTPUT_RGBA,		/* see to_rgba() */
+	OUTPUT_TENSOR,		/* see struct tensor_fmt */
+	OUTPUT_GRAY,		/* a byte per pixel, see to_gray() */
+	OUTPUT_I420,		/* YUV 4:2:0: Y plane, U and V planes */
+	OUTPUT_NV12,		/* YUV 4:2:0: Y plane, interleaved UV plane */
+};
+
+static inline int output_yuv(enum output_format output)
+{
+	return output == OUTPUT_I420 || output == OUTPUT_NV12;
+}
+
+/* the gray output pixel: the luma, the value itself for CFA_MONO */
+static inline uint8_t to_gray(int red, int green, int blue)
+{
+	return (red + 2 * green + blue + 2) >> 2;
+}
+
+/*
+ * The YUV output, BT.601 limited range. U and V are of the average of
+ * the 2x2 pixels, which are a multiple of 8x2 in the output.
+ */
+static inline uint8_t to_y(int red, int green, int blue)
+{
+	return ((66 * red + 129 * green + 25 * blue + 128) >> 8) + 16;
+}
+
+static inline uint8_t to_u(int red, int green, int blue)
+{
+	return (-38 * red - 74 * green + 112 * blue + 128 + (128 << 8)) >> 8;
+}
+
+static inline uint8_t to_v(int red, int green, int blue)
+{
+	return (112 * red - 94 * green - 18 * blue + 128 + (128 << 8)) >> 8;
+}
+
+enum tensor_layout {
+	TENSOR_CHW,		/* planar: R plane, G plane, B plane */
+	TENSOR_HWC,		/* interleaved RGB */
+};
+
+enum tensor_type {
+	TENSOR_F32,
+	TENSOR_F16,
+	TENSOR_I8,
+	TENSOR_U8,
+};
+
+/*
+ * Input tensor of a neural network. For each channel the 8-bit value v
+ * is normalized as (v / 255 - mean) / std, and then quantized for the
+ * integer types as round(x / scale) + zero_point. The frame is resized
+ * to the tensor size with the nearest neighbour sampling.
+ */
+struct tensor_fmt {
+	enum tensor_layout layout;
+	enum tensor_type type;
+	int width;
+	int height;
+	int bgr;		/* channel order is B, G, R */
+	float mean[3];
+	float std[3];
+	float scale;
+	int zero_point;
+	/*
+	 * The output element for each channel and value, filled by
+	 * tensor_init(). Both the shader and the CPU engines use this
+	 * table, which makes their outputs bit-identical.
+	 */
+	uint32_t lut[3][256];
+};
+
+/*
+ * Orientation of the output image: the frame is mirrored and/or flipped
+ * upside down, and then transposed. E.g. the clockwise rotation by 90
+ * degrees is ORIENT_VFLIP | ORIENT_TRANSPOSE.
+ */
+enum orientation {
+	ORIENT_HFLIP = 1,
+	ORIENT_VFLIP = 2,
+	ORIENT_TRANSPOSE = 4,
+};
+
+/*
+ * Lens distortion correction. The radial (k1, k2, k3) and tangential
+ * (p1, p2) distortion model of the lens, in the same form as in OpenCV,
+ * is converted into the warp grid: for every REMAP_GRID_STEP-th pixel
+ * of the corrected image the grid has the position in the frame to take
+ * the pixel from, in 1/256 pixel units plus REMAP_BIAS pixels (to keep
+ * the values positive). The positions in between are interpolated.
+ */
+#define REMAP_GRID_SHIFT 4
+#define REMAP_GRID_STEP (1 << REMAP_GRID_SHIFT)
+#define REMAP_BIAS 4
+
+struct remap_fmt {
+	int enabled;
+	float k[3];
+	float p[2];
+	float fx, fy;		/* focal length in pixels, 0 - width/2 */
+	float cx, cy;		/* optical center, -1 - the frame center */
+	int grid_width;		/* nodes per row */
+	int grid_height;
+	int32_t *grid;		/* x, y pairs, filled by remap_init() */
+};
+
+/*
+ * HDR merge of the bracketed exposures: the input holds the frames of
+ * the same format one after another, from the longest exposure to the
+ * shortest one, which are merged in the Bayer domain before demosaicing.
+ * The merged values have the extra bits for the ratio of the longest
+ * exposure to the shortest one (16 bits at most), and are tone mapped or
+ * scaled down to 8 bits.
+ */
+#define HDR_MAX_FRAMES 4
+
+struct hdr_fmt {
+	int enabled;
+	int frames;		/* 2..HDR_MAX_FRAMES */
+	int ratio[HDR_MAX_FRAMES];	/* of the exposure of the first frame
+					 * to the one of each, 1..256 */
+	int shift;		/* the extra bits, filled by hdr_parse() */
+};
+
+/*
+ * Sensor calibration before everything else: the dark frame (of the same
+ * format and stride as the input) and the offset of each column (the
+ * column fixed pattern noise) are subtracted from the raw values, the
+ * result is clamped to the range of the input.
+ */
+struct dark_fmt {
+	int enabled;
+	const uint8_t *frame;	/* NULL for none */
+	const int32_t *columns;	/* in the input units, NULL for none */
+};
+
+/*
+ * Bayer domain denoise before demosaicing: range-weighted average of the
+ * pixel and its 8 same-colour neighbours. The neighbours which differ by
+ * the strength or more are ignored.
+ */
+struct denoise_fmt {
+	int enabled;
+	int strength[3];	/* for R, G and B, 0..255 */
+};
+
+/*
+ * Temporal denoise of the RGBA output: each pixel is blended with the
+ * output of the previous frame, with the weight of up to strength/256 for
+ * the static pixels, down to 0 for the ones which differ by the threshold
+ * or more in any channel (the motion).
+ */
+struct temporal_fmt {
+	int enabled;
+	int strength;		/* 0..255 */
+	int threshold;		/* 1..255 */
+	const uint32_t *prev;	/* the previous output, NULL for none */
+};
+
+/*
+ * Post-processing after demosaicing: false colour suppression (the chroma
+ * median of the pixel and its 4 nearest neighbours) and sharpening (the
+ * unsharp mask on luma).
+ */
+struct postfilter_fmt {
+	int enabled;
+	int sharpen;		/* amount in 1/16 units, 0..255 */
+	int chroma_median;
+};
+
+/*
+ * Tone mapping of the input to 8 bits before demosaicing (the high bit
+ * depth input is scaled down to 8 bits otherwise). The global curve is
+ * the contrast limited equalization of the histogram of the previous
+ * frame. The local one subtracts the edge-aware local average, taken from
+ * the bilateral grid of the frame, times the strength: the dark areas are
+ * lifted and the bright ones toned down, the local contrast is kept.
+ *
+ * The statistics are collected from the 2x2 quads every TONE_STATS_STEP
+ * pixels. The grid has a node every TONE_CELL pixels, and the range nodes
+ * every TONE_RANGE 8-bit levels.
+ */
+#define TONE_BINS 256
+#define TONE_STATS_STEP 8
+#define TONE_CELL_SHIFT 5
+#define TONE_CELL (1 << TONE_CELL_SHIFT)
+#define TONE_RANGE_SHIFT 5
+#define TONE_RANGE (1 << TONE_RANGE_SHIFT)
+#define TONE_RANGE_NODES (256 / TONE_RANGE + 1)
+
+struct tone_fmt {
+	int enabled;
+	int local;		/* local tone mapping strength, 0..255 */
+	uint32_t *hist;		/* CPU engines: in - of the previous frame,
+				 * out - of this one (TONE_BINS) */
+};
+
+struct debayer_opts {
+	enum output_format output;
+	struct tensor_fmt tensor;
+	unsigned int orient;	/* enum orientation flags */
+	struct remap_fmt remap;
+	struct hdr_fmt hdr;
+	struct dark_fmt dark;
+	struct denoise_fmt denoise;
+	struct postfilter_fmt post;
+	struct tone_fmt tone;
+	struct temporal_fmt temporal;	/* for OUTPUT_RGBA only */
+	int incremental;	/* GL: only the changed tiles, see tiles.c */
+	int atlas;		/* GL: the frames of an atlas, see atlas.c */
+};
+
+/* bits per pixel of the input after the HDR merge */
+static inline int merged_bits(const struct frame_fmt *fmt,
+			      const struct debayer_opts *opts)
+{
+	return fmt->bits + (opts->hdr.enabled ? opts->hdr.shift : 0);
+}
+
+/*
+ * The high bit depth, calibrated, HDR, 4x4 CFA or tone mapped input is
+ * converted to the 8-bit Bayer frame on the way to the demosaic filter
+ */
+static inline int input_converted(const struct frame_fmt *fmt,
+				  const struct debayer_opts *opts)
+{
+	return fmt->bits > 8 || opts->tone.enabled || opts->dark.enabled ||
+	       opts->hdr.enabled || cfa_remosaiced(fmt->cfa);
+}
+
+/*
+ * The gathering modes read each input pixel many times, the input is
+ * converted to the 8-bit frame in a separate pass for them instead of on
+ * every read. The other modes convert it in the demosaic loop.
+ */
+static inline int convert_pass(const struct frame_fmt *fmt,
+			       const struct debayer_opts *opts)
+{
+	return (opts->output != OUTPUT_RGBA || opts->remap.enabled) &&
+	       input_converted(fmt, opts);
+}
+
+/* must match the local_size_x/y of the shader */
+#define LSIZE_X 32
+#define LSIZE_Y 8
+/* of the X-Trans tiles, aligned to the 6x6 pattern */
+#define XTRANS_LSIZE_X 24
+#define XTRANS_LSIZE_Y 12
+
+/* size of the output image */
+static inline void orient_size(const struct frame_fmt *fmt,
+			       unsigned int orient, int *width, int *height)
+{
+	*width = orient & ORIENT_TRANSPOSE ? fmt->height : fmt->width;
+	*height = orient & ORIENT_TRANSPOSE ? fmt->width : fmt->height;
+}
+
+/* index in the output image of the frame pixel (x,y) */
+static inline long orient_index(const struct frame_fmt *fmt,
+				unsigned int orient, int x, int y)
+{
+	if (orient & ORIENT_HFLIP)
+		x = fmt->width - 1 - x;
+	if (orient & ORIENT_VFLIP)
+		y = fmt->height - 1 - y;
+	if (orient & ORIENT_TRANSPOSE)
+		return (long)x * fmt->height + y;
+	return (long)y * fmt->width + x;
+}
+
+/* the frame pixel at the position (x,y) in the output image */
+static inline void orient_src(const struct frame_fmt *fmt,
+			      unsigned int orient, int *x, int *y)
+{
+	if (orient & ORIENT_TRANSPOSE) {
+		int t = *x;
+
+		*x = *y;
+		*y = t;
+	}
+	if (orient & ORIENT_HFLIP)
+		*x = fmt->width - 1 - *x;
+	if (orient & ORIENT_VFLIP)
+		*y = fmt->height - 1 - *y;
+}
+
+/* tensor.c */
+int tensor_parse(const char *spec, struct tensor_fmt *t);
+int tensor_init(struct tensor_fmt *t, int width, int height);
+int tensor_elem_size(const struct tensor_fmt *t);
+long output_size(const struct frame_fmt *fmt, const struct debayer_opts *opts);
+
+/* tiles.c */
+struct tile_map {
+	struct frame_fmt fmt;	/* of the previous frame */
+	int tiles_x, tiles_y;
+	int lsize_x, lsize_y;	/* the tile size */
+	uint64_t *hash;		/* of each tile of the previous frame */
+	int valid;		/* there was a previous frame */
+	uint32_t *list;		/* the tiles to demosaic, x | y << 16, with
+				 * room up to a multiple of 1024 */
+	int count;		/* in list */
+};
+
+int tile_map_update(struct tile_map *m, const struct frame_fmt *fmt,
+		    const struct debayer_opts *opts, const uint8_t *in,
+		    int lsize_x, int lsize_y);
+void tile_map_free(struct tile_map *m);
+
+/* tone.c */
+int hdr_parse(const char *spec, struct hdr_fmt *h);
+int tone_parse(const char *spec, struct tone_fmt *t);
+void tone_grid_size(const struct frame_fmt *fmt, int *width, int *height);
+/* the conversion of the input to the 8-bit frame, row by row */
+struct tone_map {
+	const struct frame_fmt *fmt;
+	const struct debayer_opts *opts;
+	const uint8_t *in;
+	struct frame_fmt fmt8;	/* of the 8-bit frame */
+	int shift;
+	uint8_t *lut;		/* the curve, NULL if not tone mapped */
+	uint32_t *grid;		/* NULL without the local tone mapping */
+	int grid_width;
+};
+int tone_map_init(struct tone_map *m, const struct frame_fmt *fmt,
+		  const struct debayer_opts *opts, const uint8_t *in);
+void tone_map_row(const struct tone_map *m, int y, uint8_t *out);
+void tone_map_free(struct tone_map *m);
+uint8_t *tone_frame(const struct frame_fmt *fmt,
+		    const struct debayer_opts *opts, const uint8_t *in,
+		    struct frame_fmt *fmt8);
+void ir_plane(const struct frame_fmt *fmt, const struct debayer_opts *opts,
+	      const uint8_t *in, uint8_t *out);
+
+/* xtrans.c */
+extern const int xtrans_dirs[4][2];
+int xtrans_colour(int x, int y);
+void xtrans_init(uint32_t table[XTRANS_TABLE]);
+
+/*
+ * DNG input: the raw image configures the frame format. It is read from
+ * the file mapping if it is stored the way the engines read it (the
+ * uncompressed 8-bit or 16-bit little endian strips one after another),
+ * otherwise the strips or the tiles are unpacked or decoded into buf.
+ */
+struct dng_image {
+	struct frame_fmt fmt;
+	int black;		/* BlackLevel, the average of the pattern */
+	int white;		/* WhiteLevel */
+	float neutral[3];	/* AsShotNeutral, 0 if none */
+	float matrix[9];	/* ColorMatrix1 (XYZ to camera), 0 if none */
+	const uint8_t *data;	/* the frame of fmt */
+	void *map;		/* of the file */
+	size_t map_size;
+	uint8_t *buf;		/* NULL if the data is in the mapping */
+};
+
+/* atlas.c */
+/* a frame in the table of the shader, see ATLAS in debayer.comp */
+struct atlas_desc {
+	int32_t in_offset;	/* words, in the input buffer */
+	int32_t out_offset;	/* words, in the output buffer */
+	int32_t width, height;
+	int32_t stride;		/* bytes */
+	int32_t red_x, red_y;	/* see bayer_first_red() */
+	int32_t first_group;	/* the first workgroup of the frame */
+};
+
+struct atlas_frame {
+	struct frame_fmt fmt;	/* of the frame in the atlas */
+	char *out_name;		/* NULL if not written */
+	long in_offset;		/* bytes, in the input buffer */
+	long out_offset;	/* bytes, in the output buffer */
+};
+
+struct atlas {
+	struct atlas_frame *frames;
+	int count, capacity;
+	uint8_t *in;		/* the input frames, one after another */
+	long in_size, in_capacity;
+	long out_size;		/* of all the outputs */
+	struct atlas_desc *table;	/* from atlas_table() */
+	int groups;		/* the workgroups of all the frames */
+};
+
+int atlas_add(struct atlas *a, const struct frame_fmt *fmt,
+	      const struct debayer_opts *opts, const uint8_t *data,
+	      const char *out_name);
+int atlas_table(struct atlas *a, int lsize_x, int lsize_y);
+int atlas_write(const struct atlas *a, const struct debayer_opts *opts,
+		const uint8_t *out, int quality);
+void atlas_free(struct atlas *a);
+
+/* archive.c */
+/* the largest input decompressed up front to be replayed by -n */
+#define ARCHIVE_REPLAY_MAX	(1L << 30)
+struct archive_stream;
+long archive_read(const char *fname, char **data);
+struct archive_stream *archive_open(const char *fname, long frame_size,
+				    int replay, long *frames);
+const uint8_t *archive_next(struct archive_stream *s);
+void archive_close(struct archive_stream *s);
+
+/* dng.c */
+int dng_open(const char *fname, struct dng_image *dng);
+void dng_close(struct dng_image *dng);
+
+/* ljpeg.c */
+long ljpeg_decode(const uint8_t *data, size_t size, uint16_t *out,
+		  long capacity);
+
+/* image.c */
+enum image_format {
+	IMAGE_RAW,		/* the output buffer as it is */
+	IMAGE_JPEG,
+	IMAGE_PNG,
+};
+
+enum image_format image_format(const char *fname);
+int image_write(const char *fname, enum image_format format, int quality,
+		const void *data, int width, int height, int gray);
+
+/* cache.c */
+struct cache {
+	const char *dir;	/* NULL if the cache is not used */
+	uint64_t options;	/* hash of the ones which change the output */
+	char key[33];		/* of the entry, from cache_lookup() */
+	double start;		/* ms, of the lookup */
+	double saved;		/* ms, the run of the entry took */
+};
+
+void cache_option(struct cache *c, int opt, const char *arg);
+long cache_lookup(struct cache *c, const char *in_name,
+		  const char *shader_fname);
+int cache_fetch(struct cache *c, const char *out_name,
+		enum image_format image, long files);
+void cache_store(struct cache *c, const char *out_name,
+		 enum image_format image, long files);
+
+/* parallel.c */
+int parallel_threads(void);
+void parallel_for(int count, void (*fn)(void *arg, int i), void *arg);
+
+/* pipeline.c */
+int pipeline_read(const char *fname, int *argc, char ***argv);
+void pipeline_plan(const struct frame_fmt *fmt,
+		   const struct debayer_opts *opts, const char *engine);
+
+/* rawz.c */
+long rawz_write(FILE *fp, const struct frame_fmt *fmt, const uint8_t *data,
+		long frames);
+long rawz_read(const char *fname, const struct frame_fmt *fmt, char **data);
+
+/* remap.c */
+int remap_parse(const char *spec, struct remap_fmt *r);
+int remap_init(struct remap_fmt *r, const struct frame_fmt *fmt);
+void remap_free(struct remap_fmt *r);
+
+/*
+ * The position in the frame of the pixel (x,y) of the corrected image, in
+ * 1/256 pixel units plus REMAP_BIAS pixels
+ */
+static inline void remap_src(const struct remap_fmt *r, int x, int y,
+			     int *src_x, int *src_y)
+{
+	const int32_t *g = r->grid +
+		2 * ((y >> REMAP_GRID_SHIFT) * r->grid_width +
+		     (x >> REMAP_GRID_SHIFT));
+	const int32_t *g1 = g + 2 * r->grid_width;
+	int fx = x & (REMAP_GRID_STEP - 1);
+	int fy = y & (REMAP_GRID_STEP - 1);
+	int w00 = (REMAP_GRID_STEP - fx) * (REMAP_GRID_STEP - fy);
+	int w10 = fx * (REMAP_GRID_STEP - fy);
+	int w01 = (REMAP_GRID_STEP - fx) * fy;
+	int w11 = fx * fy;
+
+	*src_x = (g[0] * w00 + g[2] * w10 + g1[0] * w01 + g1[2] * w11) >>
+		 (2 * REMAP_GRID_SHIFT);
+	*src_y = (g[1] * w00 + g[3] * w10 + g1[1] * w01 + g1[3] * w11) >>
+		 (2 * REMAP_GRID_SHIFT);
+}
+
+/*
+ * Nearest neighbour sampling: the frame coordinate for the tensor
+ * coordinate t along the axis of t_size tensor and f_size frame pixels.
+ */
+static inline int tensor_src(int t, int t_size, int f_size)
+{
+	return ((2 * t + 1) * f_size) / (2 * t_size);
+}
+
+struct cpu_engine {
+	const char *name;
+	void (*process)(const struct frame_fmt *fmt,
+			const struct debayer_opts *opts,
+			const uint8_t *in, void *out);
+};
+
+/* NULL terminated, the first entry is the reference implementation */
+extern const struct cpu_engine cpu_engines[];
+
+const struct cpu_engine *cpu_engine_find(const char *name);
+
+#endif /* DEBAYER_H */
@@ -0,0 +1,541 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * DNG input: the raw image of the file and the metadata the pipeline is
+ * configured from, read from the TIFF structure of the file mapping.
+ *
+ * Copyright (C) 2021, Linaro
+ */
+
+#define _POSIX_C_SOURCE 200809L	/* mmap() */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "debayer.h"
+
+#define TAG_NEW_SUBFILE_TYPE	254
+#define TAG_WIDTH		256
+#define TAG_HEIGHT		257
+#define TAG_BITS		258
+#define TAG_COMPRESSION		259
+#define TAG_PHOTOMETRIC		262
+#define TAG_STRIP_OFFSETS	273
+#define TAG_SAMPLES		277
+#define TAG_ROWS_PER_STRIP	278
+#define TAG_STRIP_BYTES		279
+#define TAG_TILE_WIDTH		322
+#define TAG_TILE_HEIGHT		323
+#define TAG_TILE_OFFSETS	324
+#define TAG_TILE_BYTES		325
+#define TAG_SUB_IFDS		330
+#define TAG_CFA_REPEAT		33421
+#define TAG_CFA_PATTERN		33422
+#define TAG_DNG_VERSION		50706
+#define TAG_BLACK_LEVEL		50714
+#define TAG_WHITE_LEVEL		50717
+#define TAG_COLOR_MATRIX	50721
+#define TAG_AS_SHOT_NEUTRAL	50728
+
+#define PHOTOMETRIC_CFA		32803
+#define PHOTOMETRIC_LINEAR_RAW	34892
+#define COMPRESSION_NONE	1
+#define COMPRESSION_LJPEG	7
+
+#define DNG_MAX_SUB_IFDS 16
+
+struct tiff {
+	const uint8_t *p;
+	size_t size;
+	int be;			/* big endian ("MM") */
+};
+
+/* an entry of an IFD, the values are at the offset in the file */
+struct tiff_entry {
+	int type;
+	uint32_t count;
+	size_t offset;
+};
+
+/* a strip or a tile of the raw image */
+struct dng_segment {
+	size_t offset;		/* of the data in the file */
+	size_t size;
+	int x, y;		/* in the image */
+	int width, height;	/* of the data, the tiles can be cut off */
+	int failed;
+};
+
+struct dng_read {
+	const struct tiff *t;
+	struct dng_image *dng;
+	struct dng_segment *segs;
+	int bits;		/* per sample in the file */
+	int compression;
+};
+
+/* the integer of 1..4 bytes at the offset, 0 past the end */
+static uint32_t tiff_get(const struct tiff *t, size_t offset, int bytes)
+{
+	uint32_t v = 0;
+	int i;
+
+	if (offset > t->size || t->size - offset < (size_t)bytes)
+		return 0;
+	for (i = 0; i < bytes; i++)
+		v |= (uint32_t)t->p[offset + i] <<
+		     8 * (t->be ? bytes - 1 - i : i);
+	return v;
+}
+
+static int tiff_type_size(int type)
+{
+	/* BYTE, ASCII, SHORT, LONG, RATIONAL, the signed ones, FLOAT,
+	 * DOUBLE, IFD */
+	static const int sizes[14] = {
+		0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8, 4,
+	};
+
+	return type > 0 && type < 14 ? sizes[type] : 0;
+}
+
+static int tiff_find(const struct tiff *t, size_t ifd, int tag,
+		     struct tiff_entry *e)
+{
+	int n = tiff_get(t, ifd, 2);
+	int i;
+
+	for (i = 0; i < n; i++) {
+		size_t entry = ifd + 2 + 12 * i;
+		size_t size;
+
+		if (tiff_get(t, entry, 2) != tag)
+			continue;
+		e->type = tiff_get(t, entry + 2, 2);
+		e->count = tiff_get(t, entry + 4, 4);
+		size = tiff_type_size(e->type);
+		if (!size || e->count > t->size / size)
+			return 0;
+		size *= e->count;
+		e->offset = size <= 4 ? entry + 8 : tiff_get(t, entry + 8, 4);
+		return e->offset <= t->size && t->size - e->offset >= size;
+	}
+	return 0;
+}
+
+/* the i-th value of the entry as a number, 0 past the end */
+static double tiff_value(const struct tiff *t, const struct tiff_entry *e,
+			 uint32_t i)
+{
+	size_t offset = e->offset + (size_t)i * tiff_type_size(e->type);
+	uint32_t lo, hi;
+	uint64_t u;
+	double d;
+	float f;
+
+	if (i >= e->count)
+		return 0;
+	switch (e->type) {
+	case 3:
+		return tiff_get(t, offset, 2);
+	case 4:
+	case 13:
+		return tiff_get(t, offset, 4);
+	case 5:
+		hi = tiff_get(t, offset + 4, 4);
+		return hi ? (double)tiff_get(t, offset, 4) / hi : 0;
+	case 6:
+		return (int8_t)tiff_get(t, offset, 1);
+	case 8:
+		return (int16_t)tiff_get(t, offset, 2);
+	case 9:
+		return (int32_t)tiff_get(t, offset, 4);
+	case 10:
+		hi = tiff_get(t, offset + 4, 4);
+		return hi ? (double)(int32_t)tiff_get(t, offset, 4) /
+			    (int32_t)hi : 0;
+	case 11:
+		lo = tiff_get(t, offset, 4);
+		memcpy(&f, &lo, sizeof(f));
+		return f;
+	case 12:
+		lo = tiff_get(t, offset + (t->be ? 4 : 0), 4);
+		hi = tiff_get(t, offset + (t->be ? 0 : 4), 4);
+		u = (uint64_t)hi << 32 | lo;
+		memcpy(&d, &u, sizeof(d));
+		return d;
+	default:
+		return tiff_get(t, offset, 1);
+	}
+}
+
+static long tiff_int(const struct tiff *t, size_t ifd, int tag, long def)
+{
+	struct tiff_entry e;
+
+	return tiff_find(t, ifd, tag, &e) ? (long)tiff_value(t, &e, 0) : def;
+}
+
+/* the full resolution raw image: in IFD0 or one of its sub-IFDs */
+static size_t dng_raw_ifd(const struct tiff *t, size_t ifd0)
+{
+	size_t ifds[1 + DNG_MAX_SUB_IFDS];
+	struct tiff_entry e;
+	uint32_t i;
+	int n = 0;
+
+	ifds[n++] = ifd0;
+	if (tiff_find(t, ifd0, TAG_SUB_IFDS, &e))
+		for (i = 0; i < e.count && n < 1 + DNG_MAX_SUB_IFDS; i++)
+			ifds[n++] = tiff_value(t, &e, i);
+
+	for (i = 0; i < (uint32_t)n; i++) {
+		long photometric = tiff_int(t, ifds[i], TAG_PHOTOMETRIC, 0);
+
+		if (tiff_int(t, ifds[i], TAG_NEW_SUBFILE_TYPE, 0) == 0 &&
+		    (photometric == PHOTOMETRIC_CFA ||
+		     photometric == PHOTOMETRIC_LINEAR_RAW))
+			return ifds[i];
+	}
+	return 0;
+}
+
+/* the colour filter array and the order from the CFAPattern */
+static int dng_cfa(const struct tiff *t, size_t ifd, struct frame_fmt *fmt)
+{
+	struct tiff_entry e;
+	uint8_t pattern[XTRANS_SIZE * XTRANS_SIZE];
+	int rows = 2, cols = 2;
+	int x, y, o;
+
+	if (tiff_find(t, ifd, TAG_CFA_REPEAT, &e)) {
+		rows = tiff_value(t, &e, 0);
+		cols = tiff_value(t, &e, 1);
+	}
+	if (rows != cols || (rows != 2 && rows != XTRANS_SIZE) ||
+	    !tiff_find(t, ifd, TAG_CFA_PATTERN, &e) ||
+	    e.count != (uint32_t)(rows * cols)) {
+		printf("dng: unsupported %dx%d CFA pattern\n", cols, rows);
+		return -1;
+	}
+	for (x = 0; x < rows * cols; x++)
+		pattern[x] = tiff_value(t, &e, x);
+
+	if (rows == XTRANS_SIZE) {
+		/* the engines know only the phase of xtrans_colour() */
+		for (x = 0; x < rows * cols; x++) {
+			if (pattern[x] != xtrans_colour(x % cols, x / cols)) {
+				printf("dng: unsupported X-Trans phase\n");
+				return -1;
+			}
+		}
+		fmt->cfa = CFA_XTRANS;
+		return 0;
+	}
+
+	for (o = BAYER_RGGB; o <= BAYER_BGGR; o++) {
+		bayer_first_red(o, &x, &y);
+		if (pattern[y * 2 + x] == 0 &&
+		    pattern[(1 - y) * 2 + 1 - x] == 2 &&
+		    pattern[y * 2 + 1 - x] == 1 &&
+		    pattern[(1 - y) * 2 + x] == 1) {
+			fmt->cfa = CFA_BAYER;
+			fmt->order = o;
+			return 0;
+		}
+	}
+	printf("dng: unsupported CFA pattern %d%d%d%d\n", pattern[0],
+	       pattern[1], pattern[2], pattern[3]);
+	return -1;
+}
+
+/* the sample x of the row packed MSB first, as TIFF does */
+static int dng_unpack(const struct tiff *t, const uint8_t *row, int x,
+		      int bits)
+{
+	long bit = (long)x * bits;
+	const uint8_t *p = row + bit / 8;
+	int n = (bit % 8 + bits + 7) / 8;
+	uint32_t v = 0;
+	int i;
+
+	if (bits == 8)
+		return row[x];
+	if (bits == 16)
+		return t->be ? row[2 * x] << 8 | row[2 * x + 1] :
+			       row[2 * x] | row[2 * x + 1] << 8;
+	for (i = 0; i < n; i++)
+		v = v << 8 | p[i];
+	return (v >> (8 * n - bit % 8 - bits)) & ((1u << bits) - 1);
+}
+
+/* decodes or unpacks a segment into the frame buffer */
+static void dng_read_segment(void *arg, int i)
+{
+	struct dng_read *r = arg;
+	struct dng_segment *s = &r->segs[i];
+	const struct frame_fmt *fmt = &r->dng->fmt;
+	const uint8_t *src = r->t->p + s->offset;
+	long samples = (long)s->width * s->height;
+	long row_bytes = ((long)s->width * r->bits + 7) / 8;
+	int bpp = fmt->bits > 8 ? 2 : 1;
+	uint16_t *tile;
+	int x, y;
+
+	tile = malloc(sizeof(*tile) * samples);
+	if (tile == NULL) {
+		s->failed = 1;
+		return;
+	}
+	if (r->compression == COMPRESSION_LJPEG) {
+		if (ljpeg_decode(src, s->size, tile, samples) < samples)
+			s->failed = 1;
+	} else if ((size_t)(row_bytes * s->height) > s->size) {
+		s->failed = 1;
+	} else {
+		for (y = 0; y < s->height; y++)
+			for (x = 0; x < s->width; x++)
+				tile[y * s->width + x] = dng_unpack(r->t,
+					src + y * row_bytes, x, r->bits);
+	}
+
+	for (y = 0; !s->failed && y < s->height; y++) {
+		uint8_t *dst = r->dng->buf + (long)(s->y + y) * fmt->stride +
+			       bpp * s->x;
+
+		if (s->y + y >= fmt->height)
+			break;
+		for (x = 0; x < s->width && s->x + x < fmt->width; x++) {
+			int v = tile[y * s->width + x];
+
+			if (bpp == 1) {
+				dst[x] = v;
+			} else {
+				dst[2 * x] = v;
+				dst[2 * x + 1] = v >> 8;
+			}
+		}
+	}
+	free(tile);
+}
+
+/*
+ * The uncompressed strips of 8-bit or 16-bit little endian samples one
+ * after another are the input frame as the engines read it.
+ */
+static int dng_mapped(const struct tiff *t, const struct dng_read *r,
+		      int count)
+{
+	const struct dng_segment *s = r->segs;
+	long row_bytes = (long)s->width * r->bits / 8;
+	int i;
+
+	if (r->compression != COMPRESSION_NONE ||
+	    s->width != r->dng->fmt.width ||
+	    (r->bits != 8 && (r->bits != 16 || t->be)) || row_bytes % 4 ||
+	    s->offset + (size_t)row_bytes * r->dng->fmt.height > t->size)
+		return 0;
+	for (i = 1; i < count; i++)
+		if (s[i].offset != s->offset + (size_t)s[i].y * row_bytes)
+			return 0;
+	r->dng->fmt.stride = row_bytes;
+	r->dng->data = t->p + s->offset;
+	return 1;
+}
+
+/* the strips or the tiles of the image */
+static int dng_image_data(const struct tiff *t, size_t ifd,
+			  struct dng_image *dng, int bits, int compression)
+{
+	struct frame_fmt *fmt = &dng->fmt;
+	struct dng_read r = {
+		.t = t,
+		.dng = dng,
+		.bits = bits,
+		.compression = compression,
+	};
+	struct tiff_entry offsets, sizes;
+	int tiled = tiff_find(t, ifd, TAG_TILE_OFFSETS, &offsets);
+	int seg_w = tiled ? tiff_int(t, ifd, TAG_TILE_WIDTH, 0) : fmt->width;
+	int seg_h = tiff_int(t, ifd, tiled ? TAG_TILE_HEIGHT :
+			     TAG_ROWS_PER_STRIP, fmt->height);
+	int across, down, count;
+	int i, ret = -1;
+
+	if (seg_h > fmt->height && !tiled)
+		seg_h = fmt->height;
+	if (seg_w <= 0 || seg_h <= 0 ||
+	    (!tiled && !tiff_find(t, ifd, TAG_STRIP_OFFSETS, &offsets)) ||
+	    !tiff_find(t, ifd, tiled ? TAG_TILE_BYTES : TAG_STRIP_BYTES,
+		       &sizes)) {
+		printf("dng: no image data\n");
+		return -1;
+	}
+	across = (fmt->width + seg_w - 1) / seg_w;
+	down = (fmt->height + seg_h - 1) / seg_h;
+	count = across * down;
+	if (offsets.count != (uint32_t)count ||
+	    sizes.count != (uint32_t)count) {
+		printf("dng: %u segments for %dx%d image of %dx%d ones\n",
+		       offsets.count, fmt->width, fmt->height, seg_w, seg_h);
+		return -1;
+	}
+
+	r.segs = calloc(count, sizeof(*r.segs));
+	if (r.segs == NULL) {
+		printf("out of memory\n");
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		struct dng_segment *s = &r.segs[i];
+
+		s->offset = tiff_value(t, &offsets, i);
+		s->size = tiff_value(t, &sizes, i);
+		s->x = i % across * seg_w;
+		s->y = i / across * seg_h;
+		s->width = seg_w;
+		/* the last strip is shorter, the tiles are padded */
+		s->height = tiled || s->y + seg_h <= fmt->height ? seg_h :
+			    fmt->height - s->y;
+		if (s->offset > t->size || t->size - s->offset < s->size) {
+			printf("dng: segment %d is past the end\n", i);
+			goto out;
+		}
+	}
+
+	fmt->stride = (fmt->width * (fmt->bits > 8 ? 2 : 1) + 3) / 4 * 4;
+	if (dng_mapped(t, &r, count)) {
+		ret = 0;
+		goto out;
+	}
+
+	dng->buf = malloc((size_t)fmt->stride * fmt->height);
+	if (dng->buf == NULL) {
+		printf("out of memory\n");
+		goto out;
+	}
+	/* the segments are independent, and decoded on all the CPUs */
+	parallel_for(count, dng_read_segment, &r);
+	for (i = 0; i < count; i++) {
+		if (r.segs[i].failed) {
+			printf("dng: bad data of segment %d\n", i);
+			goto out;
+		}
+	}
+	dng->data = dng->buf;
+	ret = 0;
+out:
+	free(r.segs);
+	return ret;
+}
+
+static int dng_parse(const struct tiff *t, size_t ifd0, struct dng_image *dng)
+{
+	struct frame_fmt *fmt = &dng->fmt;
+	size_t ifd = dng_raw_ifd(t, ifd0);
+	long bits = tiff_int(t, ifd, TAG_BITS, 0);
+	long compression = tiff_int(t, ifd, TAG_COMPRESSION,
+				    COMPRESSION_NONE);
+	struct tiff_entry e;
+	double sum = 0;
+	uint32_t i;
+
+	if (!ifd) {
+		printf("dng: no raw image\n");
+		return -1;
+	}
+	fmt->width = tiff_int(t, ifd, TAG_WIDTH, 0);
+	fmt->height = tiff_int(t, ifd, TAG_HEIGHT, 0);
+	if (fmt->width <= 0 || fmt->height <= 0 || bits < 8 || bits > 16 ||
+	    tiff_int(t, ifd, TAG_SAMPLES, 1) != 1 ||
+	    (compression != COMPRESSION_NONE &&
+	     compression != COMPRESSION_LJPEG)) {
+		printf("dng: unsupported %dx%d image, %ld bits, compression %ld\n",
+		       fmt->width, fmt->height, bits, compression);
+		return -1;
+	}
+
+	if (tiff_int(t, ifd, TAG_PHOTOMETRIC, 0) == PHOTOMETRIC_LINEAR_RAW)
+		fmt->cfa = CFA_MONO;
+	else if (dng_cfa(t, ifd, fmt) < 0)
+		return -1;
+
+	if (tiff_find(t, ifd, TAG_BLACK_LEVEL, &e) && e.count) {
+		for (i = 0; i < e.count; i++)
+			sum += tiff_value(t, &e, i);
+		dng->black = sum / e.count + 0.5;
+	}
+	dng->white = tiff_int(t, ifd, TAG_WHITE_LEVEL, (1L << bits) - 1);
+	if (tiff_find(t, ifd0, TAG_AS_SHOT_NEUTRAL, &e) && e.count == 3)
+		for (i = 0; i < 3; i++)
+			dng->neutral[i] = tiff_value(t, &e, i);
+	if (tiff_find(t, ifd0, TAG_COLOR_MATRIX, &e) && e.count == 9)
+		for (i = 0; i < 9; i++)
+			dng->matrix[i] = tiff_value(t, &e, i);
+
+	/* the bits the white level needs, in the 16-bit words */
+	fmt->bits = 8;
+	if (bits > 8) {
+		fmt->bits = 9;
+		while (fmt->bits < bits && dng->white >> fmt->bits)
+			fmt->bits++;
+	}
+	return dng_image_data(t, ifd, dng, bits, compression);
+}
+
+/*
+ * Returns 0 and the image of the DNG file, 1 if the file is not a DNG,
+ * -1 if it is one which can't be read.
+ */
+int dng_open(const char *fname, struct dng_image *dng)
+{
+	struct tiff t;
+	struct tiff_entry e;
+	struct stat st;
+	void *map;
+	size_t ifd0;
+	int fd;
+
+	memset(dng, 0, sizeof(*dng));
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return 1;
+	if (fstat(fd, &st) < 0 || st.st_size < 8) {
+		close(fd);
+		return 1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 1;
+
+	t.p = map;
+	t.size = st.st_size;
+	t.be = !memcmp(map, "MM\0*", 4);
+	ifd0 = tiff_get(&t, 4, 4);
+	if ((!t.be && memcmp(map, "II*\0", 4)) ||
+	    !tiff_find(&t, ifd0, TAG_DNG_VERSION, &e)) {
+		munmap(map, st.st_size);
+		return 1;
+	}
+
+	dng->map = map;
+	dng->map_size = st.st_size;
+	if (dng_parse(&t, ifd0, dng) < 0) {
+		dng_close(dng);
+		return -1;
+	}
+	return 0;
+}
+
+void dng_close(struct dng_image *dng)
+{
+	free(dng->buf);
+	if (dng->map)
+		munmap(dng->map, dng->map_size);
+	memset(dng, 0, sizeof(*dng));
+}
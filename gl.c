@@ -0,0 +1,1039 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * The GL engine: runs the compute shader in a window-less EGL + GLES 3.1
+ * context to demosaic the raw frames.
+ *
+ * Copyright (C) 2021, Linaro
+ *
+ * The method to run a headless compute shader is taken from the blog post
+ * by Eduardo Lima Mitev <elima@igalia.com> :
+ * https://blogs.igalia.com/elima/2016/10/06/example-run-an-opengl-es-compute-shader-on-a-drm-render-node/
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gl.h"
+
+long read_input_file(const char *fname, char **data, const char *type)
+{
+	FILE *fp;
+	long size;
+	char *p_data;
+
+	fp = fopen(fname, type);
+	if (fp == NULL)
+		return 0;
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if (size <= 0)
+		goto err_seek;
+
+	p_data = malloc(size);
+	if (p_data == NULL)
+		goto err_seek;
+
+	if (fread(p_data, 1, size, fp) != size)
+		goto err_fread;
+
+	fclose(fp);
+	*data = p_data;
+	return size;
+
+err_fread:
+	free(p_data);
+err_seek:
+	fclose(fp);
+	return -1;
+}
+
+
+long read_input_bin_file(const char *fname, char **data)
+{
+	return read_input_file(fname, data, "rb");
+}
+
+long read_input_text_file(const char *fname, char **data)
+{
+	return read_input_file(fname, data, "r");
+}
+
+
+/*
+ * The surfaceless display is the same for all the converters of the
+ * process (e.g. the threads of the Python module): it is terminated with
+ * the last of them.
+ */
+static pthread_mutex_t surfaceless_lock = PTHREAD_MUTEX_INITIALIZER;
+static int surfaceless_users;
+
+static void terminate_display(struct converter *conv)
+{
+	if (conv->gbm == NULL) {
+		pthread_mutex_lock(&surfaceless_lock);
+		if (--surfaceless_users == 0)
+			eglTerminate(conv->egl_dpy);
+		pthread_mutex_unlock(&surfaceless_lock);
+		return;
+	}
+	eglTerminate(conv->egl_dpy);
+}
+
+int init_egl(struct converter * conv, const char * render_node)
+{
+	const char *egl_extension_st;
+	static const EGLint config_attribs[] = {
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT_KHR, EGL_NONE
+	};
+	static const EGLint attribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 3,
+		EGL_CONTEXT_MINOR_VERSION, 1, EGL_NONE
+	};
+	EGLConfig cfg;
+	EGLint count;
+	EGLint major, minor;
+
+	conv->fd = open (render_node, O_RDWR);
+	if (conv->fd < 0) {
+		perror("init_opengl: ");
+		/*
+		 * No render node (e.g. in a container or a CI job): the
+		 * surfaceless platform still gives the software rasterizer
+		 * (llvmpipe), which is enough to run the compute shader.
+		 */
+		printf("init_opengl: falling back to the surfaceless platform\n");
+		conv->gbm = NULL;
+		conv->egl_dpy = eglGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+						      EGL_DEFAULT_DISPLAY, NULL);
+	} else {
+		conv->gbm = gbm_create_device(conv->fd);
+		if (conv->gbm == NULL) {
+			printf("init_opengl: failed to create GBM device\n");
+			goto err_gbm;
+		}
+
+		/* setup EGL from the GBM device */
+		conv->egl_dpy = eglGetPlatformDisplay(EGL_PLATFORM_GBM_MESA,
+						      conv->gbm, NULL);
+	}
+	if (conv->egl_dpy == NULL) {
+		printf("init_opengl: eglGetPlatformDisplay() failed\n");
+		goto err_egl_dpy;
+	}
+	if (conv->gbm == NULL) {
+		pthread_mutex_lock(&surfaceless_lock);
+		surfaceless_users++;
+		pthread_mutex_unlock(&surfaceless_lock);
+	}
+
+	/* initialize an EGL display connection */
+	if (eglInitialize(conv->egl_dpy, &major, &minor) != EGL_TRUE) {
+		printf("init_opengl: eglInitialize() failed\n");
+		goto err_egl_ctx;
+	} else {
+		printf("EGL version: %d.%d\n", major, minor);
+	}
+
+	egl_extension_st = eglQueryString (conv->egl_dpy, EGL_EXTENSIONS);
+	if (strstr (egl_extension_st, "EGL_KHR_create_context") == NULL ||
+	    strstr (egl_extension_st, "EGL_KHR_surfaceless_context") == NULL) {
+		printf("init_opengl: EGL_KHR_create_context or EGL_KHR_surfaceless_context not supported\n");
+		goto err_egl_ctx;
+	}
+
+	if (!eglChooseConfig(conv->egl_dpy, config_attribs, NULL, 0, &count)) {
+                printf("init_opengl: eglChooseConfig(&cfg == NULL) failed\n");
+        }
+        printf("eglChooseConfig(): %d matching configs available\n", count);
+
+	/*
+	 * Get the first EGL frame buffer configuration that matches the
+	 * specified attributes - we request GL ES 3.x.
+	 */
+	if (!eglChooseConfig(conv->egl_dpy, config_attribs, &cfg, 1, &count)) {
+		printf("init_opengl: eglChooseConfig() failed: %d\n",
+		       eglGetError());
+		goto err_egl_ctx;
+	}
+	/* the surfaceless platform has no configs, we don't need one anyway */
+	if (count == 0)
+		cfg = EGL_NO_CONFIG_KHR;
+
+	if (!eglBindAPI(EGL_OPENGL_ES_API)) {
+		printf("init_opengl: eglBindAPI() failed: %d\n", eglGetError());
+		goto err_egl_ctx;
+	}
+
+	conv->core_ctx = eglCreateContext(conv->egl_dpy, cfg, EGL_NO_CONTEXT,
+					  attribs);
+	if (conv->core_ctx == EGL_NO_CONTEXT) {
+		printf("init_opengl: eglCreateContext() failed\n");
+		goto err_egl_ctx;
+	}
+
+	/*
+	 * eglMakeCurrent() binds context to the current rendering thread.
+	 * We don't need neither draw nor read surfaces hence EGL_NO_SURFACE's.
+	 */
+	if (!eglMakeCurrent(conv->egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
+			    conv->core_ctx)) {
+		printf("init_opengl: eglMakeCurrent() failed: %d\n",
+		       eglGetError());
+		goto err_egl_make_current;
+	}
+
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	printf("*** EGL version: %d.%d\n", major, minor);
+
+	return 0;
+
+err_egl_make_current:
+	eglDestroyContext(conv->egl_dpy, conv->core_ctx);
+err_egl_ctx:
+	terminate_display(conv);
+err_egl_dpy:
+	if (conv->gbm)
+		gbm_device_destroy(conv->gbm);
+err_gbm:
+	if (conv->fd >= 0)
+		close(conv->fd);
+	return -1;
+}
+
+void deinit_egl(struct converter *conv)
+{
+	eglDestroyContext(conv->egl_dpy, conv->core_ctx);
+	terminate_display(conv);
+	if (conv->gbm)
+		gbm_device_destroy(conv->gbm);
+	if (conv->fd >= 0)
+		close(conv->fd);
+}
+
+/* Builds the program from the shader source with the #define's given */
+int init_shader(struct converter *conv, const char *defines, GLuint *program)
+{
+	GLenum err;
+	GLint param;
+	char *compile_log;
+
+	int shader_cnt;
+	char *shader_src;
+	const char *src[3];
+	GLint src_len[3];
+	char *eol;
+
+	shader_cnt = read_input_text_file(conv->shader_fname, &shader_src);
+	if (shader_cnt <= 0) {
+		printf("Fail to read the shader source from file \"%s\"\n",
+		       conv->shader_fname);
+		return GL_TRUE; /* GL_NO_ERROR == GL_FALSE */
+	}
+	printf("%d bytes read from \"%s\"\n", shader_cnt, conv->shader_fname);
+
+	conv->compute_shader = glCreateShader(GL_COMPUTE_SHADER);
+	if(!conv->compute_shader) {
+		free(shader_src);
+		return glGetError();
+	}
+
+	/*
+	 * The #define's from the configuration go right after the #version
+	 * line, which has to be the first one.
+	 */
+	for (eol = shader_src; eol + 8 < shader_src + shader_cnt; eol++)
+		if ((eol == shader_src || eol[-1] == '\n') &&
+		    !memcmp(eol, "#version", 8))
+			break;
+	eol = memchr(eol, '\n', shader_src + shader_cnt - eol);
+	src_len[0] = eol ? eol - shader_src + 1 : shader_cnt;
+	src[0] = shader_src;
+	src[1] = defines;
+	src_len[1] = strlen(defines);
+	src[2] = shader_src + src_len[0];
+	src_len[2] = shader_cnt - src_len[0];
+	glShaderSource(conv->compute_shader, 3, src, src_len);
+	/*
+	 * The shader source has been copied into the shader object, so
+	 * shader_src[] contents is no longer needed.
+	 */
+	free(shader_src);
+
+	if ((err = glGetError()) != GL_NO_ERROR)
+		return err;
+
+	glCompileShader(conv->compute_shader);
+	glGetShaderiv(conv->compute_shader, GL_COMPILE_STATUS, &param);
+	if (param != GL_TRUE) {
+		glGetShaderiv(conv->compute_shader, GL_INFO_LOG_LENGTH, &param);
+		printf("glCompileShader() failed");
+		compile_log = malloc(param);
+		if (compile_log == NULL) {
+			printf(", no log is available\n");
+			return GL_TRUE; /* GL_NO_ERROR == GL_FALSE */
+		}
+		glGetShaderInfoLog(conv->compute_shader, param, NULL,
+				   compile_log);
+		if (glGetError() == GL_NO_ERROR)
+			printf("glCompileShader failed:\n"
+			       "--- log ---\n%s\n--- log ---\n", compile_log);
+		free(compile_log);
+		return GL_TRUE;
+	}
+
+	*program = glCreateProgram();
+	if(!*program) {
+		err = glGetError();
+		goto err_del_shader;
+	}
+
+	glAttachShader(*program, conv->compute_shader);
+	if ((err = glGetError()) != GL_NO_ERROR)
+		goto err_del_program;
+
+	glLinkProgram(*program);
+	if ((err = glGetError()) != GL_NO_ERROR)
+		goto err_del_program;
+
+	glDeleteShader(conv->compute_shader);
+	return 0;
+
+err_del_program:
+	glDeleteProgram(*program);
+	*program = 0;
+err_del_shader:
+	glDeleteShader(conv->compute_shader);
+	return err;
+}
+
+/* the uniforms of the main program */
+static void get_uniforms(struct converter *conv)
+{
+	conv->u_size = glGetUniformLocation(conv->shader_program, "size");
+	conv->u_stride = glGetUniformLocation(conv->shader_program, "stride");
+	conv->u_first_red = glGetUniformLocation(conv->shader_program,
+						 "first_red");
+	conv->u_tensor_size = glGetUniformLocation(conv->shader_program,
+						   "tensor_size");
+	conv->u_tensor_words = glGetUniformLocation(conv->shader_program,
+						    "tensor_words");
+	conv->u_grid_width = glGetUniformLocation(conv->shader_program,
+						  "grid_width");
+	conv->u_dn_strength = glGetUniformLocation(conv->shader_program,
+						   "dn_strength");
+	conv->u_tn_params = glGetUniformLocation(conv->shader_program,
+						 "tn_params");
+	conv->u_pf_params = glGetUniformLocation(conv->shader_program,
+						 "pf_params");
+}
+
+int use_shader(GLuint shader_program)
+{
+	glUseProgram(shader_program);
+	return (glGetError() != GL_NO_ERROR);
+}
+
+void free_shader(struct converter * conv)
+{
+	/* glDeleteShader() had been called at this point */
+	glDeleteProgram(conv->shader_program);
+	int i;
+
+	for (i = 0; i < pass_num; i++) {
+		glDeleteProgram(conv->pass_programs[i]);
+		conv->pass_programs[i] = 0;
+	}
+}
+
+/* The input conversion part of the shader configuration */
+int input_defines(const struct frame_fmt *fmt,
+		  const struct debayer_opts *opts, char *buf, size_t len)
+{
+	static const char * const cfa_names[] = {
+		[CFA_QUAD] = "CFA_QUAD",
+		[CFA_QUAD_BIN] = "CFA_QUAD_BIN",
+		[CFA_RGBIR] = "CFA_RGBIR",
+	};
+	int n = 0;
+
+	buf[0] = '\0';
+	if (fmt->bits > 8)
+		n += snprintf(buf + n, len - n, "#define RAW16\n");
+	if (opts->dark.enabled && opts->dark.frame)
+		n += snprintf(buf + n, len - n, "#define DARK_FRAME\n");
+	if (opts->dark.enabled && opts->dark.columns)
+		n += snprintf(buf + n, len - n, "#define DARK_COLUMNS\n");
+	if (opts->hdr.enabled)
+		n += snprintf(buf + n, len - n,
+			      "#define HDR\n#define HDR_FRAMES %d\n",
+			      opts->hdr.frames);
+	if (cfa_remosaiced(fmt->cfa))
+		n += snprintf(buf + n, len - n, "#define %s\n",
+			      cfa_names[fmt->cfa]);
+	if (opts->tone.enabled)
+		n += snprintf(buf + n, len - n,
+			      "#define TONE\n%s"
+			      "#define TONE_STATS_STEP %d\n"
+			      "#define TONE_CELL_SHIFT %d\n"
+			      "#define TONE_RANGE_SHIFT %d\n",
+			      opts->tone.local ? "#define TONE_LOCAL\n" : "",
+			      TONE_STATS_STEP, TONE_CELL_SHIFT,
+			      TONE_RANGE_SHIFT);
+	return n;
+}
+
+/*
+ * The shader configuration, see the top of debayer.comp; also printed by
+ * pipeline_plan()
+ */
+void build_defines(const struct frame_fmt *fmt,
+		   const struct debayer_opts *opts, char *buf, size_t len)
+{
+	const struct tensor_fmt *t = &opts->tensor;
+	int n = 0;
+
+	buf[0] = '\0';
+	if (opts->orient & ORIENT_HFLIP)
+		n += snprintf(buf + n, len - n, "#define ORIENT_HFLIP\n");
+	if (opts->orient & ORIENT_VFLIP)
+		n += snprintf(buf + n, len - n, "#define ORIENT_VFLIP\n");
+	if (opts->orient & ORIENT_TRANSPOSE)
+		n += snprintf(buf + n, len - n, "#define ORIENT_TRANSPOSE\n");
+	if (opts->remap.enabled)
+		n += snprintf(buf + n, len - n,
+			      "#define REMAP\n"
+			      "#define REMAP_GRID_SHIFT %d\n"
+			      "#define REMAP_BIAS %d\n",
+			      REMAP_GRID_SHIFT, REMAP_BIAS);
+	if (opts->denoise.enabled)
+		n += snprintf(buf + n, len - n, "#define DENOISE\n");
+	if (fmt->cfa == CFA_XTRANS)
+		n += snprintf(buf + n, len - n, "#define CFA_XTRANS\n");
+	if (fmt->cfa == CFA_MONO)
+		n += snprintf(buf + n, len - n, "#define CFA_MONO\n");
+	if (opts->output == OUTPUT_GRAY)
+		n += snprintf(buf + n, len - n, "#define OUTPUT_GRAY\n");
+	if (output_yuv(opts->output))
+		n += snprintf(buf + n, len - n, "#define OUTPUT_YUV\n%s",
+			      opts->output == OUTPUT_NV12 ?
+			      "#define YUV_NV12\n" : "");
+	if (opts->post.enabled)
+		n += snprintf(buf + n, len - n, "#define POSTFILTER\n");
+	if (opts->temporal.enabled && opts->output == OUTPUT_RGBA)
+		n += snprintf(buf + n, len - n, "#define TEMPORAL\n");
+	if (opts->incremental)
+		n += snprintf(buf + n, len - n, "#define TILE_LIST\n");
+	if (opts->atlas)
+		n += snprintf(buf + n, len - n, "#define ATLAS\n");
+	/* the gathering modes read the converted frame, see run_convert() */
+	if (!convert_pass(fmt, opts))
+		n += input_defines(fmt, opts, buf + n, len - n);
+	if (opts->output == OUTPUT_TENSOR)
+		n += snprintf(buf + n, len - n,
+			      "#define OUTPUT_TENSOR\n"
+			      "#define TENSOR_ESIZE %d\n%s%s",
+			      tensor_elem_size(t),
+			      t->layout == TENSOR_CHW ?
+			      "#define TENSOR_CHW\n" : "",
+			      t->bgr ? "#define TENSOR_BGR\n" : "");
+}
+
+/* (Re)builds the shader programs if the configuration has changed */
+int configure_shader(struct converter *conv, const struct frame_fmt *fmt,
+		     const struct debayer_opts *opts)
+{
+	static const char * const pass_names[pass_num] = {
+		[pass_tone_curve] = "PASS_TONE_CURVE",
+		[pass_tone_stats] = "PASS_TONE_STATS",
+		[pass_convert] = "PASS_CONVERT",
+		[pass_ir] = "PASS_IR",
+	};
+	char defines[sizeof(conv->shader_defines) / 2];
+	char pass_defines[sizeof(defines)];
+	char key[sizeof(conv->shader_defines)];
+	int n;
+	int ret;
+	int i;
+
+	/* the passes only need the input conversion */
+	build_defines(fmt, opts, defines, sizeof(defines));
+	n = input_defines(fmt, opts, pass_defines, sizeof(pass_defines));
+	snprintf(key, sizeof(key), "%s%s", defines, pass_defines);
+	if (conv->shader_program && !strcmp(key, conv->shader_defines))
+		return 0;
+
+	if (conv->shader_program) {
+		free_shader(conv);
+		conv->shader_program = 0;
+	}
+	strcpy(conv->shader_defines, key);
+	/* the output of the previous frame is of another configuration */
+	conv->tiles.valid = 0;
+	ret = init_shader(conv, defines, &conv->shader_program);
+	if (ret)
+		return ret;
+	get_uniforms(conv);
+
+	for (i = 0; i < pass_num; i++) {
+		if (!(i == pass_convert ? convert_pass(fmt, opts) :
+		      i == pass_ir ? fmt->cfa == CFA_RGBIR :
+		      opts->tone.enabled))
+			continue;
+		snprintf(pass_defines + n, sizeof(pass_defines) - n,
+			 "#define %s\n", pass_names[i]);
+		ret = init_shader(conv, pass_defines, &conv->pass_programs[i]);
+		if (ret) {
+			free_shader(conv);
+			conv->shader_program = 0;
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The calibration data is uploaded once, and stays on the GPU for the
+ * following frames of the stream
+ */
+static int load_dark(struct converter *conv, const struct frame_fmt *fmt,
+		     const struct dark_fmt *dark)
+{
+	GLenum err;
+
+	if (dark->frame && dark->frame != conv->dark_frame) {
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, conv->bos[bo_dark]);
+		glBufferData(GL_SHADER_STORAGE_BUFFER,
+			     (GLsizei)input_frame_size(fmt), dark->frame,
+			     GL_STATIC_DRAW);
+		conv->dark_frame = dark->frame;
+	}
+	if (dark->columns && dark->columns != conv->dark_columns) {
+		int width, height;
+
+		sensor_size(fmt, &width, &height);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER,
+			     conv->bos[bo_dark_columns]);
+		glBufferData(GL_SHADER_STORAGE_BUFFER,
+			     sizeof(*dark->columns) * width,
+			     dark->columns, GL_STATIC_DRAW);
+		conv->dark_columns = dark->columns;
+	}
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, conv->bos[bo_dark]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9,
+			 conv->bos[bo_dark_columns]);
+
+	err = glGetError();
+	if (err != GL_NO_ERROR) {
+		printf("dark frame upload error 0x%04X\n", err);
+		return -1;
+	}
+	return 0;
+}
+
+/* the uniforms of the input conversion, see input_defines() */
+static void set_input_uniforms(GLuint prog, const struct frame_fmt *fmt,
+			       const struct debayer_opts *opts)
+{
+	const struct hdr_fmt *h = &opts->hdr;
+	int grid_width, grid_height;
+	int fr_x, fr_y;
+
+	bayer_first_red(fmt->order, &fr_x, &fr_y);
+	glUniform2i(glGetUniformLocation(prog, "first_red"), fr_x, fr_y);
+	glUniform1i(glGetUniformLocation(prog, "raw_bits"),
+		    merged_bits(fmt, opts));
+	if (h->enabled) {
+		glUniform1i(glGetUniformLocation(prog, "in_bits"), fmt->bits);
+		glUniform4i(glGetUniformLocation(prog, "hdr_ratio"),
+			    h->ratio[0], h->ratio[1], h->ratio[2], h->ratio[3]);
+	}
+	if (opts->tone.local) {
+		tone_grid_size(fmt, &grid_width, &grid_height);
+		glUniform1i(glGetUniformLocation(prog, "tone_grid_width"),
+			    grid_width);
+		glUniform1i(glGetUniformLocation(prog, "tone_strength"),
+			    opts->tone.local);
+	}
+}
+
+/*
+ * The tone mapping passes before the frame: the curve from the histogram
+ * of the previous frame, then the statistics of this frame (the new
+ * histogram and the bilateral grid). All the buffers stay on the GPU, the
+ * histogram is only uploaded (zeroed) at the start of a stream.
+ */
+static int run_tone(struct converter *conv, const struct frame_fmt *fmt,
+		    const struct debayer_opts *opts)
+{
+	static const GLuint no_hist[TONE_BINS];
+	int bits = merged_bits(fmt, opts);
+	int grid_width, grid_height, grid_words;
+	GLuint prog;
+	GLenum err;
+
+	tone_grid_size(fmt, &grid_width, &grid_height);
+	grid_words = opts->tone.local ?
+		     2 * TONE_RANGE_NODES * grid_width * grid_height : 0;
+
+	if (conv->tone_bits != bits) {
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, conv->bos[bo_tone_hist]);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(no_hist),
+			     no_hist, GL_DYNAMIC_COPY);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, conv->bos[bo_tone_lut]);
+		glBufferData(GL_SHADER_STORAGE_BUFFER,
+			     sizeof(GLuint) << bits, NULL, GL_DYNAMIC_COPY);
+		conv->tone_bits = bits;
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, conv->bos[bo_tone_grid]);
+	glBufferData(GL_SHADER_STORAGE_BUFFER,
+		     sizeof(GLuint) * (grid_words ? grid_words : 1), NULL,
+		     GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, conv->bos[bo_tone_lut]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, conv->bos[bo_tone_hist]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, conv->bos[bo_tone_grid]);
+
+	/* one workgroup, an invocation per histogram bin */
+	prog = conv->pass_programs[pass_tone_curve];
+	if (use_shader(prog) != 0)
+		return -1;
+	glUniform1i(glGetUniformLocation(prog, "raw_bits"), bits);
+	glUniform1i(glGetUniformLocation(prog, "tone_grid_words"), grid_words);
+	glDispatchCompute(1, 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	/* an invocation per 2x2 quad of the statistics */
+	prog = conv->pass_programs[pass_tone_stats];
+	if (use_shader(prog) != 0)
+		return -1;
+	glUniform2i(glGetUniformLocation(prog, "size"), fmt->width,
+		    fmt->height);
+	glUniform1i(glGetUniformLocation(prog, "stride"), fmt->stride);
+	set_input_uniforms(prog, fmt, opts);
+	glDispatchCompute(((fmt->width + TONE_STATS_STEP - 1) /
+			   TONE_STATS_STEP + LSIZE_X - 1) / LSIZE_X,
+			  ((fmt->height + TONE_STATS_STEP - 1) /
+			   TONE_STATS_STEP + LSIZE_Y - 1) / LSIZE_Y, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	err = glGetError();
+	if (err != GL_NO_ERROR) {
+		printf("tone passes error 0x%04X\n", err);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The 8-bit frame of the width rounded up to the word for the gathering
+ * modes, see convert_pass(). The main program reads it instead of the
+ * input.
+ */
+static int run_convert(struct converter *conv, const struct frame_fmt *fmt,
+		       const struct debayer_opts *opts)
+{
+	GLuint prog = conv->pass_programs[pass_convert];
+	int words = (fmt->width + 3) / 4;
+	GLenum err;
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, conv->bos[bo_conv]);
+	glBufferData(GL_SHADER_STORAGE_BUFFER,
+		     sizeof(GLuint) * words * fmt->height, NULL,
+		     GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, conv->bos[bo_conv]);
+
+	if (use_shader(prog) != 0)
+		return -1;
+	glUniform2i(glGetUniformLocation(prog, "size"), fmt->width,
+		    fmt->height);
+	glUniform1i(glGetUniformLocation(prog, "stride"), fmt->stride);
+	set_input_uniforms(prog, fmt, opts);
+	glDispatchCompute((words + LSIZE_X - 1) / LSIZE_X,
+			  (fmt->height + LSIZE_Y - 1) / LSIZE_Y, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, conv->bos[bo_conv]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, conv->bos[bo_out]);
+	err = glGetError();
+	if (err != GL_NO_ERROR) {
+		printf("conversion pass error 0x%04X\n", err);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The IR plane of CFA_RGBIR after the output, from the input (not the
+ * converted frame)
+ */
+static int run_ir(struct converter *conv, const struct frame_fmt *fmt,
+		  const struct debayer_opts *opts, long data_out_size)
+{
+	GLuint prog = conv->pass_programs[pass_ir];
+	long words = ir_plane_size(fmt) / 4;
+	long groups = (words + LSIZE_X * LSIZE_Y - 1) / (LSIZE_X * LSIZE_Y);
+	GLenum err;
+
+	/* the other region of the output, no barrier after the main pass */
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, conv->bos[bo_in]);
+	if (use_shader(prog) != 0)
+		return -1;
+	glUniform2i(glGetUniformLocation(prog, "size"), fmt->width,
+		    fmt->height);
+	glUniform1i(glGetUniformLocation(prog, "stride"), fmt->stride);
+	glUniform1i(glGetUniformLocation(prog, "ir_offset"),
+		    (data_out_size - ir_plane_size(fmt)) / 4);
+	set_input_uniforms(prog, fmt, opts);
+	glDispatchCompute(groups < 1024 ? groups : 1024,
+			  (groups + 1023) / 1024, 1);
+
+	err = glGetError();
+	if (err != GL_NO_ERROR) {
+		printf("IR pass error 0x%04X\n", err);
+		return -1;
+	}
+	return 0;
+}
+
+/* the fence of the shaders dispatched so far */
+GLsync fence_shader(void)
+{
+	glMemoryBarrier(GL_ALL_BARRIER_BITS);
+	return glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+/* waits for the shaders dispatched to complete */
+static void wait_shader(void)
+{
+	GLsync sync = fence_shader();
+
+	/* a large frame on a software renderer can take a while */
+	while (glClientWaitSync(sync, GL_SYNC_FLUSH_COMMANDS_BIT,
+				100*1000*1000 /* 100mS */) == GL_TIMEOUT_EXPIRED)
+		;
+	glDeleteSync(sync);
+}
+
+/*
+ * Upload the frame and dispatch the shader on it, without waiting for it
+ * to complete, see fence_shader() and run_shader().
+ * The result stays in the bo_out buffer, see map_output().
+ * For the temporal denoise the output of the previous call stays on the
+ * GPU: bo_out and bo_prev are swapped, and the shader reads bo_prev.
+ * For the HDR merge data_in holds all the exposures one after another.
+ */
+int dispatch_shader(struct converter *conv, const struct frame_fmt *fmt,
+		    const struct debayer_opts *opts, const void *data_in)
+{
+	const struct tensor_fmt *t = &opts->tensor;
+	long data_in_size = input_frame_size(fmt);
+	long data_out_size = output_size(fmt, opts);
+	int temporal = opts->temporal.enabled && opts->output == OUTPUT_RGBA;
+	int history = temporal && conv->history_size == data_out_size;
+	int convert = convert_pass(fmt, opts);
+	int xtrans = fmt->cfa == CFA_XTRANS;
+	int lsize_x = xtrans ? XTRANS_LSIZE_X : LSIZE_X;
+	int lsize_y = xtrans ? XTRANS_LSIZE_Y : LSIZE_Y;
+	struct tile_map *tiles = &conv->tiles;
+	int keep = 0;
+	int i;
+	int fr_x, fr_y;
+	GLenum err;
+
+	if (fmt->stride % 4) {
+		printf("the stride must be multiple of 4 (%d)\n", fmt->stride);
+		return -1;
+	}
+	if (configure_shader(conv, fmt, opts) != 0) {
+		printf("use_shader() failed \n");
+		return -1;
+	}
+	/* the output of the unchanged tiles stays in bo_out */
+	if (opts->incremental) {
+		if (tile_map_update(tiles, fmt, opts, data_in, lsize_x,
+				    lsize_y) != 0) {
+			printf("incremental mode: out of memory\n");
+			return -1;
+		}
+		keep = tiles->count < tiles->tiles_x * tiles->tiles_y;
+	}
+	tiles->valid = 0;
+
+	conv->history_size = 0;
+	if (temporal) {
+		GLuint prev = conv->bos[bo_out];
+
+		conv->bos[bo_out] = conv->bos[bo_prev];
+		conv->bos[bo_prev] = prev;
+		if (!history) {
+			/* not read (zero weight), but must be there */
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, prev);
+			glBufferData(GL_SHADER_STORAGE_BUFFER,
+				     (GLsizei)data_out_size, NULL,
+				     GL_STREAM_READ);
+		}
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, prev);
+	}
+
+	/* each HDR exposure goes to its own buffer */
+	for (i = 0; i < (opts->hdr.enabled ? opts->hdr.frames : 1); i++) {
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, conv->bos[bo_in + i]);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizei)data_in_size,
+			     (const uint8_t *)data_in + i * data_in_size,
+			     GL_STREAM_DRAW);
+		err = glGetError();
+		if (err != GL_NO_ERROR) {
+			printf("glBufferData(in, size=%ld) error 0x%04X\n",
+			       data_in_size, err);
+			return -1;
+		}
+		if (i > 0)
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9 + i,
+					 conv->bos[bo_in + i]);
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, conv->bos[bo_out]);
+	if (!keep)
+		glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizei)data_out_size,
+			     NULL, GL_STREAM_READ);
+	err = glGetError();
+	if (err != GL_NO_ERROR) {
+		printf("glBufferData(out, size=%ld) error 0x%04X\n",
+		       data_out_size, err);
+		return -1;
+	}
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, conv->bos[bo_in]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, conv->bos[bo_out]);
+
+	if ((opts->dark.enabled && load_dark(conv, fmt, &opts->dark) != 0) ||
+	    (opts->tone.enabled && run_tone(conv, fmt, opts) != 0) ||
+	    (convert && run_convert(conv, fmt, opts) != 0) ||
+	    use_shader(conv->shader_program) != 0) {
+		printf("use_shader() failed \n");
+		return -1;
+	}
+	bayer_first_red(fmt->order, &fr_x, &fr_y);
+	glUniform2i(conv->u_size, fmt->width, fmt->height);
+	glUniform1i(conv->u_stride, convert ? (fmt->width + 3) / 4 * 4 :
+		    fmt->stride);
+	glUniform2i(conv->u_first_red, fr_x, fr_y);
+	if (!convert)
+		set_input_uniforms(conv->shader_program, fmt, opts);
+
+	if (opts->remap.enabled) {
+		const struct remap_fmt *r = &opts->remap;
+
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, conv->bos[bo_grid]);
+		glBufferData(GL_SHADER_STORAGE_BUFFER,
+			     sizeof(*r->grid) * 2 * r->grid_width * r->grid_height,
+			     r->grid, GL_STREAM_DRAW);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, conv->bos[bo_grid]);
+		glUniform1i(conv->u_grid_width, r->grid_width);
+	}
+	if (fmt->cfa == CFA_XTRANS) {
+		uint32_t table[XTRANS_TABLE];
+
+		xtrans_init(table);
+		glUniform4iv(glGetUniformLocation(conv->shader_program,
+						  "xtrans_table"),
+			     XTRANS_TABLE / 4, (const GLint *)table);
+	}
+	if (opts->denoise.enabled)
+		glUniform3i(conv->u_dn_strength, opts->denoise.strength[0],
+			    opts->denoise.strength[1],
+			    opts->denoise.strength[2]);
+	if (opts->post.enabled)
+		glUniform2i(conv->u_pf_params, opts->post.sharpen,
+			    opts->post.chroma_median);
+	if (temporal)
+		glUniform2i(conv->u_tn_params,
+			    history ? opts->temporal.strength : 0,
+			    opts->temporal.threshold);
+
+	if (opts->output == OUTPUT_TENSOR) {
+		/* CHW: one invocation per word of a plane, HWC: per word */
+		long words = (long)t->width * t->height *
+			     tensor_elem_size(t) / 4;
+		long groups;
+
+		if (t->layout == TENSOR_HWC)
+			words *= 3;
+		groups = (words + LSIZE_X * LSIZE_Y - 1) / (LSIZE_X * LSIZE_Y);
+
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, conv->bos[bo_lut]);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(t->lut), t->lut,
+			     GL_STREAM_DRAW);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, conv->bos[bo_lut]);
+		glUniform2i(conv->u_tensor_size, t->width, t->height);
+		glUniform1i(conv->u_tensor_words, words);
+
+		/* the number of workgroups by X is limited to 65535 */
+		glDispatchCompute(groups < 1024 ? groups : 1024,
+				  (groups + 1023) / 1024, 1);
+	} else if (opts->output == OUTPUT_GRAY) {
+		/* one invocation per word of 4 output pixels */
+		long words = (long)fmt->width * fmt->height / 4;
+		long groups = (words + LSIZE_X * LSIZE_Y - 1) /
+			      (LSIZE_X * LSIZE_Y);
+
+		glUniform1i(glGetUniformLocation(conv->shader_program,
+						 "gray_words"), words);
+		glDispatchCompute(groups < 1024 ? groups : 1024,
+				  (groups + 1023) / 1024, 1);
+	} else if (output_yuv(opts->output)) {
+		/* one invocation per 8x2 output block */
+		long blocks = (long)fmt->width * fmt->height / 16;
+		long groups = (blocks + LSIZE_X * LSIZE_Y - 1) /
+			      (LSIZE_X * LSIZE_Y);
+
+		glUniform1i(glGetUniformLocation(conv->shader_program,
+						 "yuv_blocks"), blocks);
+		glDispatchCompute(groups < 1024 ? groups : 1024,
+				  (groups + 1023) / 1024, 1);
+	} else if (opts->remap.enabled) {
+		/* one invocation per output pixel */
+		int out_w, out_h;
+
+		orient_size(fmt, opts->orient, &out_w, &out_h);
+		glDispatchCompute((out_w + LSIZE_X - 1) / LSIZE_X,
+				  (out_h + LSIZE_Y - 1) / LSIZE_Y, 1);
+	} else if (fmt->cfa == CFA_MONO && !opts->post.enabled) {
+		/* one invocation per input word, see MONO_DIRECT */
+		glDispatchCompute(((fmt->width + 3) / 4 + LSIZE_X - 1) / LSIZE_X,
+				  (fmt->height + LSIZE_Y - 1) / LSIZE_Y, 1);
+	} else if (opts->incremental) {
+		/*
+		 * A workgroup per tile of the list, see TILE_LIST. The rows
+		 * of 1024 workgroups are filled up with the last tile again.
+		 */
+		long groups = tiles->count;
+		long rows = (groups + 1023) / 1024;
+		long n = groups > 1024 ? rows * 1024 : groups;
+
+		for (i = groups; i < n; i++)
+			tiles->list[i] = tiles->list[groups - 1];
+		if (groups) {
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER,
+				     conv->bos[bo_tiles]);
+			glBufferData(GL_SHADER_STORAGE_BUFFER,
+				     sizeof(*tiles->list) * n, tiles->list,
+				     GL_STREAM_DRAW);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13,
+					 conv->bos[bo_tiles]);
+			glDispatchCompute(groups < 1024 ? groups : 1024, rows,
+					  1);
+		}
+	} else {
+		/* the last workgroups in a row or column can be partially used */
+		glDispatchCompute((fmt->width + lsize_x - 1) / lsize_x,
+				  (fmt->height + lsize_y - 1) / lsize_y, 1);
+	}
+	err = glGetError();
+	if (err != GL_NO_ERROR) {
+		printf("glDispatchCompute() error 0x%04X\n", err);
+		return -1;
+	}
+	if (fmt->cfa == CFA_RGBIR && run_ir(conv, fmt, opts, data_out_size))
+		return -1;
+
+	if (temporal)
+		conv->history_size = data_out_size;
+	tiles->valid = opts->incremental;
+	return 0;
+}
+
+/* dispatch_shader() and the wait for the shader to complete */
+int run_shader(struct converter *conv, const struct frame_fmt *fmt,
+	       const struct debayer_opts *opts, const void *data_in)
+{
+	if (dispatch_shader(conv, fmt, opts, data_in) != 0)
+		return -1;
+	wait_shader();
+	return 0;
+}
+
+/*
+ * All the frames of the atlas in one dispatch, a workgroup per tile of
+ * each frame (see ATLAS): the input frames are uploaded in one buffer
+ * with the table of them, the outputs stay in the bo_out buffer.
+ */
+int run_atlas(struct converter *conv, struct atlas *a,
+	      const struct debayer_opts *opts)
+{
+	long rows;
+	GLenum err;
+
+	if (configure_shader(conv, &a->frames[0].fmt, opts) != 0 ||
+	    atlas_table(a, LSIZE_X, LSIZE_Y) != 0) {
+		printf("use_shader() failed \n");
+		return -1;
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, conv->bos[bo_in]);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizei)a->in_size, a->in,
+		     GL_STREAM_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, conv->bos[bo_out]);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizei)a->out_size, NULL,
+		     GL_STREAM_READ);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, conv->bos[bo_atlas]);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(*a->table) * a->count,
+		     a->table, GL_STREAM_DRAW);
+	err = glGetError();
+	if (err != GL_NO_ERROR) {
+		printf("glBufferData(atlas, size=%ld) error 0x%04X\n",
+		       a->in_size + a->out_size, err);
+		return -1;
+	}
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, conv->bos[bo_in]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, conv->bos[bo_out]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, conv->bos[bo_atlas]);
+
+	if (use_shader(conv->shader_program) != 0) {
+		printf("use_shader() failed \n");
+		return -1;
+	}
+	glUniform1i(glGetUniformLocation(conv->shader_program,
+					 "atlas_frames"), a->count);
+	glUniform1i(glGetUniformLocation(conv->shader_program,
+					 "atlas_groups"), a->groups);
+	if (opts->denoise.enabled)
+		glUniform3i(conv->u_dn_strength, opts->denoise.strength[0],
+			    opts->denoise.strength[1],
+			    opts->denoise.strength[2]);
+	if (opts->post.enabled)
+		glUniform2i(conv->u_pf_params, opts->post.sharpen,
+			    opts->post.chroma_median);
+
+	/* the number of workgroups by X is limited to 65535 */
+	rows = (a->groups + 1023) / 1024;
+	glDispatchCompute(a->groups < 1024 ? a->groups : 1024, rows, 1);
+	err = glGetError();
+	if (err != GL_NO_ERROR) {
+		printf("glDispatchCompute() error 0x%04X\n", err);
+		return -1;
+	}
+	wait_shader();
+	return 0;
+}
+
+const uint32_t *map_output(struct converter *conv, long data_out_size)
+{
+	void *data;
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, conv->bos[bo_out]);
+	data = glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, data_out_size,
+				GL_MAP_READ_BIT);
+	if (data == NULL)
+		printf("glMapBufferRange(out) error 0x%04X\n",
+		       glGetError());
+	return data;
+}
+
+void unmap_output(struct converter *conv)
+{
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, conv->bos[bo_out]);
+	glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+}
@@ -0,0 +1,110 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * The GL engine: the compute shader in a window-less EGL + GLES 3.1
+ * context, for the demo application and the GStreamer element.
+ *
+ * Copyright (C) 2021, Linaro
+ */
+
+#ifndef GL_H
+#define GL_H
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES3/gl32.h>
+#include <gbm.h>
+
+#include "debayer.h"
+
+#define RENDER_NODE_FNAME "/dev/dri/renderD128"
+
+enum {
+	bo_in,
+	bo_in1,		/* the following HDR exposures */
+	bo_in2,
+	bo_in3,
+	bo_out,
+	bo_lut,
+	bo_grid,
+	bo_prev,	/* the previous output, swapped with bo_out */
+	bo_tone_lut,
+	bo_tone_hist,
+	bo_tone_grid,
+	bo_conv,	/* the 8-bit frame of the gathering modes */
+	bo_dark,
+	bo_dark_columns,
+	bo_tiles,	/* the tiles to demosaic, see tile_map_update() */
+	bo_atlas,	/* the table of the atlas frames, see atlas_table() */
+	bo_num
+};
+
+/* the programs run before the main one, see debayer.comp */
+enum {
+	pass_tone_curve,
+	pass_tone_stats,
+	pass_convert,
+	pass_ir,
+	pass_num
+};
+
+struct converter {
+	/* EGL realted stuff */
+	int fd;		/* render node fd */
+	struct gbm_device *gbm;
+	EGLDisplay egl_dpy;
+	EGLContext core_ctx;
+
+	/* buffers related stuff */
+	GLuint bos[bo_num];
+	uint8_t * p_in;
+	const uint8_t * p_out;
+
+	/* shader */
+	GLuint shader_program;
+	GLuint compute_shader;
+	const char * shader_fname;
+	char shader_defines[1024];	/* see configure_shader() */
+	GLuint pass_programs[pass_num];
+	GLint u_size;
+	GLint u_stride;
+	GLint u_first_red;
+	GLint u_tensor_size;
+	GLint u_tensor_words;
+	GLint u_grid_width;
+	GLint u_dn_strength;
+	GLint u_tn_params;
+	GLint u_pf_params;
+	int tone_bits;		/* of the histogram in bo_tone_hist, 0 - none */
+	/* the calibration data in bo_dark and bo_dark_columns, see load_dark() */
+	const uint8_t *dark_frame;
+	const int32_t *dark_columns;
+	long history_size;	/* of the output in bo_prev, 0 for none */
+	struct tile_map tiles;	/* of the output in bo_out, incremental mode */
+};
+
+long read_input_file(const char *fname, char **data, const char *type);
+long read_input_bin_file(const char *fname, char **data);
+long read_input_text_file(const char *fname, char **data);
+
+int init_egl(struct converter *conv, const char *render_node);
+void deinit_egl(struct converter *conv);
+int init_shader(struct converter *conv, const char *defines, GLuint *program);
+int use_shader(GLuint shader_program);
+void free_shader(struct converter *conv);
+int input_defines(const struct frame_fmt *fmt,
+		  const struct debayer_opts *opts, char *buf, size_t len);
+void build_defines(const struct frame_fmt *fmt,
+		   const struct debayer_opts *opts, char *buf, size_t len);
+int configure_shader(struct converter *conv, const struct frame_fmt *fmt,
+		     const struct debayer_opts *opts);
+int dispatch_shader(struct converter *conv, const struct frame_fmt *fmt,
+		    const struct debayer_opts *opts, const void *data_in);
+GLsync fence_shader(void);
+int run_shader(struct converter *conv, const struct frame_fmt *fmt,
+	       const struct debayer_opts *opts, const void *data_in);
+int run_atlas(struct converter *conv, struct atlas *a,
+	      const struct debayer_opts *opts);
+const uint32_t *map_output(struct converter *conv, long data_out_size);
+void unmap_output(struct converter *conv);
+
+#endif /* GL_H */
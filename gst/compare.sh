@@ -0,0 +1,66 @@
+#!/bin/sh
+# SPDX-License-Identifier: LGPL-3.0
+#
+# Runs debayerssbo against bayer2rgb of gst-plugins-bad on the same
+# videotestsrc ! rgb2bayer stream (make gst-check):
+#  - the frames of the gl engine must be the ones of cpu-ref,
+#  - the time of the frames of each converter is printed.
+#
+#   gst/compare.sh [<width>x<height>] [<frames>]
+#
+# Copyright (C) 2021, Linaro
+
+set -e
+
+size=${1:-1920x1080}
+frames=${2:-300}
+width=${size%x*}
+height=${size#*x}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+export GST_PLUGIN_PATH="$(dirname "$0")/..${GST_PLUGIN_PATH:+:$GST_PLUGIN_PATH}"
+
+if ! gst-inspect-1.0 debayerssbo >/dev/null 2>&1; then
+	echo "debayerssbo not found, run make gst first"
+	exit 1
+fi
+
+# the bayer frames of the test pattern, moving to change every frame
+src="videotestsrc pattern=ball num-buffers=$frames !
+	video/x-raw,format=ARGB,width=$width,height=$height ! rgb2bayer !
+	video/x-bayer,format=rggb"
+
+now_ms()
+{
+	echo $(($(date +%s%N) / 1000000))
+}
+
+# run <name> <converter>: the time of the frames into fakesink
+run()
+{
+	start=$(now_ms)
+	gst-launch-1.0 -q $src ! $2 ! video/x-raw,format=ABGR ! \
+		fakesink sync=false
+	ms=$(($(now_ms) - start))
+	echo "$1: $frames frames of $size in $ms ms," \
+	     "$(echo "scale=2; $ms / $frames" | bc) ms/frame"
+}
+
+# the output of the engines, bit-identical
+for engine in gl cpu-ref; do
+	gst-launch-1.0 -q videotestsrc pattern=ball num-buffers=10 ! \
+		video/x-raw,format=ARGB,width=$width,height=$height ! \
+		rgb2bayer ! video/x-bayer,format=rggb ! \
+		debayerssbo engine=$engine ! video/x-raw,format=ABGR ! \
+		filesink location="$tmp/$engine.abgr"
+done
+if ! cmp -s "$tmp/gl.abgr" "$tmp/cpu-ref.abgr"; then
+	echo "debayerssbo: the gl and cpu-ref frames differ"
+	exit 1
+fi
+echo "debayerssbo: the gl and cpu-ref frames are the same"
+
+run "debayerssbo engine=gl" "debayerssbo engine=gl"
+run "debayerssbo engine=cpu" "debayerssbo engine=cpu"
+run "bayer2rgb" "bayer2rgb"
@@ -0,0 +1,511 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * debayerssbo: the GStreamer element of the converter, video/x-bayer in,
+ * ABGR or NV12 out, through the compute shader (or a CPU engine). The
+ * RGBA output of the engines is the 32-bit word R << 24 | G << 16 |
+ * B << 8 | 0xff, in memory the bytes A, B, G, R: the ABGR format.
+ *
+ *   gst-launch-1.0 videotestsrc ! video/x-raw,format=ARGB,width=1920,height=1080 !
+ *       rgb2bayer ! video/x-bayer,format=bggr ! debayerssbo ! fakesink
+ *
+ * The converter lives as long as the element runs: the EGL context, the
+ * shader program (rebuilt when the caps change) and the storage buffers
+ * are kept from a frame to the next. The context is made current on the
+ * streaming thread for each frame and released after it, so that stop()
+ * can free it from another thread.
+ *
+ * The element is not zero-copy: each frame costs an upload of the input
+ * and a copy of the output. The input buffer is mapped and uploaded into
+ * the storage buffer, a dma-buf from upstream as well (GLES 3.1 has no way
+ * to bind it as a storage buffer). The output is copied from the mapped
+ * output buffer into the buffer from the downstream pool, plane by plane
+ * with its strides. Upstream is offered a pool of the input frames.
+ *
+ * Copyright (C) 2021, Linaro
+ */
+
+#include <string.h>
+
+#include <gst/base/gstbasetransform.h>
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+#include "../gl.h"
+
+#define DEFAULT_ENGINE "gl"
+#ifndef DEBAYER_SHADER
+#define DEBAYER_SHADER "./debayer.comp"
+#endif
+
+GST_DEBUG_CATEGORY_STATIC(gst_debayer_ssbo_debug);
+#define GST_CAT_DEFAULT gst_debayer_ssbo_debug
+
+#define GST_TYPE_DEBAYER_SSBO (gst_debayer_ssbo_get_type())
+G_DECLARE_FINAL_TYPE(GstDebayerSsbo, gst_debayer_ssbo, GST, DEBAYER_SSBO,
+		     GstBaseTransform)
+
+struct _GstDebayerSsbo {
+	GstBaseTransform parent;
+
+	gchar *engine;		/* gl, cpu or cpu-ref */
+	gchar *shader;
+	const struct cpu_engine *cpu;	/* NULL for gl */
+
+	struct converter conv;
+	gboolean gl_ready;	/* conv has the context and the buffers */
+
+	struct frame_fmt fmt;
+	struct debayer_opts opts;
+	GstVideoInfo out_info;
+	long in_size, out_size;
+	guint8 *cpu_out;	/* the output of the CPU engines */
+};
+
+enum {
+	PROP_0,
+	PROP_ENGINE,
+	PROP_SHADER,
+};
+
+G_DEFINE_TYPE(GstDebayerSsbo, gst_debayer_ssbo, GST_TYPE_BASE_TRANSFORM);
+
+static GstStaticPadTemplate sink_template =
+	GST_STATIC_PAD_TEMPLATE("sink", GST_PAD_SINK, GST_PAD_ALWAYS,
+		GST_STATIC_CAPS("video/x-bayer, "
+				"format = (string) { bggr, rggb, grbg, gbrg }, "
+				"width = (int) [ 1, MAX ], "
+				"height = (int) [ 1, MAX ], "
+				"framerate = (fraction) [ 0, MAX ]"));
+
+static GstStaticPadTemplate src_template =
+	GST_STATIC_PAD_TEMPLATE("src", GST_PAD_SRC, GST_PAD_ALWAYS,
+		GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE("{ ABGR, NV12 }")));
+
+static const char * const bayer_formats[] = {
+	[BAYER_RGGB] = "rggb",
+	[BAYER_GRBG] = "grbg",
+	[BAYER_GBRG] = "gbrg",
+	[BAYER_BGGR] = "bggr",
+};
+
+/* the frame format of the video/x-bayer caps, the rows are 4 bytes aligned */
+static gboolean bayer_caps_fmt(GstCaps *caps, struct frame_fmt *fmt)
+{
+	GstStructure *s = gst_caps_get_structure(caps, 0);
+	const gchar *format = gst_structure_get_string(s, "format");
+	guint i;
+
+	memset(fmt, 0, sizeof(*fmt));
+	if (format == NULL ||
+	    !gst_structure_get_int(s, "width", &fmt->width) ||
+	    !gst_structure_get_int(s, "height", &fmt->height))
+		return FALSE;
+	for (i = 0; i < G_N_ELEMENTS(bayer_formats); i++)
+		if (!strcmp(format, bayer_formats[i]))
+			break;
+	if (i == G_N_ELEMENTS(bayer_formats))
+		return FALSE;
+	fmt->order = i;
+	fmt->stride = GST_ROUND_UP_4(fmt->width);
+	fmt->bits = 8;
+	fmt->cfa = CFA_BAYER;
+	return TRUE;
+}
+
+/* the same frame of the other media type, any format of the other pad */
+static GstCaps *gst_debayer_ssbo_transform_caps(GstBaseTransform *trans,
+						GstPadDirection direction,
+						GstCaps *caps,
+						GstCaps *filter)
+{
+	GstPad *other = direction == GST_PAD_SINK ? trans->srcpad :
+						    trans->sinkpad;
+	GstCaps *tmpl, *res, *tmp;
+	guint i;
+
+	res = gst_caps_copy(caps);
+	for (i = 0; i < gst_caps_get_size(res); i++) {
+		GstStructure *s = gst_caps_get_structure(res, i);
+
+		gst_structure_set_name(s, direction == GST_PAD_SINK ?
+				       "video/x-raw" : "video/x-bayer");
+		gst_structure_remove_fields(s, "format", "colorimetry",
+					    "chroma-site", NULL);
+	}
+	tmpl = gst_pad_get_pad_template_caps(other);
+	tmp = gst_caps_intersect(res, tmpl);
+	gst_caps_unref(tmpl);
+	gst_caps_unref(res);
+	res = tmp;
+
+	if (filter) {
+		tmp = gst_caps_intersect_full(filter, res,
+					      GST_CAPS_INTERSECT_FIRST);
+		gst_caps_unref(res);
+		res = tmp;
+	}
+	return res;
+}
+
+static gboolean gst_debayer_ssbo_get_unit_size(GstBaseTransform *trans,
+					       GstCaps *caps, gsize *size)
+{
+	struct frame_fmt fmt;
+	GstVideoInfo info;
+
+	if (bayer_caps_fmt(caps, &fmt)) {
+		*size = input_frame_size(&fmt);
+		return TRUE;
+	}
+	if (!gst_video_info_from_caps(&info, caps))
+		return FALSE;
+	*size = GST_VIDEO_INFO_SIZE(&info);
+	return TRUE;
+}
+
+static gboolean gst_debayer_ssbo_set_caps(GstBaseTransform *trans,
+					  GstCaps *incaps, GstCaps *outcaps)
+{
+	GstDebayerSsbo *self = GST_DEBAYER_SSBO(trans);
+
+	if (!bayer_caps_fmt(incaps, &self->fmt) ||
+	    !gst_video_info_from_caps(&self->out_info, outcaps))
+		return FALSE;
+
+	memset(&self->opts, 0, sizeof(self->opts));
+	if (GST_VIDEO_INFO_FORMAT(&self->out_info) == GST_VIDEO_FORMAT_NV12) {
+		/* the shader writes 8x2 blocks */
+		if (self->fmt.width % 8 || self->fmt.height % 2) {
+			GST_ERROR_OBJECT(self, "NV12 needs the size in 8x2 blocks");
+			return FALSE;
+		}
+		self->opts.output = OUTPUT_NV12;
+	} else {
+		/* ABGR, see the top */
+		self->opts.output = OUTPUT_RGBA;
+	}
+	self->in_size = input_frame_size(&self->fmt);
+	self->out_size = output_size(&self->fmt, &self->opts);
+
+	g_free(self->cpu_out);
+	self->cpu_out = self->cpu ? g_malloc(self->out_size) : NULL;
+	GST_INFO_OBJECT(self, "%dx%d %s to %s on %s", self->fmt.width,
+			self->fmt.height, bayer_formats[self->fmt.order],
+			GST_VIDEO_INFO_NAME(&self->out_info), self->engine);
+	return TRUE;
+}
+
+/* a pool of the input frames for upstream */
+static gboolean gst_debayer_ssbo_propose_allocation(GstBaseTransform *trans,
+						    GstQuery *decide_query,
+						    GstQuery *query)
+{
+	struct frame_fmt fmt;
+	GstBufferPool *pool;
+	GstStructure *config;
+	gboolean need_pool;
+	GstCaps *caps;
+
+	gst_query_parse_allocation(query, &caps, &need_pool);
+	if (caps == NULL || !bayer_caps_fmt(caps, &fmt))
+		return FALSE;
+	if (need_pool) {
+		pool = gst_buffer_pool_new();
+		config = gst_buffer_pool_get_config(pool);
+		gst_buffer_pool_config_set_params(config, caps,
+						  input_frame_size(&fmt), 2, 0);
+		if (!gst_buffer_pool_set_config(pool, config)) {
+			gst_object_unref(pool);
+			return FALSE;
+		}
+		gst_query_add_allocation_pool(query, pool,
+					      input_frame_size(&fmt), 2, 0);
+		gst_object_unref(pool);
+	}
+	return TRUE;
+}
+
+/* the output buffers from the downstream pool, or from a video pool */
+static gboolean gst_debayer_ssbo_decide_allocation(GstBaseTransform *trans,
+						   GstQuery *query)
+{
+	GstDebayerSsbo *self = GST_DEBAYER_SSBO(trans);
+	GstBufferPool *pool = NULL;
+	guint size = 0, min = 0, max = 0;
+	GstStructure *config;
+	gboolean update;
+	GstCaps *caps;
+
+	gst_query_parse_allocation(query, &caps, NULL);
+	update = gst_query_get_n_allocation_pools(query) > 0;
+	if (update)
+		gst_query_parse_nth_allocation_pool(query, 0, &pool, &size,
+						    &min, &max);
+	if (pool == NULL)
+		pool = gst_video_buffer_pool_new();
+	size = MAX(size, GST_VIDEO_INFO_SIZE(&self->out_info));
+
+	config = gst_buffer_pool_get_config(pool);
+	gst_buffer_pool_config_set_params(config, caps, size, min, max);
+	if (gst_query_find_allocation_meta(query, GST_VIDEO_META_API_TYPE,
+					   NULL))
+		gst_buffer_pool_config_add_option(config,
+					GST_BUFFER_POOL_OPTION_VIDEO_META);
+	gst_buffer_pool_set_config(pool, config);
+
+	if (update)
+		gst_query_set_nth_allocation_pool(query, 0, pool, size, min,
+						  max);
+	else
+		gst_query_add_allocation_pool(query, pool, size, min, max);
+	gst_object_unref(pool);
+
+	return GST_BASE_TRANSFORM_CLASS(gst_debayer_ssbo_parent_class)->
+		decide_allocation(trans, query);
+}
+
+/* the output of the engine into the frame, row by row for its strides */
+static void copy_output(GstDebayerSsbo *self, const guint8 *data,
+			GstVideoFrame *frame)
+{
+	guint p;
+	gint y;
+
+	for (p = 0; p < GST_VIDEO_FRAME_N_PLANES(frame); p++) {
+		guint8 *dst = GST_VIDEO_FRAME_PLANE_DATA(frame, p);
+		gint stride = GST_VIDEO_FRAME_PLANE_STRIDE(frame, p);
+		gint width = GST_VIDEO_FRAME_COMP_WIDTH(frame, p) *
+			     GST_VIDEO_FRAME_COMP_PSTRIDE(frame, p);
+		gint height = GST_VIDEO_FRAME_COMP_HEIGHT(frame, p);
+
+		for (y = 0; y < height; y++)
+			memcpy(dst + (gsize)y * stride, data + (gsize)y * width,
+			       width);
+		data += (gsize)width * height;
+	}
+}
+
+/* the context on this thread, created with the buffers on the first frame */
+static gboolean gl_acquire(GstDebayerSsbo *self)
+{
+	struct converter *conv = &self->conv;
+
+	if (self->gl_ready)
+		return eglMakeCurrent(conv->egl_dpy, EGL_NO_SURFACE,
+				      EGL_NO_SURFACE, conv->core_ctx);
+
+	memset(conv, 0, sizeof(*conv));
+	conv->shader_fname = self->shader;
+	if (init_egl(conv, RENDER_NODE_FNAME) != 0)
+		return FALSE;
+	glGenBuffers(bo_num, conv->bos);
+	self->gl_ready = TRUE;
+	return TRUE;
+}
+
+static void gl_release(GstDebayerSsbo *self)
+{
+	eglMakeCurrent(self->conv.egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
+		       EGL_NO_CONTEXT);
+}
+
+static GstFlowReturn gst_debayer_ssbo_transform(GstBaseTransform *trans,
+						GstBuffer *inbuf,
+						GstBuffer *outbuf)
+{
+	GstDebayerSsbo *self = GST_DEBAYER_SSBO(trans);
+	GstFlowReturn ret = GST_FLOW_ERROR;
+	const guint8 *data;
+	GstVideoFrame frame;
+	GstMapInfo in;
+
+	/* a dma-buf is mapped as well, see the top */
+	if (!gst_buffer_map(inbuf, &in, GST_MAP_READ))
+		return GST_FLOW_ERROR;
+	if ((long)in.size < self->in_size) {
+		GST_ERROR_OBJECT(self, "the input buffer is too short");
+		gst_buffer_unmap(inbuf, &in);
+		return GST_FLOW_ERROR;
+	}
+	if (!gst_video_frame_map(&frame, &self->out_info, outbuf,
+				 GST_MAP_WRITE)) {
+		gst_buffer_unmap(inbuf, &in);
+		return GST_FLOW_ERROR;
+	}
+
+	if (self->cpu) {
+		self->cpu->process(&self->fmt, &self->opts, in.data,
+				   self->cpu_out);
+		copy_output(self, self->cpu_out, &frame);
+		ret = GST_FLOW_OK;
+		goto unmap;
+	}
+
+	if (!gl_acquire(self)) {
+		GST_ELEMENT_ERROR(self, RESOURCE, FAILED,
+				  ("GL engine is not available"), (NULL));
+		goto unmap;
+	}
+	if (run_shader(&self->conv, &self->fmt, &self->opts, in.data) != 0) {
+		GST_ELEMENT_ERROR(self, STREAM, FAILED,
+				  ("the shader failed"), (NULL));
+		goto release;
+	}
+	data = (const guint8 *)map_output(&self->conv, self->out_size);
+	if (data) {
+		copy_output(self, data, &frame);
+		unmap_output(&self->conv);
+		ret = GST_FLOW_OK;
+	}
+
+release:
+	gl_release(self);
+unmap:
+	gst_video_frame_unmap(&frame);
+	gst_buffer_unmap(inbuf, &in);
+	return ret;
+}
+
+static gboolean gst_debayer_ssbo_start(GstBaseTransform *trans)
+{
+	GstDebayerSsbo *self = GST_DEBAYER_SSBO(trans);
+
+	self->cpu = NULL;
+	if (strcmp(self->engine, "gl")) {
+		self->cpu = cpu_engine_find(self->engine);
+		if (self->cpu == NULL) {
+			GST_ELEMENT_ERROR(self, RESOURCE, SETTINGS,
+					  ("unknown engine \"%s\"",
+					   self->engine), (NULL));
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static gboolean gst_debayer_ssbo_stop(GstBaseTransform *trans)
+{
+	GstDebayerSsbo *self = GST_DEBAYER_SSBO(trans);
+	struct converter *conv = &self->conv;
+
+	if (self->gl_ready && gl_acquire(self)) {
+		glDeleteBuffers(bo_num, conv->bos);
+		if (conv->shader_program)
+			free_shader(conv);
+		tile_map_free(&conv->tiles);
+		gl_release(self);
+		deinit_egl(conv);
+	}
+	self->gl_ready = FALSE;
+	g_free(self->cpu_out);
+	self->cpu_out = NULL;
+	return TRUE;
+}
+
+static void gst_debayer_ssbo_set_property(GObject *object, guint prop_id,
+					  const GValue *value,
+					  GParamSpec *pspec)
+{
+	GstDebayerSsbo *self = GST_DEBAYER_SSBO(object);
+
+	switch (prop_id) {
+	case PROP_ENGINE:
+		g_free(self->engine);
+		self->engine = g_value_dup_string(value);
+		break;
+	case PROP_SHADER:
+		g_free(self->shader);
+		self->shader = g_value_dup_string(value);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+		break;
+	}
+}
+
+static void gst_debayer_ssbo_get_property(GObject *object, guint prop_id,
+					  GValue *value, GParamSpec *pspec)
+{
+	GstDebayerSsbo *self = GST_DEBAYER_SSBO(object);
+
+	switch (prop_id) {
+	case PROP_ENGINE:
+		g_value_set_string(value, self->engine);
+		break;
+	case PROP_SHADER:
+		g_value_set_string(value, self->shader);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+		break;
+	}
+}
+
+static void gst_debayer_ssbo_finalize(GObject *object)
+{
+	GstDebayerSsbo *self = GST_DEBAYER_SSBO(object);
+
+	g_free(self->engine);
+	g_free(self->shader);
+	G_OBJECT_CLASS(gst_debayer_ssbo_parent_class)->finalize(object);
+}
+
+static void gst_debayer_ssbo_class_init(GstDebayerSsboClass *klass)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+	GstElementClass *element_class = GST_ELEMENT_CLASS(klass);
+	GstBaseTransformClass *trans_class = GST_BASE_TRANSFORM_CLASS(klass);
+
+	gobject_class->set_property = gst_debayer_ssbo_set_property;
+	gobject_class->get_property = gst_debayer_ssbo_get_property;
+	gobject_class->finalize = gst_debayer_ssbo_finalize;
+
+	g_object_class_install_property(gobject_class, PROP_ENGINE,
+		g_param_spec_string("engine", "Engine",
+				    "gl, cpu or cpu-ref", DEFAULT_ENGINE,
+				    G_PARAM_READWRITE |
+				    G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property(gobject_class, PROP_SHADER,
+		g_param_spec_string("shader", "Shader",
+				    "The file of the compute shader",
+				    DEBAYER_SHADER, G_PARAM_READWRITE |
+				    G_PARAM_STATIC_STRINGS));
+
+	gst_element_class_add_static_pad_template(element_class,
+						  &sink_template);
+	gst_element_class_add_static_pad_template(element_class,
+						  &src_template);
+	gst_element_class_set_static_metadata(element_class,
+		"Bayer to ABGR/NV12 on the GPU", "Filter/Converter/Video",
+		"Demosaics the raw Bayer frames with a compute shader",
+		"Linaro");
+
+	trans_class->transform_caps = gst_debayer_ssbo_transform_caps;
+	trans_class->get_unit_size = gst_debayer_ssbo_get_unit_size;
+	trans_class->set_caps = gst_debayer_ssbo_set_caps;
+	trans_class->propose_allocation = gst_debayer_ssbo_propose_allocation;
+	trans_class->decide_allocation = gst_debayer_ssbo_decide_allocation;
+	trans_class->transform = gst_debayer_ssbo_transform;
+	trans_class->start = gst_debayer_ssbo_start;
+	trans_class->stop = gst_debayer_ssbo_stop;
+	trans_class->passthrough_on_same_caps = FALSE;
+}
+
+static void gst_debayer_ssbo_init(GstDebayerSsbo *self)
+{
+	self->engine = g_strdup(DEFAULT_ENGINE);
+	self->shader = g_strdup(DEBAYER_SHADER);
+}
+
+static gboolean plugin_init(GstPlugin *plugin)
+{
+	GST_DEBUG_CATEGORY_INIT(gst_debayer_ssbo_debug, "debayerssbo", 0,
+				"debayerssbo");
+	return gst_element_register(plugin, "debayerssbo", GST_RANK_NONE,
+				    GST_TYPE_DEBAYER_SSBO);
+}
+
+GST_PLUGIN_DEFINE(GST_VERSION_MAJOR, GST_VERSION_MINOR, debayerssbo,
+		  "Bayer demosaicing with a compute shader", plugin_init,
+		  "1.0", "LGPL", "debayer-ssbo-demo",
+		  "https://github.com/Linaro")
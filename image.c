@@ -0,0 +1,447 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * JPEG and PNG files of the RGBA or gray output: the image is encoded in
+ * horizontal bands on all the CPUs, straight from the output buffer, and
+ * the bands are joined into one stream - at the restart markers for JPEG,
+ * at the flush points of deflate for PNG.
+ *
+ * Copyright (C) 2021, Linaro
+ */
+
+#define _POSIX_C_SOURCE 200809L	/* strcasecmp() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <jpeglib.h>
+#include <zlib.h>
+
+#include "debayer.h"
+
+/* the bands per thread, for the load balance */
+#define IMAGE_BANDS_PER_THREAD 4
+/* the maximum JPEG restart interval in MCUs */
+#define JPEG_MAX_RESTART 65535
+/* of the YCbCr 4:2:0 MCU, 8 for gray */
+#define JPEG_MCU_SIZE 16
+#define PNG_ZLIB_HEADER "\x78\x9c"
+
+struct image {
+	const uint8_t *data;	/* RGBA words, or gray bytes */
+	int width, height;
+	int gray;
+	int quality;		/* of JPEG */
+	int band_h;		/* rows per band, the last one can be less */
+	int bands;
+	unsigned char **out;	/* the encoded bands */
+	unsigned long *size;
+	unsigned long *adler;	/* PNG: of the filtered rows of the band */
+	unsigned long *raw_size;
+};
+
+static int image_channels(const struct image *im)
+{
+	return im->gray ? 1 : 3;
+}
+
+/* the band height, a multiple of the unit, for the threads */
+static void image_bands(struct image *im, int unit, int max_rows)
+{
+	int bands = parallel_threads() * IMAGE_BANDS_PER_THREAD;
+
+	im->band_h = (im->height + bands - 1) / bands;
+	im->band_h = (im->band_h + unit - 1) / unit * unit;
+	if (max_rows < unit)
+		max_rows = unit;
+	if (im->band_h > max_rows)
+		im->band_h = max_rows / unit * unit;
+	im->bands = (im->height + im->band_h - 1) / im->band_h;
+}
+
+static int image_alloc(struct image *im)
+{
+	im->out = calloc(im->bands, sizeof(*im->out));
+	im->size = calloc(im->bands, sizeof(*im->size));
+	im->adler = calloc(im->bands, sizeof(*im->adler));
+	im->raw_size = calloc(im->bands, sizeof(*im->raw_size));
+	return im->out && im->size && im->adler && im->raw_size ? 0 : -1;
+}
+
+static void image_free(struct image *im)
+{
+	int i;
+
+	for (i = 0; im->out && i < im->bands; i++)
+		free(im->out[i]);
+	free(im->out);
+	free(im->size);
+	free(im->adler);
+	free(im->raw_size);
+}
+
+/*
+ * A band as a JPEG image of its own: the tables are the default ones for
+ * the quality, the same in all the bands.
+ */
+static void jpeg_band(void *arg, int i)
+{
+	struct image *im = arg;
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	int y0 = i * im->band_h;
+	int bpp = im->gray ? 1 : 4;
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	jpeg_mem_dest(&cinfo, &im->out[i], &im->size[i]);
+	cinfo.image_width = im->width;
+	cinfo.image_height = im->height - y0 < im->band_h ?
+			     im->height - y0 : im->band_h;
+	/* the RGBA word in memory is X, B, G, R */
+	cinfo.input_components = bpp;
+	cinfo.in_color_space = im->gray ? JCS_GRAYSCALE : JCS_EXT_XBGR;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, im->quality, TRUE);
+	cinfo.optimize_coding = FALSE;
+	jpeg_start_compress(&cinfo, TRUE);
+	while (cinfo.next_scanline < cinfo.image_height) {
+		JSAMPROW row = (JSAMPROW)(im->data +
+			((long)(y0 + cinfo.next_scanline) * im->width) * bpp);
+
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+}
+
+/*
+ * The offsets of the SOF marker and of the SOS one in the band, returns
+ * the offset of the entropy coded data after the SOS header, 0 if none
+ */
+static size_t jpeg_markers(const uint8_t *p, size_t size, size_t *sof,
+			   size_t *sos)
+{
+	size_t i = 2;
+
+	*sof = 0;
+	while (i + 4 <= size && p[i] == 0xff) {
+		size_t len = p[i + 2] << 8 | p[i + 3];
+
+		if (p[i + 1] == 0xc0)
+			*sof = i;
+		if (p[i + 1] == 0xda) {
+			*sos = i;
+			return *sof ? i + 2 + len : 0;
+		}
+		i += 2 + len;
+	}
+	return 0;
+}
+
+/*
+ * The headers of the first band with the full height and the restart
+ * interval of a band, then the entropy coded data of the bands, each
+ * after the next RSTn marker
+ */
+static int jpeg_join(const struct image *im, FILE *fp)
+{
+	int mcu = im->gray ? 8 : JPEG_MCU_SIZE;
+	int interval = (im->width + mcu - 1) / mcu * (im->band_h / mcu);
+	uint8_t dri[6] = { 0xff, 0xdd, 0x00, 0x04, interval >> 8, interval };
+	uint8_t height[2] = { im->height >> 8, im->height };
+	size_t sof, sos;
+	int i;
+
+	if (!jpeg_markers(im->out[0], im->size[0], &sof, &sos) ||
+	    fwrite(im->out[0], 1, sof + 5, fp) != sof + 5 ||
+	    fwrite(height, 1, 2, fp) != 2 ||
+	    fwrite(im->out[0] + sof + 7, 1, sos - sof - 7, fp) !=
+	    sos - sof - 7 ||
+	    (im->bands > 1 && fwrite(dri, 1, 6, fp) != 6))
+		return -1;
+
+	for (i = 0; i < im->bands; i++) {
+		const uint8_t *p = im->out[i];
+		uint8_t rst[2] = { 0xff, 0xd0 + (i - 1) % 8 };
+		size_t start = i ? jpeg_markers(p, im->size[i], &sof, &sos) :
+			       sos;
+
+		/* up to the EOI marker, the first band with its SOS */
+		if (!start || im->size[i] < start + 2 ||
+		    (i && fwrite(rst, 1, 2, fp) != 2) ||
+		    fwrite(p + start, 1, im->size[i] - 2 - start, fp) !=
+		    im->size[i] - 2 - start)
+			return -1;
+	}
+	return fputc(0xff, fp) == EOF || fputc(0xd9, fp) == EOF ? -1 : 0;
+}
+
+static inline int paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+	if (pa <= pb && pa <= pc)
+		return a;
+	return pb <= pc ? b : c;
+}
+
+/* the samples of the output row y, 0 above the image */
+static void png_row(const struct image *im, int y, uint8_t *row)
+{
+	const uint32_t *rgba = (const uint32_t *)im->data +
+			       (long)y * im->width;
+	int x;
+
+	if (y < 0) {
+		memset(row, 0, (size_t)im->width * image_channels(im));
+		return;
+	}
+	if (im->gray) {
+		memcpy(row, im->data + (long)y * im->width, im->width);
+		return;
+	}
+	for (x = 0; x < im->width; x++) {
+		row[3 * x] = rgba[x] >> 24;
+		row[3 * x + 1] = rgba[x] >> 16;
+		row[3 * x + 2] = rgba[x] >> 8;
+	}
+}
+
+/* the row filtered by the filter f, see png_filter() */
+static void png_filter_row(int f, const uint8_t *cur, const uint8_t *prev,
+			   int len, int bpp, uint8_t *out)
+{
+	int i;
+
+	switch (f) {
+	case 0:
+		memcpy(out, cur, len);
+		break;
+	case 1:
+		memcpy(out, cur, bpp);
+		for (i = bpp; i < len; i++)
+			out[i] = cur[i] - cur[i - bpp];
+		break;
+	case 2:
+		for (i = 0; i < len; i++)
+			out[i] = cur[i] - prev[i];
+		break;
+	case 3:
+		for (i = 0; i < bpp; i++)
+			out[i] = cur[i] - (prev[i] >> 1);
+		for (; i < len; i++)
+			out[i] = cur[i] - ((cur[i - bpp] + prev[i]) >> 1);
+		break;
+	default:
+		for (i = 0; i < bpp; i++)
+			out[i] = cur[i] - prev[i];
+		for (; i < len; i++)
+			out[i] = cur[i] - paeth(cur[i - bpp], prev[i],
+						prev[i - bpp]);
+	}
+}
+
+/*
+ * Filters the row by each of the 5 filters, and keeps the one of the
+ * smallest sum of the absolute (signed) values, as libpng does
+ */
+static void png_filter(const uint8_t *cur, const uint8_t *prev, int len,
+		       int bpp, uint8_t *out, uint8_t *tmp)
+{
+	long best_sum = -1;
+	int f, i;
+
+	for (f = 0; f < 5; f++) {
+		long sum = 0;
+
+		png_filter_row(f, cur, prev, len, bpp, tmp);
+		for (i = 0; i < len; i++)
+			sum += tmp[i] < 128 ? tmp[i] : 256 - tmp[i];
+		if (best_sum < 0 || sum < best_sum) {
+			best_sum = sum;
+			out[0] = f;
+			memcpy(out + 1, tmp, len);
+		}
+	}
+}
+
+/*
+ * A band as a piece of the deflate stream: the last one is final, the
+ * others end at a byte aligned (sync) flush point, so that they can be
+ * joined one after another.
+ */
+static void png_band(void *arg, int i)
+{
+	struct image *im = arg;
+	int y0 = i * im->band_h;
+	int h = im->height - y0 < im->band_h ? im->height - y0 : im->band_h;
+	int len = im->width * image_channels(im);
+	long raw_size = (long)(1 + len) * h;
+	uint8_t *raw = malloc(raw_size);
+	uint8_t *rows = malloc(3L * len);
+	z_stream z;
+	uLong bound;
+	int y;
+
+	memset(&z, 0, sizeof(z));
+	if (raw == NULL || rows == NULL ||
+	    deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+			 Z_FILTERED) != Z_OK)
+		goto out;
+
+	/* the previous row, the current one, the filter scratch */
+	png_row(im, y0 - 1, rows);
+	for (y = 0; y < h; y++) {
+		uint8_t *prev = rows + (y % 2) * len;
+		uint8_t *cur = rows + ((y + 1) % 2) * len;
+
+		png_row(im, y0 + y, cur);
+		png_filter(cur, prev, len, image_channels(im),
+			   raw + (long)y * (1 + len), rows + 2L * len);
+	}
+	im->adler[i] = adler32(adler32(0, NULL, 0), raw, raw_size);
+	im->raw_size[i] = raw_size;
+
+	/* the sync flush adds an empty stored block */
+	bound = deflateBound(&z, raw_size) + 16;
+	im->out[i] = malloc(bound);
+	if (im->out[i] == NULL)
+		goto out;
+	z.next_in = raw;
+	z.avail_in = raw_size;
+	z.next_out = im->out[i];
+	z.avail_out = bound;
+	if (deflate(&z, i == im->bands - 1 ? Z_FINISH : Z_SYNC_FLUSH) ==
+	    Z_STREAM_ERROR || z.avail_in) {
+		free(im->out[i]);
+		im->out[i] = NULL;
+	} else {
+		im->size[i] = bound - z.avail_out;
+	}
+out:
+	deflateEnd(&z);
+	free(rows);
+	free(raw);
+}
+
+static int png_chunk(FILE *fp, const char *type, const void *data,
+		     unsigned long size)
+{
+	uint8_t len[4] = { size >> 24, size >> 16, size >> 8, size };
+	uLong crc = crc32(crc32(0, NULL, 0), (const Bytef *)type, 4);
+	uint8_t tail[4];
+
+	crc = crc32(crc, data, size);
+	tail[0] = crc >> 24;
+	tail[1] = crc >> 16;
+	tail[2] = crc >> 8;
+	tail[3] = crc;
+	return fwrite(len, 1, 4, fp) != 4 || fwrite(type, 1, 4, fp) != 4 ||
+	       fwrite(data, 1, size, fp) != size ||
+	       fwrite(tail, 1, 4, fp) != 4 ? -1 : 0;
+}
+
+/* the zlib stream: the header, a band per IDAT chunk and the checksum */
+static int png_join(const struct image *im, FILE *fp)
+{
+	static const uint8_t signature[8] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n',
+	};
+	uint8_t ihdr[13] = {
+		im->width >> 24, im->width >> 16, im->width >> 8, im->width,
+		im->height >> 24, im->height >> 16, im->height >> 8,
+		im->height, 8, im->gray ? 0 : 2, 0, 0, 0,
+	};
+	uLong adler = im->adler[0];
+	uint8_t tail[4];
+	int i;
+
+	for (i = 1; i < im->bands; i++)
+		adler = adler32_combine(adler, im->adler[i],
+					im->raw_size[i]);
+	tail[0] = adler >> 24;
+	tail[1] = adler >> 16;
+	tail[2] = adler >> 8;
+	tail[3] = adler;
+
+	if (fwrite(signature, 1, 8, fp) != 8 ||
+	    png_chunk(fp, "IHDR", ihdr, 13) < 0 ||
+	    png_chunk(fp, "IDAT", PNG_ZLIB_HEADER, 2) < 0)
+		return -1;
+	for (i = 0; i < im->bands; i++)
+		if (png_chunk(fp, "IDAT", im->out[i], im->size[i]) < 0)
+			return -1;
+	return png_chunk(fp, "IDAT", tail, 4) < 0 ||
+	       png_chunk(fp, "IEND", "", 0) < 0 ? -1 : 0;
+}
+
+/* from the extension of the file name */
+enum image_format image_format(const char *fname)
+{
+	const char *ext = strrchr(fname, '.');
+
+	if (ext == NULL)
+		return IMAGE_RAW;
+	if (!strcasecmp(ext, ".jpg") || !strcasecmp(ext, ".jpeg"))
+		return IMAGE_JPEG;
+	if (!strcasecmp(ext, ".png"))
+		return IMAGE_PNG;
+	return IMAGE_RAW;
+}
+
+/*
+ * Writes the RGBA (see to_rgba()) or the gray image into the JPEG or PNG
+ * file, the quality is of JPEG (1..100)
+ */
+int image_write(const char *fname, enum image_format format, int quality,
+		const void *data, int width, int height, int gray)
+{
+	struct image im = {
+		.data = data,
+		.width = width,
+		.height = height,
+		.gray = gray,
+		.quality = quality,
+	};
+	FILE *fp;
+	int i, ret = -1;
+
+	if (format == IMAGE_JPEG) {
+		/* the restart interval of a band must fit 16 bits */
+		int mcu = gray ? 8 : JPEG_MCU_SIZE;
+
+		image_bands(&im, mcu, JPEG_MAX_RESTART /
+			    ((width + mcu - 1) / mcu) * mcu);
+	} else {
+		image_bands(&im, 1, height);
+	}
+	if (image_alloc(&im) < 0) {
+		printf("out of memory\n");
+		goto out;
+	}
+	parallel_for(im.bands, format == IMAGE_JPEG ? jpeg_band : png_band,
+		     &im);
+	for (i = 0; i < im.bands; i++) {
+		if (im.out[i] == NULL) {
+			printf("%s: band %d failed\n", fname, i);
+			goto out;
+		}
+	}
+
+	fp = fopen(fname, "wb");
+	if (fp == NULL) {
+		printf("Failed to open output file \"%s\"\n", fname);
+		goto out;
+	}
+	ret = format == IMAGE_JPEG ? jpeg_join(&im, fp) : png_join(&im, fp);
+	if (fclose(fp) != 0)
+		ret = -1;
+	if (ret < 0)
+		printf("Failed to write \"%s\"\n", fname);
+out:
+	image_free(&im);
+	return ret;
+}
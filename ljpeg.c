@@ -0,0 +1,303 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * Lossless JPEG (ITU T.81 process 14, the Huffman coded one) decoder for
+ * the compressed DNG tiles and strips.
+ *
+ * Copyright (C) 2021, Linaro
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debayer.h"
+
+/* the codes up to this long are decoded with one table lookup */
+#define LJ_LUT_BITS 9
+#define LJ_MAX_COMPONENTS 4
+
+struct lj_huff {
+	int defined;
+	int maxcode[17];	/* the largest code of each length, -1 none */
+	int mincode[17];
+	int valptr[17];		/* the first value of each length */
+	uint8_t vals[256];
+	uint16_t lut[1 << LJ_LUT_BITS];	/* length << 8 | value, 0 - longer */
+};
+
+/*
+ * The entropy coded data: the bits are taken from the MSB of acc. The
+ * stuffed zero bytes are dropped, and zeros are read from a marker on.
+ */
+struct lj_bits {
+	const uint8_t *p, *end;
+	uint32_t acc;
+	int n;			/* the bits in acc */
+	int marker;		/* p is at the marker */
+};
+
+static int lj_huff_init(struct lj_huff *h, const uint8_t counts[16],
+			const uint8_t *vals)
+{
+	int code = 0, k = 0;
+	int len, i, j;
+
+	memset(h, 0, sizeof(*h));
+	for (len = 1; len <= 16; len++) {
+		h->valptr[len] = k;
+		h->mincode[len] = code;
+		for (i = 0; i < counts[len - 1]; i++, k++, code++) {
+			if (k >= 256)
+				return -1;
+			h->vals[k] = vals[k];
+			if (len > LJ_LUT_BITS)
+				continue;
+			for (j = 0; j < 1 << (LJ_LUT_BITS - len); j++)
+				h->lut[(code << (LJ_LUT_BITS - len)) + j] =
+					len << 8 | vals[k];
+		}
+		h->maxcode[len] = counts[len - 1] ? code - 1 : -1;
+		code <<= 1;
+	}
+	h->defined = 1;
+	return 0;
+}
+
+static void lj_fill(struct lj_bits *b)
+{
+	while (b->n <= 24) {
+		uint32_t c = 0;
+
+		if (!b->marker && b->p < b->end) {
+			c = *b->p;
+			if (c != 0xff) {
+				b->p++;
+			} else if (b->p + 1 < b->end && b->p[1] == 0x00) {
+				b->p += 2;
+			} else {
+				b->marker = 1;
+				c = 0;
+			}
+		}
+		b->acc |= c << (24 - b->n);
+		b->n += 8;
+	}
+}
+
+static inline uint32_t lj_take(struct lj_bits *b, int n)
+{
+	uint32_t v = b->acc >> (32 - n);
+
+	b->acc <<= n;
+	b->n -= n;
+	return v;
+}
+
+static int lj_symbol(struct lj_bits *b, const struct lj_huff *h)
+{
+	int e, len;
+
+	lj_fill(b);
+	e = h->lut[b->acc >> (32 - LJ_LUT_BITS)];
+	if (e) {
+		lj_take(b, e >> 8);
+		return e & 0xff;
+	}
+	for (len = LJ_LUT_BITS + 1; len <= 16; len++) {
+		int code = b->acc >> (32 - len);
+
+		if (code <= h->maxcode[len]) {
+			lj_take(b, len);
+			return h->vals[h->valptr[len] + code - h->mincode[len]];
+		}
+	}
+	return -1;
+}
+
+/* the difference of the SSSS category */
+static int lj_diff(struct lj_bits *b, int ssss)
+{
+	int v;
+
+	if (ssss == 0)
+		return 0;
+	if (ssss == 16)
+		return 32768;
+	lj_fill(b);
+	v = lj_take(b, ssss);
+	if (v < 1 << (ssss - 1))
+		v -= (1 << ssss) - 1;
+	return v;
+}
+
+/* past the RSTn marker, for the next restart interval */
+static int lj_restart(struct lj_bits *b)
+{
+	while (b->p + 1 < b->end &&
+	       !(b->p[0] == 0xff && b->p[1] >= 0xd0 && b->p[1] <= 0xd7))
+		b->p++;
+	if (b->p + 1 >= b->end)
+		return -1;
+	b->p += 2;
+	b->acc = 0;
+	b->n = 0;
+	b->marker = 0;
+	return 0;
+}
+
+static inline int lj_predict(int sel, int ra, int rb, int rc)
+{
+	switch (sel) {
+	case 1:
+		return ra;
+	case 2:
+		return rb;
+	case 3:
+		return rc;
+	case 4:
+		return ra + rb - rc;
+	case 5:
+		return ra + ((rb - rc) >> 1);
+	case 6:
+		return rb + ((ra - rc) >> 1);
+	default:
+		return (ra + rb) >> 1;
+	}
+}
+
+/*
+ * Decodes the image into out[], up to capacity samples in the raster
+ * order: the rows of the interleaved samples of the components. Returns
+ * the number of samples of the image, or -1 if it can't be decoded. The
+ * restart interval must be a multiple of the row.
+ */
+long ljpeg_decode(const uint8_t *data, size_t size, uint16_t *out,
+		  long capacity)
+{
+	struct lj_huff huff[4];
+	int table[LJ_MAX_COMPONENTS];
+	const uint8_t *p = data, *end = data + size;
+	int precision = 0, width = 0, height = 0, comps = 0;
+	int restart = 0, sel = 0, pt = 0;
+	struct lj_bits b;
+	int *rows = NULL;
+	long samples = -1;
+	int x, y, c;
+
+	memset(huff, 0, sizeof(huff));
+	if (size < 4 || p[0] != 0xff || p[1] != 0xd8)
+		return -1;
+	p += 2;
+
+	/* the markers up to the start of scan */
+	for (;;) {
+		int marker, len;
+
+		if (end - p < 4 || p[0] != 0xff)
+			return -1;
+		marker = p[1];
+		len = p[2] << 8 | p[3];
+		if (len < 2 || end - p < 2 + len)
+			return -1;
+
+		if (marker == 0xc4) {
+			const uint8_t *q = p + 4, *q_end = p + 2 + len;
+
+			while (q_end - q >= 17) {
+				int n = 0, i;
+
+				for (i = 0; i < 16; i++)
+					n += q[1 + i];
+				if (q_end - q < 17 + n ||
+				    lj_huff_init(&huff[q[0] & 3], q + 1,
+						 q + 17) < 0)
+					return -1;
+				q += 17 + n;
+			}
+		} else if (marker == 0xc3) {
+			if (len < 8)
+				return -1;
+			precision = p[4];
+			height = p[5] << 8 | p[6];
+			width = p[7] << 8 | p[8];
+			comps = p[9];
+			if (comps < 1 || comps > LJ_MAX_COMPONENTS ||
+			    len < 8 + 3 * comps)
+				return -1;
+		} else if (marker == 0xdd) {
+			if (len < 4)
+				return -1;
+			restart = p[4] << 8 | p[5];
+		} else if (marker == 0xda) {
+			if (len < 6 + 2 * comps || p[4] != comps)
+				return -1;
+			for (c = 0; c < comps; c++) {
+				table[c] = p[6 + 2 * c] >> 4;
+				if (!huff[table[c]].defined)
+					return -1;
+			}
+			sel = p[5 + 2 * comps];
+			pt = p[7 + 2 * comps] & 15;
+			p += 2 + len;
+			break;
+		} else if ((marker >= 0xc0 && marker <= 0xcf &&
+			    marker != 0xc8 && marker != 0xcc) ||
+			   marker < 0xc0 || marker == 0xd8 || marker == 0xd9) {
+			/* not the lossless Huffman image */
+			return -1;
+		}
+		p += 2 + len;
+	}
+	if (!width || !height || precision < 2 || precision > 16 ||
+	    sel < 1 || sel > 7 || pt >= precision ||
+	    (restart && restart % width))
+		return -1;
+
+	/* the previous and the current rows of the samples */
+	rows = malloc(sizeof(*rows) * 2 * width * comps);
+	if (rows == NULL)
+		return -1;
+
+	b.p = p;
+	b.end = end;
+	b.acc = 0;
+	b.n = 0;
+	b.marker = 0;
+	for (y = 0; y < height; y++) {
+		int *prev = rows + ((y + 1) & 1) * width * comps;
+		int *cur = rows + (y & 1) * width * comps;
+		/* the first row of the image or the restart interval */
+		int first = y == 0 || (restart && y * width % restart == 0);
+
+		if (y > 0 && first && lj_restart(&b) < 0)
+			goto out;
+		for (x = 0; x < width; x++) {
+			for (c = 0; c < comps; c++) {
+				int i = x * comps + c;
+				int ssss = lj_symbol(&b, &huff[table[c]]);
+				int pred;
+				long o;
+
+				if (ssss < 0 || ssss > 16)
+					goto out;
+				if (first && x == 0)
+					pred = 1 << (precision - pt - 1);
+				else if (first)
+					pred = cur[i - comps];
+				else if (x == 0)
+					pred = prev[i];
+				else
+					pred = lj_predict(sel, cur[i - comps],
+							  prev[i],
+							  prev[i - comps]);
+				cur[i] = (pred + lj_diff(&b, ssss)) & 0xffff;
+				o = ((long)y * width + x) * comps + c;
+				if (o < capacity)
+					out[o] = cur[i] << pt;
+			}
+		}
+	}
+	samples = (long)width * height * comps;
+out:
+	free(rows);
+	return samples;
+}
@@ -4,369 +4,1639 @@
  * EGL + GLES 3.1 context to demosaic 8-bit raw bayer image.
  *
  * Copyright (C) 2021, Linaro
- *
- * The method to run a headless compute shader is taken from the blog post
- * by Eduardo Lima Mitev <elima@igalia.com> :
- * https://blogs.igalia.com/elima/2016/10/06/example-run-an-opengl-es-compute-shader-on-a-drm-render-node/
  */
 
-#include <EGL/egl.h>
-#include <EGL/eglext.h>
-#include <GLES3/gl32.h>
-#include <assert.h>
-#include <fcntl.h>
-#include <gbm.h>
+#define _POSIX_C_SOURCE 200809L	/* clock_gettime() */
+
 #include <getopt.h>
-#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
-#define RENDER_NODE_FNAME "/dev/dri/renderD128"
+#include "gl.h"
 
 #define SHADER_FNAME "./debayer.comp"
 
-enum {
-	bo_in,
-	bo_out,
-	bo_num
+static double time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void print_throughput(const struct frame_fmt *fmt, int iterations,
+			     double ms)
+{
+	int width, height;
+
+	if (iterations < 2)
+		return;
+	/* of the sensor, to compare the colour filter arrays */
+	sensor_size(fmt, &width, &height);
+	printf("%d frames %dx%d: %.2f ms/frame, %.1f Mpixel/s\n", iterations,
+	       width, height, ms / iterations,
+	       (double)width * height * iterations / ms / 1000.0);
+}
+
+#define USAGE \
+	"Usage: %s [-h] [-s XxY] [-f <order>] [-S <stride>] [-e <engine>] [-t <spec>] [-g] [-y <format>] [-Y <fps>] [-q <quality>] [-Z] [-O <orient>] [-L <spec>] [-D <strength>] [-P <spec>] [-T <strength>] [-C <cfa>] [-b <bits>] [-H <ratios>] [-K <files>] [-M <spec>] [-I] [-c <dir>] [-p <pipeline>] [-n <count>] <inputfile> <outputfile>\n" \
+	"       %s -A <list> [-e <engine>] [-s XxY] [-f <order>] [-S <stride>] [-q <quality>] [-O <orient>] [-D <strength>] [-P <spec>] [-n <count>]\n" \
+	"       %s -F <iterations>[,<seed>]\n" \
+	"-f <order>   Specify input bayer order: RGGB, GRBG, GBRG or BGGR (default)\n" \
+	"-s XxY       Specify input image size (default 1920x1080)\n" \
+	"-S <stride>  Specify input line length in bytes (default: the width\n" \
+	"             times the bytes per pixel)\n" \
+	"-e <engine>  Use the gl (default), cpu or cpu-ref engine\n" \
+	"-t <spec>    Write the tensor instead of RGBA, <spec> is a comma\n" \
+	"             separated list of: chw|hwc, f32|f16|i8|u8, rgb|bgr,\n" \
+	"             WxH, mean=R:G:B, std=R:G:B, scale=S, zp=N\n" \
+	"-g           Write the 8-bit gray image (the luma) instead of RGBA\n" \
+	"-y <format>  Write the YUV 4:2:0 image instead of RGBA: i420 or nv12\n" \
+	"             (bare frames, the stream has no header for nv12)\n" \
+	"-Y <fps>     Write the I420 or gray output as the YUV4MPEG2 stream of\n" \
+	"             <rate>[:<scale>] frames per second; <outputfile> can be -\n" \
+	"             (the standard output) for piping into an encoder. Not\n" \
+	"             for nv12, which Y4M can't describe\n" \
+	"-q <quality> Of the JPEG <outputfile> (1..100, default 90)\n" \
+	"A .jpg or .png <outputfile> is the image file of the RGBA or gray output,\n" \
+	"with %%d in the name for the number of the frame of a stream\n" \
+	"-Z           Compress the input frames losslessly into <outputfile>\n" \
+	"             instead of demosaicing them; it is read back as the input\n" \
+	"-O <orient>  Rotate or flip the output: none (default), hflip, vflip,\n" \
+	"             rot90, rot180, rot270 (clockwise), transpose or transverse\n" \
+	"-L <spec>    Correct the lens distortion, <spec> is a comma separated\n" \
+	"             list of: k1=, k2=, k3=, p1=, p2= (the distortion coefficients),\n" \
+	"             f=FX[:FY] (focal length in pixels), c=CX:CY (optical center)\n" \
+	"-D <strength> Denoise the frame before demosaicing, R[,G,B] (0..255)\n" \
+	"             the pixels which differ by less than the strength are blended\n" \
+	"-P <spec>    Post-process the demosaiced image, <spec> is a comma\n" \
+	"             separated list of: sharp=N (sharpening, 16 is 1.0),\n" \
+	"             chroma (false colour suppression)\n" \
+	"-T <strength>[,<threshold>] Blend the RGBA output with the previous\n" \
+	"             frame: up to strength/256 (0..255) for the static pixels,\n" \
+	"             none for the ones which differ by threshold (default 32)\n" \
+	"-C <cfa>     Colour filter array: bayer (default), quad (Quad Bayer\n" \
+	"             remosaiced), quad-bin (binned to the half size), rgbir\n" \
+	"             (RGB-IR 4x4, the IR plane is written after the output),\n" \
+	"             xtrans (Fuji X-Trans 6x6) or mono (monochrome, not\n" \
+	"             demosaiced); the -f order is not used for the last two\n" \
+	"-b <bits>    Input bits per pixel: 8 (default), or 9..16 in 16-bit little\n" \
+	"             endian words, scaled down to 8 bits unless tone mapped\n" \
+	"-H <ratios>  Merge the HDR exposures (the frames of the input, the\n" \
+	"             longest first): the ratios of the first exposure to the\n" \
+	"             following ones, e.g. 4,16 for 3 frames\n" \
+	"-K <dark>[,<columns>] Subtract the dark frame (of the input format) and\n" \
+	"             the column offsets (16-bit signed little endian per column)\n" \
+	"-M <spec>    Tone map the input to 8 bits: global (the curve from the\n" \
+	"             histogram of the previous frame) or local=N (and the local\n" \
+	"             tone mapping of strength 1..255)\n" \
+	"-I           Demosaic only the tiles of the frame which have changed\n" \
+	"             since the previous one (gl engine, RGBA output)\n" \
+	"-c <dir>     Keep the output files in the cache directory <dir>, and\n" \
+	"             take them from there for the same input and options\n" \
+	"-A <list>    Demosaic the 8-bit Bayer frames of the list into RGBA in one\n" \
+	"             dispatch (the atlas): a line per frame, <inputfile>\n" \
+	"             <outputfile> [WxH [<order> [<stride>]]]\n" \
+	"-p <pipeline> Take the stages from the pipeline file, a line per stage\n" \
+	"             (see pipeline.c), and print the plan of the passes\n" \
+	"-n <count>   Process the frames <count> times and print the throughput\n" \
+	"A DNG <inputfile> gives its own -s, -f, -C, -b and -S, and the black\n" \
+	"level is subtracted unless -K is given; a zstd or LZ4 compressed\n" \
+	"<inputfile> is decompressed\n" \
+	"-F <n>[,<seed>] Compare all the engines against cpu-ref on n random frames\n" \
+	"-h           Shows this help\n"
+
+static const char * const bayer_order_names[] = {
+	[BAYER_RGGB] = "RGGB",
+	[BAYER_GRBG] = "GRBG",
+	[BAYER_GBRG] = "GBRG",
+	[BAYER_BGGR] = "BGGR",
+};
+
+static const char * const cfa_names[] = {
+	[CFA_BAYER] = "bayer",
+	[CFA_QUAD] = "quad",
+	[CFA_QUAD_BIN] = "quad-bin",
+	[CFA_RGBIR] = "rgbir",
+	[CFA_XTRANS] = "xtrans",
+	[CFA_MONO] = "mono",
 };
 
-long read_input_file(const char *fname, char **data, const char *type)
+/* indexed by the enum orientation flags */
+static const char * const orientation_names[] = {
+	"none", "hflip", "vflip", "rot180",
+	"transpose", "rot270", "rot90", "transverse",
+};
+
+static int parse_orientation(const char *p, unsigned int *orient)
 {
-	FILE *fp;
-	long size;
-	char *p_data;
+	unsigned int i;
 
-	fp = fopen(fname, type);
-	if (fp == NULL)
-		return 0;
-	fseek(fp, 0, SEEK_END);
-	size = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
-	if (size <= 0)
-		goto err_seek;
-
-	p_data = malloc(size);
-	if (p_data == NULL)
-		goto err_seek;
-
-	if (fread(p_data, 1, size, fp) != size)
-		goto err_fread;
-
-	fclose(fp);
-	*data = p_data;
-	return size;
-
-err_fread:
-	free(p_data);
-err_seek:
-	fclose(fp);
+	for (i = 0; i < 8; i++) {
+		if (!strcmp(p, orientation_names[i])) {
+			*orient = i;
+			return 0;
+		}
+	}
 	return -1;
 }
 
+/* R[,G,B], the same strength for all the channels if only one is given */
+static int parse_denoise(const char *p, struct denoise_fmt *dn)
+{
+	int n = sscanf(p, "%d,%d,%d", &dn->strength[0], &dn->strength[1],
+		       &dn->strength[2]);
+	int i;
+
+	if (n == 1)
+		dn->strength[1] = dn->strength[2] = dn->strength[0];
+	else if (n != 3)
+		return -1;
 
-long read_input_bin_file(const char *fname, char **data)
+	dn->enabled = 0;
+	for (i = 0; i < 3; i++) {
+		if (dn->strength[i] < 0 || dn->strength[i] > 255)
+			return -1;
+		if (dn->strength[i])
+			dn->enabled = 1;
+	}
+	return 0;
+}
+
+static int parse_postfilter(const char *p, struct postfilter_fmt *pf)
 {
-	return read_input_file(fname, data, "rb");
+	while (*p) {
+		size_t len = strcspn(p, ",");
+		char *end;
+
+		if (len == 6 && !strncmp(p, "chroma", len)) {
+			pf->chroma_median = 1;
+		} else if (!strncmp(p, "sharp=", 6)) {
+			pf->sharpen = strtol(p + 6, &end, 10);
+			if (end != p + len || pf->sharpen < 0 ||
+			    pf->sharpen > 255)
+				return -1;
+		} else {
+			return -1;
+		}
+		p += len;
+		if (*p == ',')
+			p++;
+	}
+	pf->enabled = pf->sharpen || pf->chroma_median;
+	return 0;
 }
 
-long read_input_text_file(const char *fname, char **data)
+static int parse_temporal(const char *p, struct temporal_fmt *t)
 {
-	return read_input_file(fname, data, "r");
+	t->threshold = 32;
+	if (sscanf(p, "%d,%d", &t->strength, &t->threshold) < 1 ||
+	    t->strength < 0 || t->strength > 255 ||
+	    t->threshold < 1 || t->threshold > 255)
+		return -1;
+	t->enabled = 1;
+	return 0;
 }
 
-long write_output_file(const char *fname, const char *p_data, long data_size)
+/*
+ * The calibration files "<dark>[,<columns>]": the dark frame of the input
+ * format, and/or the column offsets, a 16-bit little endian signed word
+ * per column. Either name can be empty.
+ */
+static int load_calibration(const char *spec, const struct frame_fmt *fmt,
+			    struct dark_fmt *dark)
 {
-	FILE *fp;
+	char name[256];
+	size_t len = strcspn(spec, ",");
+	char *data = NULL;
+	int32_t *columns;
+	long size;
+	int width, height;
+	int x;
 
-	fp = fopen(fname, "wb");
-	if (fp == NULL)
-		return 0;
-	if (fwrite(p_data, 1, data_size, fp) != data_size) {
-		fclose(fp);
+	memset(dark, 0, sizeof(*dark));
+	if (len >= sizeof(name))
 		return -1;
+	memcpy(name, spec, len);
+	name[len] = '\0';
+	if (len) {
+		size = read_input_bin_file(name, &data);
+		if (size < input_frame_size(fmt)) {
+			printf("\"%s\" is too short for the dark frame\n", name);
+			free(data);
+			return -1;
+		}
+		dark->frame = (uint8_t *)data;
+		data = NULL;
 	}
 
-	fclose(fp);
-	return data_size;
+	if (spec[len] == ',' && spec[len + 1]) {
+		size = read_input_bin_file(spec + len + 1, &data);
+		sensor_size(fmt, &width, &height);
+		columns = malloc(sizeof(*columns) * width);
+		if (size < 2L * width || columns == NULL) {
+			printf("\"%s\" is too short for %d column offsets\n",
+			       spec + len + 1, width);
+			free(columns);
+			free(data);
+			free((void *)dark->frame);
+			dark->frame = NULL;
+			return -1;
+		}
+		for (x = 0; x < width; x++)
+			columns[x] = (int16_t)((uint8_t)data[2 * x] |
+					       (uint8_t)data[2 * x + 1] << 8);
+		free(data);
+		dark->columns = columns;
+	}
+	dark->enabled = dark->frame || dark->columns;
+	return dark->enabled ? 0 : -1;
+}
+
+static void free_calibration(struct dark_fmt *dark)
+{
+	free((void *)dark->frame);
+	free((void *)dark->columns);
+	memset(dark, 0, sizeof(*dark));
 }
 
-struct converter {
-	/* EGL realted stuff */
-	int fd;		/* render node fd */
-	struct gbm_device *gbm;
-	EGLDisplay egl_dpy;
-	EGLContext core_ctx;
+/* the YUV4MPEG2 stream of the I420 or gray output */
+struct y4m_fmt {
+	int enabled;
+	int rate, scale;	/* the frame rate is rate / scale */
+};
 
-	/* buffers related stuff */
-	GLuint bos[bo_num];
-	uint8_t * p_in;
-	const uint8_t * p_out;
+/* "<rate>[:<scale>]" frames per second */
+static int parse_y4m(const char *spec, struct y4m_fmt *y4m)
+{
+	y4m->scale = 1;
+	if (sscanf(spec, "%d:%d", &y4m->rate, &y4m->scale) < 1 ||
+	    y4m->rate <= 0 || y4m->scale <= 0)
+		return -1;
+	y4m->enabled = 1;
+	return 0;
+}
+
+static int y4m_header(FILE *fp, const struct y4m_fmt *y4m,
+		      const struct frame_fmt *fmt,
+		      const struct debayer_opts *opts)
+{
+	int out_w, out_h;
+
+	if (!y4m->enabled)
+		return 0;
+	orient_size(fmt, opts->orient, &out_w, &out_h);
+	return fprintf(fp, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 %s\n", out_w,
+		       out_h, y4m->rate, y4m->scale,
+		       opts->output == OUTPUT_GRAY ?
+		       "Cmono XCOLORRANGE=FULL" :
+		       "C420jpeg XCOLORRANGE=LIMITED") < 0 ? -1 : 0;
+}
 
-	/* shader */
-	GLuint shader_program;
-	GLuint compute_shader;
-	const char * shader_fname;
+/* where the output frames go */
+struct output_file {
+	FILE *fp;		/* NULL for the image files */
+	struct y4m_fmt y4m;
+	enum image_format image;
+	const char *name;	/* of the image files, %d is the frame */
+	int quality;		/* of JPEG */
+	int rawz;		/* the input frames, losslessly compressed */
+	long frame;
 };
 
-int init_egl(struct converter * conv, const char * render_node)
+/* the image file name can have one %d (with the width) for the frame */
+static int check_image_name(const char *name, long frames)
 {
-	const char *egl_extension_st;
-	static const EGLint config_attribs[] = {
-		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT_KHR, EGL_NONE
-	};
-	static const EGLint attribs[] = {
-		EGL_CONTEXT_MAJOR_VERSION, 3,
-		EGL_CONTEXT_MINOR_VERSION, 1, EGL_NONE
-	};
-	EGLConfig cfg;
-	EGLint count;
-	EGLint major, minor;
+	const char *p = strchr(name, '%');
 
-	conv->fd = open (render_node, O_RDWR);
-	if (conv->fd < 0) {
-		perror("init_opengl: ");
-		return -1;
-	}
+	if (p == NULL)
+		return frames == 1 ? 0 : -1;
+	p += 1 + strspn(p + 1, "0123456789");
+	return *p == 'd' && strchr(p, '%') == NULL ? 0 : -1;
+}
 
-	conv->gbm = gbm_create_device(conv->fd);
-	if (conv->gbm == NULL) {
-		printf("init_opengl: failed to create GBM device\n");
-		goto err_gbm;
+/*
+ * An output frame: after its own header in the Y4M stream, or encoded
+ * into the next image file straight from the output buffer
+ */
+static int write_frame(struct output_file *out, const struct frame_fmt *fmt,
+		       const struct debayer_opts *opts, const void *data,
+		       long size)
+{
+	char name[4096];
+	int out_w, out_h;
+
+	if (out->image != IMAGE_RAW) {
+		orient_size(fmt, opts->orient, &out_w, &out_h);
+		snprintf(name, sizeof(name), out->name, out->frame++);
+		return image_write(name, out->image, out->quality, data,
+				   out_w, out_h, opts->output == OUTPUT_GRAY);
 	}
+	if (out->y4m.enabled && fputs("FRAME\n", out->fp) == EOF)
+		return -1;
+	return fwrite(data, 1, size, out->fp) == (size_t)size ? 0 : -1;
+}
 
-	/* setup EGL from the GBM device */
-	conv->egl_dpy = eglGetPlatformDisplay(EGL_PLATFORM_GBM_MESA,
-					      conv->gbm, NULL);
-	if (conv->egl_dpy == NULL) {
-		printf("init_opengl: eglGetPlatformDisplay() failed\n");
-		goto err_egl_dpy;
-	}
+static void print_written(const struct output_file *out, long bytes)
+{
+	if (out->image != IMAGE_RAW)
+		printf("%s: %ld images written\n", out->name, out->frame);
+	else
+		printf("%s: %ld bytes written\n", out->name, bytes);
+}
 
-	/* initialize an EGL display connection */
-	if (eglInitialize(conv->egl_dpy, &major, &minor) != EGL_TRUE) {
-		printf("init_opengl: eglInitialize() failed\n");
-		goto err_egl_ctx;
-	} else {
-		printf("EGL version: %d.%d\n", major, minor);
-	}
+/* the output files of the run go into the cache, after they are written */
+static void cache_output(struct cache *cache, struct output_file *out)
+{
+	if (cache->dir == NULL)
+		return;
+	if (out->fp)
+		fflush(out->fp);
+	cache_store(cache, out->name, out->image,
+		    out->image != IMAGE_RAW ? out->frame : 1);
+}
 
-	egl_extension_st = eglQueryString (conv->egl_dpy, EGL_EXTENSIONS);
-	if (strstr (egl_extension_st, "EGL_KHR_create_context") == NULL ||
-	    strstr (egl_extension_st, "EGL_KHR_surfaceless_context") == NULL) {
-		printf("init_opengl: EGL_KHR_create_context or EGL_KHR_surfaceless_context not supported\n");
-		goto err_egl_ctx;
-	}
+/* the black level of the DNG file is subtracted as the column offsets */
+static int dng_calibration(const struct dng_image *dng, struct dark_fmt *dark)
+{
+	int32_t *columns;
+	int width, height;
+	int x;
 
-	if (!eglChooseConfig(conv->egl_dpy, config_attribs, NULL, 0, &count)) {
-                printf("init_opengl: eglChooseConfig(&cfg == NULL) failed\n");
-        }
-        printf("eglChooseConfig(): %d matching configs available\n", count);
+	sensor_size(&dng->fmt, &width, &height);
+	columns = malloc(sizeof(*columns) * width);
+	if (columns == NULL)
+		return -1;
+	for (x = 0; x < width; x++)
+		columns[x] = dng->black;
+	memset(dark, 0, sizeof(*dark));
+	dark->columns = columns;
+	dark->enabled = 1;
+	return 0;
+}
 
-	/*
-	 * Get the first EGL frame buffer configuration that matches the
-	 * specified attributes - we request GL ES 3.x.
-	 */
-	if (!eglChooseConfig(conv->egl_dpy, config_attribs, &cfg, 1, &count)) {
-		printf("init_opengl: eglChooseConfig() failed: %d\n",
-		       eglGetError());
-		goto err_egl_ctx;
-	}
+static void print_dng(const char *fname, const struct dng_image *dng)
+{
+	const struct frame_fmt *fmt = &dng->fmt;
+	const float *m = dng->matrix;
+
+	printf("%s: DNG %dx%d %s %s, %d bits, black %d, white %d\n", fname,
+	       fmt->width, fmt->height, cfa_names[fmt->cfa],
+	       fmt->cfa == CFA_BAYER ? bayer_order_names[fmt->order] : "",
+	       fmt->bits, dng->black, dng->white);
+	/* there is no white balance or colour correction to apply them */
+	printf("%s: as shot neutral %.4f %.4f %.4f\n", fname,
+	       dng->neutral[0], dng->neutral[1], dng->neutral[2]);
+	printf("%s: colour matrix %.4f %.4f %.4f, %.4f %.4f %.4f, %.4f %.4f %.4f\n",
+	       fname, m[0], m[1], m[2], m[3], m[4], m[5], m[6], m[7], m[8]);
+}
 
-	if (!eglBindAPI(EGL_OPENGL_ES_API)) {
-		printf("init_opengl: eglBindAPI() failed: %d\n", eglGetError());
-		goto err_egl_ctx;
-	}
+/*
+ * The input is either read into memory, streamed from the compressed file
+ * or in the DNG file mapping
+ */
+static void free_input(char *data, struct archive_stream *stream,
+		       struct dng_image *dng)
+{
+	if (dng->map)
+		dng_close(dng);
+	else
+		free(data);
+	archive_close(stream);
+}
 
-	conv->core_ctx = eglCreateContext(conv->egl_dpy, cfg, EGL_NO_CONTEXT,
-					  attribs);
-	if (conv->core_ctx == EGL_NO_CONTEXT) {
-		printf("init_opengl: eglCreateContext() failed\n");
-		goto err_egl_ctx;
-	}
+/* the input frame of the iteration i */
+static const uint8_t *input_frame(const char *data,
+				  struct archive_stream *stream, long i,
+				  long frames, long frame_size)
+{
+	const uint8_t *in;
+
+	if (stream == NULL)
+		return (const uint8_t *)data + (i % frames) * frame_size;
+	in = archive_next(stream);
+	if (in == NULL)
+		printf("Failed to decompress frame %ld\n", i % frames);
+	return in;
+}
 
-	/*
-	 * eglMakeCurrent() binds context to the current rendering thread.
-	 * We don't need neither draw nor read surfaces hence EGL_NO_SURFACE's.
-	 */
-	if (!eglMakeCurrent(conv->egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
-			    conv->core_ctx)) {
-		printf("init_opengl: eglMakeCurrent() failed: %d\n",
-		       eglGetError());
-		goto err_egl_make_current;
-	}
+static int parse_cfa(const char *p, enum cfa_type *cfa)
+{
+	int i;
 
-	glGetIntegerv(GL_MAJOR_VERSION, &major);
-	glGetIntegerv(GL_MINOR_VERSION, &minor);
-	printf("*** EGL version: %d.%d\n", major, minor);
+	for (i = 0; i < 6; i++) {
+		if (!strcmp(p, cfa_names[i])) {
+			*cfa = i;
+			return 0;
+		}
+	}
+	return -1;
+}
 
-	return 0;
+static int parse_bayer_order(const char *p, int *bo)
+{
+	int i;
 
-err_egl_make_current:
-	eglDestroyContext(conv->egl_dpy, conv->core_ctx);
-err_egl_ctx:
-	eglTerminate(conv->egl_dpy);
-err_egl_dpy:
-	gbm_device_destroy(conv->gbm);
-err_gbm:
-	close(conv->fd);
+	for (i = 0; i < 4; i++) {
+		if (!strcmp(p, bayer_order_names[i])) {
+			*bo = i;
+			return 0;
+		}
+	}
 	return -1;
 }
 
-void deinit_egl(struct converter *conv)
+/* xorshift32, not to depend on the libc rand() for reproducible runs */
+static uint32_t fuzz_rand(uint32_t *state)
 {
-	eglDestroyContext(conv->egl_dpy, conv->core_ctx);
-	eglTerminate(conv->egl_dpy);
-	gbm_device_destroy(conv->gbm);
-	close(conv->fd);
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
 }
 
-int init_shader(struct converter *conv)
+/* Mostly small frames, but also the ones around the workgroup size */
+static int fuzz_dim(uint32_t *state, int lsize, int max)
 {
-	GLenum err;
-	GLint param;
-	char *compile_log;
+	uint32_t r = fuzz_rand(state);
 
-	int shader_cnt;
-	char *shader_src;
+	if (r % 4 == 0)
+		return lsize * (1 + (r >> 2) % 8) + (int)((r >> 8) % 3) - 1;
+	return 1 + (r >> 2) % max;
+}
 
-	shader_cnt = read_input_text_file(conv->shader_fname, &shader_src);
-	if (shader_cnt <= 0) {
-		printf("Fail to read the shader source from file \"%s\"\n",
-		       conv->shader_fname);
-		return GL_TRUE; /* GL_NO_ERROR == GL_FALSE */
-	}
-	printf("%d bytes read from \"%s\"\n", shader_cnt, conv->shader_fname);
+static void fuzz_fill(uint32_t *state, uint8_t *data, long size, int pattern)
+{
+	long i;
+
+	for (i = 0; i < size; i++) {
+		uint32_t r = fuzz_rand(state);
 
-	conv->compute_shader = glCreateShader(GL_COMPUTE_SHADER);
-	if(!conv->compute_shader) {
-		free(shader_src);
-		return glGetError();
+		switch (pattern) {
+		case 0:
+			data[i] = r;		/* noise */
+			break;
+		case 1:
+			data[i] = 0;		/* black */
+			break;
+		case 2:
+			data[i] = 0xff;		/* saturated */
+			break;
+		default:
+			data[i] = r & 1 ? 0xff : 0;	/* max. contrast */
+			break;
+		}
 	}
+}
 
-	glShaderSource(conv->compute_shader, 1, &shader_src, &shader_cnt);
-	/*
-	 * The shader source has been copied into the shader object, so
-	 * shader_src[] contents is no longer needed.
-	 */
-	free(shader_src);
+static int fuzz_compare(const char *engine, const struct debayer_opts *opts,
+			const uint8_t *ref, const uint8_t *out, long size)
+{
+	long i;
+
+	for (i = 0; i < size; i++) {
+		if (ref[i] != out[i]) {
+			printf("%s: mismatch at byte %ld: 0x%02X != 0x%02X (cpu-ref)\n",
+			       engine, i, out[i], ref[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
 
-	if ((err = glGetError()) != GL_NO_ERROR)
-		return err;
+static void fuzz_opts(uint32_t *state, const struct frame_fmt *fmt,
+		      struct debayer_opts *opts)
+{
+	struct tensor_fmt *t = &opts->tensor;
+	int c;
+
+	memset(opts, 0, sizeof(*opts));
+	opts->orient = fuzz_rand(state) % 8;
+	if (fuzz_rand(state) % 3 == 0) {
+		struct remap_fmt *r = &opts->remap;
+
+		/* barrel and pincushion, off-center, beyond the frame */
+		r->enabled = 1;
+		r->k[0] = ((int)(fuzz_rand(state) % 81) - 40) / 100.0f;
+		r->k[1] = ((int)(fuzz_rand(state) % 21) - 10) / 100.0f;
+		r->p[0] = ((int)(fuzz_rand(state) % 21) - 10) / 1000.0f;
+		r->p[1] = ((int)(fuzz_rand(state) % 21) - 10) / 1000.0f;
+		r->fx = r->fy = 0.25f * (1 + fuzz_rand(state) % 4) * fmt->width;
+		r->cx = fuzz_rand(state) % fmt->width;
+		r->cy = fuzz_rand(state) % fmt->height;
+		remap_init(r, fmt);
+	}
+	/* the denoise is for the Bayer pattern */
+	if (fuzz_rand(state) % 2 && fmt->cfa != CFA_XTRANS &&
+	    fmt->cfa != CFA_MONO) {
+		struct denoise_fmt *dn = &opts->denoise;
+
+		/* weak to strong, one of the channels can be off */
+		dn->enabled = 1;
+		for (c = 0; c < 3; c++)
+			dn->strength[c] = fuzz_rand(state) % 5 ?
+					  1 + fuzz_rand(state) % 255 : 0;
+	}
+	if (fuzz_rand(state) % 2) {
+		struct postfilter_fmt *pf = &opts->post;
 
-	glCompileShader(conv->compute_shader);
-	glGetShaderiv(conv->compute_shader, GL_COMPILE_STATUS, &param);
-	if (param != GL_TRUE) {
-		glGetShaderiv(conv->compute_shader, GL_INFO_LOG_LENGTH, &param);
-		printf("glCompileShader() failed");
-		compile_log = malloc(param);
-		if (compile_log == NULL) {
-			printf(", no log is available\n");
-			return GL_TRUE; /* GL_NO_ERROR == GL_FALSE */
+		pf->enabled = 1;
+		pf->sharpen = fuzz_rand(state) % 3 ? fuzz_rand(state) % 256 : 0;
+		pf->chroma_median = fuzz_rand(state) % 2;
+	}
+	if (fuzz_rand(state) % 4 == 0) {
+		/* up to 16 bits of the merged values */
+		int limit = 1 << (16 - fmt->bits < 8 ? 16 - fmt->bits : 8);
+		int frames = 2 + fuzz_rand(state) % (HDR_MAX_FRAMES - 1);
+		char spec[32];
+		int n = 0;
+
+		for (c = 1; c < frames; c++)
+			n += snprintf(spec + n, sizeof(spec) - n, "%d,",
+				      1 + (int)(fuzz_rand(state) % limit));
+		hdr_parse(spec, &opts->hdr);
+	}
+	if (fuzz_rand(state) % 2) {
+		opts->tone.enabled = 1;
+		opts->tone.local = fuzz_rand(state) % 2 ?
+				   1 + fuzz_rand(state) % 255 : 0;
+	}
+	if (fuzz_rand(state) % 2) {
+		struct temporal_fmt *tn = &opts->temporal;
+
+		/* RGBA output */
+		if (fuzz_rand(state) % 2) {
+			tn->enabled = 1;
+			tn->strength = fuzz_rand(state) % 256;
+			tn->threshold = 1 + fuzz_rand(state) % 255;
+		} else if (fuzz_rand(state) % 2) {
+			int out_w, out_h;
+
+			orient_size(fmt, opts->orient, &out_w, &out_h);
+			if (out_w % 8 == 0 && out_h % 2 == 0 &&
+			    fuzz_rand(state) % 2)
+				opts->output = fuzz_rand(state) % 2 ?
+					       OUTPUT_NV12 : OUTPUT_I420;
+			else if ((long)out_w * out_h % 4 == 0)
+				opts->output = OUTPUT_GRAY;
 		}
-		glGetShaderInfoLog(conv->compute_shader, param, NULL,
-				   compile_log);
-		if (glGetError() == GL_NO_ERROR)
-			printf("glCompileShader failed:\n"
-			       "--- log ---\n%s\n--- log ---\n", compile_log);
-		free(compile_log);
-		return GL_TRUE;
+		return;
 	}
 
-	conv->shader_program = glCreateProgram();
-	if(!conv->shader_program) {
-		err = glGetError();
-		goto err_del_shader;
+	opts->output = OUTPUT_TENSOR;
+	t->layout = fuzz_rand(state) % 2;
+	t->type = fuzz_rand(state) % 4;
+	t->bgr = fuzz_rand(state) % 2;
+	/* down- and upscaling, the plane must be a multiple of 4 bytes */
+	t->width = 4 * (1 + fuzz_rand(state) % 24);
+	t->height = 1 + fuzz_rand(state) % 40;
+	for (c = 0; c < 3; c++) {
+		t->mean[c] = (fuzz_rand(state) % 256) / 255.0f;
+		t->std[c] = (1 + fuzz_rand(state) % 100) / 100.0f;
 	}
+	t->scale = (1 + fuzz_rand(state) % 100) / 1000.0f;
+	t->zero_point = (int)(fuzz_rand(state) % 256) - 128;
+	tensor_init(t, 0, 0);	/* the size is set already */
+}
 
-	glAttachShader(conv->shader_program, conv->compute_shader);
-	if ((err = glGetError()) != GL_NO_ERROR)
-		goto err_del_program;
+/*
+ * For the temporal denoise and the tone mapping the frame is processed
+ * after in_prev, the output of which is written to prev.
+ */
+/*
+ * The output of a tile depends on the input around it only, the ones of
+ * the unchanged input can be kept (see -I)
+ */
+static int tiles_independent(const struct frame_fmt *fmt,
+			     const struct debayer_opts *opts)
+{
+	return opts->output == OUTPUT_RGBA && !opts->remap.enabled &&
+	       !opts->tone.enabled && !opts->temporal.enabled &&
+	       (fmt->cfa != CFA_MONO || opts->post.enabled);
+}
 
-	glLinkProgram(conv->shader_program);
-	if ((err = glGetError()) != GL_NO_ERROR)
-		goto err_del_program;
+/*
+ * The incremental mode of the GL engine, on the RGBA output of the tiles
+ * (without the options which are not for it): after the frame with a few
+ * pixels changed, the tiles around them must be demosaiced again.
+ */
+static int fuzz_incremental(struct converter *conv, uint32_t *state,
+			    const struct frame_fmt *fmt,
+			    const struct debayer_opts *opts,
+			    const uint8_t *in, uint8_t *in_prev, long in_size)
+{
+	struct debayer_opts inc = *opts;
+	const uint8_t *gl_out;
+	uint8_t *ref;
+	long size;
+	int ret;
+	int k;
+
+	inc.output = OUTPUT_RGBA;
+	inc.remap.enabled = 0;
+	inc.tone.enabled = 0;
+	inc.temporal.enabled = 0;
+	if (!tiles_independent(fmt, &inc))
+		return 0;
+	size = output_size(fmt, &inc);
+	ref = malloc(size);
+	if (ref == NULL) {
+		printf("fuzz: out of memory\n");
+		return -1;
+	}
+	cpu_engines[0].process(fmt, &inc, in, ref);
+
+	memcpy(in_prev, in, in_size);
+	for (k = 0; k < 8; k++)
+		in_prev[fuzz_rand(state) % in_size] ^= 0x80;
+	inc.incremental = 1;
+	conv->tiles.valid = 0;
+	ret = run_shader(conv, fmt, &inc, in_prev);
+	if (ret == 0)
+		ret = run_shader(conv, fmt, &inc, in);
+	if (ret == 0) {
+		gl_out = (const uint8_t *)map_output(conv, size);
+		ret = gl_out ? fuzz_compare("gl -I", &inc, ref, gl_out,
+					    size) : -1;
+		if (gl_out)
+			unmap_output(conv);
+	}
+	if (ret)
+		printf("fuzz: incremental RGBA output, without remap, tone mapping and temporal denoise\n");
+	free(ref);
+	return ret;
+}
 
-	glDeleteShader(conv->compute_shader);
-	return 0;
+/*
+ * The atlas of a few frames of random sizes and bayer orders, with the
+ * orientation and the filters of the iteration: the GL engine demosaics
+ * them in one dispatch, cpu-ref one by one.
+ */
+static int fuzz_atlas(struct converter *conv, uint32_t *state,
+		      const struct debayer_opts *opts)
+{
+	struct debayer_opts at;
+	struct atlas a;
+	const uint8_t *gl_out = NULL;
+	uint8_t *ref = NULL;
+	int count = 2 + fuzz_rand(state) % 7;
+	int ret = -1;
+	int i;
 
-err_del_program:
-	glDeleteProgram(conv->shader_program);
-err_del_shader:
-	glDeleteShader(conv->compute_shader);
-	return err;
+	memset(&at, 0, sizeof(at));
+	at.orient = opts->orient;
+	at.denoise = opts->denoise;
+	at.post = opts->post;
+	memset(&a, 0, sizeof(a));
+	for (i = 0; i < count; i++) {
+		struct frame_fmt fmt = { .bits = 8, .cfa = CFA_BAYER };
+		uint8_t *in;
+		int added;
+
+		fmt.width = fuzz_dim(state, LSIZE_X, 160);
+		fmt.height = fuzz_dim(state, LSIZE_Y, 40);
+		fmt.stride = fmt.width + fuzz_rand(state) % 5;
+		fmt.order = fuzz_rand(state) % 4;
+		in = malloc(input_frame_size(&fmt));
+		if (in == NULL)
+			goto out;
+		fuzz_fill(state, in, input_frame_size(&fmt),
+			  fuzz_rand(state) % 4);
+		added = atlas_add(&a, &fmt, &at, in, NULL);
+		free(in);
+		if (added < 0)
+			goto out;
+	}
+	ref = malloc(a.out_size);
+	if (ref == NULL)
+		goto out;
+	for (i = 0; i < a.count; i++)
+		cpu_engines[0].process(&a.frames[i].fmt, &at,
+				       a.in + a.frames[i].in_offset,
+				       ref + a.frames[i].out_offset);
+
+	at.atlas = 1;
+	if (run_atlas(conv, &a, &at) == 0)
+		gl_out = (const uint8_t *)map_output(conv, a.out_size);
+	if (gl_out) {
+		ret = fuzz_compare("gl -A", &at, ref, gl_out, a.out_size);
+		unmap_output(conv);
+	}
+out:
+	if (ret)
+		printf("fuzz: atlas of %d frames, with the orientation, denoise and post-filter below only\n",
+		       a.count);
+	free(ref);
+	atlas_free(&a);
+	return ret;
 }
 
-int use_shader(GLuint shader_program)
+static void fuzz_process(const struct cpu_engine *e,
+			 const struct frame_fmt *fmt,
+			 struct debayer_opts *opts, const uint8_t *in,
+			 const uint8_t *in_prev, uint32_t *prev, void *out)
 {
-	glUseProgram(shader_program);
-	return (glGetError() != GL_NO_ERROR);
+	uint32_t hist[TONE_BINS];
+
+	memset(hist, 0, sizeof(hist));
+	opts->tone.hist = hist;
+	opts->temporal.prev = NULL;
+	if (opts->temporal.enabled || opts->tone.enabled) {
+		e->process(fmt, opts, in_prev, prev);
+		if (opts->temporal.enabled)
+			opts->temporal.prev = prev;
+	}
+	e->process(fmt, opts, in, out);
+	opts->tone.hist = NULL;
 }
 
-void free_shader(struct converter * conv)
+/*
+ * Differential testing: the random frames of random size, stride and
+ * bayer order are processed by every engine available, and the results
+ * must be bit-identical to the ones of the reference CPU engine.
+ * conv is NULL if the GL engine could not be initialized.
+ */
+static int fuzz(struct converter *conv, int iterations, uint32_t seed)
 {
-	/* glDeleteShader() had been called at this point */
-	glDeleteProgram(conv->shader_program);
+	const struct cpu_engine *e;
+	uint32_t state = seed ? seed : 1;
+	/* the frames of the loops of the shader, in all and gathered */
+	int xtrans[2] = { 0, 0 }, remosaic[2] = { 0, 0 }, post[2] = { 0, 0 };
+	int i;
+
+	printf("fuzz: %d iterations, seed %u\n", iterations, seed);
+	for (i = 0; i < iterations; i++) {
+		struct frame_fmt fmt;
+		struct debayer_opts opts;
+		const uint8_t *gl_out;
+		uint8_t *in, *ref, *out;
+		uint8_t *in_prev;
+		uint32_t *prev;
+		uint8_t *dark = NULL;
+		int32_t *columns = NULL;
+		long in_size, out_size;
+		int pattern;
+		int bpp;
+		long k;
+		int ret = 0;
+		int gathered;
+
+		fmt.width = fuzz_dim(&state, LSIZE_X, 160);
+		fmt.height = fuzz_dim(&state, LSIZE_Y, 40);
+		/* often enough for the 8x2 blocks of the YUV output */
+		if (fuzz_rand(&state) % 4 == 0) {
+			fmt.width = (fmt.width + 7) / 8 * 8;
+			fmt.height = (fmt.height + 7) / 8 * 8;
+		}
+		fmt.bits = fuzz_rand(&state) % 2 ? 9 + fuzz_rand(&state) % 8 : 8;
+		bpp = fmt.bits > 8 ? 2 : 1;
+		/* the 4x4 CFAs of the sensor size in multiples of 4 */
+		fmt.cfa = fuzz_rand(&state) % 4 ? CFA_BAYER :
+			  1 + fuzz_rand(&state) % 5;
+		if (cfa_remosaiced(fmt.cfa)) {
+			fmt.width = (fmt.width + 3) / 4 * 4;
+			fmt.height = (fmt.height + 3) / 4 * 4;
+		}
+		fmt.stride = (fmt.width * bpp + 3) / 4 * 4 +
+			     4 * (fuzz_rand(&state) % 3);
+		if (fmt.cfa == CFA_QUAD_BIN) {
+			fmt.width /= 2;
+			fmt.height /= 2;
+		}
+		fmt.order = fuzz_rand(&state) % 4;
+		pattern = fuzz_rand(&state) % 4;
+		fuzz_opts(&state, &fmt, &opts);
+		out_size = output_size(&fmt, &opts);
+
+		/* all the HDR exposures */
+		in_size = input_frame_size(&fmt) *
+			  (opts.hdr.enabled ? opts.hdr.frames : 1);
+		in = malloc(in_size);
+		in_prev = malloc(in_size);
+		ref = malloc(out_size);
+		out = malloc(out_size);
+		prev = malloc(out_size);
+		if (in == NULL || in_prev == NULL || ref == NULL ||
+		    out == NULL || prev == NULL) {
+			printf("fuzz: out of memory\n");
+			free(in);
+			free(in_prev);
+			free(ref);
+			free(out);
+			free(prev);
+			return -1;
+		}
+		/* the line padding is random too, it must not leak out */
+		fuzz_fill(&state, in, in_size, pattern);
+		/* the motion: the same frame with some pixels changed */
+		memcpy(in_prev, in, in_size);
+		fuzz_fill(&state, in_prev, in_size / 8, 0);
+
+		/* the calibration, saturating some of the pixels */
+		if (fuzz_rand(&state) % 3 == 0) {
+			dark = malloc(input_frame_size(&fmt));
+			if (dark && fuzz_rand(&state) % 2) {
+				fuzz_fill(&state, dark, input_frame_size(&fmt),
+					  0);
+				for (k = 0; k < input_frame_size(&fmt); k++)
+					dark[k] &= 0x1f;
+				opts.dark.frame = dark;
+			}
+			columns = malloc(sizeof(*columns) * 2 * fmt.width);
+			if (columns && (!opts.dark.frame ||
+					fuzz_rand(&state) % 2)) {
+				for (k = 0; k < 2 * fmt.width; k++)
+					columns[k] = ((int)(fuzz_rand(&state) % 64) -
+						      32) << (fmt.bits - 8);
+				opts.dark.columns = columns;
+			}
+			opts.dark.enabled = 1;
+		}
+
+		fuzz_process(&cpu_engines[0], &fmt, &opts, in, in_prev, prev,
+			     ref);
+		for (e = &cpu_engines[1]; e->name && ret == 0; e++) {
+			fuzz_process(e, &fmt, &opts, in, in_prev, prev, out);
+			ret = fuzz_compare(e->name, &opts, ref, out, out_size);
+		}
+		if (ret == 0 && conv) {
+			conv->history_size = 0;
+			conv->tone_bits = 0;
+			conv->dark_frame = NULL;
+			conv->dark_columns = NULL;
+			if (opts.temporal.enabled || opts.tone.enabled)
+				ret = run_shader(conv, &fmt, &opts, in_prev);
+			if (ret == 0)
+				ret = run_shader(conv, &fmt, &opts, in);
+			if (ret == 0) {
+				gl_out = (const uint8_t *)map_output(conv,
+								     out_size);
+				ret = gl_out ? fuzz_compare("gl", &opts, ref,
+							    gl_out, out_size) : -1;
+				if (gl_out)
+					unmap_output(conv);
+			}
+		}
+		if (ret == 0 && conv && (i & 1))
+			ret = fuzz_incremental(conv, &state, &fmt, &opts, in,
+					       in_prev, in_size);
+		if (ret == 0 && conv && i % 4 == 2)
+			ret = fuzz_atlas(conv, &state, &opts);
+
+		free(in);
+		free(in_prev);
+		free(ref);
+		free(out);
+		free(prev);
+		free(dark);
+		free(columns);
+		remap_free(&opts.remap);
+		if (ret) {
+			printf("fuzz: iteration %d failed: %dx%d stride %d %s %s %d bits pattern %d\n",
+			       i, fmt.width, fmt.height, fmt.stride,
+			       bayer_order_names[fmt.order], cfa_names[fmt.cfa],
+			       fmt.bits, pattern);
+			printf("fuzz: orientation %s\n",
+			       orientation_names[opts.orient]);
+			if (opts.remap.enabled)
+				printf("fuzz: remap k %g %g p %g %g f %g c %g %g\n",
+				       opts.remap.k[0], opts.remap.k[1],
+				       opts.remap.p[0], opts.remap.p[1],
+				       opts.remap.fx, opts.remap.cx,
+				       opts.remap.cy);
+			if (opts.hdr.enabled)
+				printf("fuzz: hdr %d frames ratios %d,%d,%d\n",
+				       opts.hdr.frames, opts.hdr.ratio[1],
+				       opts.hdr.ratio[2], opts.hdr.ratio[3]);
+			if (opts.dark.enabled)
+				printf("fuzz: calibration%s%s\n",
+				       opts.dark.frame ? " dark frame" : "",
+				       opts.dark.columns ? " columns" : "");
+			if (opts.denoise.enabled)
+				printf("fuzz: denoise %d,%d,%d\n",
+				       opts.denoise.strength[0],
+				       opts.denoise.strength[1],
+				       opts.denoise.strength[2]);
+			if (opts.post.enabled)
+				printf("fuzz: post-filter sharp %d%s\n",
+				       opts.post.sharpen,
+				       opts.post.chroma_median ? " chroma" : "");
+			if (opts.tone.enabled)
+				printf("fuzz: tone mapping %s %d\n",
+				       opts.tone.local ? "local" : "global",
+				       opts.tone.local);
+			if (opts.temporal.enabled)
+				printf("fuzz: temporal %d,%d\n",
+				       opts.temporal.strength,
+				       opts.temporal.threshold);
+			if (opts.output == OUTPUT_GRAY)
+				printf("fuzz: gray output\n");
+			if (output_yuv(opts.output))
+				printf("fuzz: %s output\n",
+				       opts.output == OUTPUT_NV12 ?
+				       "nv12" : "i420");
+			if (opts.output == OUTPUT_TENSOR)
+				printf("fuzz: tensor %s type %d %dx%d%s\n",
+				       opts.tensor.layout == TENSOR_CHW ?
+				       "chw" : "hwc", opts.tensor.type,
+				       opts.tensor.width, opts.tensor.height,
+				       opts.tensor.bgr ? " bgr" : "");
+			return -1;
+		}
+		gathered = opts.output != OUTPUT_RGBA || opts.remap.enabled;
+		xtrans[0] += fmt.cfa == CFA_XTRANS;
+		xtrans[1] += fmt.cfa == CFA_XTRANS && gathered;
+		remosaic[0] += cfa_remosaiced(fmt.cfa);
+		remosaic[1] += cfa_remosaiced(fmt.cfa) && gathered;
+		post[0] += opts.post.enabled;
+		post[1] += opts.post.enabled && gathered;
+	}
+	printf("fuzz: %d frames bit-identical on %s engines\n", iterations,
+	       conv ? "all the" : "the CPU");
+	printf("fuzz: %d X-Trans (%d gathered), %d remosaiced (%d), %d post-filtered (%d)\n",
+	       xtrans[0], xtrans[1], remosaic[0], remosaic[1], post[0],
+	       post[1]);
+	return 0;
 }
 
-#define LSIZE_X 32
-#define LSIZE_Y 8
-/* number of workgroups by X and Y */
-#define WG_NUM_X (1920 / LSIZE_X)
-#define WG_NUM_Y (1080 / LSIZE_Y)
+/*
+ * The atlas list: a line per frame, "<inputfile> <outputfile> [WxH
+ * [<order> [<stride>]]]", the ones not given are of -s, -f and -S (the
+ * width for the size given). The frame is the first one of the file.
+ */
+static int read_atlas_list(const char *fname, const struct frame_fmt *fmt,
+			   const struct debayer_opts *opts, struct atlas *a)
+{
+	char *list, *line, *next;
+	long size;
+	int n;
 
-#define USAGE \
-	"Usage: %s [-h] -s XxY -f <format> <inputfile> <outputfile>\n" \
-	"-f <order>   Specify input file format\n" \
-	"-s XxY       Specify input image size (e.g. 640x480)\n" \
-	"-h           Shows this help\n"
+	size = read_input_text_file(fname, &list);
+	if (size <= 0 || (line = realloc(list, size + 1)) == NULL) {
+		printf("Failed to read the atlas list \"%s\"\n", fname);
+		if (size > 0)
+			free(list);
+		return -1;
+	}
+	list = line;
+	list[size] = '\0';
+
+	for (n = 1; line; line = next, n++) {
+		char in_name[4096], out_name[4096], dims[64], order[64];
+		struct frame_fmt f = *fmt;
+		char *data = NULL;
+		long data_size;
+		int fields, bo, stride = 0;
+
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		fields = sscanf(line, "%4095s %4095s %63s %63s %d", in_name,
+				out_name, dims, order, &stride);
+		if (fields <= 0 || in_name[0] == '#')
+			continue;
+		if (fields < 2 ||
+		    (fields > 2 && (sscanf(dims, "%dx%d", &f.width,
+					   &f.height) != 2 ||
+				    f.width <= 0 || f.height <= 0)) ||
+		    (fields > 3 && parse_bayer_order(order, &bo) < 0)) {
+			printf("%s:%d: bad frame\n", fname, n);
+			goto fail;
+		}
+		if (fields > 3)
+			f.order = bo;
+		if (fields > 2)
+			f.stride = stride;
+		if (f.stride == 0)
+			f.stride = f.width;
+		if (f.stride < f.width) {
+			printf("%s:%d: bad stride\n", fname, n);
+			goto fail;
+		}
 
-static int parse_bayer_order(const char *p, int *bo)
+		data_size = read_input_bin_file(in_name, &data);
+		if (data_size < input_frame_size(&f)) {
+			printf("\"%s\" is too short for %dx%d frame\n", in_name,
+			       f.width, f.height);
+			if (data_size > 0)
+				free(data);
+			goto fail;
+		}
+		if (atlas_add(a, &f, opts, (uint8_t *)data, out_name) < 0) {
+			printf("out of memory\n");
+			free(data);
+			goto fail;
+		}
+		free(data);
+	}
+	free(list);
+	return 0;
+
+fail:
+	free(list);
+	return -1;
+}
+
+/* the throughput of the atlas, and the output of each frame to its file */
+static int write_atlas(const struct atlas *a, const struct debayer_opts *opts,
+		       const void *data, int iterations, double ms,
+		       int quality)
 {
-	return -1; /* not implemented yet */
+	double pixels = 0;
+	int i;
+
+	for (i = 0; i < a->count; i++)
+		pixels += (double)a->frames[i].fmt.width *
+			  a->frames[i].fmt.height;
+	printf("%d frames, %d times: %.2f ms/atlas, %.3f ms/frame, %.1f Mpixel/s\n",
+	       a->count, iterations, ms / iterations,
+	       ms / iterations / a->count, pixels * iterations / ms / 1000.0);
+	if (atlas_write(a, opts, data, quality) < 0)
+		return -1;
+	printf("%d frames written\n", a->count);
+	return 0;
+}
+
+/*
+ * The frames of the atlas list: the GL engine demosaics all of them in
+ * one dispatch, a CPU one frame by frame
+ */
+static int process_atlas(struct converter *conv, const char *list,
+			 const struct frame_fmt *fmt,
+			 struct debayer_opts *opts,
+			 const struct cpu_engine *cpu_eng, int iterations,
+			 int quality)
+{
+	struct atlas a;
+	const void *data;
+	uint8_t *out = NULL;
+	double start, ms = 0;
+	int ret = -1;
+	int i, k;
+
+	memset(&a, 0, sizeof(a));
+	if (read_atlas_list(list, fmt, opts, &a) < 0)
+		goto out;
+	if (a.count == 0) {
+		printf("no frames in \"%s\"\n", list);
+		goto out;
+	}
+
+	if (cpu_eng) {
+		out = malloc(a.out_size);
+		if (out == NULL) {
+			printf("out of memory\n");
+			goto out;
+		}
+		for (i = 0; i < iterations; i++) {
+			start = time_ms();
+			for (k = 0; k < a.count; k++)
+				cpu_eng->process(&a.frames[k].fmt, opts,
+						 a.in + a.frames[k].in_offset,
+						 out + a.frames[k].out_offset);
+			ms += time_ms() - start;
+		}
+		ret = write_atlas(&a, opts, out, iterations, ms, quality);
+		goto out;
+	}
+
+	if (init_egl(conv, RENDER_NODE_FNAME) != 0) {
+		printf("EGL initialization failed\n");
+		goto out;
+	}
+	glGenBuffers(bo_num, conv->bos);
+	opts->atlas = 1;
+	for (i = 0; i < iterations; i++) {
+		start = time_ms();
+		if (run_atlas(conv, &a, opts) != 0)
+			break;
+		ms += time_ms() - start;
+	}
+	data = i == iterations ? map_output(conv, a.out_size) : NULL;
+	if (data) {
+		ret = write_atlas(&a, opts, data, iterations, ms, quality);
+		unmap_output(conv);
+	}
+	glDeleteBuffers(bo_num, conv->bos);
+	if (conv->shader_program)
+		free_shader(conv);
+	deinit_egl(conv);
+out:
+	free(out);
+	atlas_free(&a);
+	return ret;
 }
 
 int main(int argc, char* argv[])
 {
 	struct converter cvt;
+	struct frame_fmt fmt = {
+		.width = 1920,
+		.height = 1080,
+		.stride = 0,
+		.order = BAYER_BGGR,
+		.bits = 8,
+	};
+	static struct debayer_opts opts;
+	static uint32_t tone_hist[TONE_BINS];
+	const struct cpu_engine *cpu_eng = NULL;
 	int b_ord = -1;
+	const char *dark_spec = NULL;
+	const char *atlas_list = NULL;
+	int pipeline = 0;
+	int fuzz_iterations = 0;
+	unsigned int fuzz_seed = 0;
 	char *p_data_in; /* copy of the data from the input file */
+	struct archive_stream *stream = NULL;	/* or the streamed frames */
+	struct dng_image dng;
+	struct output_file out = { .quality = 90 };
+	struct cache cache = { .dir = NULL };
 	long data_in_size, data_out_size;
+	long frame_size, frames;
+	int iterations = 1;
+	double start, ms = 0;
+	long skipped = 0;	/* tiles, in the incremental mode */
+	int ret = -1;
 	int i;
 
+	memset(&cvt, 0, sizeof(cvt));
 	cvt.shader_fname = SHADER_FNAME;
 
 	/* Process cmd line options */
 	for (;;) {
-		int c = getopt(argc, argv, "f:h");
+		int c = getopt(argc, argv, "e:f:s:S:t:gy:Y:q:ZO:L:D:P:T:C:b:H:K:M:Ic:A:p:n:F:h");
 		if (c == -1) break;
+		cache_option(&cache, c, optarg);
 		switch (c) {
+		case 'e':
+			if (strcmp(optarg, "gl") == 0)
+				break;
+			cpu_eng = cpu_engine_find(optarg);
+			if (cpu_eng == NULL) {
+				printf("unknown engine \"%s\"\n", optarg);
+				return -1;
+			}
+			break;
 		case 'f':
 			if (parse_bayer_order(optarg, &b_ord) < 0) {
 				printf("bad bayer order\n");
 				return -1;;
 			}
+			fmt.order = b_ord;
+			break;
+		case 's':
+			if (sscanf(optarg, "%dx%d", &fmt.width,
+				   &fmt.height) != 2 ||
+			    fmt.width <= 0 || fmt.height <= 0) {
+				printf("bad image size\n");
+				return -1;
+			}
+			break;
+		case 'S':
+			fmt.stride = atoi(optarg);
+			break;
+		case 't':
+			if (tensor_parse(optarg, &opts.tensor) < 0) {
+				printf("bad tensor format\n");
+				return -1;
+			}
+			opts.output = OUTPUT_TENSOR;
+			break;
+		case 'g':
+			opts.output = OUTPUT_GRAY;
+			break;
+		case 'y':
+			if (!strcmp(optarg, "i420")) {
+				opts.output = OUTPUT_I420;
+			} else if (!strcmp(optarg, "nv12")) {
+				opts.output = OUTPUT_NV12;
+			} else {
+				printf("bad YUV format\n");
+				return -1;
+			}
+			break;
+		case 'q':
+			out.quality = atoi(optarg);
+			if (out.quality < 1 || out.quality > 100) {
+				printf("bad JPEG quality\n");
+				return -1;
+			}
+			break;
+		case 'Z':
+			out.rawz = 1;
+			break;
+		case 'Y':
+			if (parse_y4m(optarg, &out.y4m) < 0) {
+				printf("bad frame rate\n");
+				return -1;
+			}
+			break;
+		case 'O':
+			if (parse_orientation(optarg, &opts.orient) < 0) {
+				printf("bad orientation\n");
+				return -1;
+			}
+			break;
+		case 'L':
+			if (remap_parse(optarg, &opts.remap) < 0) {
+				printf("bad distortion model\n");
+				return -1;
+			}
+			break;
+		case 'D':
+			if (parse_denoise(optarg, &opts.denoise) < 0) {
+				printf("bad denoise strength\n");
+				return -1;
+			}
+			break;
+		case 'P':
+			if (parse_postfilter(optarg, &opts.post) < 0) {
+				printf("bad post-filter\n");
+				return -1;
+			}
+			break;
+		case 'T':
+			if (parse_temporal(optarg, &opts.temporal) < 0) {
+				printf("bad temporal denoise parameters\n");
+				return -1;
+			}
+			break;
+		case 'C':
+			if (parse_cfa(optarg, &fmt.cfa) < 0) {
+				printf("bad colour filter array\n");
+				return -1;
+			}
+			break;
+		case 'b':
+			fmt.bits = atoi(optarg);
+			if (fmt.bits < 8 || fmt.bits > 16) {
+				printf("bad bits per pixel\n");
+				return -1;
+			}
+			break;
+		case 'H':
+			if (hdr_parse(optarg, &opts.hdr) < 0) {
+				printf("bad exposure ratios\n");
+				return -1;
+			}
+			break;
+		case 'K':
+			dark_spec = optarg;
+			break;
+		case 'M':
+			if (tone_parse(optarg, &opts.tone) < 0) {
+				printf("bad tone mapping\n");
+				return -1;
+			}
+			break;
+		case 'I':
+			opts.incremental = 1;
+			break;
+		case 'c':
+			cache.dir = optarg;
+			break;
+		case 'A':
+			atlas_list = optarg;
+			break;
+		case 'p':
+			if (pipeline_read(optarg, &argc, &argv) < 0)
+				return -1;
+			pipeline = 1;
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			if (iterations <= 0) {
+				printf("bad number of iterations\n");
+				return -1;
+			}
+			break;
+		case 'F':
+			if (sscanf(optarg, "%d,%u", &fuzz_iterations,
+				   &fuzz_seed) < 1 || fuzz_iterations <= 0) {
+				printf("bad number of iterations\n");
+				return -1;
+			}
+			if (fuzz_seed == 0)
+				fuzz_seed = time(NULL);
 			break;
 		case 'h':
-			printf(USAGE, argv[0]);
+			printf(USAGE, argv[0], argv[0], argv[0]);
 			return 0;
 		}
 	}
+
+	if (fuzz_iterations) {
+		/* the CPU engines are still worth testing without GL */
+		if (init_egl(&cvt, RENDER_NODE_FNAME) != 0) {
+			printf("GL engine is not available\n");
+			return fuzz(NULL, fuzz_iterations, fuzz_seed) ? 1 : 0;
+		}
+		glGenBuffers(bo_num, cvt.bos);
+		ret = fuzz(&cvt, fuzz_iterations, fuzz_seed) ? 1 : 0;
+		glDeleteBuffers(bo_num, cvt.bos);
+		if (cvt.shader_program)
+			free_shader(&cvt);
+		deinit_egl(&cvt);
+		return ret;
+	}
+
+	if (atlas_list) {
+		if (argc != optind) {
+			printf("-A takes the input and output files from the list\n");
+			return -1;
+		}
+		if (fmt.bits > 8 || fmt.cfa != CFA_BAYER ||
+		    opts.output != OUTPUT_RGBA || opts.remap.enabled ||
+		    opts.tone.enabled || opts.temporal.enabled ||
+		    opts.hdr.enabled || dark_spec || opts.incremental ||
+		    out.y4m.enabled || out.rawz || cache.dir) {
+			printf("-A needs the 8-bit Bayer frames and the RGBA output, without -L, -M, -T, -H, -K, -I, -Y, -Z and -c\n");
+			return -1;
+		}
+		return process_atlas(&cvt, atlas_list, &fmt, &opts, cpu_eng,
+				     iterations, out.quality) ? -1 : 0;
+	}
+
 	if (argc - optind != 2) {
 		printf("Give input and output files\n");
 		return -1;
 	}
+	/* the frame format of a DNG file is the one of its raw image */
+	switch (dng_open(argv[optind], &dng)) {
+	case -1:
+		printf("Failed to read DNG file \"%s\"\n", argv[optind]);
+		return -1;
+	case 0:
+		fmt = dng.fmt;
+		print_dng(argv[optind], &dng);
+		break;
+	}
+	if (fmt.stride == 0)
+		fmt.stride = fmt.width * (fmt.bits > 8 ? 2 : 1);
+	if (fmt.stride < fmt.width * (fmt.bits > 8 ? 2 : 1)) {
+		printf("bad stride\n");
+		return -1;
+	}
+	/* -s is the size of the sensor, fmt is of the Bayer frame */
+	if (cfa_remosaiced(fmt.cfa) && (fmt.width % 4 || fmt.height % 4)) {
+		printf("the size must be a multiple of 4 for the %s CFA\n",
+		       cfa_names[fmt.cfa]);
+		return -1;
+	}
+	if (fmt.cfa == CFA_QUAD_BIN) {
+		fmt.width /= 2;
+		fmt.height /= 2;
+	}
+	if (opts.remap.enabled && remap_init(&opts.remap, &fmt) < 0) {
+		printf("out of memory\n");
+		return -1;
+	}
+	if (merged_bits(&fmt, &opts) > 16) {
+		printf("the exposure ratios need more than 16 bits\n");
+		return -1;
+	}
+	if (dark_spec && load_calibration(dark_spec, &fmt, &opts.dark) < 0) {
+		printf("bad calibration data\n");
+		return -1;
+	}
+	if (!dark_spec && dng.black > 0 &&
+	    dng_calibration(&dng, &opts.dark) < 0) {
+		printf("out of memory\n");
+		return -1;
+	}
+	if (opts.output == OUTPUT_TENSOR) {
+		int out_w, out_h;
 
-	/* Read the file to process into memory */
-	data_in_size = read_input_bin_file(argv[optind], &p_data_in);
+		orient_size(&fmt, opts.orient, &out_w, &out_h);
+		if (tensor_init(&opts.tensor, out_w, out_h) < 0)
+			return -1;
+	}
+
+	if (opts.temporal.enabled && opts.output != OUTPUT_RGBA) {
+		printf("the temporal denoise needs the RGBA output\n");
+		return -1;
+	}
+	if (opts.denoise.enabled &&
+	    (fmt.cfa == CFA_XTRANS || fmt.cfa == CFA_MONO)) {
+		printf("the denoise is not supported for the %s CFA\n",
+		       cfa_names[fmt.cfa]);
+		return -1;
+	}
+	/* the shader writes the gray image by 32-bit words */
+	if (opts.output == OUTPUT_GRAY && (long)fmt.width * fmt.height % 4) {
+		printf("gray: %dx%d is not a multiple of 4 pixels\n",
+		       fmt.width, fmt.height);
+		return -1;
+	}
+	if (output_yuv(opts.output)) {
+		int out_w, out_h;
+
+		orient_size(&fmt, opts.orient, &out_w, &out_h);
+		if (out_w % 8 || out_h % 2) {
+			printf("yuv: %dx%d is not a multiple of 8x2 pixels\n",
+			       out_w, out_h);
+			return -1;
+		}
+	}
+	if (out.y4m.enabled && opts.output == OUTPUT_NV12) {
+		/* the decoders would read its UV plane as the U and V ones */
+		printf("Y4M has no NV12 layout, use -y i420 with -Y\n");
+		return -1;
+	}
+	if (out.y4m.enabled && (fmt.cfa == CFA_RGBIR ||
+			    (opts.output != OUTPUT_I420 &&
+			     opts.output != OUTPUT_GRAY))) {
+		printf("Y4M needs the I420 or gray output, without IR\n");
+		return -1;
+	}
+	if (opts.incremental && (cpu_eng || !tiles_independent(&fmt, &opts))) {
+		printf("-I needs the gl engine and the RGBA output (post-filtered for mono), without -L, -M and -T\n");
+		return -1;
+	}
+	if (cache.dir && !strcmp(argv[optind+1], "-")) {
+		printf("-c needs an output file, not the standard output\n");
+		return -1;
+	}
+
+	if (pipeline)
+		pipeline_plan(&fmt, &opts, cpu_eng ? cpu_eng->name : "gl");
+
+	/* the output files of the same input and options, from the cache */
+	if (cache.dir) {
+		long files = cache_lookup(&cache, argv[optind],
+					  cvt.shader_fname);
+		enum image_format image = out.rawz ? IMAGE_RAW :
+					  image_format(argv[optind+1]);
+
+		if (files < 0) {
+			printf("Failed to read input file \"%s\"\n",
+			       argv[optind]);
+			free_input(NULL, NULL, &dng);
+			return -1;
+		}
+		if (files > 0 && (image == IMAGE_RAW ||
+				  check_image_name(argv[optind+1], files) == 0) &&
+		    cache_fetch(&cache, argv[optind+1], image, files) == 0) {
+			free_input(NULL, NULL, &dng);
+			remap_free(&opts.remap);
+			free_calibration(&opts.dark);
+			return 0;
+		}
+	}
+
+	/* a stream of frames one after another, the exposures for HDR */
+	frame_size = input_frame_size(&fmt) *
+		     (opts.hdr.enabled ? opts.hdr.frames : 1);
+
+	/*
+	 * Read the file to process into memory, unless it is mapped, or
+	 * decompress it: frame by frame ahead of the engine, or all of it
+	 * up front for -Z and for the replay of -n if it isn't too large
+	 */
+	if (dng.data) {
+		p_data_in = (char *)dng.data;
+		data_in_size = input_frame_size(&fmt);
+	} else {
+		if (!out.rawz)
+			stream = archive_open(argv[optind], frame_size,
+					      iterations > 1, &frames);
+		if (stream && iterations > 1 &&
+		    frames * frame_size <= ARCHIVE_REPLAY_MAX) {
+			archive_close(stream);
+			stream = NULL;
+		}
+		if (stream) {
+			p_data_in = NULL;
+			data_in_size = frames * frame_size;
+		} else {
+			data_in_size = archive_read(argv[optind], &p_data_in);
+		}
+		if (data_in_size == 0)
+			data_in_size = rawz_read(argv[optind], &fmt,
+						 &p_data_in);
+		if (data_in_size == 0)
+			data_in_size = read_input_bin_file(argv[optind],
+							   &p_data_in);
+	}
 	if (data_in_size <= 0) {
 		printf("Failed to read input file \"%s\"\n", argv[optind]);
 		return -1;
 	}
-	data_out_size = 4 * data_in_size;
+	frames = data_in_size / frame_size;
+	if (frames == 0) {
+		printf("\"%s\" is too short for %dx%d frame\n", argv[optind],
+		       fmt.width, fmt.height);
+		free_input(p_data_in, stream, &dng);
+		return -1;
+	}
+	data_out_size = output_size(&fmt, &opts);
+
+	/* the JPEG and PNG files are written frame by frame */
+	out.name = argv[optind+1];
+	out.image = out.rawz ? IMAGE_RAW : image_format(out.name);
+	if (out.image != IMAGE_RAW) {
+		if ((opts.output != OUTPUT_RGBA &&
+		     opts.output != OUTPUT_GRAY) || out.y4m.enabled ||
+		    check_image_name(out.name, frames) < 0) {
+			printf("the images need the RGBA or gray output, and %%d in \"%s\" for the frames\n",
+			       out.name);
+			free_input(p_data_in, stream, &dng);
+			return -1;
+		}
+	} else if (out.rawz && out.y4m.enabled) {
+		printf("-Z writes the input frames, not Y4M\n");
+		free_input(p_data_in, stream, &dng);
+		return -1;
+	} else if (!strcmp(out.name, "-")) {
+		/* the standard output, the messages go to stderr then */
+		int fd = dup(STDOUT_FILENO);
+
+		fflush(stdout);
+		out.fp = fd < 0 ? NULL : fdopen(fd, "wb");
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+	} else {
+		out.fp = fopen(out.name, "wb");
+	}
+	if (out.image == IMAGE_RAW &&
+	    (out.fp == NULL || y4m_header(out.fp, &out.y4m, &fmt, &opts) < 0)) {
+		printf("Failed to open output file \"%s\"\n", out.name);
+		if (out.fp)
+			fclose(out.fp);
+		free_input(p_data_in, stream, &dng);
+		return -1;
+	}
+
+	if (out.rawz) {
+		long size = rawz_write(out.fp, &fmt, (uint8_t *)p_data_in,
+				       frames);
+
+		if (size < 0) {
+			printf("Failed to write \"%s\"\n", out.name);
+		} else {
+			print_written(&out, size);
+			cache_output(&cache, &out);
+		}
+		fclose(out.fp);
+		free_input(p_data_in, stream, &dng);
+		remap_free(&opts.remap);
+		free_calibration(&opts.dark);
+		return size < 0 ? -1 : 0;
+	}
+
+	if (cpu_eng) {
+		/* the previous output is kept for the temporal denoise */
+		int nbufs = opts.temporal.enabled ? 2 : 1;
+		uint32_t *bufs[2] = { NULL, NULL };
+
+		/* the histogram goes from one frame to the next one */
+		opts.tone.hist = tone_hist;
+
+		for (i = 0; i < nbufs; i++)
+			bufs[i] = malloc(data_out_size);
+		if (bufs[0] == NULL || bufs[nbufs - 1] == NULL) {
+			printf("out of memory\n");
+			goto cpu_exit;
+		}
+
+		for (i = 0; i < iterations * frames; i++) {
+			uint32_t *data = bufs[i % nbufs];
+			const uint8_t *in = input_frame(p_data_in, stream, i,
+							frames, frame_size);
+
+			if (in == NULL)
+				break;
+			opts.temporal.prev = i ? bufs[(i + 1) % nbufs] : NULL;
+			start = time_ms();
+			cpu_eng->process(&fmt, &opts, in, data);
+			ms += time_ms() - start;
+
+			/* the output of the last pass through the frames */
+			if (i >= (iterations - 1) * frames &&
+			    write_frame(&out, &fmt, &opts, data,
+					data_out_size) < 0)
+				break;
+		}
+		if (i == iterations * frames) {
+			print_throughput(&fmt, i, ms);
+			print_written(&out, data_out_size * frames);
+			cache_output(&cache, &out);
+			ret = 0;
+		}
+cpu_exit:
+		free(bufs[0]);
+		free(bufs[1]);
+		if (out.fp)
+			fclose(out.fp);
+		free_input(p_data_in, stream, &dng);
+		remap_free(&opts.remap);
+		free_calibration(&opts.dark);
+		return ret;
+	}
 
 	/* Initialize OpenGL stuff */
 	if (init_egl(&cvt, RENDER_NODE_FNAME) != 0) {
@@ -374,79 +1644,69 @@ int main(int argc, char* argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	if (init_shader(&cvt) != 0) {
+	if (configure_shader(&cvt, &fmt, &opts) != 0) {
 		printf("Shader creation failed\n");
 		exit(EXIT_FAILURE);
 	}
 
 	/* Do the things here... */
-	GLenum err;
-	void *data;
 	glGenBuffers(bo_num, cvt.bos);
 
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cvt.bos[bo_in]);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizei)data_in_size,
-		     p_data_in, GL_STREAM_DRAW);
-	err = glGetError();
-	if (err != GL_NO_ERROR) {
-		printf("glBufferData(in, size=%ld) error 0x%04X\n",
-		       data_in_size, err);
-		goto err_buffs;
-	}
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cvt.bos[bo_out]);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizei)data_out_size,
-		     NULL, GL_STREAM_READ);
-	err = glGetError();
-	if (err != GL_NO_ERROR) {
-		printf("glBufferData(out, size=%ld) error 0x%04X\n",
-		       data_out_size, err);
-		goto err_buffs;
-	}
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, cvt.bos[bo_in]);
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, cvt.bos[bo_out]);
-	GLsync sync;
-	for (i=0; i < 1; i++) {
-		if (use_shader(cvt.shader_program) != 0) {
-			printf("use_shader() failed \n");
-			break;
-		}
-		glDispatchCompute(WG_NUM_X, WG_NUM_Y, 1);
+	for (i = 0; i < iterations * frames; i++) {
+		const uint8_t *in = input_frame(p_data_in, stream, i, frames,
+						frame_size);
+		const void *data;
+		int written;
 
-		err = glGetError();
-		if (err != GL_NO_ERROR) {
-			printf("glDispatchCompute() error 0x%04X\n", err);
+		if (in == NULL)
 			break;
+		start = time_ms();
+		if (run_shader(&cvt, &fmt, &opts, in) != 0)
+			break;
+		ms += time_ms() - start;
+		if (opts.incremental) {
+			int total = cvt.tiles.tiles_x * cvt.tiles.tiles_y;
+
+			skipped += total - cvt.tiles.count;
+			if (i >= (iterations - 1) * frames)
+				printf("frame %ld: %d of %d tiles skipped (%.1f%%)\n",
+				       i % frames, total - cvt.tiles.count,
+				       total, 100.0 * (total - cvt.tiles.count) /
+				       total);
 		}
+		if (i < (iterations - 1) * frames)
+			continue;
 
-		glMemoryBarrier(GL_ALL_BARRIER_BITS);
-
-		sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		/* Write the output buffer to the file */
+		data = map_output(&cvt, data_out_size);
+		if (data == NULL)
+			break;
+		written = write_frame(&out, &fmt, &opts, data, data_out_size);
+		unmap_output(&cvt);
+		if (written < 0)
+			break;
 	}
-
-	glClientWaitSync(sync, GL_SYNC_FLUSH_COMMANDS_BIT,
-			 100*1000 /* 100mS */);
-
-	/* Write the output buffer to the file */
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cvt.bos[bo_out]);
-	data = glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, data_out_size,
-				GL_MAP_READ_BIT);
-	if (data == NULL) {
-		printf("glMapBufferRange(out) error 0x%04X\n",
-		       glGetError());
-	} else {
-		if (write_output_file(argv[optind+1], data, data_out_size)
-		    == data_out_size)
-			printf("%s: %ld bytes written\n", argv[optind+1],
-			       data_out_size);
-		glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+	if (i == iterations * frames) {
+		print_throughput(&fmt, i, ms);
+		if (opts.incremental)
+			printf("%.1f%% of the tiles skipped\n",
+			       100.0 * skipped / ((double)i *
+						  cvt.tiles.tiles_x *
+						  cvt.tiles.tiles_y));
+		print_written(&out, data_out_size * frames);
+		cache_output(&cache, &out);
+		ret = 0;
 	}
 
 	/* Cleanup and exit */
-err_buffs:
-	/* glDeleteTextures(1, &cvt.tbo_tex); */
 	glDeleteBuffers(bo_num, cvt.bos);
+	tile_map_free(&cvt.tiles);
 	free_shader(&cvt);
 	deinit_egl(&cvt);
-	free(p_data_in);
-	return err;
+	if (out.fp)
+		fclose(out.fp);
+	free_input(p_data_in, stream, &dng);
+	remap_free(&opts.remap);
+	free_calibration(&opts.dark);
+	return ret;
 }
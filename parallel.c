@@ -0,0 +1,81 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * Worker threads: the iterations of a loop are shared by the threads on
+ * all the online CPUs, the calling thread included.
+ *
+ * Copyright (C) 2021, Linaro
+ */
+
+#define _POSIX_C_SOURCE 200809L	/* sysconf() */
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "debayer.h"
+
+#define PARALLEL_MAX_THREADS 64
+
+struct parallel_job {
+	void (*fn)(void *arg, int i);
+	void *arg;
+	int count;
+	int next;		/* the next iteration to run */
+	pthread_mutex_t lock;
+};
+
+static void *parallel_worker(void *p)
+{
+	struct parallel_job *job = p;
+
+	for (;;) {
+		int i;
+
+		pthread_mutex_lock(&job->lock);
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->count)
+			break;
+		job->fn(job->arg, i);
+	}
+	return NULL;
+}
+
+int parallel_threads(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 1)
+		return 1;
+	return n < PARALLEL_MAX_THREADS ? n : PARALLEL_MAX_THREADS;
+}
+
+/*
+ * Runs fn(arg, i) for i = 0..count-1 in any order, and returns when all
+ * are done. If the threads can't be created, the calling one runs all.
+ */
+void parallel_for(int count, void (*fn)(void *arg, int i), void *arg)
+{
+	pthread_t threads[PARALLEL_MAX_THREADS];
+	struct parallel_job job = {
+		.fn = fn,
+		.arg = arg,
+		.count = count,
+		.next = 0,
+	};
+	int n = parallel_threads();
+	int i, started = 0;
+
+	if (n > count)
+		n = count;
+	pthread_mutex_init(&job.lock, NULL);
+	for (i = 1; i < n; i++) {
+		if (pthread_create(&threads[started], NULL, parallel_worker,
+				   &job))
+			break;
+		started++;
+	}
+	parallel_worker(&job);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&job.lock);
+}
@@ -0,0 +1,495 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * The pipeline description: the ISP stages in a file, a line per stage,
+ * instead of the options, and the plan of the passes the engines run for
+ * them with the memory traffic of each, and for gl the configuration of
+ * the shader program of each pass.
+ *
+ * The stages go in the order the engines apply them:
+ *   input [WxH] [<order>] [bits=N] [stride=N]
+ *   dark <dark>[,<columns>]	-K
+ *   hdr <ratios>		-H
+ *   tone global|local=N	-M
+ *   denoise <strength>		-D
+ *   demosaic [<cfa>]		-C
+ *   post <spec>		-P
+ *   lens <spec>		-L
+ *   orient <orient>		-O
+ *   temporal <strength>	-T
+ *   output [rgba|gray|i420|nv12|tensor=<spec>] [y4m=<fps>] [quality=N]
+ * and become these options, in place of -p.
+ *
+ * The per-pixel stages are fused into one pass (of the shader, or of the
+ * row loop of the cpu engine), the neighbourhood filters along with them
+ * through the halo of the tile or the ring of the rows; the passes are
+ * only split where a stage needs the whole frame: the tone statistics
+ * before the curve, the converted frame for the gathering outputs, and
+ * the IR plane.
+ *
+ * Copyright (C) 2021, Linaro
+ */
+
+#define _POSIX_C_SOURCE 200809L	/* strtok_r(), optind */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debayer.h"
+#include "gl.h"
+
+enum stage {
+	STAGE_INPUT,
+	STAGE_DARK,
+	STAGE_HDR,
+	STAGE_TONE,
+	STAGE_DENOISE,
+	STAGE_DEMOSAIC,
+	STAGE_POST,
+	STAGE_LENS,
+	STAGE_ORIENT,
+	STAGE_TEMPORAL,
+	STAGE_OUTPUT,
+	STAGE_NUM
+};
+
+static const struct {
+	const char *name;
+	int opt;		/* of the argument, 0 if parsed here */
+} stages[STAGE_NUM] = {
+	[STAGE_INPUT] = { "input", 0 },
+	[STAGE_DARK] = { "dark", 'K' },
+	[STAGE_HDR] = { "hdr", 'H' },
+	[STAGE_TONE] = { "tone", 'M' },
+	[STAGE_DENOISE] = { "denoise", 'D' },
+	[STAGE_DEMOSAIC] = { "demosaic", 'C' },
+	[STAGE_POST] = { "post", 'P' },
+	[STAGE_LENS] = { "lens", 'L' },
+	[STAGE_ORIENT] = { "orient", 'O' },
+	[STAGE_TEMPORAL] = { "temporal", 'T' },
+	[STAGE_OUTPUT] = { "output", 0 },
+};
+
+/* the options of the file, and the argv they are spliced into */
+static char *pipeline_text;
+static char **pipeline_argv;
+
+static const char *option_name(int opt)
+{
+	static const char names[] = "-K\0-H\0-M\0-D\0-C\0-P\0-L\0-O\0-T\0"
+				    "-s\0-f\0-b\0-S\0-g\0-y\0-t\0-Y\0-q";
+	const char *p;
+
+	for (p = names; ; p += 3)
+		if (p[1] == opt)
+			return p;
+}
+
+/* the options of a word of the input or output stage */
+static int stage_word(enum stage stage, char *word, const char **args,
+		      int *n)
+{
+	static const char * const orders[] = { "RGGB", "GRBG", "GBRG",
+						"BGGR" };
+	char *value = strchr(word, '=');
+	int width, height;
+	unsigned int i;
+
+	if (value)
+		*value++ = '\0';
+#define ARG(opt, arg) (args[(*n)++] = option_name(opt), args[(*n)++] = (arg))
+	if (stage == STAGE_INPUT) {
+		if (value == NULL && sscanf(word, "%dx%d", &width,
+					    &height) == 2)
+			return ARG('s', word), 0;
+		for (i = 0; value == NULL && i < 4; i++)
+			if (!strcmp(word, orders[i]))
+				return ARG('f', word), 0;
+		if (value && !strcmp(word, "bits"))
+			return ARG('b', value), 0;
+		if (value && !strcmp(word, "stride"))
+			return ARG('S', value), 0;
+		return -1;
+	}
+	if (value == NULL && !strcmp(word, "rgba"))
+		return 0;
+	if (value == NULL && !strcmp(word, "gray"))
+		return args[(*n)++] = option_name('g'), 0;
+	if (value == NULL && (!strcmp(word, "i420") || !strcmp(word, "nv12")))
+		return ARG('y', word), 0;
+	if (value && !strcmp(word, "tensor"))
+		return ARG('t', value), 0;
+	if (value && !strcmp(word, "y4m"))
+		return ARG('Y', value), 0;
+	if (value && !strcmp(word, "quality"))
+		return ARG('q', value), 0;
+#undef ARG
+	return -1;
+}
+
+/*
+ * Reads the pipeline file, and inserts its options into argv at optind,
+ * where getopt() goes on with them.
+ */
+int pipeline_read(const char *fname, int *argc, char ***argv)
+{
+	enum stage last = STAGE_INPUT;
+	unsigned int seen = 0;
+	const char **args;
+	char *line, *next;
+	int n = 0, words = 0;
+	int i, line_no;
+	long size;
+	FILE *fp;
+
+	if (pipeline_text) {
+		printf("only one pipeline file can be given\n");
+		return -1;
+	}
+	fp = fopen(fname, "r");
+	if (fp == NULL || fseek(fp, 0, SEEK_END) < 0 ||
+	    (size = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) < 0 ||
+	    (pipeline_text = malloc(size + 1)) == NULL ||
+	    fread(pipeline_text, 1, size, fp) != (size_t)size) {
+		printf("Failed to read the pipeline file \"%s\"\n", fname);
+		if (fp)
+			fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	pipeline_text[size] = '\0';
+
+	/* at most two arguments per word */
+	for (i = 0; i < size; i++)
+		words += pipeline_text[i] == ' ' || pipeline_text[i] == '\t' ||
+			 pipeline_text[i] == '\n';
+	args = malloc(sizeof(*args) * (2 * words + 2));
+	pipeline_argv = malloc(sizeof(*pipeline_argv) *
+			       (*argc + 2 * words + 3));
+	if (args == NULL || pipeline_argv == NULL) {
+		printf("out of memory\n");
+		free(args);
+		return -1;
+	}
+
+	for (line = pipeline_text, line_no = 1; line; line = next, line_no++) {
+		char *word, *arg, *save;
+		enum stage s;
+
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		if (strchr(line, '#'))
+			*strchr(line, '#') = '\0';
+		word = strtok_r(line, " \t\r", &save);
+		if (word == NULL)
+			continue;
+		for (s = 0; s < STAGE_NUM; s++)
+			if (!strcmp(word, stages[s].name))
+				break;
+		if (s == STAGE_NUM) {
+			printf("%s:%d: unknown stage \"%s\"\n", fname, line_no,
+			       word);
+			goto fail;
+		}
+		if (seen & (1u << s)) {
+			printf("%s:%d: %s is already given\n", fname, line_no,
+			       stages[s].name);
+			goto fail;
+		}
+		if (s < last) {
+			printf("%s:%d: %s must come before %s\n", fname,
+			       line_no, stages[s].name, stages[last].name);
+			goto fail;
+		}
+		seen |= 1u << s;
+		last = s;
+
+		if (stages[s].opt) {
+			arg = strtok_r(NULL, " \t\r", &save);
+			/* the default CFA needs no argument */
+			if (arg == NULL && s == STAGE_DEMOSAIC)
+				continue;
+			if (arg == NULL || strtok_r(NULL, " \t\r", &save)) {
+				printf("%s:%d: %s takes one argument\n",
+				       fname, line_no, stages[s].name);
+				goto fail;
+			}
+			args[n++] = option_name(stages[s].opt);
+			args[n++] = arg;
+			continue;
+		}
+		while ((word = strtok_r(NULL, " \t\r", &save))) {
+			if (stage_word(s, word, args, &n) < 0) {
+				printf("%s:%d: bad %s \"%s\"\n", fname,
+				       line_no, stages[s].name, word);
+				goto fail;
+			}
+		}
+	}
+
+	/* getopt() only permutes the pointers, the strings are not written */
+	memcpy(pipeline_argv, *argv, sizeof(**argv) * optind);
+	memcpy(pipeline_argv + optind, args, sizeof(*args) * n);
+	memcpy(pipeline_argv + optind + n, *argv + optind,
+	       sizeof(**argv) * (*argc - optind + 1));
+	*argv = pipeline_argv;
+	*argc += n;
+	free(args);
+	return 0;
+
+fail:
+	free(args);
+	return -1;
+}
+
+/*
+ * a pass of the plan: its stages, the bytes it reads and writes, and the
+ * #defines of its shader program
+ */
+struct pass {
+	char stages[256];
+	const char *why;
+	long read, written;
+	char defines[512];
+};
+
+struct plan {
+	struct pass passes[8];
+	int count;
+	int unfused;		/* passes, one per stage */
+	long unfused_bytes;
+};
+
+static void add_stage(char *stages, const char *name)
+{
+	size_t len = strlen(stages);
+
+	snprintf(stages + len, 256 - len, "%s%s", len ? " > " : "", name);
+}
+
+/* a stage of its own in the unfused pipeline */
+static void unfused(struct plan *p, long read, long written)
+{
+	p->unfused++;
+	p->unfused_bytes += read + written;
+}
+
+/*
+ * The defines of the program, as configure_shader() builds them, in one
+ * line: NAME or NAME=value
+ */
+static void set_defines(struct pass *pass, const char *defines,
+			const char *program)
+{
+	size_t n = 0, len = sizeof(pass->defines);
+	const char *line;
+
+	pass->defines[0] = '\0';
+	for (line = defines; line && *line; line = strchr(line, '\n')) {
+		char text[128], name[64], value[64];
+		size_t end;
+		int words;
+
+		line += *line == '\n';
+		end = strcspn(line, "\n");
+		if (end >= sizeof(text))
+			end = sizeof(text) - 1;
+		memcpy(text, line, end);
+		text[end] = '\0';
+		words = sscanf(text, "#define %63s %63s", name, value);
+		if (words < 1 || n >= len)
+			continue;
+		n += snprintf(pass->defines + n, len - n, "%s%s%s%s",
+			      n ? " " : "", name, words == 2 ? "=" : "",
+			      words == 2 ? value : "");
+	}
+	if (program && n < len)
+		snprintf(pass->defines + n, len - n, "%s%s", n ? " " : "",
+			 program);
+}
+
+static struct pass *new_pass(struct plan *p, const char *why)
+{
+	struct pass *pass = &p->passes[p->count++];
+
+	memset(pass, 0, sizeof(*pass));
+	pass->why = why;
+	return pass;
+}
+
+/*
+ * Prints the plan of the engine for the frame: the passes, the stages
+ * fused in each, and the memory traffic of a frame, against the one of
+ * the pipeline of a pass per stage. The traffic counts each buffer once,
+ * plus the halo of the tiles the shader loads again for the neighbourhood
+ * filters.
+ */
+void pipeline_plan(const struct frame_fmt *fmt,
+		   const struct debayer_opts *opts, const char *engine)
+{
+	static const char * const cfa_names[] = {
+		[CFA_QUAD] = "remosaic", [CFA_QUAD_BIN] = "bin",
+		[CFA_RGBIR] = "remosaic",
+	};
+	static const char * const output_names[] = {
+		[OUTPUT_RGBA] = "rgba", [OUTPUT_TENSOR] = "tensor",
+		[OUTPUT_GRAY] = "gray", [OUTPUT_I420] = "i420",
+		[OUTPUT_NV12] = "nv12",
+	};
+	int gl = !strcmp(engine, "gl");
+	int gathered = opts->output != OUTPUT_RGBA || opts->remap.enabled;
+	int converted = input_converted(fmt, opts);
+	int exposures = opts->hdr.enabled ? opts->hdr.frames : 1;
+	long px = (long)fmt->width * fmt->height;
+	long in = input_frame_size(fmt) * exposures;
+	long ir = fmt->cfa == CFA_RGBIR ? ir_plane_size(fmt) : 0;
+	long out = output_size(fmt, opts) - ir;
+	long dark = 0, cur, main_in;
+	int radius = 0, lsize_x = LSIZE_X, lsize_y = LSIZE_Y;
+	struct plan p = { .count = 0 };
+	struct pass *pass;
+	char defines[512];
+	long total = 0;
+	int sensor_w, sensor_h;
+	int i;
+
+	sensor_size(fmt, &sensor_w, &sensor_h);
+	if (opts->dark.enabled && opts->dark.frame)
+		dark += input_frame_size(fmt);
+	if (opts->dark.enabled && opts->dark.columns)
+		dark += 2L * sensor_w;
+
+	/* the histogram (and the grid) before the curve */
+	if (opts->tone.enabled) {
+		pass = new_pass(&p, "the whole frame before the curve");
+		add_stage(pass->stages, "tone statistics");
+		pass->read = in / (TONE_STATS_STEP * TONE_STATS_STEP / 4);
+		unfused(&p, pass->read, 0);
+		if (gl) {
+			input_defines(fmt, opts, defines, sizeof(defines));
+			set_defines(pass, defines, "PASS_TONE_STATS");
+		}
+	}
+
+	/* the input conversion, a pass for the gathering outputs */
+	pass = new_pass(&p, NULL);
+	cur = in;
+	if (opts->dark.enabled) {
+		add_stage(pass->stages, "dark");
+		unfused(&p, cur + dark, cur);
+	}
+	if (opts->hdr.enabled) {
+		add_stage(pass->stages, "hdr");
+		unfused(&p, cur, 2L * sensor_w * sensor_h);
+		cur = 2L * sensor_w * sensor_h;
+	}
+	if (cfa_remosaiced(fmt->cfa)) {
+		add_stage(pass->stages, cfa_names[fmt->cfa]);
+		unfused(&p, cur, px * (merged_bits(fmt, opts) > 8 ? 2 : 1));
+		cur = px * (merged_bits(fmt, opts) > 8 ? 2 : 1);
+	}
+	if (opts->tone.enabled || merged_bits(fmt, opts) > 8) {
+		add_stage(pass->stages, opts->tone.enabled ? "tone" : "8-bit");
+		unfused(&p, cur, px);
+	}
+	main_in = in + dark;
+	if (converted && (gathered || !strcmp(engine, "cpu-ref"))) {
+		pass->why = gathered ? "the output gathers from the whole frame" :
+				       "the reference converts the frame first";
+		pass->read = in + dark;
+		pass->written = px;
+		main_in = px;
+		if (gl) {
+			input_defines(fmt, opts, defines, sizeof(defines));
+			set_defines(pass, defines, "PASS_CONVERT");
+		}
+		pass = new_pass(&p, NULL);
+	}
+
+	/* the rest in one pass, the filters through the halo */
+	if (opts->denoise.enabled) {
+		add_stage(pass->stages, "denoise 5x5");
+		unfused(&p, px, px);
+		radius += 2;
+	}
+	if (fmt->cfa == CFA_MONO) {
+		add_stage(pass->stages, "mono");
+	} else {
+		add_stage(pass->stages, fmt->cfa == CFA_XTRANS ?
+			  "demosaic x-trans 5x5" : "demosaic 5x5");
+		radius += 2;
+	}
+	unfused(&p, px, 4 * px);
+	if (opts->post.enabled) {
+		add_stage(pass->stages, "post 3x3");
+		unfused(&p, 4 * px, 4 * px);
+		radius += 1;
+	}
+	if (opts->remap.enabled) {
+		add_stage(pass->stages, "lens");
+		unfused(&p, 4 * px, 4 * px);
+	}
+	if (opts->orient) {
+		add_stage(pass->stages, "orient");
+		unfused(&p, 4 * px, 4 * px);
+	}
+	if (opts->temporal.enabled) {
+		add_stage(pass->stages, "temporal");
+		unfused(&p, 8 * px, 4 * px);
+	}
+	add_stage(pass->stages, output_names[opts->output]);
+	if (opts->output != OUTPUT_RGBA)
+		unfused(&p, 4 * px, out);
+	pass->read = main_in + (opts->temporal.enabled ? 4 * px : 0);
+	pass->written = out;
+	if (gl) {
+		build_defines(fmt, opts, defines, sizeof(defines));
+		set_defines(pass, defines, NULL);
+	}
+	if (fmt->cfa == CFA_XTRANS) {
+		lsize_x = XTRANS_LSIZE_X;
+		lsize_y = XTRANS_LSIZE_Y;
+	}
+	/* the tiles of the shader load their halo again */
+	if (gl && !gathered && radius) {
+		pass->read += main_in *
+			      ((lsize_x + 2 * radius) * (lsize_y + 2 * radius) -
+			       lsize_x * lsize_y) / (lsize_x * lsize_y);
+		pass->why = "the tiles with the halo of the filters";
+	} else if (radius) {
+		pass->why = !strcmp(engine, "cpu") && !gathered ?
+			    "the filters on the ring of the rows" :
+			    "the filters read the frame around each pixel";
+	}
+
+	if (ir) {
+		pass = new_pass(&p, "from the input, after the output");
+		add_stage(pass->stages, "ir");
+		pass->read = in + dark;
+		pass->written = ir;
+		unfused(&p, in + dark, ir);
+		if (gl) {
+			input_defines(fmt, opts, defines, sizeof(defines));
+			set_defines(pass, defines, "PASS_IR");
+		}
+	}
+
+	printf("plan: %dx%d %d-bit to %s on %s\n", fmt->width, fmt->height,
+	       fmt->bits, output_names[opts->output], engine);
+	for (i = 0; i < p.count; i++) {
+		pass = &p.passes[i];
+		total += pass->read + pass->written;
+		printf("  pass %d: %s\n", i + 1, pass->stages);
+		printf("          %.1f MB read, %.1f MB written%s%s%s\n",
+		       pass->read / 1e6, pass->written / 1e6,
+		       pass->why ? " (" : "", pass->why ? pass->why : "",
+		       pass->why ? ")" : "");
+		if (pass->defines[0])
+			printf("          shader: %s\n", pass->defines);
+	}
+	printf("plan: %d pass%s, %.1f MB per frame; a pass per stage: %d passes, %.1f MB\n",
+	       p.count, p.count > 1 ? "es" : "", total / 1e6, p.unfused,
+	       p.unfused_bytes / 1e6);
+}
@@ -0,0 +1,592 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * The Python module of the converter:
+ *
+ *   import debayer_ssbo
+ *   conv = debayer_ssbo.Converter(engine="gl")
+ *   frame = conv.process(raw, 1920, 1080, order="RGGB", output="abgr")
+ *   abgr = memoryview(frame)	# or numpy.asarray(frame), (1080, 1920, 4)
+ *   rgb = numpy.asarray(frame)[..., :0:-1]
+ *
+ * The 4 bytes of a pixel are A, B, G, R: the RGBA output of the engines
+ * is the 32-bit word of to_rgba(), exported as it is.
+ *
+ * The input is any object of the buffer protocol (bytes, bytearray,
+ * memoryview, a C-contiguous numpy array), read in place. The output
+ * frame exports its memory without a copy: the mapping of the output
+ * buffer of the GL engine, or the memory the CPU engine wrote. Both come
+ * from a pool of the converter and go back to it when the frame is freed;
+ * a GL buffer is unmapped then by the next process() call, which is the
+ * one with the context.
+ *
+ * process() runs without the GIL, so that the Python threads, each with
+ * its converter (and GL context), keep the engines busy; the calls on the
+ * same converter are serialized.
+ *
+ * Copyright (C) 2021, Linaro
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <structmember.h>
+
+#include <pthread.h>
+
+#include "../gl.h"
+
+#ifndef DEBAYER_SHADER
+#define DEBAYER_SHADER "./debayer.comp"
+#endif
+
+/* an output buffer of the pool */
+struct pool_buf {
+	struct pool_buf *next;
+	long size;
+	void *data;		/* the CPU engines */
+	GLuint bo;		/* the GL engine */
+	const void *map;	/* of bo while a frame has it */
+};
+
+typedef struct {
+	PyObject_HEAD
+	const struct cpu_engine *cpu;	/* NULL for gl */
+	char *shader;
+	pthread_mutex_t lock;	/* the engine, the context and conv */
+	struct converter conv;
+	int gl_ready;		/* conv has the context and the buffers */
+	GLuint out_bo;		/* bos[bo_out] of conv, see run_gl() */
+	pthread_mutex_t pool_lock;
+	struct pool_buf *free;	/* unmapped */
+	struct pool_buf *unmap;	/* released by their frames, still mapped */
+} ConverterObject;
+
+typedef struct {
+	PyObject_HEAD
+	ConverterObject *owner;
+	struct pool_buf *buf;
+	const void *data;
+	long size;
+	int width;
+	int height;
+	const char *format;
+	int ndim;
+	Py_ssize_t shape[3];
+	Py_ssize_t strides[3];
+} FrameObject;
+
+static PyTypeObject FrameType;
+
+static const char * const order_names[] = {
+	[BAYER_RGGB] = "RGGB",
+	[BAYER_GRBG] = "GRBG",
+	[BAYER_GBRG] = "GBRG",
+	[BAYER_BGGR] = "BGGR",
+};
+
+static const char * const cfa_names[] = {
+	[CFA_BAYER] = "bayer",
+	[CFA_QUAD] = "quad",
+	[CFA_QUAD_BIN] = "quad-bin",
+	[CFA_RGBIR] = "rgbir",
+	[CFA_XTRANS] = "xtrans",
+	[CFA_MONO] = "mono",
+};
+
+static const char * const output_names[] = {
+	[OUTPUT_RGBA] = "abgr",	/* the bytes of to_rgba() */
+	[OUTPUT_GRAY] = "gray",
+	[OUTPUT_I420] = "i420",
+	[OUTPUT_NV12] = "nv12",
+};
+
+static int find_name(const char *name, const char * const *names, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (names[i] && !strcmp(name, names[i]))
+			return i;
+	return -1;
+}
+
+/* the frame from the options of process(), the CLI checks of main.c */
+static int parse_frame(int width, int height, const char *order,
+		       const char *cfa, int bits, int stride,
+		       const char *output, struct frame_fmt *fmt,
+		       struct debayer_opts *opts)
+{
+	int i;
+
+	memset(fmt, 0, sizeof(*fmt));
+	memset(opts, 0, sizeof(*opts));
+	if (width <= 0 || height <= 0) {
+		PyErr_SetString(PyExc_ValueError, "bad image size");
+		return -1;
+	}
+	fmt->width = width;
+	fmt->height = height;
+	i = find_name(order, order_names, 4);
+	if (i < 0) {
+		PyErr_SetString(PyExc_ValueError, "bad bayer order");
+		return -1;
+	}
+	fmt->order = i;
+	i = find_name(cfa, cfa_names, 6);
+	if (i < 0) {
+		PyErr_SetString(PyExc_ValueError, "bad colour filter array");
+		return -1;
+	}
+	fmt->cfa = i;
+	if (bits < 8 || bits > 16) {
+		PyErr_SetString(PyExc_ValueError, "bad bits per pixel");
+		return -1;
+	}
+	fmt->bits = bits;
+	fmt->stride = stride ? stride : width * (bits > 8 ? 2 : 1);
+	if (fmt->stride < width * (bits > 8 ? 2 : 1)) {
+		PyErr_SetString(PyExc_ValueError, "the stride is too small");
+		return -1;
+	}
+
+	/* not the tensor output, it needs its spec */
+	i = find_name(output, output_names, OUTPUT_NV12 + 1);
+	if (i < 0) {
+		PyErr_SetString(PyExc_ValueError, "bad output format");
+		return -1;
+	}
+	opts->output = i;
+	/* the shader writes the gray image by 32-bit words */
+	if (opts->output == OUTPUT_GRAY && (long)width * height % 4) {
+		PyErr_SetString(PyExc_ValueError,
+				"gray: the frame is not a multiple of 4 pixels");
+		return -1;
+	}
+	if (output_yuv(opts->output) && (width % 8 || height % 2)) {
+		PyErr_SetString(PyExc_ValueError,
+				"yuv: the frame is not a multiple of 8x2 pixels");
+		return -1;
+	}
+	return 0;
+}
+
+/* the unmapped buffer of the size, NULL if there isn't one */
+static struct pool_buf *pool_get(ConverterObject *self, long size)
+{
+	struct pool_buf **p, *buf = NULL;
+
+	pthread_mutex_lock(&self->pool_lock);
+	for (p = &self->free; *p; p = &(*p)->next) {
+		if ((*p)->size == size) {
+			buf = *p;
+			*p = buf->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&self->pool_lock);
+	return buf;
+}
+
+static void pool_put(ConverterObject *self, struct pool_buf *buf)
+{
+	pthread_mutex_lock(&self->pool_lock);
+	if (buf->map) {
+		buf->next = self->unmap;
+		self->unmap = buf;
+	} else {
+		buf->next = self->free;
+		self->free = buf;
+	}
+	pthread_mutex_unlock(&self->pool_lock);
+}
+
+/* unmaps the buffers the frames have released, the context is current */
+static void pool_unmap(ConverterObject *self)
+{
+	struct pool_buf *buf, *next;
+
+	pthread_mutex_lock(&self->pool_lock);
+	for (buf = self->unmap; buf; buf = next) {
+		next = buf->next;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, buf->bo);
+		glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+		buf->map = NULL;
+		buf->next = self->free;
+		self->free = buf;
+	}
+	self->unmap = NULL;
+	pthread_mutex_unlock(&self->pool_lock);
+}
+
+/* the context on this thread, created with the buffers on the first call */
+static int gl_acquire(ConverterObject *self)
+{
+	struct converter *conv = &self->conv;
+
+	if (self->gl_ready)
+		return eglMakeCurrent(conv->egl_dpy, EGL_NO_SURFACE,
+				      EGL_NO_SURFACE, conv->core_ctx) ? 0 : -1;
+
+	memset(conv, 0, sizeof(*conv));
+	conv->shader_fname = self->shader;
+	if (init_egl(conv, RENDER_NODE_FNAME) != 0)
+		return -1;
+	glGenBuffers(bo_num, conv->bos);
+	self->out_bo = conv->bos[bo_out];
+	self->gl_ready = 1;
+	return 0;
+}
+
+static void gl_release(ConverterObject *self)
+{
+	eglMakeCurrent(self->conv.egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
+		       EGL_NO_CONTEXT);
+}
+
+/*
+ * The shader writes into a buffer of the pool instead of bos[bo_out],
+ * which stays mapped while the frame has it.
+ */
+static struct pool_buf *run_gl(ConverterObject *self,
+			       const struct frame_fmt *fmt,
+			       const struct debayer_opts *opts,
+			       const void *in, const char **err)
+{
+	struct converter *conv = &self->conv;
+	long size = output_size(fmt, opts);
+	struct pool_buf *buf;
+
+	if (gl_acquire(self) != 0) {
+		*err = "the GL engine is not available";
+		return NULL;
+	}
+	pool_unmap(self);
+	buf = pool_get(self, size);
+	if (buf == NULL) {
+		buf = calloc(1, sizeof(*buf));
+		if (buf == NULL) {
+			*err = "out of memory";
+			goto release;
+		}
+		glGenBuffers(1, &buf->bo);
+		buf->size = size;
+	}
+
+	conv->bos[bo_out] = buf->bo;
+	if (run_shader(conv, fmt, opts, in) == 0)
+		buf->map = map_output(conv, size);
+	conv->bos[bo_out] = self->out_bo;
+	if (buf->map == NULL) {
+		*err = "the shader failed";
+		pool_put(self, buf);
+		buf = NULL;
+	}
+release:
+	gl_release(self);
+	return buf;
+}
+
+static struct pool_buf *run_cpu(ConverterObject *self,
+				const struct frame_fmt *fmt,
+				const struct debayer_opts *opts,
+				const void *in, const char **err)
+{
+	long size = output_size(fmt, opts);
+	struct pool_buf *buf;
+
+	buf = pool_get(self, size);
+	if (buf == NULL) {
+		buf = calloc(1, sizeof(*buf));
+		if (buf)
+			buf->data = malloc(size);
+		if (buf == NULL || buf->data == NULL) {
+			free(buf);
+			*err = "out of memory";
+			return NULL;
+		}
+		buf->size = size;
+	}
+	self->cpu->process(fmt, opts, in, buf->data);
+	return buf;
+}
+
+static PyObject *converter_process(ConverterObject *self, PyObject *args,
+				   PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"data", "width", "height", "order", "cfa", "bits", "stride",
+		"output", NULL
+	};
+	const char *order = "RGGB", *cfa = "bayer", *output = "abgr";
+	const char *err = NULL;
+	int width, height, bits = 8, stride = 0;
+	struct debayer_opts opts;
+	struct frame_fmt fmt;
+	struct pool_buf *buf;
+	FrameObject *frame;
+	PyObject *data;
+	Py_buffer in;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "Oii|ssiis", kwlist,
+					 &data, &width, &height, &order, &cfa,
+					 &bits, &stride, &output))
+		return NULL;
+	if (parse_frame(width, height, order, cfa, bits, stride, output,
+			&fmt, &opts) != 0)
+		return NULL;
+	if (self->cpu == NULL && fmt.stride % 4) {
+		PyErr_SetString(PyExc_ValueError,
+				"the stride must be multiple of 4 for gl");
+		return NULL;
+	}
+	if (PyObject_GetBuffer(data, &in, PyBUF_SIMPLE) != 0)
+		return NULL;
+	if (in.len < input_frame_size(&fmt)) {
+		PyErr_SetString(PyExc_ValueError, "the input is too short");
+		PyBuffer_Release(&in);
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&self->lock);
+	if (self->cpu)
+		buf = run_cpu(self, &fmt, &opts, in.buf, &err);
+	else
+		buf = run_gl(self, &fmt, &opts, in.buf, &err);
+	pthread_mutex_unlock(&self->lock);
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&in);
+
+	if (buf == NULL) {
+		PyErr_SetString(PyExc_RuntimeError, err);
+		return NULL;
+	}
+	frame = PyObject_New(FrameObject, &FrameType);
+	if (frame == NULL) {
+		pool_put(self, buf);
+		return NULL;
+	}
+	Py_INCREF(self);
+	frame->owner = self;
+	frame->buf = buf;
+	frame->data = buf->map ? buf->map : buf->data;
+	frame->size = buf->size;
+	frame->width = width;
+	frame->height = height;
+	frame->format = output_names[opts.output];
+
+	frame->ndim = 1;
+	frame->shape[0] = buf->size;
+	frame->strides[0] = 1;
+	if (opts.output == OUTPUT_RGBA || opts.output == OUTPUT_GRAY) {
+		int bpp = opts.output == OUTPUT_RGBA ? 4 : 1;
+
+		frame->ndim = bpp > 1 ? 3 : 2;
+		frame->shape[0] = height;
+		frame->shape[1] = width;
+		frame->shape[2] = bpp;
+		frame->strides[0] = (Py_ssize_t)width * bpp;
+		frame->strides[1] = bpp;
+		frame->strides[2] = 1;
+	}
+	return (PyObject *)frame;
+}
+
+static int converter_init(ConverterObject *self, PyObject *args,
+			  PyObject *kwds)
+{
+	static char *kwlist[] = { "engine", "shader", NULL };
+	const char *engine = "gl", *shader = DEBAYER_SHADER;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ss", kwlist, &engine,
+					 &shader))
+		return -1;
+	if (self->shader) {
+		PyErr_SetString(PyExc_RuntimeError,
+				"the converter is initialized already");
+		return -1;
+	}
+	self->cpu = NULL;
+	if (strcmp(engine, "gl")) {
+		self->cpu = cpu_engine_find(engine);
+		if (self->cpu == NULL) {
+			PyErr_Format(PyExc_ValueError, "unknown engine \"%s\"",
+				     engine);
+			return -1;
+		}
+	}
+	self->shader = strdup(shader);
+	if (self->shader == NULL) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	return 0;
+}
+
+static PyObject *converter_new(PyTypeObject *type, PyObject *args,
+			       PyObject *kwds)
+{
+	ConverterObject *self = (ConverterObject *)type->tp_alloc(type, 0);
+
+	if (self == NULL)
+		return NULL;
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_mutex_init(&self->pool_lock, NULL);
+	return (PyObject *)self;
+}
+
+/* the frames have a reference: all the buffers are back in the pool */
+static void converter_dealloc(ConverterObject *self)
+{
+	struct converter *conv = &self->conv;
+	struct pool_buf *buf, *next;
+
+	if (self->gl_ready && gl_acquire(self) == 0) {
+		pool_unmap(self);
+		for (buf = self->free; buf; buf = buf->next)
+			glDeleteBuffers(1, &buf->bo);
+		glDeleteBuffers(bo_num, conv->bos);
+		if (conv->shader_program)
+			free_shader(conv);
+		gl_release(self);
+		deinit_egl(conv);
+	}
+	for (buf = self->free; buf; buf = next) {
+		next = buf->next;
+		free(buf->data);
+		free(buf);
+	}
+	free(self->shader);
+	pthread_mutex_destroy(&self->lock);
+	pthread_mutex_destroy(&self->pool_lock);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyMethodDef converter_methods[] = {
+	{ "process", (PyCFunction)(void (*)(void))converter_process,
+	  METH_VARARGS | METH_KEYWORDS,
+	  "process(data, width, height, order='RGGB', cfa='bayer', bits=8, "
+	  "stride=0, output='abgr')\n\n"
+	  "Demosaics the frame in the buffer data, returns the Frame of the "
+	  "output: abgr, gray, i420 or nv12." },
+	{ NULL }
+};
+
+static PyTypeObject ConverterType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "debayer_ssbo.Converter",
+	.tp_doc = "Converter(engine='gl', shader=<debayer.comp>)\n\n"
+		  "The demosaicing engine: gl, cpu or cpu-ref.",
+	.tp_basicsize = sizeof(ConverterObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_new = converter_new,
+	.tp_init = (initproc)converter_init,
+	.tp_dealloc = (destructor)converter_dealloc,
+	.tp_methods = converter_methods,
+};
+
+static int frame_getbuffer(FrameObject *self, Py_buffer *view, int flags)
+{
+	if (flags & PyBUF_WRITABLE) {
+		PyErr_SetString(PyExc_BufferError, "the frame is read-only");
+		view->obj = NULL;
+		return -1;
+	}
+	view->buf = (void *)self->data;
+	view->obj = (PyObject *)self;
+	Py_INCREF(self);
+	view->len = self->size;
+	view->readonly = 1;
+	view->itemsize = 1;
+	view->format = (flags & PyBUF_FORMAT) ? "B" : NULL;
+	view->ndim = self->ndim;
+	view->shape = (flags & PyBUF_ND) ? self->shape : NULL;
+	view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ?
+			self->strides : NULL;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+	return 0;
+}
+
+static void frame_dealloc(FrameObject *self)
+{
+	pool_put(self->owner, self->buf);
+	Py_DECREF(self->owner);
+	PyObject_Free(self);
+}
+
+static Py_ssize_t frame_length(FrameObject *self)
+{
+	return self->size;
+}
+
+static PyObject *frame_get_format(FrameObject *self, void *closure)
+{
+	return PyUnicode_FromString(self->format);
+}
+
+static PyBufferProcs frame_as_buffer = {
+	.bf_getbuffer = (getbufferproc)frame_getbuffer,
+};
+
+static PySequenceMethods frame_as_sequence = {
+	.sq_length = (lenfunc)frame_length,
+};
+
+static PyMemberDef frame_members[] = {
+	{ "width", T_INT, offsetof(FrameObject, width), READONLY, NULL },
+	{ "height", T_INT, offsetof(FrameObject, height), READONLY, NULL },
+	{ NULL }
+};
+
+static PyGetSetDef frame_getset[] = {
+	{ "format", (getter)frame_get_format, NULL, NULL, NULL },
+	{ NULL }
+};
+
+static PyTypeObject FrameType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "debayer_ssbo.Frame",
+	.tp_doc = "The output of Converter.process(), read through the buffer "
+		  "protocol: (height, width, 4) for abgr, A, B, G, R in the "
+		  "last axis, (height, width) for "
+		  "gray, the bytes of the planes for i420 and nv12.",
+	.tp_basicsize = sizeof(FrameObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_dealloc = (destructor)frame_dealloc,
+	.tp_as_buffer = &frame_as_buffer,
+	.tp_as_sequence = &frame_as_sequence,
+	.tp_members = frame_members,
+	.tp_getset = frame_getset,
+};
+
+static struct PyModuleDef debayer_module = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "debayer_ssbo",
+	.m_doc = "Demosaicing of the raw frames with a compute shader.",
+	.m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_debayer_ssbo(void)
+{
+	PyObject *m;
+
+	if (PyType_Ready(&ConverterType) < 0 || PyType_Ready(&FrameType) < 0)
+		return NULL;
+	m = PyModule_Create(&debayer_module);
+	if (m == NULL)
+		return NULL;
+	Py_INCREF(&ConverterType);
+	if (PyModule_AddObject(m, "Converter",
+			       (PyObject *)&ConverterType) < 0) {
+		Py_DECREF(&ConverterType);
+		Py_DECREF(m);
+		return NULL;
+	}
+	Py_INCREF(&FrameType);
+	if (PyModule_AddObject(m, "Frame", (PyObject *)&FrameType) < 0) {
+		Py_DECREF(&FrameType);
+		Py_DECREF(m);
+		return NULL;
+	}
+	return m;
+}
@@ -0,0 +1,123 @@
+# SPDX-License-Identifier: LGPL-3.0
+#
+# The tests of the debayer_ssbo module (make python-check): the output of
+# the engines against cpu-ref and against known pixels, and process()
+# without the GIL.
+#
+# Copyright (C) 2021, Linaro
+
+import os
+import random
+import threading
+import time
+import unittest
+
+import debayer_ssbo
+
+ENGINES = ["gl", "cpu", "cpu-ref"]
+
+
+def raw_frame(width, height, seed, bits=8):
+    rnd = random.Random(seed)
+    if bits == 8:
+        return bytes(rnd.getrandbits(8) for _ in range(width * height))
+    data = bytearray()
+    for _ in range(width * height):
+        data += rnd.getrandbits(bits).to_bytes(2, "little")
+    return bytes(data)
+
+
+class TestOutput(unittest.TestCase):
+    def test_flat(self):
+        # a flat frame is the same gray in all the channels, A first, away
+        # from the border where the missing neighbours are 0
+        for engine in ENGINES:
+            conv = debayer_ssbo.Converter(engine=engine)
+            frame = conv.process(bytes([100]) * (64 * 32), 64, 32)
+            view = memoryview(frame)
+            self.assertEqual(view.shape, (32, 64, 4))
+            self.assertEqual(frame.format, "abgr")
+            for y in (8, 15, 23):
+                for x in (8, 33, 55):
+                    self.assertEqual([view[y, x, c] for c in range(4)],
+                                     [255, 100, 100, 100], engine)
+
+    def test_pixels(self):
+        # the red pixel of RGGB keeps its value in the R byte
+        raw = raw_frame(64, 32, 1)
+        conv = debayer_ssbo.Converter(engine="gl")
+        view = memoryview(conv.process(raw, 64, 32))
+        for y in range(0, 32, 2):
+            for x in range(0, 64, 2):
+                self.assertEqual(view[y, x, 3], raw[y * 64 + x])
+
+    def test_cpu_ref(self):
+        ref = debayer_ssbo.Converter(engine="cpu-ref")
+        cases = [
+            dict(width=320, height=240, order="GRBG", output="abgr"),
+            dict(width=256, height=160, order="GBRG", bits=12,
+                 output="nv12"),
+            dict(width=128, height=96, cfa="quad", output="gray"),
+            dict(width=192, height=96, cfa="xtrans", output="i420"),
+        ]
+        for i, case in enumerate(cases):
+            raw = raw_frame(case["width"], case["height"], i,
+                            case.get("bits", 8))
+            expected = memoryview(ref.process(raw, **case)).tobytes()
+            for engine in ("gl", "cpu"):
+                conv = debayer_ssbo.Converter(engine=engine)
+                frame = conv.process(memoryview(raw), **case)
+                self.assertEqual(memoryview(frame).tobytes(), expected,
+                                 (engine, case))
+
+    def test_pool(self):
+        # the frames alive have their own memory, a freed one is reused
+        conv = debayer_ssbo.Converter()
+        a = conv.process(raw_frame(64, 32, 1), 64, 32)
+        b = conv.process(raw_frame(64, 32, 2), 64, 32)
+        self.assertNotEqual(memoryview(a).tobytes(),
+                            memoryview(b).tobytes())
+        saved = memoryview(a).tobytes()
+        del b
+        conv.process(raw_frame(64, 32, 3), 64, 32)
+        self.assertEqual(memoryview(a).tobytes(), saved)
+
+    def test_errors(self):
+        conv = debayer_ssbo.Converter(engine="cpu")
+        with self.assertRaises(ValueError):
+            conv.process(b"\0" * 100, 64, 32)
+        with self.assertRaises(ValueError):
+            conv.process(b"\0" * 2048, 64, 32, output="rgba")
+        with self.assertRaises(ValueError):
+            debayer_ssbo.Converter(engine="none")
+        with self.assertRaises(TypeError):
+            memoryview(conv.process(b"\0" * 2048, 64, 32))[0, 0, 0] = 1
+
+
+class TestGil(unittest.TestCase):
+    def test_released(self):
+        # the main thread runs while process() does
+        conv = debayer_ssbo.Converter(engine="cpu-ref")
+        raw = os.urandom(1920 * 1080)
+        span = []
+
+        def work():
+            start = time.monotonic()
+            conv.process(raw, 1920, 1080)
+            span.append(time.monotonic() - start)
+
+        ticks = []
+        thread = threading.Thread(target=work)
+        thread.start()
+        while thread.is_alive():
+            ticks.append(time.monotonic())
+            time.sleep(0.001)
+        thread.join()
+
+        gaps = [b - a for a, b in zip(ticks, ticks[1:])]
+        self.assertGreater(span[0], 0.05)
+        self.assertLess(max(gaps), span[0] / 2)
+
+
+if __name__ == "__main__":
+    unittest.main()
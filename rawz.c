@@ -0,0 +1,625 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * Lossless codec of the raw frames. Each pixel is predicted from the
+ * pixels of the same colour (of the same 2x2 CFA plane) in the row above,
+ * so that no pixel of a row waits for the previous one when decoded, and
+ * the residuals are bit packed in blocks of RAWZ_BLOCK, all of the same
+ * width in a block. The frame is coded in strips of rows which don't
+ * depend on each other, encoded and decoded on all the CPUs in parallel.
+ *
+ * Copyright (C) 2021, Linaro
+ */
+
+#define _POSIX_C_SOURCE 200809L	/* mmap() */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "debayer.h"
+
+#define RAWZ_MAGIC		"RAWZ"
+#define RAWZ_VERSION		1
+/*
+ * magic, version, bits, 2 reserved bytes, then the width, height, stride,
+ * rows per strip and strips (32-bit little endian); the sizes of the
+ * strips follow.
+ */
+#define RAWZ_HEADER_SIZE	28
+#define RAWZ_STRIP_ROWS		64
+#define RAWZ_BLOCK		32
+/* the zero bytes after each strip, the decoder reads a word at a time */
+#define RAWZ_SLACK		4
+
+struct rawz_strip {
+	const uint8_t *src;	/* encoded */
+	size_t size;
+	uint8_t *dst;		/* the first row in the frame */
+	int rows;
+	int failed;
+};
+
+struct rawz_job {
+	int width;
+	int stride;
+	int bpp;
+	struct rawz_strip *strips;
+};
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static inline int rawz_sample(const uint8_t *row, int x, int bpp)
+{
+	return bpp == 1 ? row[x] : row[2 * x] | row[2 * x + 1] << 8;
+}
+
+static inline void rawz_store(uint8_t *row, int x, int v, int bpp)
+{
+	if (bpp == 1) {
+		row[x] = v;
+	} else {
+		row[2 * x] = v;
+		row[2 * x + 1] = v >> 8;
+	}
+}
+
+/*
+ * Of the pixel of the r-th row of the strip: from the 3 pixels of the
+ * colour in the row above, or from the left one in the first rows.
+ */
+static inline int rawz_predict(const uint8_t *row, int stride, int x, int r,
+			       int width, int bpp)
+{
+	const uint8_t *up = row - 2 * stride;
+	int l = x < 2 ? x : x - 2;
+	int rt = x + 2 < width ? x + 2 : x;
+
+	if (r < 2)
+		return x < 2 ? 0 : rawz_sample(row, x - 2, bpp);
+	return (rawz_sample(up, l, bpp) + 2 * rawz_sample(up, x, bpp) +
+		rawz_sample(up, rt, bpp) + 2) >> 2;
+}
+
+/*
+ * The residual is taken modulo the sample word, so that any value of it
+ * is coded, and zigzag mapped: 0, -1, 1, -2, ... to 0, 1, 2, 3, ...
+ */
+static inline unsigned int rawz_zigzag(int v, int pred, int bpp)
+{
+	int shift = 32 - 8 * bpp;
+	int d = (int)((unsigned int)(v - pred) << shift) >> shift;
+
+	return (unsigned int)d << 1 ^ (unsigned int)(d >> 31);
+}
+
+static inline int rawz_unzigzag(unsigned int z, int pred, int bpp)
+{
+	int d = (int)(z >> 1) ^ -(int)(z & 1);
+
+	return (pred + d) & ((1 << 8 * bpp) - 1);
+}
+
+/* the strip size for the worst case, a full width block each */
+static size_t rawz_strip_capacity(int width, int rows, int bpp)
+{
+	int blocks = (width + RAWZ_BLOCK - 1) / RAWZ_BLOCK;
+
+	return (size_t)rows * blocks * (1 + RAWZ_BLOCK * bpp) + RAWZ_SLACK;
+}
+
+/* the residuals of the row are padded to the block with zeros */
+static uint8_t *rawz_pack_row(uint8_t *q, const unsigned int *z, int width)
+{
+	int x, k;
+
+	for (x = 0; x < width; x += RAWZ_BLOCK) {
+		unsigned int max = 0;
+		uint64_t acc = 0;
+		int bits = 0, n = 0;
+
+		for (k = 0; k < RAWZ_BLOCK; k++)
+			max |= z[x + k];
+		while (max >> bits)
+			bits++;
+
+		/* RAWZ_BLOCK * bits ends on a byte */
+		*q++ = bits;
+		for (k = 0; k < RAWZ_BLOCK; k++) {
+			acc |= (uint64_t)z[x + k] << n;
+			for (n += bits; n >= 8; n -= 8) {
+				*q++ = acc;
+				acc >>= 8;
+			}
+		}
+	}
+	return q;
+}
+
+static void rawz_encode_strip(void *arg, int i)
+{
+	const struct rawz_job *job = arg;
+	struct rawz_strip *s = &job->strips[i];
+	int blocks = (job->width + RAWZ_BLOCK - 1) / RAWZ_BLOCK;
+	unsigned int *z;
+	uint8_t *q;
+	int r, x;
+
+	q = malloc(rawz_strip_capacity(job->width, s->rows, job->bpp));
+	z = calloc(blocks * RAWZ_BLOCK, sizeof(*z));
+	s->src = q;
+	if (q == NULL || z == NULL) {
+		s->failed = 1;
+		free(z);
+		return;
+	}
+	for (r = 0; r < s->rows; r++) {
+		const uint8_t *row = s->dst + (long)r * job->stride;
+
+		for (x = 0; x < job->width; x++)
+			z[x] = rawz_zigzag(rawz_sample(row, x, job->bpp),
+					   rawz_predict(row, job->stride, x, r,
+							job->width, job->bpp),
+					   job->bpp);
+		q = rawz_pack_row(q, z, job->width);
+	}
+	memset(q, 0, RAWZ_SLACK);
+	s->size = q + RAWZ_SLACK - s->src;
+	free(z);
+}
+
+static inline void rawz_unpack_block(const uint8_t *p, uint16_t *z,
+				     int bits)
+{
+	int k;
+
+	for (k = 0; k < RAWZ_BLOCK; k++) {
+		int bit = k * bits;
+
+		z[k] = get_le32(p + bit / 8) >> (bit % 8) & ((1u << bits) - 1);
+	}
+}
+
+#ifdef __SSE2__
+/*
+ * The block of 1 to 15 bits, 4 residuals in each 64-bit lane: the 4 *
+ * bits of 2 of them are loaded from their byte, shifted down to their
+ * first bit, and spread out into the 4 words of their lane. Up to 8 bytes
+ * past the block are read.
+ */
+static void rawz_unpack_block_sse2(const uint8_t *p, uint16_t *z, int bits)
+{
+	const __m128i mask = _mm_set1_epi64x((1 << bits) - 1);
+	const __m128i n1 = _mm_cvtsi32_si128(bits);
+	const __m128i n2 = _mm_cvtsi32_si128(2 * bits);
+	const __m128i n3 = _mm_cvtsi32_si128(3 * bits);
+	int k;
+
+	for (k = 0; k < RAWZ_BLOCK; k += 8) {
+		int lo = k * bits, hi = lo + 4 * bits;
+		__m128i g, v;
+
+		g = _mm_unpacklo_epi64(
+			_mm_srl_epi64(_mm_loadl_epi64((const __m128i *)
+						      (p + lo / 8)),
+				      _mm_cvtsi32_si128(lo % 8)),
+			_mm_srl_epi64(_mm_loadl_epi64((const __m128i *)
+						      (p + hi / 8)),
+				      _mm_cvtsi32_si128(hi % 8)));
+		v = _mm_and_si128(g, mask);
+		v = _mm_or_si128(v, _mm_slli_epi64(_mm_and_si128(
+			_mm_srl_epi64(g, n1), mask), 16));
+		v = _mm_or_si128(v, _mm_slli_epi64(_mm_and_si128(
+			_mm_srl_epi64(g, n2), mask), 32));
+		v = _mm_or_si128(v, _mm_slli_epi64(_mm_and_si128(
+			_mm_srl_epi64(g, n3), mask), 48));
+		_mm_storeu_si128((__m128i *)(z + k), v);
+	}
+}
+#endif
+
+/*
+ * The residuals of the row, NULL if the strip is too short for them. The
+ * block is unpacked with SSE2 where there is, unless it is among the last
+ * bytes of the strip, or by the code for its width, with constant shifts.
+ */
+static const uint8_t *rawz_unpack_row(const uint8_t *p, const uint8_t *end,
+				      uint16_t *z, int width, int bpp)
+{
+	int x;
+
+	for (x = 0; x < width; x += RAWZ_BLOCK) {
+		int bits = *p++;
+
+		if (bits > 8 * bpp || end - p < RAWZ_BLOCK * bits / 8)
+			return NULL;
+#ifdef __SSE2__
+		if (bits > 0 && bits < 16 &&
+		    end - p >= RAWZ_BLOCK * bits / 8 + 8) {
+			rawz_unpack_block_sse2(p, z + x, bits);
+			p += RAWZ_BLOCK * bits / 8;
+			continue;
+		}
+#endif
+		switch (bits) {
+		case 0:
+			memset(z + x, 0, sizeof(*z) * RAWZ_BLOCK);
+			break;
+		case 1: rawz_unpack_block(p, z + x, 1); break;
+		case 2: rawz_unpack_block(p, z + x, 2); break;
+		case 3: rawz_unpack_block(p, z + x, 3); break;
+		case 4: rawz_unpack_block(p, z + x, 4); break;
+		case 5: rawz_unpack_block(p, z + x, 5); break;
+		case 6: rawz_unpack_block(p, z + x, 6); break;
+		case 7: rawz_unpack_block(p, z + x, 7); break;
+		case 8: rawz_unpack_block(p, z + x, 8); break;
+		default:
+			rawz_unpack_block(p, z + x, bits);
+			break;
+		}
+		p += RAWZ_BLOCK * bits / 8;
+	}
+	return p;
+}
+
+#ifdef __SSE2__
+/*
+ * The middle of the row from x = 2, 16 8-bit or 8 16-bit pixels at once.
+ * The 1:2:1 prediction is the rounded average of the pixel above with the
+ * average of its neighbours rounded down, which is the same value. Returns
+ * the next x, for the scalar loop.
+ */
+static int rawz_decode_row_sse2(uint8_t *row, const uint8_t *up,
+				const uint16_t *z, int width, int bpp)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int x = 2;
+
+	if (bpp == 1) {
+		const __m128i one = _mm_set1_epi8(1);
+		const __m128i low7 = _mm_set1_epi8(0x7f);
+
+		for (; x + 16 <= width - 2; x += 16) {
+			__m128i a = _mm_loadu_si128((const __m128i *)
+						    (up + x - 2));
+			__m128i b = _mm_loadu_si128((const __m128i *)(up + x));
+			__m128i c = _mm_loadu_si128((const __m128i *)
+						    (up + x + 2));
+			__m128i h = _mm_sub_epi8(_mm_avg_epu8(a, c),
+				_mm_and_si128(_mm_xor_si128(a, c), one));
+			__m128i r = _mm_packus_epi16(
+				_mm_loadu_si128((const __m128i *)(z + x)),
+				_mm_loadu_si128((const __m128i *)(z + x + 8)));
+			__m128i d = _mm_xor_si128(
+				_mm_and_si128(_mm_srli_epi16(r, 1), low7),
+				_mm_sub_epi8(zero, _mm_and_si128(r, one)));
+
+			_mm_storeu_si128((__m128i *)(row + x),
+					 _mm_add_epi8(_mm_avg_epu8(h, b), d));
+		}
+	} else {
+		const __m128i one = _mm_set1_epi16(1);
+
+		for (; x + 8 <= width - 2; x += 8) {
+			__m128i a = _mm_loadu_si128((const __m128i *)
+						    (up + 2 * x - 4));
+			__m128i b = _mm_loadu_si128((const __m128i *)
+						    (up + 2 * x));
+			__m128i c = _mm_loadu_si128((const __m128i *)
+						    (up + 2 * x + 4));
+			__m128i h = _mm_sub_epi16(_mm_avg_epu16(a, c),
+				_mm_and_si128(_mm_xor_si128(a, c), one));
+			__m128i r = _mm_loadu_si128((const __m128i *)(z + x));
+			__m128i d = _mm_xor_si128(_mm_srli_epi16(r, 1),
+				_mm_sub_epi16(zero, _mm_and_si128(r, one)));
+
+			_mm_storeu_si128((__m128i *)(row + 2 * x),
+					 _mm_add_epi16(_mm_avg_epu16(h, b), d));
+		}
+	}
+	return x;
+}
+#endif
+
+/*
+ * A row below the first ones: no pixel depends on the previous one, so
+ * the middle of the row is done with SSE2 where there is, the rest by the
+ * scalar loop.
+ */
+static inline void rawz_decode_row(uint8_t *row, int stride,
+				   const uint16_t *z, int width, int bpp)
+{
+	const uint8_t *up = row - 2 * stride;
+	int x = 2;
+
+#ifdef __SSE2__
+	x = rawz_decode_row_sse2(row, up, z, width, bpp);
+#endif
+	for (; x < width - 2; x++) {
+		int pred = (rawz_sample(up, x - 2, bpp) +
+			    2 * rawz_sample(up, x, bpp) +
+			    rawz_sample(up, x + 2, bpp) + 2) >> 2;
+
+		rawz_store(row, x, rawz_unzigzag(z[x], pred, bpp), bpp);
+	}
+	for (x = 0; x < width; x++) {
+		if (x == 2 && width > 4)
+			x = width - 2;
+		rawz_store(row, x, rawz_unzigzag(z[x],
+			   rawz_predict(row, stride, x, 2, width, bpp), bpp),
+			   bpp);
+	}
+}
+
+/* the sample word known at compile time */
+static void rawz_decode_row8(uint8_t *row, int stride, const uint16_t *z,
+			     int width)
+{
+	rawz_decode_row(row, stride, z, width, 1);
+}
+
+static void rawz_decode_row16(uint8_t *row, int stride, const uint16_t *z,
+			      int width)
+{
+	rawz_decode_row(row, stride, z, width, 2);
+}
+
+/* the first rows of the strip, from the left pixels */
+static void rawz_decode_first(uint8_t *row, const uint16_t *z, int width,
+			      int bpp)
+{
+	int x;
+
+	for (x = 0; x < width; x++)
+		rawz_store(row, x, rawz_unzigzag(z[x], x < 2 ? 0 :
+			   rawz_sample(row, x - 2, bpp), bpp), bpp);
+}
+
+static void rawz_decode_strip(void *arg, int i)
+{
+	const struct rawz_job *job = arg;
+	struct rawz_strip *s = &job->strips[i];
+	const uint8_t *p = s->src, *end = s->src + s->size - RAWZ_SLACK;
+	int blocks = (job->width + RAWZ_BLOCK - 1) / RAWZ_BLOCK;
+	uint16_t *z;
+	int r;
+
+	z = malloc(sizeof(*z) * blocks * RAWZ_BLOCK);
+	if (z == NULL) {
+		s->failed = 1;
+		return;
+	}
+	for (r = 0; r < s->rows; r++) {
+		uint8_t *row = s->dst + (long)r * job->stride;
+
+		p = rawz_unpack_row(p, end, z, job->width, job->bpp);
+		if (p == NULL) {
+			s->failed = 1;
+			break;
+		}
+		if (r < 2)
+			rawz_decode_first(row, z, job->width, job->bpp);
+		else if (job->bpp == 1)
+			rawz_decode_row8(row, job->stride, z, job->width);
+		else
+			rawz_decode_row16(row, job->stride, z, job->width);
+		memset(row + job->width * job->bpp, 0,
+		       job->stride - job->width * job->bpp);
+	}
+	free(z);
+}
+
+static void rawz_job_init(struct rawz_job *job, const struct frame_fmt *fmt)
+{
+	int height;
+
+	sensor_size(fmt, &job->width, &height);
+	job->stride = fmt->stride;
+	job->bpp = fmt->bits > 8 ? 2 : 1;
+}
+
+static int rawz_strips(const struct frame_fmt *fmt)
+{
+	int width, height;
+
+	sensor_size(fmt, &width, &height);
+	return (height + RAWZ_STRIP_ROWS - 1) / RAWZ_STRIP_ROWS;
+}
+
+/* Encodes the frames of data into the file, returns its size or -1 */
+long rawz_write(FILE *fp, const struct frame_fmt *fmt, const uint8_t *data,
+		long frames)
+{
+	struct rawz_job job;
+	uint8_t header[RAWZ_HEADER_SIZE];
+	int count = rawz_strips(fmt);
+	uint8_t *table = malloc(4 * count);
+	long size = 0, f;
+	int width, height, failed, i;
+
+	rawz_job_init(&job, fmt);
+	sensor_size(fmt, &width, &height);
+	job.strips = calloc(count, sizeof(*job.strips));
+	if (job.strips == NULL || table == NULL) {
+		size = -1;
+		goto out;
+	}
+
+	memcpy(header, RAWZ_MAGIC, 4);
+	header[4] = RAWZ_VERSION;
+	header[5] = fmt->bits;
+	header[6] = 0;
+	header[7] = 0;
+	put_le32(header + 8, width);
+	put_le32(header + 12, height);
+	put_le32(header + 16, fmt->stride);
+	put_le32(header + 20, RAWZ_STRIP_ROWS);
+	put_le32(header + 24, count);
+
+	for (f = 0; f < frames && size >= 0; f++) {
+		const uint8_t *frame = data + f * input_frame_size(fmt);
+
+		for (i = 0; i < count; i++) {
+			struct rawz_strip *s = &job.strips[i];
+
+			s->dst = (uint8_t *)frame +
+				 (long)i * RAWZ_STRIP_ROWS * fmt->stride;
+			s->rows = height - i * RAWZ_STRIP_ROWS;
+			if (s->rows > RAWZ_STRIP_ROWS)
+				s->rows = RAWZ_STRIP_ROWS;
+		}
+		parallel_for(count, rawz_encode_strip, &job);
+
+		size += RAWZ_HEADER_SIZE + 4 * count;
+		for (i = 0, failed = 0; i < count; i++) {
+			put_le32(table + 4 * i, job.strips[i].size);
+			size += job.strips[i].size;
+			failed |= job.strips[i].failed;
+		}
+		if (failed ||
+		    fwrite(header, RAWZ_HEADER_SIZE, 1, fp) != 1 ||
+		    fwrite(table, 4 * count, 1, fp) != 1)
+			size = -1;
+		for (i = 0; i < count; i++) {
+			struct rawz_strip *s = &job.strips[i];
+
+			if (size >= 0 && fwrite(s->src, s->size, 1, fp) != 1)
+				size = -1;
+			free((void *)s->src);
+			s->src = NULL;
+		}
+	}
+out:
+	free(job.strips);
+	free(table);
+	return size;
+}
+
+/*
+ * The strips of the frames of the file, returns their count, -1 if the
+ * frames are not the ones of fmt or the file is truncated.
+ */
+static long rawz_parse(const uint8_t *p, size_t size,
+		       const struct frame_fmt *fmt, struct rawz_strip *strips,
+		       uint8_t *out)
+{
+	int count = rawz_strips(fmt);
+	int width, height;
+	long n = 0;
+	int i;
+
+	sensor_size(fmt, &width, &height);
+	while (size > 0) {
+		const uint8_t *table = p + RAWZ_HEADER_SIZE;
+
+		if (size < RAWZ_HEADER_SIZE + 4 * (size_t)count ||
+		    memcmp(p, RAWZ_MAGIC, 4) || p[4] != RAWZ_VERSION ||
+		    p[5] != fmt->bits || get_le32(p + 8) != (uint32_t)width ||
+		    get_le32(p + 12) != (uint32_t)height ||
+		    get_le32(p + 16) != (uint32_t)fmt->stride ||
+		    get_le32(p + 20) != RAWZ_STRIP_ROWS ||
+		    get_le32(p + 24) != (uint32_t)count)
+			return -1;
+		p += RAWZ_HEADER_SIZE + 4 * count;
+		size -= RAWZ_HEADER_SIZE + 4 * count;
+
+		for (i = 0; i < count; i++, n++) {
+			size_t len = get_le32(table + 4 * i);
+
+			if (len < RAWZ_SLACK || len > size)
+				return -1;
+			if (strips) {
+				strips[n].src = p;
+				strips[n].size = len;
+				strips[n].dst = out + (n / count) *
+					input_frame_size(fmt) +
+					(long)i * RAWZ_STRIP_ROWS * fmt->stride;
+				strips[n].rows = height - i * RAWZ_STRIP_ROWS;
+				if (strips[n].rows > RAWZ_STRIP_ROWS)
+					strips[n].rows = RAWZ_STRIP_ROWS;
+			}
+			p += len;
+			size -= len;
+		}
+	}
+	return n;
+}
+
+/*
+ * Returns the size of the decoded frames of the file in *data, 0 if it is
+ * not a file of the codec, -1 if it can't be read or its frames are not
+ * of the format fmt.
+ */
+long rawz_read(const char *fname, const struct frame_fmt *fmt, char **data)
+{
+	struct rawz_job job;
+	struct stat st;
+	uint8_t *map, *out = NULL;
+	long size = -1, strips;
+	int width, height;
+	int fd, i;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st) < 0 || st.st_size < RAWZ_HEADER_SIZE) {
+		close(fd);
+		return 0;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+	if (memcmp(map, RAWZ_MAGIC, 4)) {
+		munmap(map, st.st_size);
+		return 0;
+	}
+
+	rawz_job_init(&job, fmt);
+	job.strips = NULL;
+	strips = rawz_parse(map, st.st_size, fmt, NULL, NULL);
+	if (strips <= 0) {
+		sensor_size(fmt, &width, &height);
+		printf("\"%s\" is truncated or not of %dx%d %d-bit frames of stride %d\n",
+		       fname, width, height, fmt->bits, fmt->stride);
+		goto out;
+	}
+	size = strips / rawz_strips(fmt) * input_frame_size(fmt);
+	out = malloc(size);
+	job.strips = calloc(strips, sizeof(*job.strips));
+	if (out == NULL || job.strips == NULL) {
+		size = -1;
+		goto out;
+	}
+	rawz_parse(map, st.st_size, fmt, job.strips, out);
+	parallel_for(strips, rawz_decode_strip, &job);
+	for (i = 0; i < strips; i++)
+		if (job.strips[i].failed)
+			size = -1;
+out:
+	if (size < 0) {
+		free(out);
+		out = NULL;
+	}
+	free(job.strips);
+	munmap(map, st.st_size);
+	*data = (char *)out;
+	return size;
+}
@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * Lens distortion correction: parsing of the distortion model, and the
+ * warp grid the engines interpolate.
+ *
+ * Copyright (C) 2021, Linaro
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debayer.h"
+
+/*
+ * The spec is the comma separated list of:
+ *   k1=<v>, k2=<v>, k3=<v>   radial distortion coefficients (0)
+ *   p1=<v>, p2=<v>           tangential distortion coefficients (0)
+ *   f=<fx>[:<fy>]            focal length in pixels (width/2)
+ *   c=<cx>:<cy>              optical center in pixels (the frame center)
+ */
+int remap_parse(const char *spec, struct remap_fmt *r)
+{
+	char tok[64];
+	int ret = 0;
+
+	memset(r, 0, sizeof(*r));
+	r->cx = r->cy = -1.0f;
+	r->enabled = 1;
+
+	while (*spec && ret == 0) {
+		size_t len = strcspn(spec, ",");
+
+		if (len >= sizeof(tok))
+			len = sizeof(tok) - 1;
+		memcpy(tok, spec, len);
+		tok[len] = '\0';
+		spec += strcspn(spec, ",");
+		if (*spec == ',')
+			spec++;
+
+		if (sscanf(tok, "k1=%f", &r->k[0]) == 1 ||
+		    sscanf(tok, "k2=%f", &r->k[1]) == 1 ||
+		    sscanf(tok, "k3=%f", &r->k[2]) == 1 ||
+		    sscanf(tok, "p1=%f", &r->p[0]) == 1 ||
+		    sscanf(tok, "p2=%f", &r->p[1]) == 1 ||
+		    sscanf(tok, "c=%f:%f", &r->cx, &r->cy) == 2)
+			continue;
+		switch (sscanf(tok, "f=%f:%f", &r->fx, &r->fy)) {
+		case 1:
+			r->fy = r->fx;
+			/* fallthrough */
+		case 2:
+			if (r->fx > 0 && r->fy > 0)
+				break;
+			/* fallthrough */
+		default:
+			printf("remap: bad \"%s\"\n", tok);
+			ret = -1;
+			break;
+		}
+	}
+	return ret;
+}
+
+/* Builds the warp grid for the frame */
+int remap_init(struct remap_fmt *r, const struct frame_fmt *fmt)
+{
+	float fx = r->fx > 0 ? r->fx : fmt->width / 2.0f;
+	float fy = r->fy > 0 ? r->fy : fx;
+	float cx = r->cx >= 0 ? r->cx : (fmt->width - 1) / 2.0f;
+	float cy = r->cy >= 0 ? r->cy : (fmt->height - 1) / 2.0f;
+	int gx, gy;
+
+	/* one node more than needed for the interpolation at the last pixel */
+	r->grid_width = (fmt->width - 1) / REMAP_GRID_STEP + 2;
+	r->grid_height = (fmt->height - 1) / REMAP_GRID_STEP + 2;
+	free(r->grid);
+	r->grid = malloc(sizeof(*r->grid) * 2 * r->grid_width * r->grid_height);
+	if (r->grid == NULL)
+		return -1;
+
+	for (gy = 0; gy < r->grid_height; gy++) {
+		for (gx = 0; gx < r->grid_width; gx++) {
+			int32_t *g = r->grid + 2 * (gy * r->grid_width + gx);
+			float x = (gx * REMAP_GRID_STEP - cx) / fx;
+			float y = (gy * REMAP_GRID_STEP - cy) / fy;
+			float r2 = x * x + y * y;
+			float k = 1 + r2 * (r->k[0] + r2 * (r->k[1] +
+							  r2 * r->k[2]));
+			float xd = x * k + 2 * r->p[0] * x * y +
+				   r->p[1] * (r2 + 2 * x * x);
+			float yd = y * k + r->p[0] * (r2 + 2 * y * y) +
+				   2 * r->p[1] * x * y;
+			/* the source is black beyond a pixel from the frame */
+			float sx = fminf(fmaxf(xd * fx + cx, -2),
+					 fmt->width + 1);
+			float sy = fminf(fmaxf(yd * fy + cy, -2),
+					 fmt->height + 1);
+
+			g[0] = lrintf((sx + REMAP_BIAS) * 256);
+			g[1] = lrintf((sy + REMAP_BIAS) * 256);
+		}
+	}
+	return 0;
+}
+
+void remap_free(struct remap_fmt *r)
+{
+	free(r->grid);
+	r->grid = NULL;
+}
@@ -0,0 +1,206 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * Tensor output format: parsing of the format spec and the lookup table
+ * which does the normalization and quantization.
+ *
+ * Copyright (C) 2021, Linaro
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debayer.h"
+
+/* IEEE 754 binary16 bits of the float, rounded to nearest even */
+static uint16_t float_to_half(float f)
+{
+	uint32_t x;
+	uint32_t sign, mant;
+	int exp;
+
+	memcpy(&x, &f, sizeof(x));
+	sign = (x >> 16) & 0x8000;
+	exp = (int)((x >> 23) & 0xff) - 127 + 15;
+	mant = x & 0x7fffff;
+
+	if (((x >> 23) & 0xff) == 0xff)		/* inf or NaN */
+		return sign | 0x7c00 | (mant ? 0x200 : 0);
+	if (exp >= 31)				/* overflow */
+		return sign | 0x7c00;
+	if (exp <= 0) {				/* subnormal or zero */
+		uint32_t shift = 14 - exp;
+
+		if (shift > 24)
+			return sign;
+		mant |= 0x800000;
+		x = mant >> shift;
+		mant &= (1u << shift) - 1;
+		if (mant > (1u << (shift - 1)) ||
+		    (mant == (1u << (shift - 1)) && (x & 1)))
+			x++;
+		return sign | x;
+	}
+	x = ((uint32_t)exp << 10) | (mant >> 13);
+	mant &= 0x1fff;
+	/* the carry into the exponent gives the right result, even inf */
+	if (mant > 0x1000 || (mant == 0x1000 && (x & 1)))
+		x++;
+	return sign | x;
+}
+
+static int parse_triple(const char *p, float *v)
+{
+	return sscanf(p, "%f:%f:%f", &v[0], &v[1], &v[2]) == 3 ? 0 : -1;
+}
+
+/*
+ * The spec is the comma separated list of:
+ *   chw | hwc              layout (chw)
+ *   f32 | f16 | i8 | u8    element type (f32)
+ *   rgb | bgr              channel order (rgb)
+ *   <width>x<height>       tensor size (the frame size)
+ *   mean=<r>:<g>:<b>       normalization (0:0:0)
+ *   std=<r>:<g>:<b>        normalization (1:1:1)
+ *   scale=<s>              quantization scale (1/255)
+ *   zp=<n>                 quantization zero point (-128 for i8, 0 for u8)
+ */
+int tensor_parse(const char *spec, struct tensor_fmt *t)
+{
+	char tok[64];
+	int zp_set = 0;
+	int ret = 0;
+	int i;
+
+	memset(t, 0, sizeof(*t));
+	for (i = 0; i < 3; i++)
+		t->std[i] = 1.0f;
+	t->scale = 1.0f / 255;
+
+	while (*spec && ret == 0) {
+		size_t len = strcspn(spec, ",");
+
+		if (len >= sizeof(tok))
+			len = sizeof(tok) - 1;
+		memcpy(tok, spec, len);
+		tok[len] = '\0';
+		spec += strcspn(spec, ",");
+		if (*spec == ',')
+			spec++;
+
+		if (!strcmp(tok, "chw"))
+			t->layout = TENSOR_CHW;
+		else if (!strcmp(tok, "hwc"))
+			t->layout = TENSOR_HWC;
+		else if (!strcmp(tok, "f32"))
+			t->type = TENSOR_F32;
+		else if (!strcmp(tok, "f16"))
+			t->type = TENSOR_F16;
+		else if (!strcmp(tok, "i8"))
+			t->type = TENSOR_I8;
+		else if (!strcmp(tok, "u8"))
+			t->type = TENSOR_U8;
+		else if (!strcmp(tok, "rgb"))
+			t->bgr = 0;
+		else if (!strcmp(tok, "bgr"))
+			t->bgr = 1;
+		else if (!strncmp(tok, "mean=", 5))
+			ret = parse_triple(tok + 5, t->mean);
+		else if (!strncmp(tok, "std=", 4))
+			ret = parse_triple(tok + 4, t->std);
+		else if (!strncmp(tok, "scale=", 6))
+			t->scale = strtof(tok + 6, NULL);
+		else if (!strncmp(tok, "zp=", 3))
+			zp_set = sscanf(tok + 3, "%d", &t->zero_point) == 1;
+		else if (sscanf(tok, "%dx%d", &t->width, &t->height) != 2 ||
+			 t->width <= 0 || t->height <= 0)
+			ret = -1;
+		if (ret)
+			printf("tensor: bad \"%s\"\n", tok);
+	}
+
+	if (!zp_set && t->type == TENSOR_I8)
+		t->zero_point = -128;
+	for (i = 0; i < 3; i++)
+		if (t->std[i] == 0.0f)
+			ret = -1;
+	if (t->scale == 0.0f)
+		ret = -1;
+	return ret;
+}
+
+int tensor_elem_size(const struct tensor_fmt *t)
+{
+	switch (t->type) {
+	case TENSOR_F32:
+		return 4;
+	case TENSOR_F16:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+long output_size(const struct frame_fmt *fmt, const struct debayer_opts *opts)
+{
+	const struct tensor_fmt *t = &opts->tensor;
+
+	if (opts->output == OUTPUT_TENSOR)
+		return 3L * t->width * t->height * tensor_elem_size(t) +
+		       ir_plane_size(fmt);
+	if (opts->output == OUTPUT_GRAY)
+		return (long)fmt->width * fmt->height + ir_plane_size(fmt);
+	if (output_yuv(opts->output))
+		return (long)fmt->width * fmt->height * 3 / 2 +
+		       ir_plane_size(fmt);
+	return 4L * fmt->width * fmt->height + ir_plane_size(fmt);
+}
+
+/*
+ * Completes the tensor format for the output image of the given size, and
+ * fills the lookup table.
+ */
+int tensor_init(struct tensor_fmt *t, int width, int height)
+{
+	int c, v;
+
+	if (t->width == 0) {
+		t->width = width;
+		t->height = height;
+	}
+	/* the shader writes the tensor by 32-bit words, plane by plane */
+	if ((long)t->width * t->height * tensor_elem_size(t) % 4) {
+		printf("tensor: %dx%d plane is not a multiple of 4 bytes\n",
+		       t->width, t->height);
+		return -1;
+	}
+
+	for (c = 0; c < 3; c++) {
+		/* the channel of the frame which goes to the c-th plane */
+		int src = t->bgr ? 2 - c : c;
+
+		for (v = 0; v < 256; v++) {
+			float x = (v / 255.0f - t->mean[src]) / t->std[src];
+			float q = floorf(x / t->scale + 0.5f) + t->zero_point;
+			uint32_t e;
+
+			switch (t->type) {
+			case TENSOR_F32:
+				memcpy(&e, &x, sizeof(e));
+				break;
+			case TENSOR_F16:
+				e = float_to_half(x);
+				break;
+			case TENSOR_I8:
+				e = (uint8_t)(int8_t)fminf(fmaxf(q, -128), 127);
+				break;
+			default:
+				e = (uint8_t)fminf(fmaxf(q, 0), 255);
+				break;
+			}
+			t->lut[c][v] = e;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,172 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * The incremental mode: each workgroup tile of the input is hashed, and
+ * only the tiles whose input has changed since the previous frame are
+ * demosaiced again, the output of the others stays as it is.
+ *
+ * The input a tile reads (the halo of the filters and the remosaic) is
+ * less than a tile around it, so a tile is demosaiced if the tile or any
+ * of its 8 neighbours has changed.
+ *
+ * Copyright (C) 2021, Linaro
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debayer.h"
+
+#define TILE_HASH_SEED		0x9e3779b97f4a7c15ull
+#define TILE_HASH_MUL		0xff51afd7ed558ccdull
+
+struct tile_job {
+	struct tile_map *m;
+	const struct frame_fmt *fmt;
+	const uint8_t *in;
+	int exposures;		/* the HDR frames one after another */
+	uint64_t *hash;		/* of this frame */
+};
+
+static uint64_t hash_word(uint64_t h, uint64_t w)
+{
+	h = (h ^ w) * TILE_HASH_MUL;
+	return h ^ h >> 32;
+}
+
+/* the bytes of the rows of a tile, stride apart */
+static uint64_t hash_rect(uint64_t h, const uint8_t *p, int stride,
+			  int bytes, int rows)
+{
+	uint64_t w;
+	int x, y;
+
+	for (y = 0; y < rows; y++, p += stride) {
+		for (x = 0; x + 8 <= bytes; x += 8) {
+			memcpy(&w, p + x, 8);
+			h = hash_word(h, w);
+		}
+		if (x < bytes) {
+			w = 0;
+			memcpy(&w, p + x, bytes - x);
+			h = hash_word(h, w);
+		}
+	}
+	return h;
+}
+
+/* the tiles of a row, from the input of the sensor */
+static void tile_row(void *arg, int ty)
+{
+	const struct tile_job *job = arg;
+	const struct tile_map *m = job->m;
+	const struct frame_fmt *fmt = job->fmt;
+	int bpp = fmt->bits > 8 ? 2 : 1;
+	int scale = fmt->cfa == CFA_QUAD_BIN ? 2 : 1;
+	int width, height;
+	int tile_w = m->lsize_x * scale * bpp, tile_h = m->lsize_y * scale;
+	int y = ty * tile_h, rows;
+	int tx, i;
+
+	sensor_size(fmt, &width, &height);
+	rows = height - y < tile_h ? height - y : tile_h;
+	for (tx = 0; tx < m->tiles_x; tx++) {
+		int x = tx * tile_w;
+		int bytes = width * bpp - x < tile_w ? width * bpp - x : tile_w;
+		uint64_t h = TILE_HASH_SEED;
+
+		for (i = 0; i < job->exposures; i++)
+			h = hash_rect(h, job->in + i * input_frame_size(fmt) +
+				      (long)y * fmt->stride + x, fmt->stride,
+				      bytes, rows);
+		job->hash[ty * m->tiles_x + tx] = h;
+	}
+}
+
+static int same_fmt(const struct frame_fmt *a, const struct frame_fmt *b)
+{
+	return a->width == b->width && a->height == b->height &&
+	       a->stride == b->stride && a->order == b->order &&
+	       a->bits == b->bits && a->cfa == b->cfa;
+}
+
+/*
+ * Hashes the tiles of the frame, and lists the ones to demosaic: all of
+ * them if the previous frame was of another format (or there was none).
+ */
+int tile_map_update(struct tile_map *m, const struct frame_fmt *fmt,
+		    const struct debayer_opts *opts, const uint8_t *in,
+		    int lsize_x, int lsize_y)
+{
+	int tiles_x = (fmt->width + lsize_x - 1) / lsize_x;
+	int tiles_y = (fmt->height + lsize_y - 1) / lsize_y;
+	struct tile_job job = {
+		.m = m,
+		.fmt = fmt,
+		.in = in,
+		.exposures = opts->hdr.enabled ? opts->hdr.frames : 1,
+	};
+	uint8_t *changed;
+	int tx, ty, dx, dy;
+
+	if (!same_fmt(&m->fmt, fmt) || m->lsize_x != lsize_x ||
+	    m->lsize_y != lsize_y) {
+		tile_map_free(m);
+		m->hash = malloc(sizeof(*m->hash) * tiles_x * tiles_y);
+		/* the GPU fills up the rows of 1024 workgroups */
+		m->list = malloc(sizeof(*m->list) *
+				 ((tiles_x * tiles_y + 1023) / 1024 * 1024));
+		if (m->hash == NULL || m->list == NULL) {
+			tile_map_free(m);
+			return -1;
+		}
+		m->tiles_x = tiles_x;
+		m->tiles_y = tiles_y;
+		m->lsize_x = lsize_x;
+		m->lsize_y = lsize_y;
+		m->fmt = *fmt;
+	}
+	job.hash = malloc(sizeof(*job.hash) * tiles_x * tiles_y);
+	changed = malloc(tiles_x * tiles_y);
+	if (job.hash == NULL || changed == NULL) {
+		free(job.hash);
+		free(changed);
+		return -1;
+	}
+	parallel_for(tiles_y, tile_row, &job);
+
+	for (ty = 0; ty < tiles_y; ty++)
+		for (tx = 0; tx < tiles_x; tx++) {
+			int i = ty * tiles_x + tx;
+
+			changed[i] = !m->valid || job.hash[i] != m->hash[i];
+		}
+	m->count = 0;
+	for (ty = 0; ty < tiles_y; ty++)
+		for (tx = 0; tx < tiles_x; tx++) {
+			int dirty = 0;
+
+			for (dy = -1; dy <= 1 && !dirty; dy++)
+				for (dx = -1; dx <= 1 && !dirty; dx++)
+					dirty = tx + dx >= 0 &&
+						tx + dx < tiles_x &&
+						ty + dy >= 0 &&
+						ty + dy < tiles_y &&
+						changed[(ty + dy) * tiles_x +
+							tx + dx];
+			if (dirty)
+				m->list[m->count++] = tx | ty << 16;
+		}
+
+	free(m->hash);
+	m->hash = job.hash;
+	m->valid = 1;
+	free(changed);
+	return 0;
+}
+
+void tile_map_free(struct tile_map *m)
+{
+	free(m->hash);
+	free(m->list);
+	memset(m, 0, sizeof(*m));
+}
@@ -0,0 +1,463 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * Conversion of the input to 8 bits: the dark frame subtraction, the HDR
+ * merge of the exposures, the conversion of the 4x4 colour filter arrays
+ * to Bayer, and the tone mapping with the global curve from the histogram of the previous
+ * frame and the local one through the bilateral grid. The compute shader
+ * does the same while loading the input and in the tone passes (see
+ * debayer.comp), with the same integer arithmetic.
+ *
+ * Copyright (C) 2021, Linaro
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debayer.h"
+
+/*
+ * The spec is the comma separated list of:
+ *   global                 the global curve only
+ *   local=<n>              and the local tone mapping of strength 1..255
+ */
+int tone_parse(const char *spec, struct tone_fmt *t)
+{
+	char tok[64];
+	int ret = 0;
+
+	memset(t, 0, sizeof(*t));
+	t->enabled = 1;
+
+	while (*spec && ret == 0) {
+		size_t len = strcspn(spec, ",");
+
+		if (len >= sizeof(tok))
+			len = sizeof(tok) - 1;
+		memcpy(tok, spec, len);
+		tok[len] = '\0';
+		spec += strcspn(spec, ",");
+		if (*spec == ',')
+			spec++;
+
+		if (!strcmp(tok, "global"))
+			continue;
+		if (sscanf(tok, "local=%d", &t->local) == 1 &&
+		    t->local > 0 && t->local <= 255)
+			continue;
+		printf("tone: bad \"%s\"\n", tok);
+		ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * The spec is the comma separated exposure ratios of the first frame to
+ * the following ones
+ */
+int hdr_parse(const char *spec, struct hdr_fmt *h)
+{
+	int max = 1;
+	int n;
+
+	memset(h, 0, sizeof(*h));
+	h->enabled = 1;
+	h->ratio[0] = 1;
+	for (h->frames = 1; *spec; h->frames++) {
+		if (h->frames == HDR_MAX_FRAMES ||
+		    sscanf(spec, "%d%n", &h->ratio[h->frames], &n) != 1 ||
+		    h->ratio[h->frames] < 1 || h->ratio[h->frames] > 256) {
+			printf("hdr: bad \"%s\"\n", spec);
+			return -1;
+		}
+		if (h->ratio[h->frames] > max)
+			max = h->ratio[h->frames];
+		spec += n;
+		if (*spec == ',')
+			spec++;
+	}
+	if (h->frames < 2)
+		return -1;
+	while ((1 << h->shift) < max)
+		h->shift++;
+	return 0;
+}
+
+/* one node more than needed for the interpolation at the last pixel */
+void tone_grid_size(const struct frame_fmt *fmt, int *width, int *height)
+{
+	*width = (fmt->width - 1) / TONE_CELL + 2;
+	*height = (fmt->height - 1) / TONE_CELL + 2;
+}
+
+/* the pixel of the frame in the input format */
+static inline int input_value(const struct frame_fmt *fmt,
+			      const uint8_t *in, long offset)
+{
+	if (fmt->bits <= 8)
+		return in[offset];
+	return (in[offset] | in[offset + 1] << 8) & ((1 << fmt->bits) - 1);
+}
+
+static inline int clamp_value(int v, int max)
+{
+	return v < 0 ? 0 : v > max ? max : v;
+}
+
+/*
+ * The exposures are averaged in the units of the first (the longest) one,
+ * weighted by the exposure time, and down to zero for the values close to
+ * the saturation. If all of them are saturated, the last one is taken.
+ */
+static int hdr_merge(const struct frame_fmt *fmt, const struct hdr_fmt *h,
+		     const uint8_t *in, long offset, int dark, int max)
+{
+	long frame_size = input_frame_size(fmt);
+	int knee = max >> 3 > 1 ? max >> 3 : 1;
+	int sum = 0, sum_w = 0;
+	int raw, v = 0, w, k;
+
+	for (k = 0; k < h->frames; k++) {
+		raw = input_value(fmt, in + k * frame_size, offset);
+		w = (max - raw < knee ? max - raw : knee) * 16 / knee *
+		    (256 / h->ratio[k]);
+		v = clamp_value(raw - dark, max) * h->ratio[k];
+		sum += w * v;
+		sum_w += w;
+	}
+	v = sum_w > 0 ? (sum + sum_w / 2) / sum_w : v;
+	return clamp_value(v, (1 << (fmt->bits + h->shift)) - 1);
+}
+
+/*
+ * The sensor pixel, the bits above fmt->bits are ignored, the dark frame
+ * subtracted, and the exposures merged
+ */
+static inline int sensor_value(const struct frame_fmt *fmt,
+			       const struct debayer_opts *opts,
+			       const uint8_t *in, int x, int y)
+{
+	const struct dark_fmt *dark = &opts->dark;
+	long offset = (long)y * fmt->stride + (fmt->bits > 8 ? 2 * x : x);
+	int max = (1 << fmt->bits) - 1;
+	int d = 0;
+
+	if (dark->enabled && dark->frame)
+		d += input_value(fmt, dark->frame, offset);
+	if (dark->enabled && dark->columns)
+		d += dark->columns[x];
+	if (opts->hdr.enabled)
+		return hdr_merge(fmt, &opts->hdr, in, offset, d, max);
+	return clamp_value(input_value(fmt, in, offset) - d, max);
+}
+
+enum { CFA_RED, CFA_GREEN, CFA_BLUE, CFA_IR };
+
+/* the colour of the Bayer pattern at (x,y) */
+static inline int bayer_colour(const struct frame_fmt *fmt, int x, int y)
+{
+	int fr_x, fr_y;
+
+	bayer_first_red(fmt->order, &fr_x, &fr_y);
+	if ((x & 1) == fr_x && (y & 1) == fr_y)
+		return CFA_RED;
+	if ((x & 1) != fr_x && (y & 1) != fr_y)
+		return CFA_BLUE;
+	return CFA_GREEN;
+}
+
+/* the colour of the sensor pixel at (x,y), see enum cfa_type */
+static int cfa_colour(const struct frame_fmt *fmt, int x, int y)
+{
+	int c;
+
+	if (fmt->cfa == CFA_QUAD)
+		return bayer_colour(fmt, x >> 1, y >> 1);
+	c = bayer_colour(fmt, x, y);
+	if (c == CFA_RED)
+		return CFA_IR;
+	if (c == CFA_BLUE && ((x >> 1) + (y >> 1)) & 1)
+		return CFA_RED;
+	return c;
+}
+
+/*
+ * The pixel of the Bayer frame: the sensor one if it has the colour,
+ * otherwise the average of the nearest ones of the colour (up to 2 pixels
+ * away) in the 4 directions, or if there are none, along the diagonals.
+ */
+static int cfa_remosaic(const struct frame_fmt *fmt,
+			const struct debayer_opts *opts, const uint8_t *in,
+			int x, int y)
+{
+	static const int dirs[8][2] = {
+		{ -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 },
+		{ -1, -1 }, { 1, -1 }, { -1, 1 }, { 1, 1 },
+	};
+	int c = bayer_colour(fmt, x, y);
+	int sum = 0, n = 0;
+	int i, d;
+
+	if (cfa_colour(fmt, x, y) == c)
+		return sensor_value(fmt, opts, in, x, y);
+	for (i = 0; i < 8 && !(i == 4 && n > 0); i++) {
+		for (d = 1; d <= 2; d++) {
+			int px = x + d * dirs[i][0], py = y + d * dirs[i][1];
+
+			if (px < 0 || py < 0 || px >= fmt->width ||
+			    py >= fmt->height || cfa_colour(fmt, px, py) != c)
+				continue;
+			sum += sensor_value(fmt, opts, in, px, py);
+			n++;
+			break;
+		}
+	}
+	return n ? (sum + n / 2) / n : 0;
+}
+
+/* the pixel of the Bayer frame to demosaic */
+static inline unsigned int raw_value(const struct frame_fmt *fmt,
+				     const struct debayer_opts *opts,
+				     const uint8_t *in, int x, int y)
+{
+	switch (fmt->cfa) {
+	case CFA_QUAD_BIN:
+		return (sensor_value(fmt, opts, in, 2 * x, 2 * y) +
+			sensor_value(fmt, opts, in, 2 * x + 1, 2 * y) +
+			sensor_value(fmt, opts, in, 2 * x, 2 * y + 1) +
+			sensor_value(fmt, opts, in, 2 * x + 1, 2 * y + 1) +
+			2) >> 2;
+	case CFA_QUAD:
+	case CFA_RGBIR:
+		return cfa_remosaic(fmt, opts, in, x, y);
+	default:
+		return sensor_value(fmt, opts, in, x, y);
+	}
+}
+
+/*
+ * The global curve: the clipped histogram plus the uniform base makes the
+ * CDF, which is the curve at the bin ends, in 1/256 units of the output.
+ * The curve is interpolated over the input values of the bin.
+ */
+static void tone_curve(const uint32_t *hist, int bits, uint8_t *lut)
+{
+	uint32_t cdf[TONE_BINS];
+	uint32_t n = 0, sum = 0;
+	uint32_t limit, base, k, total;
+	uint32_t y0 = 0, y1;
+	int shift = bits - 8;
+	uint32_t steps = 1u << shift;
+	uint32_t f;
+	int i;
+
+	for (i = 0; i < TONE_BINS; i++)
+		n += hist[i];
+	limit = n / 64 + 1;
+	base = limit / 4 + 1;
+	for (i = 0; i < TONE_BINS; i++) {
+		sum += (hist[i] < limit ? hist[i] : limit) + base;
+		cdf[i] = sum;
+	}
+
+	/* scaled down to 16 bits not to overflow */
+	k = sum / 65536 + 1;
+	total = sum / k;
+	for (i = 0; i < TONE_BINS; i++, y0 = y1) {
+		y1 = cdf[i] / k * 65280 / total;
+		for (f = 0; f < steps; f++)
+			lut[(i << shift) + f] = (y0 * (steps - 1 - f) +
+						 y1 * (f + 1) + (steps << 7)) >>
+						(shift + 8);
+	}
+}
+
+/* the grid node of the pixel value g at (x,y): sum of the values, count */
+static inline uint32_t *grid_node(uint32_t *grid, int grid_width, int x,
+				  int y, int r)
+{
+	return grid + 2 * ((y * grid_width + x) * TONE_RANGE_NODES + r);
+}
+
+/* The statistics of the frame: the histogram and the bilateral grid */
+static void tone_stats(const struct frame_fmt *fmt,
+		       const struct debayer_opts *opts, const uint8_t *in,
+		       const uint8_t *lut, uint32_t *hist, uint32_t *grid,
+		       int grid_width)
+{
+	int shift = merged_bits(fmt, opts) - 8;
+	int x, y, k;
+
+	for (y = 0; y < fmt->height; y += TONE_STATS_STEP) {
+		for (x = 0; x < fmt->width; x += TONE_STATS_STEP) {
+			for (k = 0; k < 4; k++) {
+				int px = x + (k & 1), py = y + (k >> 1);
+				unsigned int v;
+				uint32_t *node;
+				int g;
+
+				if (px >= fmt->width || py >= fmt->height)
+					continue;
+				v = raw_value(fmt, opts, in, px, py);
+				if (hist)
+					hist[v >> shift]++;
+				if (grid == NULL)
+					continue;
+				g = lut[v];
+				node = grid_node(grid, grid_width,
+					(px + TONE_CELL / 2) >> TONE_CELL_SHIFT,
+					(py + TONE_CELL / 2) >> TONE_CELL_SHIFT,
+					(g + TONE_RANGE / 2) >> TONE_RANGE_SHIFT);
+				node[0] += g;
+				node[1]++;
+			}
+		}
+	}
+}
+
+/* see tone_local() in debayer.comp */
+static int tone_local(uint32_t *grid, int grid_width, int x, int y, int g,
+		      int strength)
+{
+	int nx = x >> TONE_CELL_SHIFT, fx = x & (TONE_CELL - 1);
+	int ny = y >> TONE_CELL_SHIFT, fy = y & (TONE_CELL - 1);
+	int nr = g >> TONE_RANGE_SHIFT, fr = g & (TONE_RANGE - 1);
+	int sum = 0, count = 0;
+	int avg, t, d, k;
+
+	for (k = 0; k < 8; k++) {
+		int dx = k & 1, dy = (k >> 1) & 1, dr = k >> 2;
+		int w = (dx ? fx : TONE_CELL - fx) *
+			(dy ? fy : TONE_CELL - fy) *
+			(dr ? fr : TONE_RANGE - fr);
+		const uint32_t *node = grid_node(grid, grid_width, nx + dx,
+						 ny + dy, nr + dr);
+
+		sum += w * (int)node[0];
+		count += w * (int)node[1];
+	}
+	avg = count > 0 ? (sum + count / 2) / count : g;
+
+	/* rounded, offset not to shift the negative values */
+	t = strength * (avg - 128);
+	d = ((t + 128 + (256 << 8)) >> 8) - 256;
+	g -= d;
+	return g < 0 ? 0 : g > 255 ? 255 : g;
+}
+
+/*
+ * The conversion of the input to the 8-bit frame, calibrated, merged and
+ * tone mapped: the curve and the grid from the statistics of the frame,
+ * whose histogram replaces the one of the previous frame in t->hist.
+ * Returns -1 if out of memory.
+ */
+int tone_map_init(struct tone_map *m, const struct frame_fmt *fmt,
+		  const struct debayer_opts *opts, const uint8_t *in)
+{
+	static const uint32_t no_hist[TONE_BINS];
+	const struct tone_fmt *t = &opts->tone;
+	int bits = merged_bits(fmt, opts);
+
+	memset(m, 0, sizeof(*m));
+	m->fmt = fmt;
+	m->opts = opts;
+	m->in = in;
+	m->shift = bits - 8;
+	m->fmt8 = *fmt;
+	m->fmt8.stride = fmt->width;
+	m->fmt8.bits = 8;
+	if (cfa_remosaiced(fmt->cfa))
+		m->fmt8.cfa = CFA_BAYER;
+	if (!t->enabled)
+		return 0;
+
+	m->lut = malloc(1u << bits);
+	if (m->lut == NULL)
+		return -1;
+	tone_curve(t->hist ? t->hist : no_hist, bits, m->lut);
+	if (t->local) {
+		int grid_height;
+
+		tone_grid_size(fmt, &m->grid_width, &grid_height);
+		m->grid = calloc(2 * TONE_RANGE_NODES * m->grid_width *
+				 grid_height, sizeof(*m->grid));
+		if (m->grid == NULL) {
+			tone_map_free(m);
+			return -1;
+		}
+	}
+	if (t->hist)
+		memset(t->hist, 0, sizeof(*t->hist) * TONE_BINS);
+	tone_stats(fmt, opts, in, m->lut, t->hist, m->grid, m->grid_width);
+	return 0;
+}
+
+/* the row y of the 8-bit frame */
+void tone_map_row(const struct tone_map *m, int y, uint8_t *out)
+{
+	int x;
+
+	for (x = 0; x < m->fmt->width; x++) {
+		unsigned int v = raw_value(m->fmt, m->opts, m->in, x, y);
+
+		if (m->lut == NULL)
+			out[x] = v >> m->shift;
+		else if (m->grid == NULL)
+			out[x] = m->lut[v];
+		else
+			out[x] = tone_local(m->grid, m->grid_width, x, y,
+					    m->lut[v], m->opts->tone.local);
+	}
+}
+
+void tone_map_free(struct tone_map *m)
+{
+	free(m->grid);
+	free(m->lut);
+	m->grid = NULL;
+	m->lut = NULL;
+}
+
+/*
+ * The 8-bit frame for the engines to demosaic, see tone_map_init().
+ * Returns NULL if out of memory.
+ */
+uint8_t *tone_frame(const struct frame_fmt *fmt,
+		    const struct debayer_opts *opts, const uint8_t *in,
+		    struct frame_fmt *fmt8)
+{
+	struct tone_map m;
+	uint8_t *out;
+	int y;
+
+	out = malloc((long)fmt->width * fmt->height);
+	if (out == NULL)
+		return NULL;
+	if (tone_map_init(&m, fmt, opts, in) < 0) {
+		free(out);
+		return NULL;
+	}
+	for (y = 0; y < fmt->height; y++)
+		tone_map_row(&m, y, out + (long)y * fmt->width);
+	*fmt8 = m.fmt8;
+	tone_map_free(&m);
+	return out;
+}
+
+/*
+ * The IR plane of CFA_RGBIR, the IR pixel of each 2x2 cell scaled down to
+ * 8 bits
+ */
+void ir_plane(const struct frame_fmt *fmt, const struct debayer_opts *opts,
+	      const uint8_t *in, uint8_t *out)
+{
+	int shift = merged_bits(fmt, opts) - 8;
+	int fr_x, fr_y;
+	int x, y;
+
+	bayer_first_red(fmt->order, &fr_x, &fr_y);
+	for (y = 0; y < fmt->height / 2; y++)
+		for (x = 0; x < fmt->width / 2; x++)
+			*out++ = sensor_value(fmt, opts, in, 2 * x + fr_x,
+					      2 * y + fr_y) >> shift;
+}
@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: LGPL-3.0 */
+/*
+ * Fuji X-Trans colour filter array: the 6x6 pattern, and the table of the
+ * interpolation lines the engines demosaic it with.
+ *
+ * Copyright (C) 2021, Linaro
+ */
+
+#include "debayer.h"
+
+/*
+ * The pattern from the top left pixel of the frame, 0 - red, 1 - green,
+ * 2 - blue. Each 3x3 quarter has 5 green, 2 red and 2 blue pixels, and
+ * every row and column has all the colours.
+ */
+static const uint8_t xtrans_pattern[XTRANS_SIZE][XTRANS_SIZE] = {
+	{ 1, 1, 0, 1, 1, 2 },
+	{ 1, 1, 2, 1, 1, 0 },
+	{ 2, 0, 1, 0, 2, 1 },
+	{ 1, 1, 2, 1, 1, 0 },
+	{ 1, 1, 0, 1, 1, 2 },
+	{ 0, 2, 1, 2, 0, 1 },
+};
+
+/* the directions of the lines, see XTRANS_LINE_BITS */
+const int xtrans_dirs[4][2] = {
+	{ 1, 0 }, { 0, 1 }, { 1, 1 }, { 1, -1 },
+};
+
+int xtrans_colour(int x, int y)
+{
+	return xtrans_pattern[y % XTRANS_SIZE][x % XTRANS_SIZE];
+}
+
+/*
+ * The nearest pixel of the colour c up to XTRANS_REACH pixels away from
+ * (x,y) in the direction (dx,dy), 0 if there is none
+ */
+static int xtrans_reach(int x, int y, int dx, int dy, int c)
+{
+	int d;
+
+	for (d = 1; d <= XTRANS_REACH; d++)
+		if (xtrans_colour(x + XTRANS_SIZE + d * dx,
+				  y + XTRANS_SIZE + d * dy) == c)
+			return d;
+	return 0;
+}
+
+/*
+ * Every missing colour of every position has at least one line with the
+ * pixels of the colour on both sides within XTRANS_REACH, so there is no
+ * fallback.
+ */
+void xtrans_init(uint32_t table[XTRANS_TABLE])
+{
+	int x, y, c, i;
+
+	for (y = 0; y < XTRANS_SIZE; y++) {
+		for (x = 0; x < XTRANS_SIZE; x++) {
+			for (c = 0; c < 3; c++) {
+				uint32_t *lines = &table[
+					(y * XTRANS_SIZE + x) * 3 + c];
+				int n = 0;
+
+				*lines = 0;
+				if (xtrans_colour(x, y) == c)
+					continue;
+				for (i = 0; i < 4; i++) {
+					int dx = xtrans_dirs[i][0];
+					int dy = xtrans_dirs[i][1];
+					int da = xtrans_reach(x, y, -dx, -dy, c);
+					int db = xtrans_reach(x, y, dx, dy, c);
+
+					if (!da || !db)
+						continue;
+					*lines |= (uint32_t)(XTRANS_LINE_ON |
+						i << 2 | (da - 1) << 1 |
+						(db - 1)) << (XTRANS_LINE_BITS * n);
+					n++;
+				}
+			}
+		}
+	}
+}